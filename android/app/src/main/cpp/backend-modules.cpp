@@ -0,0 +1,202 @@
+#include "backend-modules.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <set>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <android/log.h>
+#include "ggml-backend.h"
+#include "memory-stats.h"
+
+#define LOG_TAG "LlamaJNI"
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+namespace {
+
+constexpr const char* CPU_MODULE_PREFIX = "libggml-cpu-";
+constexpr const char* MODULE_SUFFIX = ".so";
+
+cpu_backend_info info;
+std::once_flag load_once;
+
+// Exported by every CPU variant module; its type is only declared in the
+// internal ggml-backend-impl.h, so it is spelled out here
+using module_score_fn = int (*)();
+using threadpool_new_fn = ggml_threadpool_t (*)(ggml_threadpool_params*);
+using threadpool_free_fn = void (*)(ggml_threadpool_t);
+threadpool_new_fn threadpool_new = nullptr;
+threadpool_free_fn threadpool_free = nullptr;
+
+// Score of a CPU module on this device, without registering it; 0 if it cannot run here
+int score_module(const std::string& path) {
+    void* handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (handle == nullptr) {
+        return 0;
+    }
+    auto score = reinterpret_cast<module_score_fn>(dlsym(handle, "ggml_backend_score"));
+    const int result = score != nullptr ? score() : 0;
+    dlclose(handle);
+    return result;
+}
+
+void load_best_variant(const std::string& dir) {
+    const auto start = std::chrono::steady_clock::now();
+    ggml_backend_reg_t reg = ggml_backend_reg_by_name("CPU");
+    if (reg != nullptr) {
+        info.variant = "builtin";
+    } else {
+        std::string best_path;
+        DIR* d = opendir(dir.c_str());
+        if (d == nullptr) {
+            LOGE("CPU backend: cannot list %s", dir.c_str());
+        }
+        const size_t prefix_len = std::strlen(CPU_MODULE_PREFIX);
+        const size_t suffix_len = std::strlen(MODULE_SUFFIX);
+        while (d != nullptr) {
+            const dirent* entry = readdir(d);
+            if (entry == nullptr) {
+                break;
+            }
+            const std::string name = entry->d_name;
+            if (name.size() <= prefix_len + suffix_len || name.compare(0, prefix_len, CPU_MODULE_PREFIX) != 0 ||
+                name.compare(name.size() - suffix_len, suffix_len, MODULE_SUFFIX) != 0) {
+                continue;
+            }
+            info.candidates++;
+            const std::string path = dir + "/" + name;
+            const int score = score_module(path);
+            LOGI("CPU backend: %s scores %d", name.c_str(), score);
+            if (score > info.score) {
+                info.score = score;
+                info.variant = name.substr(prefix_len, name.size() - prefix_len - suffix_len);
+                best_path = path;
+            }
+        }
+        if (d != nullptr) {
+            closedir(d);
+        }
+        // Host builds tuned for the build machine ship one module without a suffix
+        const std::string native_path = dir + "/libggml-cpu" + MODULE_SUFFIX;
+        if (best_path.empty() && access(native_path.c_str(), R_OK) == 0) {
+            info.candidates++;
+            info.score = score_module(native_path);
+            info.variant = "native";
+            best_path = native_path;
+        }
+        if (!best_path.empty()) {
+            reg = ggml_backend_load(best_path.c_str());
+        }
+        if (reg == nullptr) {
+            LOGE("CPU backend: no usable module among %d in %s", info.candidates, dir.c_str());
+            info.variant.clear();
+            return;
+        }
+    }
+
+    info.loaded = true;
+    auto get_features =
+        reinterpret_cast<ggml_backend_get_features_t>(ggml_backend_reg_get_proc_address(reg, "ggml_backend_get_features"));
+    if (get_features != nullptr) {
+        for (const ggml_backend_feature* f = get_features(reg); f != nullptr && f->name != nullptr; f++) {
+            info.features.emplace_back(f->name, f->value != nullptr ? f->value : "");
+        }
+    }
+    threadpool_new = reinterpret_cast<threadpool_new_fn>(ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_new"));
+    threadpool_free = reinterpret_cast<threadpool_free_fn>(ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_free"));
+    info.load_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    LOGI("CPU backend: using %s (score %d, %zu features) in %.1f ms", info.variant.c_str(), info.score,
+         info.features.size(), info.load_ms);
+}
+
+} // namespace
+
+std::string native_library_dir() {
+    Dl_info dl;
+    if (dladdr(reinterpret_cast<void*>(&native_library_dir), &dl) == 0 || dl.dli_fname == nullptr) {
+        return ".";
+    }
+    const std::string path = dl.dli_fname;
+    const size_t slash = path.find_last_of('/');
+    return slash == std::string::npos ? "." : path.substr(0, slash);
+}
+
+const cpu_backend_info& load_cpu_backend(const std::string& dir) {
+    std::call_once(load_once, load_best_variant, dir);
+    return info;
+}
+
+bool load_backend_module(const std::string& dir, const char* name) {
+    static std::mutex modules_mutex;
+    static std::set<std::string> loaded;
+    std::lock_guard<std::mutex> lock(modules_mutex);
+    if (loaded.count(name) != 0) {
+        return true;
+    }
+    const std::string path = dir + "/libggml-" + name + MODULE_SUFFIX;
+    if (access(path.c_str(), R_OK) != 0) {
+        return false;
+    }
+    if (ggml_backend_load(path.c_str()) == nullptr) {
+        LOGE("Backend module %s failed to load", path.c_str());
+        return false;
+    }
+    LOGI("Backend module %s loaded", name);
+    loaded.insert(name);
+    return true;
+}
+
+size_t packaged_library_bytes(const std::string& dir) {
+    size_t total = 0;
+    DIR* d = opendir(dir.c_str());
+    if (d == nullptr) {
+        return 0;
+    }
+    while (const dirent* entry = readdir(d)) {
+        const std::string name = entry->d_name;
+        if (name.size() > 3 && name.compare(name.size() - 3, 3, MODULE_SUFFIX) == 0) {
+            total += file_size_bytes(dir + "/" + name);
+        }
+    }
+    closedir(d);
+    return total;
+}
+
+size_t loaded_library_bytes(const std::string& dir) {
+    FILE* f = std::fopen("/proc/self/maps", "r");
+    if (f == nullptr) {
+        return 0;
+    }
+    std::set<std::string> paths;
+    char line[1024];
+    const std::string prefix = dir + "/";
+    while (std::fgets(line, sizeof(line), f) != nullptr) {
+        const char* path = std::strchr(line, '/');
+        if (path == nullptr || std::strncmp(path, prefix.c_str(), prefix.size()) != 0) {
+            continue;
+        }
+        std::string p(path);
+        p.erase(p.find_last_not_of("\n") + 1);
+        paths.insert(p);
+    }
+    std::fclose(f);
+    size_t total = 0;
+    for (const std::string& p : paths) {
+        total += file_size_bytes(p);
+    }
+    return total;
+}
+
+ggml_threadpool_t cpu_threadpool_new(ggml_threadpool_params* params) {
+    return threadpool_new != nullptr ? threadpool_new(params) : nullptr;
+}
+
+void cpu_threadpool_free(ggml_threadpool_t threadpool) {
+    if (threadpool_free != nullptr && threadpool != nullptr) {
+        threadpool_free(threadpool);
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+#include "ggml.h"
+
+// The ggml CPU backend this process computes with. The kernels are built once
+// per instruction-set level (e.g. armv8.2 baseline, dotprod, i8mm, SVE) as
+// separate libggml-cpu-<variant>.so modules next to native-lib; each module
+// scores itself against the CPU's hwcaps and the best one is loaded. Builds
+// that link the CPU backend statically report the variant "builtin".
+struct cpu_backend_info {
+    bool loaded = false;
+    std::string variant;     // Module suffix, e.g. "android_armv8.6_1"
+    int score = 0;           // The module's own score; higher uses more of the CPU
+    int candidates = 0;      // Modules found, including ones this CPU cannot run
+    std::vector<std::pair<std::string, std::string>> features;  // As reported by the backend, e.g. DOTPROD=1
+    double load_ms = 0.0;
+};
+
+// Directory native-lib was loaded from, where the backend modules live
+std::string native_library_dir();
+
+// Load the best CPU variant from dir; later calls return the first result.
+// Must run before a model is loaded.
+const cpu_backend_info& load_cpu_backend(const std::string& dir);
+
+// Load the backend module libggml-<name>.so from dir (e.g. "vulkan") and
+// register it, once per process; returns false if it is missing or cannot run here
+bool load_backend_module(const std::string& dir, const char* name);
+
+// Bytes of the shared libraries in dir: all of them (what the build ships), or
+// only those this process has mapped (what it actually loaded)
+size_t packaged_library_bytes(const std::string& dir);
+size_t loaded_library_bytes(const std::string& dir);
+
+// Threadpools belong to the CPU module, so they are reached through the
+// backend registry. Return nullptr / do nothing when it has none.
+ggml_threadpool_t cpu_threadpool_new(ggml_threadpool_params* params);
+void cpu_threadpool_free(ggml_threadpool_t threadpool);
@@ -0,0 +1,119 @@
+#include "energy-sampler.h"
+
+#include <cmath>
+#include <cstdio>
+
+power_reader make_power_supply_reader(const std::string& sysfs_root, const std::string& supply) {
+    const std::string base = (sysfs_root.empty() ? std::string("/sys") : sysfs_root) +
+                             "/class/power_supply/" + supply + "/";
+    return [base](double& watts) {
+        long current_ua = 0, voltage_uv = 0;
+        FILE* f = std::fopen((base + "current_now").c_str(), "r");
+        if (f == nullptr) {
+            return false;
+        }
+        const bool have_current = std::fscanf(f, "%ld", &current_ua) == 1;
+        std::fclose(f);
+
+        f = std::fopen((base + "voltage_now").c_str(), "r");
+        if (f == nullptr) {
+            return false;
+        }
+        const bool have_voltage = std::fscanf(f, "%ld", &voltage_uv) == 1;
+        std::fclose(f);
+
+        if (!have_current || !have_voltage) {
+            return false;
+        }
+        // Sign of current_now while discharging differs between vendors
+        watts = std::fabs(static_cast<double>(current_ua)) * 1e-6 * static_cast<double>(voltage_uv) * 1e-6;
+        return true;
+    };
+}
+
+energy_sampler::energy_sampler(power_reader reader, int interval_ms)
+    : read_power(std::move(reader)), interval_ms(interval_ms > 0 ? interval_ms : 50) {}
+
+energy_sampler::~energy_sampler() {
+    stop();
+}
+
+void energy_sampler::start() {
+    stop();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    running = true;
+    started_at = std::chrono::steady_clock::now();
+    have_last = false;
+    energy_mj = 0.0;
+    n_samples = 0;
+    sample_locked();
+    worker = std::thread(&energy_sampler::run, this);
+}
+
+void energy_sampler::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!running) {
+            return;
+        }
+        sample_locked();
+        running = false;
+    }
+    cv.notify_all();
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+double energy_sampler::mark_mj() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (running) {
+        sample_locked();
+    }
+    return energy_mj;
+}
+
+double energy_sampler::average_power_w() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!have_last) {
+        return 0.0;
+    }
+    const double seconds = std::chrono::duration<double>(last_at - started_at).count();
+    return seconds > 0.0 ? energy_mj / 1000.0 / seconds : last_watts;
+}
+
+int energy_sampler::samples() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return n_samples;
+}
+
+void energy_sampler::sample_locked() {
+    double watts = 0.0;
+    if (!read_power || !read_power(watts)) {
+        return;
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    if (have_last) {
+        // Trapezoidal integration between consecutive samples
+        const double seconds = std::chrono::duration<double>(now - last_at).count();
+        energy_mj += 0.5 * (watts + last_watts) * seconds * 1000.0;
+    } else {
+        started_at = now;
+    }
+    last_at = now;
+    last_watts = watts;
+    have_last = true;
+    n_samples++;
+}
+
+void energy_sampler::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (running) {
+        cv.wait_for(lock, std::chrono::milliseconds(interval_ms));
+        if (running) {
+            sample_locked();
+        }
+    }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Returns the instantaneous device power draw in watts; false if unavailable
+using power_reader = std::function<bool(double& watts)>;
+
+// Power reader backed by <sysfs_root>/class/power_supply/<supply>/{current_now,voltage_now}
+power_reader make_power_supply_reader(const std::string& sysfs_root, const std::string& supply = "battery");
+
+// Integrates device power over time on a background thread so energy can be
+// attributed to inference phases. Sampling only runs between start() and stop();
+// mark_mj() takes an extra sample so short phases (a 100 ms prefill) are still covered.
+class energy_sampler {
+public:
+    energy_sampler(power_reader reader, int interval_ms);
+    ~energy_sampler();
+
+    void start();
+    void stop();
+
+    // Cumulative energy in millijoules since start(), integrated up to now
+    double mark_mj();
+
+    // Mean power over the current/last sampling window in watts
+    double average_power_w() const;
+
+    int samples() const;
+
+private:
+    power_reader read_power;
+    int interval_ms;
+
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    std::thread worker;
+    bool running = false;
+
+    std::chrono::steady_clock::time_point started_at;
+    std::chrono::steady_clock::time_point last_at;
+    double last_watts = 0.0;
+    bool have_last = false;
+    double energy_mj = 0.0;
+    int n_samples = 0;
+
+    void sample_locked();
+    void run();
+};
@@ -0,0 +1,326 @@
+#include "fused-sampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define FUSED_SAMPLER_NEON 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FUSED_SAMPLER_X86 1
+#endif
+
+namespace {
+
+// Ordering used for top-k: higher logit first, lower token id first on ties
+bool better(const llama_token_data& a, const llama_token_data& b) {
+    return a.logit > b.logit || (a.logit == b.logit && a.id < b.id);
+}
+
+// Keeps the k best candidates as a heap whose front is the weakest survivor
+class top_k_heap {
+public:
+    top_k_heap(std::vector<llama_token_data>& storage, int32_t k) : heap(storage), k(k) {
+        heap.clear();
+        heap.reserve(k);
+    }
+
+    // Smallest logit that can still enter the heap (strictly greater is required)
+    float threshold() const {
+        return static_cast<int32_t>(heap.size()) < k ? -std::numeric_limits<float>::infinity() : heap.front().logit;
+    }
+
+    void offer(llama_token id, float logit) {
+        const llama_token_data candidate = {id, logit, 0.0f};
+        if (static_cast<int32_t>(heap.size()) < k) {
+            heap.push_back(candidate);
+            std::push_heap(heap.begin(), heap.end(), better);
+        } else if (better(candidate, heap.front())) {
+            std::pop_heap(heap.begin(), heap.end(), better);
+            heap.back() = candidate;
+            std::push_heap(heap.begin(), heap.end(), better);
+        }
+    }
+
+    void finish() {
+        std::sort(heap.begin(), heap.end(), better);
+    }
+
+private:
+    std::vector<llama_token_data>& heap;
+    int32_t k;
+};
+
+// Scalar reference kernels; also used for the tails the vector loops leave over
+
+int32_t argmax_scalar(const float* logits, int32_t begin, int32_t n, int32_t best) {
+    for (int32_t i = begin; i < n; i++) {
+        if (logits[i] > logits[best]) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+void top_k_scalar(const float* logits, int32_t begin, int32_t n, top_k_heap& heap) {
+    for (int32_t i = begin; i < n; i++) {
+        if (logits[i] > heap.threshold()) {
+            heap.offer(i, logits[i]);
+        }
+    }
+}
+
+void mask_scalar(float* logits, int32_t begin, int32_t end, uint32_t bits) {
+    for (int32_t i = begin; i < end; i++) {
+        if ((bits & (1u << (i - begin))) == 0) {
+            logits[i] = -std::numeric_limits<float>::infinity();
+        }
+    }
+}
+
+#if FUSED_SAMPLER_NEON
+
+void mask_word_neon(float* logits, uint32_t bits) {
+    const uint32_t lane_bits_init[4] = {1, 2, 4, 8};
+    const uint32x4_t lane_bits = vld1q_u32(lane_bits_init);
+    const float32x4_t neg_inf = vdupq_n_f32(-std::numeric_limits<float>::infinity());
+    for (int j = 0; j < 32; j += 4) {
+        const uint32x4_t keep = vtstq_u32(vdupq_n_u32(bits >> j), lane_bits);
+        vst1q_f32(logits + j, vbslq_f32(keep, vld1q_f32(logits + j), neg_inf));
+    }
+}
+
+int32_t argmax_neon(const float* logits, int32_t n) {
+    if (n < 4) {
+        return argmax_scalar(logits, 1, n, 0);
+    }
+    float32x4_t best = vld1q_f32(logits);
+    const int32_t lane_ids[4] = {0, 1, 2, 3};
+    uint32x4_t best_idx = vld1q_u32(reinterpret_cast<const uint32_t*>(lane_ids));
+    uint32x4_t idx = best_idx;
+    const uint32x4_t step = vdupq_n_u32(4);
+
+    int32_t i = 4;
+    for (; i + 4 <= n; i += 4) {
+        idx = vaddq_u32(idx, step);
+        const float32x4_t v = vld1q_f32(logits + i);
+        const uint32x4_t gt = vcgtq_f32(v, best);  // Strict: each lane keeps its first maximum
+        best = vbslq_f32(gt, v, best);
+        best_idx = vbslq_u32(gt, idx, best_idx);
+    }
+
+    const float max_value = vmaxvq_f32(best);
+    const uint32x4_t at_max = vceqq_f32(best, vdupq_n_f32(max_value));
+    const uint32x4_t candidates = vbslq_u32(at_max, best_idx, vdupq_n_u32(UINT32_MAX));
+    return argmax_scalar(logits, i, n, static_cast<int32_t>(vminvq_u32(candidates)));
+}
+
+void top_k_neon(const float* logits, int32_t n, top_k_heap& heap) {
+    int32_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const float32x4_t v = vld1q_f32(logits + i);
+        const uint32x4_t gt = vcgtq_f32(v, vdupq_n_f32(heap.threshold()));
+        if (vmaxvq_u32(gt) == 0) {
+            continue;  // The common case once the heap is warm
+        }
+        top_k_scalar(logits, i, i + 4, heap);
+    }
+    top_k_scalar(logits, i, n, heap);
+}
+
+#elif FUSED_SAMPLER_X86
+
+bool cpu_has_avx2() {
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    return has_avx2;
+}
+
+__attribute__((target("avx2")))
+void mask_word_avx2(float* logits, uint32_t bits) {
+    const __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    const __m256 neg_inf = _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+    for (int j = 0; j < 32; j += 8) {
+        const __m256i word = _mm256_set1_epi32(static_cast<int32_t>(bits >> j));
+        const __m256i keep = _mm256_cmpeq_epi32(_mm256_and_si256(word, lane_bits), lane_bits);
+        _mm256_storeu_ps(logits + j, _mm256_blendv_ps(neg_inf, _mm256_loadu_ps(logits + j), _mm256_castsi256_ps(keep)));
+    }
+}
+
+__attribute__((target("avx2")))
+int32_t argmax_avx2(const float* logits, int32_t n) {
+    if (n < 8) {
+        return argmax_scalar(logits, 1, n, 0);
+    }
+    __m256 best = _mm256_loadu_ps(logits);
+    __m256i best_idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i idx = best_idx;
+    const __m256i step = _mm256_set1_epi32(8);
+
+    int32_t i = 8;
+    for (; i + 8 <= n; i += 8) {
+        idx = _mm256_add_epi32(idx, step);
+        const __m256 v = _mm256_loadu_ps(logits + i);
+        const __m256 gt = _mm256_cmp_ps(v, best, _CMP_GT_OQ);  // Strict: each lane keeps its first maximum
+        best = _mm256_blendv_ps(best, v, gt);
+        best_idx = _mm256_castps_si256(
+            _mm256_blendv_ps(_mm256_castsi256_ps(best_idx), _mm256_castsi256_ps(idx), gt));
+    }
+
+    alignas(32) float values[8];
+    alignas(32) int32_t indices[8];
+    _mm256_store_ps(values, best);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(indices), best_idx);
+    int32_t result = indices[0];
+    for (int lane = 1; lane < 8; lane++) {
+        if (values[lane] > logits[result] || (values[lane] == logits[result] && indices[lane] < result)) {
+            result = indices[lane];
+        }
+    }
+    return argmax_scalar(logits, i, n, result);
+}
+
+__attribute__((target("avx2")))
+void top_k_avx2(const float* logits, int32_t n, top_k_heap& heap) {
+    int32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256 v = _mm256_loadu_ps(logits + i);
+        const __m256 gt = _mm256_cmp_ps(v, _mm256_set1_ps(heap.threshold()), _CMP_GT_OQ);
+        if (_mm256_movemask_ps(gt) == 0) {
+            continue;  // The common case once the heap is warm
+        }
+        top_k_scalar(logits, i, i + 8, heap);
+    }
+    top_k_scalar(logits, i, n, heap);
+}
+
+#endif
+
+// Softmax in the sorted order, exactly as llama.cpp's softmax step computes it
+void softmax_sorted(std::vector<llama_token_data>& cur) {
+    const float max_logit = cur.front().logit;
+    float sum = 0.0f;
+    for (auto& c : cur) {
+        c.p = expf(c.logit - max_logit);
+        sum += c.p;
+    }
+    for (auto& c : cur) {
+        c.p /= sum;
+    }
+}
+
+} // namespace
+
+int32_t argmax_logits(const float* logits, int32_t n) {
+    if (n <= 0) {
+        return -1;
+    }
+#if FUSED_SAMPLER_NEON
+    return argmax_neon(logits, n);
+#elif FUSED_SAMPLER_X86
+    if (cpu_has_avx2()) {
+        return argmax_avx2(logits, n);
+    }
+#endif
+    return argmax_scalar(logits, 1, n, 0);
+}
+
+void top_k_logits(const float* logits, int32_t n, int32_t k, std::vector<llama_token_data>& out) {
+    top_k_heap heap(out, std::min(k, n));
+#if FUSED_SAMPLER_NEON
+    top_k_neon(logits, n, heap);
+#elif FUSED_SAMPLER_X86
+    if (cpu_has_avx2()) {
+        top_k_avx2(logits, n, heap);
+    } else {
+        top_k_scalar(logits, 0, n, heap);
+    }
+#else
+    top_k_scalar(logits, 0, n, heap);
+#endif
+    heap.finish();
+}
+
+void apply_token_mask(float* logits, int32_t n, const uint32_t* allowed_bits) {
+#if FUSED_SAMPLER_X86
+    const bool avx2 = cpu_has_avx2();
+#endif
+    int32_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const uint32_t bits = allowed_bits[i / 32];
+        if (bits == UINT32_MAX) {
+            continue;  // Most words under a ban-style constraint
+        }
+#if FUSED_SAMPLER_NEON
+        mask_word_neon(logits + i, bits);
+#elif FUSED_SAMPLER_X86
+        if (avx2) {
+            mask_word_avx2(logits + i, bits);
+        } else {
+            mask_scalar(logits, i, i + 32, bits);
+        }
+#else
+        mask_scalar(logits, i, i + 32, bits);
+#endif
+    }
+    if (i < n) {
+        mask_scalar(logits, i, n, allowed_bits[i / 32]);
+    }
+}
+
+// ---- fused_sampler ----
+
+fused_sampler::fused_sampler(const sampler_params& params) : params(params), rng(params.seed) {}
+
+bool fused_sampler::supports(const sampler_params& params) {
+    return params.temp <= 0.0f || params.top_k > 0;
+}
+
+const char* fused_sampler::kernel_name() {
+#if FUSED_SAMPLER_NEON
+    return "neon";
+#elif FUSED_SAMPLER_X86
+    return cpu_has_avx2() ? "avx2" : "scalar";
+#else
+    return "scalar";
+#endif
+}
+
+void fused_sampler::reset() {
+    rng.seed(params.seed);
+}
+
+llama_token fused_sampler::sample(const float* logits, int32_t n_vocab) {
+    if (params.temp <= 0.0f) {
+        return argmax_logits(logits, n_vocab);
+    }
+
+    top_k_logits(logits, n_vocab, params.top_k, survivors);
+
+    // Nucleus cut on the untempered distribution, like llama_sampler_top_p
+    if (params.top_p < 1.0f) {
+        softmax_sorted(survivors);
+        float cum_sum = 0.0f;
+        for (size_t i = 0; i < survivors.size(); i++) {
+            cum_sum += survivors[i].p;
+            if (cum_sum >= params.top_p) {  // min_keep = 1
+                survivors.resize(i + 1);
+                break;
+            }
+        }
+    }
+
+    for (auto& c : survivors) {
+        c.logit /= params.temp;
+    }
+    softmax_sorted(survivors);
+
+    // Same distribution type and RNG as llama_sampler_dist, so the draws line up
+    weights.resize(survivors.size());
+    for (size_t i = 0; i < survivors.size(); i++) {
+        weights[i] = survivors[i].p;
+    }
+    std::discrete_distribution<int> dist(weights.begin(), weights.end());
+    return survivors[dist(rng)].id;
+}
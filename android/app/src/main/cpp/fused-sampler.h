@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <random>
+#include <vector>
+#include "llama.h"
+
+// Sampling configuration shared by the llama.cpp chain and the fused sampler.
+// temp <= 0 means greedy; top_p >= 1 disables nucleus filtering.
+struct sampler_params {
+    int32_t top_k = 40;
+    float top_p = 0.9f;
+    float temp = 0.7f;
+    uint32_t seed = 12345;
+};
+
+// Fused top-k -> top-p -> temp -> dist sampler working straight off the logits.
+// The llama.cpp chain copies all n_vocab logits into a candidate array and
+// partially sorts it on every token, which is a large cost with Gemma 3's 262k
+// vocabulary. Here, a SIMD scan compares whole vectors of logits against the
+// current k-th best and touches only the few that beat it. The arithmetic on
+// the k survivors and the RNG draw mirror the chain step for step, so the same
+// seed yields the same tokens. The only exception is logits that are exactly
+// equal, which the fused sampler breaks by token id.
+class fused_sampler {
+public:
+    explicit fused_sampler(const sampler_params& params);
+
+    // The fused path needs a top-k bound (or greedy); anything else stays on the chain
+    static bool supports(const sampler_params& params);
+
+    // "neon", "avx2" or "scalar", whichever kernels this build/CPU uses
+    static const char* kernel_name();
+
+    llama_token sample(const float* logits, int32_t n_vocab);
+
+    // Restart the random stream, like llama_sampler_reset() on the chain
+    void reset();
+
+private:
+    sampler_params params;
+    std::mt19937 rng;
+    std::vector<llama_token_data> survivors;
+    std::vector<float> weights;
+};
+
+// Index of the largest logit, lowest index on ties (same as the greedy sampler)
+int32_t argmax_logits(const float* logits, int32_t n);
+
+// The k largest logits, best first, ties broken by lower token id
+void top_k_logits(const float* logits, int32_t n, int32_t k, std::vector<llama_token_data>& out);
+
+// Set every logit whose bit in allowed_bits (one bit per token, LSB first) is
+// clear to -infinity. Fully allowed 32-token words are skipped.
+void apply_token_mask(float* logits, int32_t n, const uint32_t* allowed_bits);
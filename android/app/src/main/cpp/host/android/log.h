@@ -0,0 +1,30 @@
+#pragma once
+
+// Stand-in for the NDK's <android/log.h> when native-lib is built for a desktop
+// host: log lines go to stderr, prefixed with their level and tag.
+
+#include <cstdarg>
+#include <cstdio>
+
+enum android_LogPriority {
+    ANDROID_LOG_UNKNOWN = 0,
+    ANDROID_LOG_DEFAULT,
+    ANDROID_LOG_VERBOSE,
+    ANDROID_LOG_DEBUG,
+    ANDROID_LOG_INFO,
+    ANDROID_LOG_WARN,
+    ANDROID_LOG_ERROR,
+    ANDROID_LOG_FATAL,
+    ANDROID_LOG_SILENT,
+};
+
+inline int __android_log_print(int prio, const char* tag, const char* fmt, ...) {
+    static const char LEVELS[] = "??VDIWEFS";
+    std::fprintf(stderr, "%c/%s: ", prio >= 0 && prio <= ANDROID_LOG_SILENT ? LEVELS[prio] : '?', tag);
+    va_list args;
+    va_start(args, fmt);
+    const int n = std::vfprintf(stderr, fmt, args);
+    va_end(args);
+    std::fputc('\n', stderr);
+    return n;
+}
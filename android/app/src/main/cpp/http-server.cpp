@@ -0,0 +1,468 @@
+#include "http-server.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <netinet/in.h>
+#include <random>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <android/log.h>
+
+#define LOG_TAG "LlamaJNI"
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+namespace {
+
+constexpr size_t MAX_HEADER_BYTES = 16 * 1024;
+constexpr size_t MAX_BODY_BYTES = 16 * 1024 * 1024;
+constexpr int IDLE_TIMEOUT_S = 30;  // A kept-alive connection closes after this long without a request
+
+const char* reason_phrase(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 413: return "Payload Too Large";
+        case 415: return "Unsupported Media Type";
+        case 429: return "Too Many Requests";
+        case 431: return "Request Header Fields Too Large";
+        case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        case 503: return "Service Unavailable";
+        default:  return "Unknown";
+    }
+}
+
+std::string lowercase(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return s;
+}
+
+std::string trim(const std::string& s) {
+    const size_t first = s.find_first_not_of(" \t");
+    if (first == std::string::npos) {
+        return std::string();
+    }
+    return s.substr(first, s.find_last_not_of(" \t") - first + 1);
+}
+
+bool send_fully(int fd, const char* p, size_t size) {
+    while (size > 0) {
+        const ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Append whatever the socket has to buffer; false once the peer closed or timed out
+bool receive_more(int fd, std::string& buffer, uint64_t& bytes_in) {
+    char chunk[8192];
+    ssize_t n;
+    do {
+        n = recv(fd, chunk, sizeof(chunk), 0);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        return false;
+    }
+    buffer.append(chunk, static_cast<size_t>(n));
+    bytes_in += static_cast<uint64_t>(n);
+    return true;
+}
+
+void send_error(int fd, int status) {
+    char head[192];
+    std::snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\n%sContent-Length: 0\r\nConnection: close\r\n\r\n", status,
+                  reason_phrase(status), status == 401 ? "WWW-Authenticate: Bearer\r\n" : "");
+    send_fully(fd, head, std::strlen(head));
+}
+
+std::string random_token() {
+    std::random_device device;
+    std::string token;
+    char hex[9];
+    for (int i = 0; i < 4; i++) {
+        std::snprintf(hex, sizeof(hex), "%08x", static_cast<unsigned>(device()));
+        token += hex;
+    }
+    return token;
+}
+
+// Compares in time independent of where the strings differ
+bool same_secret(const std::string& a, const std::string& b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    unsigned char diff = 0;
+    for (size_t i = 0; i < a.size(); i++) {
+        diff |= static_cast<unsigned char>(a[i] ^ b[i]);
+    }
+    return diff == 0;
+}
+
+// Host names that can only mean this device, with or without a port
+bool loopback_host(const std::string& host) {
+    std::string name = lowercase(host);
+    const size_t colon = name.rfind(':');
+    if (colon != std::string::npos && name.find(']', colon) == std::string::npos) {
+        name.resize(colon);
+    }
+    return name == "127.0.0.1" || name == "localhost" || name == "[::1]";
+}
+
+// 0 if the request may be handled, else the status to refuse it with. Web
+// pages can reach a loopback port too: a browser sends an Origin header with
+// their requests, and a DNS-rebound name in Host. Neither lets them read the
+// token, and a simple cross-origin POST cannot set a JSON content type.
+int access_status(const http_server::request& req, const std::string& token) {
+    const std::string* host = req.header("host");
+    if (req.header("origin") != nullptr || (host != nullptr && !loopback_host(*host))) {
+        return 403;
+    }
+    const std::string* authorization = req.header("authorization");
+    if (authorization == nullptr || authorization->size() < 7 ||
+        lowercase(authorization->substr(0, 7)) != "bearer " ||
+        !same_secret(trim(authorization->substr(7)), token)) {
+        return 401;
+    }
+    if (req.method == "POST") {
+        const std::string* content_type = req.header("content-type");
+        const std::string media_type =
+            content_type != nullptr ? lowercase(trim(content_type->substr(0, content_type->find(';')))) : "";
+        if (media_type != "application/json") {
+            return 415;
+        }
+    }
+    return 0;
+}
+
+} // namespace
+
+const std::string* http_server::request::header(const char* name) const {
+    for (const auto& h : headers) {
+        if (h.first == name) {
+            return &h.second;
+        }
+    }
+    return nullptr;
+}
+
+bool http_server::exchange::send_raw(const std::string& data) {
+    if (failed) {
+        return false;
+    }
+    failed = !send_fully(fd, data.data(), data.size());
+    bytes_out += data.size();
+    return !failed;
+}
+
+void http_server::exchange::respond(int status, const std::string& content_type, const std::string& body) {
+    if (responded) {
+        return;
+    }
+    responded = true;
+    char head[256];
+    std::snprintf(head, sizeof(head),
+                  "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: %s\r\n\r\n", status,
+                  reason_phrase(status), content_type.c_str(), body.size(), keep_alive ? "keep-alive" : "close");
+    if (send_raw(head)) {
+        send_raw(body);
+    }
+}
+
+bool http_server::exchange::begin_events() {
+    if (responded) {
+        return false;
+    }
+    responded = true;
+    streaming = true;
+    return send_raw(std::string("HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n"
+                                "Transfer-Encoding: chunked\r\nConnection: ") +
+                    (keep_alive ? "keep-alive" : "close") + "\r\n\r\n");
+}
+
+bool http_server::exchange::send_event(const std::string& data) {
+    if (!streaming) {
+        return false;
+    }
+    const std::string event = "data: " + data + "\n\n";
+    char size[16];
+    std::snprintf(size, sizeof(size), "%zx\r\n", event.size());
+    events++;
+    return send_raw(size + event + "\r\n");
+}
+
+// Complete the response; false if the connection cannot carry another request
+bool http_server::exchange::finish() {
+    if (!responded) {
+        respond(500, "text/plain", "No response");
+    } else if (streaming) {
+        send_raw("0\r\n\r\n");
+    }
+    std::lock_guard<std::mutex> lock(server.mutex);
+    server.counters.bytes_out += bytes_out;
+    server.counters.events += events;
+    return !failed && keep_alive;
+}
+
+struct http_server::connection {
+    int fd = -1;
+    std::thread thread;
+    std::atomic<bool> done{false};
+
+    ~connection() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+};
+
+http_server::http_server(int port, handler_fn handler, int max_connections)
+    : requested_port(port),
+      handler(std::move(handler)),
+      max_connections(std::max(1, max_connections)),
+      bearer_token(random_token()) {}
+
+http_server::~http_server() {
+    stopping = true;
+    if (listen_fd >= 0) {
+        shutdown(listen_fd, SHUT_RDWR);  // Wakes accept()
+    }
+    if (accept_thread.joinable()) {
+        accept_thread.join();
+    }
+
+    std::list<std::shared_ptr<connection>> remaining;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        remaining.swap(connections);
+    }
+    for (const auto& conn : remaining) {
+        shutdown(conn->fd, SHUT_RDWR);  // Wakes recv(); a running request finishes first
+    }
+    for (const auto& conn : remaining) {
+        if (conn->thread.joinable()) {
+            conn->thread.join();
+        }
+    }
+    if (listen_fd >= 0) {
+        ::close(listen_fd);
+    }
+}
+
+bool http_server::start() {
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        LOGE("HTTP server: socket() failed: %s", strerror(errno));
+        return false;
+    }
+    const int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    // Loopback only, and every request must also pass access_status()
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(static_cast<uint16_t>(requested_port));
+    socklen_t len = sizeof(addr);
+    if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listen_fd, 64) != 0 ||
+        getsockname(listen_fd, reinterpret_cast<sockaddr*>(&addr), &len) != 0) {
+        LOGE("HTTP server: cannot listen on port %d: %s", requested_port, strerror(errno));
+        ::close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+    bound_port = ntohs(addr.sin_port);
+
+    accept_thread = std::thread(&http_server::accept_loop, this);
+    LOGI("HTTP server: listening on 127.0.0.1:%d", bound_port);
+    return true;
+}
+
+http_server::stats http_server::snapshot() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
+
+void http_server::reap_locked() {
+    for (auto it = connections.begin(); it != connections.end();) {
+        if ((*it)->done) {
+            (*it)->thread.join();
+            it = connections.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    counters.clients = static_cast<int>(connections.size());
+}
+
+void http_server::accept_loop() {
+    while (!stopping) {
+        const int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;  // Listening socket shut down
+        }
+
+        // Small SSE chunks go out at once; idle and stalled peers time out
+        const int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        timeval timeout = {IDLE_TIMEOUT_S, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        std::lock_guard<std::mutex> lock(mutex);
+        reap_locked();
+        if (static_cast<int>(connections.size()) >= max_connections) {
+            send_error(fd, 503);
+            ::close(fd);
+            counters.refused++;
+            continue;
+        }
+        auto conn = std::make_shared<connection>();
+        conn->fd = fd;
+        connections.push_back(conn);
+        counters.connections++;
+        counters.clients = static_cast<int>(connections.size());
+        conn->thread = std::thread(&http_server::serve, this, conn);
+    }
+}
+
+void http_server::serve(const std::shared_ptr<connection>& conn) {
+    const int fd = conn->fd;
+    std::string buffer;  // Received bytes not yet consumed; may hold a pipelined request
+    bool reused = false;
+
+    while (!stopping) {
+        uint64_t bytes_in = 0;
+        size_t header_end;
+        while ((header_end = buffer.find("\r\n\r\n")) == std::string::npos) {
+            if (buffer.size() > MAX_HEADER_BYTES) {
+                send_error(fd, 431);
+                conn->done = true;
+                return;
+            }
+            if (!receive_more(fd, buffer, bytes_in)) {
+                conn->done = true;  // Closed, idle too long, or server stopping
+                return;
+            }
+        }
+        const auto start = std::chrono::steady_clock::now();
+
+        // Request line and headers
+        request req;
+        int status = 0;
+        bool keep_alive = false;
+        size_t content_length = 0;
+        size_t line_start = 0;
+        for (bool first = true; line_start < header_end; first = false) {
+            size_t line_end = buffer.find("\r\n", line_start);
+            const std::string line = buffer.substr(line_start, line_end - line_start);
+            line_start = line_end + 2;
+            if (first) {
+                const size_t sp1 = line.find(' ');
+                const size_t sp2 = line.rfind(' ');
+                if (sp1 == std::string::npos || sp2 == sp1) {
+                    status = 400;
+                    break;
+                }
+                req.method = line.substr(0, sp1);
+                req.path = line.substr(sp1 + 1, sp2 - sp1 - 1);
+                req.path = req.path.substr(0, req.path.find('?'));
+                const std::string version = line.substr(sp2 + 1);
+                keep_alive = version == "HTTP/1.1";
+                continue;
+            }
+            const size_t colon = line.find(':');
+            if (colon == std::string::npos) {
+                status = 400;
+                break;
+            }
+            req.headers.emplace_back(lowercase(trim(line.substr(0, colon))), trim(line.substr(colon + 1)));
+        }
+        if (const std::string* connection_header = req.header("connection")) {
+            const std::string value = lowercase(*connection_header);
+            keep_alive = value == "keep-alive" || (keep_alive && value != "close");
+        }
+        if (const std::string* length = req.header("content-length")) {
+            char* end = nullptr;
+            const unsigned long long n = std::strtoull(length->c_str(), &end, 10);
+            if (end == length->c_str() || *end != '\0') {
+                status = 400;
+            } else if (n > MAX_BODY_BYTES) {
+                status = 413;
+            }
+            content_length = static_cast<size_t>(n);
+        }
+        if (req.header("transfer-encoding") != nullptr && status == 0) {
+            status = 501;  // Chunked request bodies are not supported
+        }
+        bool denied = false;
+        if (status == 0) {
+            status = access_status(req, bearer_token);
+            denied = status != 0;
+        }
+        if (status != 0) {
+            send_error(fd, status);
+            std::lock_guard<std::mutex> lock(mutex);
+            (denied ? counters.denied : counters.bad_requests)++;
+            counters.bytes_in += bytes_in;
+            break;
+        }
+        buffer.erase(0, header_end + 4);
+
+        // Body; clients that wait for permission to send it get it now
+        const std::string* expect = req.header("expect");
+        if (expect != nullptr && lowercase(*expect) == "100-continue" && buffer.size() < content_length) {
+            static const char CONTINUE[] = "HTTP/1.1 100 Continue\r\n\r\n";
+            send_fully(fd, CONTINUE, sizeof(CONTINUE) - 1);
+        }
+        while (buffer.size() < content_length) {
+            if (!receive_more(fd, buffer, bytes_in)) {
+                conn->done = true;
+                return;
+            }
+        }
+        req.body = buffer.substr(0, content_length);
+        buffer.erase(0, content_length);
+        const auto parsed = std::chrono::steady_clock::now();
+
+        exchange ex(*this, fd, req, keep_alive && !stopping);
+        handler(ex);
+        const bool again = ex.finish();
+        const auto handled = std::chrono::steady_clock::now();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            counters.requests++;
+            counters.reused += reused ? 1 : 0;
+            counters.bytes_in += bytes_in;
+            counters.total_parse_ms += std::chrono::duration<double, std::milli>(parsed - start).count();
+            counters.total_handler_ms += std::chrono::duration<double, std::milli>(handled - parsed).count();
+        }
+        if (!again) {
+            break;
+        }
+        reused = true;
+    }
+    conn->done = true;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Minimal HTTP/1.1 server bound to the loopback interface, for local tools and
+// load tests. Every request needs "Authorization: Bearer <token()>", a token
+// made anew for each server; requests from web pages (an Origin header or a
+// Host other than loopback) and POST bodies that are not application/json are
+// refused before their body is read. Connections are kept alive between
+// requests and each one is served by its own thread. A handler either sends one response or streams
+// server-sent events, which use chunked encoding so the connection stays
+// usable afterwards.
+class http_server {
+public:
+    struct request {
+        std::string method;
+        std::string path;  // Without the query string
+        std::vector<std::pair<std::string, std::string>> headers;  // Names lowercased
+        std::string body;
+
+        const std::string* header(const char* name) const;
+    };
+
+    // One request/response on a connection. Handlers call respond() once, or
+    // begin_events(), then send_event() any number of times. The exchange is
+    // finished when the handler returns.
+    class exchange {
+    public:
+        const request& req;
+
+        void respond(int status, const std::string& content_type, const std::string& body);
+        bool begin_events();
+        bool send_event(const std::string& data);  // One "data:" event; false once the client is gone
+
+    private:
+        friend class http_server;
+        exchange(http_server& server, int fd, const request& req, bool keep_alive)
+            : req(req), server(server), fd(fd), keep_alive(keep_alive) {}
+
+        http_server& server;
+        const int fd;
+        bool keep_alive;
+        bool responded = false;
+        bool streaming = false;
+        bool failed = false;
+        uint64_t bytes_out = 0;
+        uint64_t events = 0;
+
+        bool send_raw(const std::string& data);
+        bool finish();
+    };
+
+    using handler_fn = std::function<void(exchange&)>;
+
+    struct stats {
+        int clients = 0;              // Open connections
+        uint64_t connections = 0;
+        uint64_t refused = 0;         // Over the connection limit
+        uint64_t requests = 0;
+        uint64_t reused = 0;          // Requests on a kept-alive connection
+        uint64_t events = 0;          // Server-sent events
+        uint64_t bad_requests = 0;
+        uint64_t denied = 0;          // Failed the origin, host, token or content type checks
+        uint64_t bytes_in = 0;
+        uint64_t bytes_out = 0;
+        double total_parse_ms = 0.0;  // Parsing headers and reading bodies
+        double total_handler_ms = 0.0;
+    };
+
+    // port 0 picks a free port
+    http_server(int port, handler_fn handler, int max_connections);
+    ~http_server();
+
+    http_server(const http_server&) = delete;
+    http_server& operator=(const http_server&) = delete;
+
+    bool start();
+    int port() const { return bound_port; }
+    const std::string& token() const { return bearer_token; }
+    stats snapshot() const;
+
+private:
+    struct connection;
+
+    const int requested_port;
+    const handler_fn handler;
+    const int max_connections;
+    const std::string bearer_token;
+
+    int listen_fd = -1;
+    int bound_port = 0;
+    std::atomic<bool> stopping{false};
+    std::thread accept_thread;
+    mutable std::mutex mutex;  // Guards connections and counters
+    std::list<std::shared_ptr<connection>> connections;
+    stats counters;
+
+    void accept_loop();
+    void serve(const std::shared_ptr<connection>& conn);
+    void reap_locked();
+};
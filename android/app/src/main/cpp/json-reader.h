@@ -0,0 +1,246 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Minimal JSON parser for request bodies of the local HTTP endpoint
+class json_value {
+public:
+    enum kind_t { NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT };
+
+    kind_t kind = NUL;
+    bool boolean = false;
+    double number = 0.0;
+    std::string string;
+    std::vector<json_value> items;                             // ARRAY
+    std::vector<std::pair<std::string, json_value>> members;  // OBJECT, in document order
+
+    // Member of an object, or nullptr
+    const json_value* get(const char* key) const {
+        if (kind != OBJECT) {
+            return nullptr;
+        }
+        for (const auto& member : members) {
+            if (member.first == key) {
+                return &member.second;
+            }
+        }
+        return nullptr;
+    }
+
+    // Returns false on malformed input or trailing garbage
+    static bool parse(const std::string& text, json_value& out) {
+        out = json_value();
+        const char* p = text.data();
+        const char* end = p + text.size();
+        if (!parse_value(p, end, out, 0)) {
+            return false;
+        }
+        skip_space(p, end);
+        return p == end;
+    }
+
+private:
+    static constexpr int MAX_DEPTH = 64;
+
+    static void skip_space(const char*& p, const char* end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+            p++;
+        }
+    }
+
+    static bool literal(const char*& p, const char* end, const char* word) {
+        for (; *word != '\0'; word++, p++) {
+            if (p >= end || *p != *word) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static void append_utf8(std::string& out, uint32_t cp) {
+        if (cp < 0x80) {
+            out += static_cast<char>(cp);
+        } else if (cp < 0x800) {
+            out += static_cast<char>(0xc0 | (cp >> 6));
+            out += static_cast<char>(0x80 | (cp & 0x3f));
+        } else if (cp < 0x10000) {
+            out += static_cast<char>(0xe0 | (cp >> 12));
+            out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+            out += static_cast<char>(0x80 | (cp & 0x3f));
+        } else {
+            out += static_cast<char>(0xf0 | (cp >> 18));
+            out += static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+            out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+            out += static_cast<char>(0x80 | (cp & 0x3f));
+        }
+    }
+
+    static bool parse_hex4(const char*& p, const char* end, uint32_t& cp) {
+        cp = 0;
+        for (int i = 0; i < 4; i++, p++) {
+            if (p >= end) {
+                return false;
+            }
+            const char c = *p;
+            cp <<= 4;
+            if (c >= '0' && c <= '9') {
+                cp |= static_cast<uint32_t>(c - '0');
+            } else if (c >= 'a' && c <= 'f') {
+                cp |= static_cast<uint32_t>(c - 'a' + 10);
+            } else if (c >= 'A' && c <= 'F') {
+                cp |= static_cast<uint32_t>(c - 'A' + 10);
+            } else {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool parse_string(const char*& p, const char* end, std::string& out) {
+        p++;  // Opening quote
+        while (p < end && *p != '"') {
+            if (static_cast<unsigned char>(*p) < 0x20) {
+                return false;
+            }
+            if (*p != '\\') {
+                out += *p++;
+                continue;
+            }
+            if (++p >= end) {
+                return false;
+            }
+            const char c = *p++;
+            switch (c) {
+                case '"':  out += '"';  break;
+                case '\\': out += '\\'; break;
+                case '/':  out += '/';  break;
+                case 'b':  out += '\b'; break;
+                case 'f':  out += '\f'; break;
+                case 'n':  out += '\n'; break;
+                case 'r':  out += '\r'; break;
+                case 't':  out += '\t'; break;
+                case 'u': {
+                    uint32_t cp;
+                    if (!parse_hex4(p, end, cp)) {
+                        return false;
+                    }
+                    // A surrogate pair encodes one code point above the BMP
+                    if (cp >= 0xd800 && cp < 0xdc00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+                        const char* q = p + 2;
+                        uint32_t low;
+                        if (parse_hex4(q, end, low) && low >= 0xdc00 && low < 0xe000) {
+                            cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                            p = q;
+                        }
+                    }
+                    append_utf8(out, cp);
+                    break;
+                }
+                default:
+                    return false;
+            }
+        }
+        if (p >= end) {
+            return false;
+        }
+        p++;  // Closing quote
+        return true;
+    }
+
+    static bool parse_value(const char*& p, const char* end, json_value& out, int depth) {
+        skip_space(p, end);
+        if (p >= end || depth > MAX_DEPTH) {
+            return false;
+        }
+        switch (*p) {
+            case 'n':
+                out.kind = NUL;
+                return literal(p, end, "null");
+            case 't':
+                out.kind = BOOLEAN;
+                out.boolean = true;
+                return literal(p, end, "true");
+            case 'f':
+                out.kind = BOOLEAN;
+                out.boolean = false;
+                return literal(p, end, "false");
+            case '"':
+                out.kind = STRING;
+                return parse_string(p, end, out.string);
+            case '[': {
+                out.kind = ARRAY;
+                p++;
+                skip_space(p, end);
+                if (p < end && *p == ']') {
+                    p++;
+                    return true;
+                }
+                for (;;) {
+                    out.items.emplace_back();
+                    if (!parse_value(p, end, out.items.back(), depth + 1)) {
+                        return false;
+                    }
+                    skip_space(p, end);
+                    if (p < end && *p == ',') {
+                        p++;
+                    } else if (p < end && *p == ']') {
+                        p++;
+                        return true;
+                    } else {
+                        return false;
+                    }
+                }
+            }
+            case '{': {
+                out.kind = OBJECT;
+                p++;
+                skip_space(p, end);
+                if (p < end && *p == '}') {
+                    p++;
+                    return true;
+                }
+                for (;;) {
+                    skip_space(p, end);
+                    out.members.emplace_back();
+                    auto& member = out.members.back();
+                    if (p >= end || *p != '"' || !parse_string(p, end, member.first)) {
+                        return false;
+                    }
+                    skip_space(p, end);
+                    if (p >= end || *p++ != ':' || !parse_value(p, end, member.second, depth + 1)) {
+                        return false;
+                    }
+                    skip_space(p, end);
+                    if (p < end && *p == ',') {
+                        p++;
+                    } else if (p < end && *p == '}') {
+                        p++;
+                        return true;
+                    } else {
+                        return false;
+                    }
+                }
+            }
+            default: {
+                // strtod needs a terminated string; numbers are short
+                const char* start = p;
+                while (p < end && (*p == '-' || *p == '+' || *p == '.' || *p == 'e' || *p == 'E' ||
+                                   (*p >= '0' && *p <= '9'))) {
+                    p++;
+                }
+                const std::string digits(start, p);
+                if (digits.empty()) {
+                    return false;
+                }
+                char* parsed_end = nullptr;
+                out.kind = NUMBER;
+                out.number = std::strtod(digits.c_str(), &parsed_end);
+                return parsed_end == digits.c_str() + digits.size();
+            }
+        }
+    }
+};
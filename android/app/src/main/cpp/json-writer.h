@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// Minimal JSON builder used to hand metrics and stats back to Dart as a single string
+class json_writer {
+public:
+    json_writer& begin_object(const char* name = nullptr) {
+        write_key(name);
+        out += '{';
+        need_comma = false;
+        return *this;
+    }
+
+    json_writer& end_object() {
+        out += '}';
+        need_comma = true;
+        return *this;
+    }
+
+    json_writer& begin_array(const char* name = nullptr) {
+        write_key(name);
+        out += '[';
+        need_comma = false;
+        return *this;
+    }
+
+    json_writer& end_array() {
+        out += ']';
+        need_comma = true;
+        return *this;
+    }
+
+    json_writer& field(const char* name, double value) {
+        write_key(name);
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%.3f", value);
+        out += buf;
+        need_comma = true;
+        return *this;
+    }
+
+    // A double with `digits` significant digits, for values that need more than
+    // the three decimals of field()
+    json_writer& number(const char* name, double value, int digits) {
+        write_key(name);
+        char buf[40];
+        std::snprintf(buf, sizeof(buf), "%.*g", digits, value);
+        out += buf;
+        need_comma = true;
+        return *this;
+    }
+
+    json_writer& field(const char* name, int64_t value) {
+        write_key(name);
+        out += std::to_string(value);
+        need_comma = true;
+        return *this;
+    }
+
+    json_writer& field(const char* name, int value) {
+        return field(name, static_cast<int64_t>(value));
+    }
+
+    json_writer& field(const char* name, uint64_t value) {
+        write_key(name);
+        out += std::to_string(value);
+        need_comma = true;
+        return *this;
+    }
+
+    json_writer& field(const char* name, bool value) {
+        write_key(name);
+        out += value ? "true" : "false";
+        need_comma = true;
+        return *this;
+    }
+
+    json_writer& field(const char* name, const std::string& value) {
+        write_key(name);
+        write_string(value);
+        need_comma = true;
+        return *this;
+    }
+
+    json_writer& field(const char* name, const char* value) {
+        return field(name, std::string(value ? value : ""));
+    }
+
+    const std::string& str() const { return out; }
+
+private:
+    std::string out;
+    bool need_comma = false;
+
+    void write_key(const char* name) {
+        if (need_comma) {
+            out += ',';
+        }
+        if (name != nullptr) {
+            write_string(name);
+            out += ':';
+        }
+    }
+
+    void write_string(const std::string& s) {
+        out += '"';
+        for (char c : s) {
+            switch (c) {
+                case '"':  out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\n': out += "\\n";  break;
+                case '\r': out += "\\r";  break;
+                case '\t': out += "\\t";  break;
+                default:
+                    if (static_cast<unsigned char>(c) < 0x20) {
+                        char buf[8];
+                        std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+                        out += buf;
+                    } else {
+                        out += c;
+                    }
+            }
+        }
+        out += '"';
+    }
+};
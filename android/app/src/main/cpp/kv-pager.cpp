@@ -0,0 +1,225 @@
+#include "kv-pager.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <android/log.h>
+
+#define LOG_TAG "LlamaJNI"
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+#ifdef KV_PAGER_TEST_HOOKS
+// Defined by the unit test; runs on the I/O thread before each batch is written
+void kv_pager_before_write();
+#endif
+
+namespace {
+
+bool write_fully(int fd, const uint8_t* p, size_t size, uint64_t offset) {
+    while (size > 0) {
+        const ssize_t n = pwrite(fd, p, size, static_cast<off_t>(offset));
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+bool read_fully(int fd, uint8_t* p, size_t size, uint64_t offset) {
+    while (size > 0) {
+        const ssize_t n = pread(fd, p, size, static_cast<off_t>(offset));
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+} // namespace
+
+kv_pager::kv_pager(std::string path, size_t page_bytes)
+    : path(std::move(path)), page_bytes(page_bytes) {
+    counters.page_bytes = page_bytes;
+}
+
+kv_pager::~kv_pager() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cv.notify_all();
+    if (io_thread.joinable()) {
+        io_thread.join();
+    }
+    if (fd >= 0) {
+        ::close(fd);
+        unlink(path.c_str());
+    }
+}
+
+bool kv_pager::open() {
+    std::lock_guard<std::mutex> lock(mutex);
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        LOGE("KV pager: cannot open %s", path.c_str());
+        return false;
+    }
+    io_thread = std::thread(&kv_pager::io_loop, this);
+    return true;
+}
+
+int kv_pager::store(std::vector<uint8_t> data) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (fd < 0 || stop) {
+        return -1;
+    }
+
+    segment_info info;
+    info.size = data.size();
+    const size_t n = (data.size() + page_bytes - 1) / page_bytes;
+    for (size_t i = 0; i < n; i++) {
+        if (!free_pages.empty()) {
+            info.pages.push_back(free_pages.back());
+            free_pages.pop_back();
+        } else {
+            info.pages.push_back(n_pages++);
+        }
+    }
+    info.pending = std::make_shared<const std::vector<uint8_t>>(std::move(data));
+
+    const int id = next_segment++;
+    queue.push_back({id, info.pages, info.pending});
+    counters.pages_used += static_cast<int>(n);
+    counters.pages_total = static_cast<int>(n_pages);
+    segments.emplace(id, std::move(info));
+    counters.segments = static_cast<int>(segments.size());
+    counters.pending_writes = static_cast<int>(queue.size());
+    cv.notify_all();
+    return id;
+}
+
+bool kv_pager::load(int segment, std::vector<uint8_t>& data) {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto found = segments.find(segment);
+    if (found == segments.end()) {
+        return false;
+    }
+    if (found->second.pending) {
+        data = *found->second.pending;
+        return true;
+    }
+
+    // Pages are never reused while their segment is live, so the read needs no lock
+    const std::vector<uint32_t> pages = found->second.pages;
+    const size_t size = found->second.size;
+    lock.unlock();
+
+    data.resize(size);
+    for (size_t i = 0; i < pages.size(); i++) {
+        const size_t offset = i * page_bytes;
+        const size_t n = std::min(page_bytes, size - offset);
+        if (!read_fully(fd, data.data() + offset, n, static_cast<uint64_t>(pages[i]) * page_bytes)) {
+            LOGE("KV pager: read of segment %d failed", segment);
+            data.clear();
+            return false;
+        }
+    }
+
+    lock.lock();
+    counters.reads++;
+    counters.bytes_read += size;
+    return true;
+}
+
+void kv_pager::release(int segment) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = segments.find(segment);
+    if (found == segments.end()) {
+        return;
+    }
+    // A queued write of these pages may still land; any later owner's write is queued behind it
+    free_pages.insert(free_pages.end(), found->second.pages.begin(), found->second.pages.end());
+    counters.pages_used -= static_cast<int>(found->second.pages.size());
+    segments.erase(found);
+    counters.segments = static_cast<int>(segments.size());
+}
+
+void kv_pager::flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle_cv.wait(lock, [this] { return queue.empty() && !writing; });
+}
+
+kv_pager::stats kv_pager::snapshot() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
+
+// Write everything queued, then sync once for the whole batch
+void kv_pager::io_loop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        cv.wait(lock, [this] { return stop || !queue.empty(); });
+        if (queue.empty()) {
+            break;  // Stopping with nothing left to write
+        }
+
+        std::deque<write_job> batch;
+        batch.swap(queue);
+        writing = true;
+        counters.pending_writes = 0;
+        lock.unlock();
+#ifdef KV_PAGER_TEST_HOOKS
+        kv_pager_before_write();
+#endif
+
+        const auto start = std::chrono::steady_clock::now();
+        uint64_t written = 0;
+        std::vector<int> done;
+        for (const write_job& job : batch) {
+            const std::vector<uint8_t>& data = *job.data;
+            bool ok = true;
+            for (size_t i = 0; ok && i < job.pages.size(); i++) {
+                const size_t offset = i * page_bytes;
+                const size_t n = std::min(page_bytes, data.size() - offset);
+                ok = write_fully(fd, data.data() + offset, n, static_cast<uint64_t>(job.pages[i]) * page_bytes);
+            }
+            if (ok) {
+                written += data.size();
+                done.push_back(job.segment);
+            } else {
+                // The segment stays readable from memory
+                LOGE("KV pager: write of segment %d failed", job.segment);
+            }
+        }
+        const bool synced = fdatasync(fd) == 0;
+        if (synced) {
+            // Written pages are clean now; let the kernel reclaim them right away
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        lock.lock();
+        for (int id : done) {
+            auto found = segments.find(id);
+            if (found != segments.end() && synced) {
+                found->second.pending.reset();
+            }
+        }
+        counters.writes += done.size();
+        counters.bytes_written += written;
+        counters.syncs += synced ? 1 : 0;
+        counters.total_write_ms += ms;
+        writing = false;
+        idle_cv.notify_all();
+    }
+    writing = false;
+    idle_cv.notify_all();
+}
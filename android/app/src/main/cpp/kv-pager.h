@@ -0,0 +1,87 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Scratch file of fixed-size pages holding serialized KV ranges that were moved
+// out of the context. store() hands a segment to an I/O thread and returns at
+// once; the thread writes queued segments and syncs the file once per batch,
+// then drops the written pages from the page cache so paged-out history does
+// not count against RAM. A segment can be loaded back (from memory while its
+// write is still queued) and released, which returns its pages for reuse. The
+// file is recreated on open(); nothing in it survives the process. Thread-safe.
+class kv_pager {
+public:
+    struct stats {
+        int segments = 0;
+        int pages_used = 0;
+        int pages_total = 0;      // File size in pages, including free ones
+        size_t page_bytes = 0;
+        int pending_writes = 0;
+        uint64_t bytes_written = 0;
+        uint64_t bytes_read = 0;
+        uint64_t writes = 0;
+        uint64_t reads = 0;
+        uint64_t syncs = 0;
+        double total_write_ms = 0.0;  // Time the I/O thread spent writing and syncing
+    };
+
+    kv_pager(std::string path, size_t page_bytes);
+    ~kv_pager();
+
+    kv_pager(const kv_pager&) = delete;
+    kv_pager& operator=(const kv_pager&) = delete;
+
+    // Create (or truncate) the file and start the I/O thread
+    bool open();
+
+    // Queue data for writing; returns the segment id, or -1 if the pager is closed
+    int store(std::vector<uint8_t> data);
+    bool load(int segment, std::vector<uint8_t>& data);
+    void release(int segment);
+
+    // Block until every queued write is on flash
+    void flush();
+
+    stats snapshot() const;
+
+private:
+    struct segment_info {
+        std::vector<uint32_t> pages;
+        size_t size = 0;
+        std::shared_ptr<const std::vector<uint8_t>> pending;  // Set until written
+    };
+
+    struct write_job {
+        int segment;
+        std::vector<uint32_t> pages;
+        std::shared_ptr<const std::vector<uint8_t>> data;
+    };
+
+    const std::string path;
+    const size_t page_bytes;
+
+    mutable std::mutex mutex;
+    std::condition_variable cv;       // Wakes the I/O thread
+    std::condition_variable idle_cv;  // Signals flush() once the queue is written
+    std::thread io_thread;
+    bool stop = false;
+    bool writing = false;
+    int fd = -1;
+    int next_segment = 0;
+    uint32_t n_pages = 0;
+    std::vector<uint32_t> free_pages;
+    std::unordered_map<int, segment_info> segments;
+    std::deque<write_job> queue;
+    stats counters;
+
+    void io_loop();
+};
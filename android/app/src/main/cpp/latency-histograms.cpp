@@ -0,0 +1,204 @@
+#include "latency-histograms.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <ctime>
+#include <vector>
+
+namespace {
+
+struct metric_info {
+    const char* name;
+    const char* help;
+    double scale;  // Recorded thousandths to the exported unit
+};
+
+const metric_info METRICS[LATENCY_METRIC_COUNT] = {
+    {"llm_time_to_first_token_seconds", "Arrival to first token of interactive requests", 1e-6},
+    {"llm_inter_token_seconds", "Time between streamed tokens of interactive requests", 1e-6},
+    {"llm_prefill_tokens_per_second", "Prompt processing rate", 1e-3},
+    {"llm_queue_wait_seconds", "Time requests waited for the scheduler", 1e-6},
+    {"llm_model_load_seconds", "Time to load a model and create its context", 1e-6},
+};
+
+const double QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+
+// Prometheus label values escape backslash, quote and newline
+std::string escape_label(const std::string& value) {
+    std::string out;
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            out += '\\';
+            out += c;
+        } else if (c == '\n') {
+            out += "\\n";
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+} // namespace
+
+int log_histogram::bucket_of(uint64_t value) {
+    constexpr uint64_t LIMIT = (uint64_t(1) << (MAX_SHIFT + SUB_BITS + 1)) - 1;
+    if (value > LIMIT) {
+        value = LIMIT;
+    }
+    if (value < 2 * SUB_BUCKETS) {
+        return static_cast<int>(value);
+    }
+    const int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+    return shift * SUB_BUCKETS + static_cast<int>(value >> shift);
+}
+
+uint64_t log_histogram::bucket_low(int bucket) {
+    if (bucket < 2 * SUB_BUCKETS) {
+        return static_cast<uint64_t>(bucket);
+    }
+    const int shift = bucket / SUB_BUCKETS - 1;
+    return static_cast<uint64_t>(bucket - shift * SUB_BUCKETS) << shift;
+}
+
+uint64_t log_histogram::bucket_high(int bucket) {
+    if (bucket < 2 * SUB_BUCKETS) {
+        return static_cast<uint64_t>(bucket) + 1;
+    }
+    const int shift = bucket / SUB_BUCKETS - 1;
+    return static_cast<uint64_t>(bucket - shift * SUB_BUCKETS + 1) << shift;
+}
+
+void log_histogram::clear() {
+    for (auto& count : counts) {
+        count.store(0, std::memory_order_relaxed);
+    }
+}
+
+// Windows age in elapsed real time: CLOCK_BOOTTIME keeps counting while the
+// device is suspended, where steady_clock (CLOCK_MONOTONIC) stops, and unlike
+// the system clock it does not jump when the date is changed
+int64_t latency_registry::current_epoch() {
+    timespec now;
+    clock_gettime(CLOCK_BOOTTIME, &now);
+    return static_cast<int64_t>(now.tv_sec) / WINDOW_S + 1;
+}
+
+int latency_registry::series(const std::string& model, const std::string& config) {
+    std::lock_guard<std::mutex> lock(register_mutex);
+    for (int i = 0; i < n_series; i++) {
+        if (slots[i].model == model && slots[i].config == config) {
+            return i;
+        }
+    }
+    if (n_series == MAX_SERIES) {
+        return -1;
+    }
+    series_state& slot = slots[n_series];
+    slot.model = model;
+    slot.config = config;
+    slot.ready.store(true, std::memory_order_release);
+    return n_series++;
+}
+
+void latency_registry::record(int series, latency_metric metric, double value) {
+    if (series < 0 || series >= MAX_SERIES || metric < 0 || metric >= LATENCY_METRIC_COUNT) {
+        return;
+    }
+    const uint64_t units = value > 0.0 ? static_cast<uint64_t>(std::llround(value * 1000.0)) : 0;
+    metric_state& state = slots[series].metrics[metric];
+    const int64_t epoch = current_epoch();
+    window& w = state.windows[epoch % WINDOWS];
+
+    // The first sample of a new epoch in this slot clears what it held a day ago
+    int64_t seen = w.epoch.load(std::memory_order_acquire);
+    if (seen != epoch) {
+        if (seen != EPOCH_CLEARING && seen < epoch &&
+            w.epoch.compare_exchange_strong(seen, EPOCH_CLEARING, std::memory_order_acq_rel)) {
+            w.hist.clear();
+            w.epoch.store(epoch, std::memory_order_release);
+        } else if (seen != epoch) {
+            n_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+    w.hist.record(units);
+    state.count.fetch_add(1, std::memory_order_relaxed);
+    state.sum.fetch_add(units, std::memory_order_relaxed);
+}
+
+std::string latency_registry::prometheus_text() const {
+    const int64_t epoch = current_epoch();
+    std::string out;
+    char line[1024];
+    std::vector<uint32_t> merged(log_histogram::BUCKETS);
+
+    for (int m = 0; m < LATENCY_METRIC_COUNT; m++) {
+        const metric_info& info = METRICS[m];
+        std::snprintf(line, sizeof(line), "# HELP %s %s, quantiles over the last %lld h\n# TYPE %s summary\n",
+                      info.name, info.help, static_cast<long long>(WINDOWS * WINDOW_S / 3600), info.name);
+        out += line;
+
+        for (int s = 0; s < MAX_SERIES; s++) {
+            const series_state& slot = slots[s];
+            if (!slot.ready.load(std::memory_order_acquire)) {
+                break;
+            }
+            const metric_state& state = slot.metrics[m];
+            const std::string labels =
+                "model=\"" + escape_label(slot.model) + "\",config=\"" + escape_label(slot.config) + "\"";
+
+            uint64_t total = 0;
+            std::fill(merged.begin(), merged.end(), 0);
+            for (const window& w : state.windows) {
+                const int64_t w_epoch = w.epoch.load(std::memory_order_acquire);
+                if (w_epoch <= 0 || w_epoch <= epoch - WINDOWS) {
+                    continue;
+                }
+                for (int b = 0; b < log_histogram::BUCKETS; b++) {
+                    const uint32_t n = w.hist.counts[b].load(std::memory_order_relaxed);
+                    merged[b] += n;
+                    total += n;
+                }
+            }
+
+            for (double q : QUANTILES) {
+                double value = NAN;
+                if (total > 0) {
+                    const uint64_t rank = static_cast<uint64_t>(std::ceil(q * total));
+                    uint64_t seen = 0;
+                    for (int b = 0; b < log_histogram::BUCKETS; b++) {
+                        seen += merged[b];
+                        if (seen >= rank && merged[b] > 0) {
+                            const double mid = 0.5 * (log_histogram::bucket_low(b) + log_histogram::bucket_high(b) - 1);
+                            value = mid * info.scale;
+                            break;
+                        }
+                    }
+                }
+                char number[32] = "NaN";  // Prometheus spelling; printf gives "nan"
+                if (!std::isnan(value)) {
+                    std::snprintf(number, sizeof(number), "%.6g", value);
+                }
+                std::snprintf(line, sizeof(line), "%s{%s,quantile=\"%g\"} %s\n", info.name, labels.c_str(), q, number);
+                out += line;
+            }
+            std::snprintf(line, sizeof(line), "%s_sum{%s} %.9g\n%s_count{%s} %llu\n", info.name, labels.c_str(),
+                          state.sum.load(std::memory_order_relaxed) * info.scale, info.name, labels.c_str(),
+                          static_cast<unsigned long long>(state.count.load(std::memory_order_relaxed)));
+            out += line;
+        }
+    }
+    std::snprintf(line, sizeof(line),
+                  "# HELP llm_latency_samples_dropped_total Samples lost while a window was cleared\n"
+                  "# TYPE llm_latency_samples_dropped_total counter\nllm_latency_samples_dropped_total %llu\n",
+                  static_cast<unsigned long long>(dropped()));
+    out += line;
+    return out;
+}
+
+latency_registry& latency_histograms() {
+    static latency_registry registry;
+    return registry;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+// Distributions kept across requests. Values are recorded in the unit noted
+// here and exported in base units (seconds, tokens/s).
+enum latency_metric {
+    LATENCY_TTFT = 0,        // ms from arrival to the first token, interactive requests
+    LATENCY_INTER_TOKEN,     // ms between streamed tokens, interactive requests
+    LATENCY_PREFILL_RATE,    // Prompt tokens/s, prompts of at least 8 tokens
+    LATENCY_QUEUE_WAIT,      // ms before the scheduler started a request
+    LATENCY_MODEL_LOAD,      // ms from load_model_with_gpu() to a usable context
+    LATENCY_METRIC_COUNT
+};
+
+// Log-linear histogram in the style of HdrHistogram: 16 linear sub-buckets per
+// power of two, so a bucket is within 6.25% of any value in it, up to 2^36.
+// Recording is one relaxed atomic increment.
+class log_histogram {
+public:
+    static constexpr int SUB_BITS = 4;
+    static constexpr int SUB_BUCKETS = 1 << SUB_BITS;
+    static constexpr int MAX_SHIFT = 32;
+    static constexpr int BUCKETS = (MAX_SHIFT + 2) * SUB_BUCKETS;
+
+    static int bucket_of(uint64_t value);
+    static uint64_t bucket_low(int bucket);
+    static uint64_t bucket_high(int bucket);  // Exclusive
+
+    void record(uint64_t value) { counts[bucket_of(value)].fetch_add(1, std::memory_order_relaxed); }
+    void clear();
+
+    std::atomic<uint32_t> counts[BUCKETS];
+};
+
+// Process-wide rolling histograms per (model, config) series. Each metric keeps
+// a ring of WINDOWS windows of WINDOW_S seconds, so quantiles cover the last
+// day; the oldest window is cleared by the first sample that lands in its slot
+// again. Lifetime count and sum are kept alongside for monotonic counters.
+//
+// record() takes no lock and never allocates, so it stays on in production
+// builds; only registering a series locks. The table lives in static storage
+// and its pages are only touched once a series records.
+class latency_registry {
+public:
+    static constexpr int MAX_SERIES = 8;
+    static constexpr int WINDOWS = 6;
+    static constexpr int64_t WINDOW_S = 4 * 3600;
+
+    // Index of the series labelled model/config, registered on first use; -1
+    // once MAX_SERIES series exist
+    int series(const std::string& model, const std::string& config);
+
+    // Samples for series -1 are ignored
+    void record(int series, latency_metric metric, double value);
+
+    // Prometheus text exposition: one summary per metric with 0.5/0.9/0.99/0.999
+    // quantiles over the rolling windows and lifetime _sum/_count
+    std::string prometheus_text() const;
+
+    // Samples lost while a window was being cleared by another thread
+    uint64_t dropped() const { return n_dropped.load(std::memory_order_relaxed); }
+
+private:
+    static constexpr int64_t EPOCH_CLEARING = -1;
+
+    struct window {
+        std::atomic<int64_t> epoch;  // 0 until first used; epochs start at 1
+        log_histogram hist;
+    };
+
+    struct metric_state {
+        window windows[WINDOWS];
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> sum;  // In thousandths of the recorded unit
+    };
+
+    struct series_state {
+        std::atomic<bool> ready;
+        std::string model;
+        std::string config;
+        metric_state metrics[LATENCY_METRIC_COUNT];
+    };
+
+    series_state slots[MAX_SERIES];
+    std::mutex register_mutex;
+    int n_series = 0;
+    std::atomic<uint64_t> n_dropped{0};
+
+    static int64_t current_epoch();  // From CLOCK_BOOTTIME, which counts suspended time
+};
+
+// The registry shared by every loaded model
+latency_registry& latency_histograms();
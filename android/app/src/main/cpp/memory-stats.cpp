@@ -0,0 +1,212 @@
+#include "memory-stats.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <android/log.h>
+#include "llama.h"
+
+size_t read_process_rss_bytes() {
+    FILE* f = std::fopen("/proc/self/statm", "r");
+    if (f == nullptr) {
+        return 0;
+    }
+    unsigned long size_pages = 0, resident_pages = 0;
+    int n = std::fscanf(f, "%lu %lu", &size_pages, &resident_pages);
+    std::fclose(f);
+    return n == 2 ? resident_pages * static_cast<size_t>(sysconf(_SC_PAGESIZE)) : 0;
+}
+
+size_t read_mem_available_bytes() {
+    FILE* f = std::fopen("/proc/meminfo", "r");
+    if (f == nullptr) {
+        return 0;
+    }
+    char line[128];
+    size_t available_kb = 0;
+    while (std::fgets(line, sizeof(line), f) != nullptr) {
+        unsigned long kb = 0;
+        if (std::sscanf(line, "MemAvailable: %lu kB", &kb) == 1) {
+            available_kb = kb;
+            break;
+        }
+    }
+    std::fclose(f);
+    return available_kb * 1024;
+}
+
+process_memory read_process_memory() {
+    process_memory mem;
+
+    FILE* f = std::fopen("/proc/self/smaps_rollup", "r");
+    if (f != nullptr) {
+        char line[128];
+        while (std::fgets(line, sizeof(line), f) != nullptr) {
+            unsigned long kb = 0;
+            if (std::sscanf(line, "Rss: %lu kB", &kb) == 1) {
+                mem.rss = kb * 1024;
+            } else if (std::sscanf(line, "Pss: %lu kB", &kb) == 1) {
+                mem.pss = kb * 1024;
+            } else if (std::sscanf(line, "Swap: %lu kB", &kb) == 1) {
+                mem.swap = kb * 1024;
+            }
+        }
+        std::fclose(f);
+    }
+
+    if (mem.rss == 0) {
+        mem.rss = read_process_rss_bytes();
+    }
+    return mem;
+}
+
+size_t file_size_bytes(const std::string& path) {
+    struct stat st;
+    if (path.empty() || stat(path.c_str(), &st) != 0) {
+        return 0;
+    }
+    return static_cast<size_t>(st.st_size);
+}
+
+// ---- file_residency_probe ----
+
+file_residency_probe::~file_residency_probe() {
+    close();
+}
+
+bool file_residency_probe::open(const std::string& path) {
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        ::close(fd);
+        return false;
+    }
+
+    void* mapped = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);  // The mapping keeps the file alive
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+
+    const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    addr = mapped;
+    length = static_cast<size_t>(st.st_size);
+    n_pages = (length + page_size - 1) / page_size;
+    pages = new unsigned char[n_pages];
+    return true;
+}
+
+void file_residency_probe::close() {
+    if (addr != nullptr) {
+        munmap(addr, length);
+        addr = nullptr;
+    }
+    delete[] pages;
+    pages = nullptr;
+    length = 0;
+    n_pages = 0;
+}
+
+size_t file_residency_probe::resident_bytes() {
+    if (addr == nullptr || mincore(addr, length, pages) != 0) {
+        return 0;
+    }
+
+    size_t resident = 0;
+    for (size_t i = 0; i < n_pages; i++) {
+        resident += pages[i] & 1;
+    }
+    const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return std::min(resident * page_size, length);
+}
+
+// ---- llama.cpp log hook ----
+
+namespace {
+
+std::mutex g_buffer_mutex;
+backend_buffer_sizes g_logged_buffers;
+
+// Parse lines like "llama_context:        CPU compute buffer size =   514.25 MiB"
+void record_buffer_line(const char* line) {
+    const char* marker = std::strstr(line, " buffer size = ");
+    if (marker == nullptr) {
+        return;
+    }
+
+    const double mib = std::strtod(marker + std::strlen(" buffer size = "), nullptr);
+    const size_t bytes = static_cast<size_t>(mib * 1024.0 * 1024.0);
+
+    // The word right before " buffer size" tells us which kind of buffer this is
+    const char* word_end = marker;
+    const char* word_begin = word_end;
+    while (word_begin > line && word_begin[-1] != ' ') {
+        word_begin--;
+    }
+    const std::string kind(word_begin, word_end);
+
+    std::lock_guard<std::mutex> lock(g_buffer_mutex);
+    if (kind == "model") {
+        g_logged_buffers.model += bytes;
+    } else if (kind == "KV") {
+        g_logged_buffers.kv += bytes;
+    } else if (kind == "compute") {
+        g_logged_buffers.compute += bytes;
+    } else if (kind == "output") {
+        g_logged_buffers.output += bytes;
+    }
+}
+
+void llama_log_hook(enum ggml_log_level level, const char* text, void* /*user_data*/) {
+    // llama.cpp may emit a line in several pieces; assemble them before parsing
+    thread_local std::string pending;
+    pending += text;
+    if (pending.empty() || pending.back() != '\n') {
+        return;
+    }
+
+    record_buffer_line(pending.c_str());
+
+    if (level == GGML_LOG_LEVEL_DEBUG) {
+        pending.clear();
+        return;
+    }
+    int prio = ANDROID_LOG_INFO;
+    if (level == GGML_LOG_LEVEL_ERROR) {
+        prio = ANDROID_LOG_ERROR;
+    } else if (level == GGML_LOG_LEVEL_WARN) {
+        prio = ANDROID_LOG_WARN;
+    }
+    __android_log_print(prio, "llama.cpp", "%s", pending.c_str());
+    pending.clear();
+}
+
+} // namespace
+
+void install_llama_log_hook() {
+    llama_log_set(llama_log_hook, nullptr);
+}
+
+void begin_buffer_size_capture() {
+    std::lock_guard<std::mutex> lock(g_buffer_mutex);
+    g_logged_buffers = backend_buffer_sizes();
+}
+
+backend_buffer_sizes take_logged_buffer_sizes() {
+    std::lock_guard<std::mutex> lock(g_buffer_mutex);
+    backend_buffer_sizes sizes = g_logged_buffers;
+    g_logged_buffers = backend_buffer_sizes();
+    return sizes;
+}
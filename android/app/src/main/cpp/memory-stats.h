@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Process-level memory counters from /proc/self (bytes)
+struct process_memory {
+    size_t rss = 0;
+    size_t pss = 0;   // 0 when smaps_rollup is unavailable
+    size_t swap = 0;
+};
+
+// Backend buffer sizes as reported by llama.cpp while creating a model/context (bytes)
+struct backend_buffer_sizes {
+    size_t model = 0;
+    size_t kv = 0;
+    size_t compute = 0;
+    size_t output = 0;
+};
+
+// Resident set size of this process in bytes (from /proc/self/statm)
+size_t read_process_rss_bytes();
+
+// MemAvailable from /proc/meminfo in bytes, 0 if it cannot be read
+size_t read_mem_available_bytes();
+
+// RSS, PSS and swap of this process. PSS comes from smaps_rollup, which is
+// cheap on kernels >= 4.14; RSS falls back to statm when it is missing.
+process_memory read_process_memory();
+
+// Size of a file on disk, 0 if it does not exist
+size_t file_size_bytes(const std::string& path);
+
+// Measures how much of a file is resident in the page cache using mincore().
+// The file is mapped once, read-only and without touching any page, so the probe
+// itself adds nothing to RSS. Because the model is mmapped from the same file,
+// its resident weight pages are exactly the pages reported here.
+class file_residency_probe {
+public:
+    ~file_residency_probe();
+
+    bool open(const std::string& path);
+    void close();
+
+    size_t file_bytes() const { return length; }
+    size_t resident_bytes();
+
+private:
+    void* addr = nullptr;
+    size_t length = 0;
+    unsigned char* pages = nullptr;
+    size_t n_pages = 0;
+};
+
+// Install a llama.cpp log callback that forwards to logcat and records the
+// "... buffer size = X MiB" lines printed while loading a model or creating a
+// context. Safe to call more than once.
+void install_llama_log_hook();
+
+// Reset the buffer sizes recorded by the log hook; call right before
+// llama_model_load_from_file / llama_init_from_model and read them back with
+// take_logged_buffer_sizes() once the call returns.
+void begin_buffer_size_capture();
+backend_buffer_sizes take_logged_buffer_sizes();
@@ -0,0 +1,561 @@
+#include "model-server.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <android/log.h>
+
+#define LOG_TAG "LlamaJNI"
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shm_ring needs lock-free 64-bit atomics");
+
+namespace {
+
+enum message_type : uint32_t {
+    MSG_HELLO = 1,    // Server -> client, carries the memfd; bytes = ring capacity
+    MSG_REQUEST = 2,  // Client -> server; bytes = prompt length, already in the request ring
+    MSG_STREAM = 3,   // Server -> client; bytes of streamed reply text put in the reply ring
+    MSG_FINAL = 4,    // Server -> client; bytes of the final reply put in the reply ring
+    MSG_DONE = 5,     // Server -> client; the final reply is complete
+    MSG_ERROR = 6,    // Server -> client; the request was malformed
+};
+
+struct message {
+    uint32_t type;
+    uint32_t bytes;
+    remote_options options;
+};
+
+// Region layout: the two ring headers on their own cache lines, then the data
+struct alignas(64) ring_slot {
+    shm_ring ring;
+};
+
+struct shared_header {
+    ring_slot request;
+    ring_slot reply;
+};
+
+size_t region_bytes(uint32_t capacity) {
+    return sizeof(shared_header) + 2 * static_cast<size_t>(capacity);
+}
+
+shared_header* header_of(void* region) {
+    return static_cast<shared_header*>(region);
+}
+
+char* request_data(void* region) {
+    return static_cast<char*>(region) + sizeof(shared_header);
+}
+
+char* reply_data(void* region, uint32_t capacity) {
+    return request_data(region) + capacity;
+}
+
+// A stalled peer must not hold a connection thread forever
+constexpr auto RING_WAIT_LIMIT = std::chrono::seconds(10);
+
+bool make_address(const std::string& path, sockaddr_un& addr, socklen_t& len) {
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    if (path[0] == '@') {
+        // Abstract namespace: leading NUL, no file, gone with the last descriptor
+        std::memcpy(addr.sun_path + 1, path.data() + 1, path.size() - 1);
+        len = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + path.size());
+    } else {
+        std::memcpy(addr.sun_path, path.data(), path.size());
+        len = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + path.size() + 1);
+    }
+    return true;
+}
+
+bool send_message(int fd, const message& msg, int pass_fd = -1) {
+    iovec iov = {const_cast<message*>(&msg), sizeof(msg)};
+    msghdr hdr = {};
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    if (pass_fd >= 0) {
+        hdr.msg_control = control;
+        hdr.msg_controllen = sizeof(control);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+    }
+    ssize_t n;
+    do {
+        n = sendmsg(fd, &hdr, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    return n == static_cast<ssize_t>(sizeof(msg));
+}
+
+// Receive one message; a passed descriptor, if any, lands in received_fd
+bool recv_message(int fd, message& msg, int* received_fd = nullptr) {
+    iovec iov = {&msg, sizeof(msg)};
+    msghdr hdr = {};
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+    ssize_t n;
+    do {
+        n = recvmsg(fd, &hdr, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n != static_cast<ssize_t>(sizeof(msg))) {
+        return false;
+    }
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg != nullptr; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int passed;
+            std::memcpy(&passed, CMSG_DATA(cmsg), sizeof(int));
+            if (received_fd != nullptr) {
+                *received_fd = passed;
+            } else {
+                ::close(passed);
+            }
+        }
+    }
+    return true;
+}
+
+// memfd_create() has no libc wrapper before API 30
+int create_shared_fd(size_t size) {
+#ifdef __NR_memfd_create
+    const int fd = static_cast<int>(syscall(__NR_memfd_create, "llama-ring", 1u /* MFD_CLOEXEC */));
+    if (fd < 0) {
+        return -1;
+    }
+    if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    (void)size;
+    return -1;
+#endif
+}
+
+} // namespace
+
+bool shm_ring::consistent(uint32_t capacity) const {
+    const uint64_t w = write_pos.load(std::memory_order_acquire);
+    const uint64_t r = read_pos.load(std::memory_order_acquire);
+    return capacity > 0 && w - r <= capacity;
+}
+
+// Both positions live in memory the peer can write, so each access re-checks
+// them on local copies: a ring claiming more than capacity bytes is refused
+// rather than trusted, and the copies below never leave [data, data + capacity)
+size_t shm_ring::write(char* data, uint32_t capacity, const char* src, size_t n) {
+    const uint64_t w = write_pos.load(std::memory_order_relaxed);
+    const uint64_t r = read_pos.load(std::memory_order_acquire);
+    if (capacity == 0 || w - r > capacity) {
+        return 0;
+    }
+    n = std::min(n, static_cast<size_t>(capacity - (w - r)));
+    const size_t at = static_cast<size_t>(w % capacity);
+    const size_t first = std::min(n, static_cast<size_t>(capacity) - at);
+    std::memcpy(data + at, src, first);
+    std::memcpy(data, src + first, n - first);
+    write_pos.store(w + n, std::memory_order_release);
+    return n;
+}
+
+size_t shm_ring::read(const char* data, uint32_t capacity, char* dst, size_t n) {
+    const uint64_t r = read_pos.load(std::memory_order_relaxed);
+    const uint64_t w = write_pos.load(std::memory_order_acquire);
+    if (capacity == 0 || w - r > capacity) {
+        return 0;
+    }
+    n = std::min(n, static_cast<size_t>(w - r));
+    const size_t at = static_cast<size_t>(r % capacity);
+    const size_t first = std::min(n, static_cast<size_t>(capacity) - at);
+    std::memcpy(dst, data + at, first);
+    std::memcpy(dst + first, data, n - first);
+    read_pos.store(r + n, std::memory_order_release);
+    return n;
+}
+
+struct model_server::connection {
+    int fd = -1;
+    void* shared = nullptr;
+    size_t shared_bytes = 0;
+    std::thread thread;
+    std::atomic<bool> done{false};
+    std::mutex write_mutex;  // Orders reply-ring writes and their messages
+
+    ~connection() {
+        if (shared != nullptr) {
+            munmap(shared, shared_bytes);
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+};
+
+model_server::model_server(std::string socket_path, handler_fn handler, uint32_t ring_bytes)
+    : socket_path(std::move(socket_path)),
+      handler(std::move(handler)),
+      ring_bytes(std::max<uint32_t>(ring_bytes, 4096)) {}
+
+model_server::~model_server() {
+    stopping = true;
+    if (listen_fd >= 0) {
+        shutdown(listen_fd, SHUT_RDWR);  // Wakes accept()
+    }
+    if (accept_thread.joinable()) {
+        accept_thread.join();
+    }
+
+    std::list<std::shared_ptr<connection>> remaining;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        remaining.swap(connections);
+    }
+    for (const auto& conn : remaining) {
+        shutdown(conn->fd, SHUT_RDWR);  // Wakes recvmsg(); a running request finishes first
+    }
+    for (const auto& conn : remaining) {
+        if (conn->thread.joinable()) {
+            conn->thread.join();
+        }
+    }
+
+    if (listen_fd >= 0) {
+        ::close(listen_fd);
+        if (socket_path[0] != '@') {
+            unlink(socket_path.c_str());
+        }
+    }
+}
+
+bool model_server::start() {
+    sockaddr_un addr;
+    socklen_t len;
+    if (!make_address(socket_path, addr, len)) {
+        LOGE("Model server: invalid socket path %s", socket_path.c_str());
+        return false;
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        LOGE("Model server: socket() failed: %s", strerror(errno));
+        return false;
+    }
+    if (socket_path[0] != '@') {
+        unlink(socket_path.c_str());  // Left behind by a previous run
+    }
+    if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), len) != 0 || listen(listen_fd, 8) != 0) {
+        LOGE("Model server: cannot listen on %s: %s", socket_path.c_str(), strerror(errno));
+        ::close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+
+    accept_thread = std::thread(&model_server::accept_loop, this);
+    LOGI("Model server: listening on %s (%u-byte rings)", socket_path.c_str(), ring_bytes);
+    return true;
+}
+
+model_server::stats model_server::snapshot() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
+
+void model_server::reap_locked() {
+    for (auto it = connections.begin(); it != connections.end();) {
+        if ((*it)->done) {
+            (*it)->thread.join();
+            it = connections.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    counters.clients = static_cast<int>(connections.size());
+}
+
+void model_server::accept_loop() {
+    while (!stopping) {
+        const int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;  // Listening socket shut down
+        }
+
+        ucred peer = {};
+        socklen_t peer_len = sizeof(peer);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len) != 0 || peer.uid != getuid()) {
+            LOGE("Model server: refused client with uid %d", static_cast<int>(peer.uid));
+            ::close(fd);
+            std::lock_guard<std::mutex> lock(mutex);
+            counters.refused++;
+            continue;
+        }
+
+        auto conn = std::make_shared<connection>();
+        conn->fd = fd;
+        conn->shared_bytes = region_bytes(ring_bytes);
+        const int shm_fd = create_shared_fd(conn->shared_bytes);
+        if (shm_fd >= 0) {
+            conn->shared = mmap(nullptr, conn->shared_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+            if (conn->shared == MAP_FAILED) {
+                conn->shared = nullptr;
+            }
+        }
+        bool ok = conn->shared != nullptr;
+        if (ok) {
+            shared_header* header = header_of(conn->shared);
+            new (&header->request.ring.write_pos) std::atomic<uint64_t>(0);
+            new (&header->request.ring.read_pos) std::atomic<uint64_t>(0);
+            new (&header->reply.ring.write_pos) std::atomic<uint64_t>(0);
+            new (&header->reply.ring.read_pos) std::atomic<uint64_t>(0);
+            message hello = {};
+            hello.type = MSG_HELLO;
+            hello.bytes = ring_bytes;
+            ok = send_message(fd, hello, shm_fd);
+        }
+        if (shm_fd >= 0) {
+            ::close(shm_fd);  // The mapping and the client's copy keep the region alive
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        reap_locked();
+        if (!ok) {
+            LOGE("Model server: no shared memory for client");
+            counters.refused++;
+            continue;  // conn closes the socket
+        }
+        connections.push_back(conn);
+        counters.connections++;
+        counters.clients = static_cast<int>(connections.size());
+        conn->thread = std::thread(&model_server::serve, this, conn);
+    }
+}
+
+void model_server::serve(const std::shared_ptr<connection>& conn) {
+    shared_header* header = header_of(conn->shared);
+    char* const in = request_data(conn->shared);
+    char* const out = reply_data(conn->shared, ring_bytes);
+    shm_ring& in_ring = header->request.ring;
+    shm_ring& out_ring = header->reply.ring;
+
+    // Put all of text into the reply ring, one message per chunk that fits.
+    // Called with write_mutex held.
+    auto send_all = [&](const std::string& text, uint32_t type) {
+        const auto deadline = std::chrono::steady_clock::now() + RING_WAIT_LIMIT;
+        size_t sent = 0;
+        while (sent < text.size()) {
+            const size_t n = out_ring.write(out, ring_bytes, text.data() + sent, text.size() - sent);
+            if (n == 0) {
+                if (stopping || !out_ring.consistent(ring_bytes) || std::chrono::steady_clock::now() > deadline) {
+                    return false;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+            message msg = {};
+            msg.type = type;
+            msg.bytes = static_cast<uint32_t>(n);
+            if (!send_message(conn->fd, msg)) {
+                return false;
+            }
+            sent += n;
+        }
+        return true;
+    };
+
+    std::string prompt;
+    message msg;
+    while (!stopping && recv_message(conn->fd, msg)) {
+        if (msg.type != MSG_REQUEST) {
+            continue;
+        }
+        if (!in_ring.consistent(ring_bytes) || !out_ring.consistent(ring_bytes)) {
+            LOGE("Model server: client corrupted the ring positions, dropping it");
+            break;
+        }
+        prompt.resize(std::min(msg.bytes, ring_bytes));
+        if (msg.bytes > ring_bytes || in_ring.read(in, ring_bytes, &prompt[0], prompt.size()) != prompt.size()) {
+            message error = {};
+            error.type = MSG_ERROR;
+            if (!send_message(conn->fd, error)) {
+                break;
+            }
+            continue;
+        }
+
+        // Stream deltas of the visible text without ever blocking generation:
+        // what does not fit the ring now waits for the next call or the end.
+        // Handlers only ever extend the text (a cascade holds back its start
+        // until it can no longer escalate), so the tail is all that is new.
+        size_t streamed = 0;
+        std::string backlog;
+        bool alive = true;
+        const stream_fn stream = [&](const std::string& visible_text) {
+            std::lock_guard<std::mutex> lock(conn->write_mutex);
+            if (!alive || visible_text.size() <= streamed) {
+                return;
+            }
+            backlog.append(visible_text, streamed, std::string::npos);
+            streamed = visible_text.size();
+            const size_t n = out_ring.write(out, ring_bytes, backlog.data(), backlog.size());
+            if (n == 0) {
+                alive = out_ring.consistent(ring_bytes);
+                return;
+            }
+            message chunk = {};
+            chunk.type = MSG_STREAM;
+            chunk.bytes = static_cast<uint32_t>(n);
+            alive = send_message(conn->fd, chunk);
+            backlog.erase(0, n);
+        };
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            counters.requests++;
+        }
+        const std::string reply = handler(prompt, msg.options, stream);
+
+        std::lock_guard<std::mutex> lock(conn->write_mutex);
+        message done = {};
+        done.type = MSG_DONE;
+        done.bytes = static_cast<uint32_t>(reply.size());
+        if (!alive || !send_all(backlog, MSG_STREAM) || !send_all(reply, MSG_FINAL) || !send_message(conn->fd, done)) {
+            break;
+        }
+        std::lock_guard<std::mutex> stats_lock(mutex);
+        counters.streamed_bytes += streamed + reply.size();
+    }
+
+    conn->done = true;
+}
+
+model_client::model_client(std::string socket_path) : socket_path(std::move(socket_path)) {}
+
+model_client::~model_client() {
+    if (shared != nullptr) {
+        munmap(shared, shared_bytes);
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+bool model_client::connect() {
+    sockaddr_un addr;
+    socklen_t len;
+    if (!make_address(socket_path, addr, len)) {
+        return false;
+    }
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr), len) != 0) {
+        LOGE("Model client: cannot connect to %s", socket_path.c_str());
+        return false;
+    }
+
+    message hello;
+    int shm_fd = -1;
+    if (!recv_message(fd, hello, &shm_fd) || hello.type != MSG_HELLO || shm_fd < 0 || hello.bytes == 0) {
+        LOGE("Model client: %s sent no shared memory", socket_path.c_str());
+        if (shm_fd >= 0) {
+            ::close(shm_fd);
+        }
+        return false;
+    }
+    capacity = hello.bytes;
+    shared_bytes = region_bytes(capacity);
+    shared = mmap(nullptr, shared_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    ::close(shm_fd);
+    if (shared == MAP_FAILED) {
+        shared = nullptr;
+        return false;
+    }
+    return true;
+}
+
+bool model_client::predict(const std::string& prompt, const remote_options& options, std::string& reply) {
+    reply.clear();
+    {
+        std::lock_guard<std::mutex> lock(partial_mutex);
+        partial_text.clear();
+    }
+    if (shared == nullptr || prompt.size() > capacity) {
+        return false;
+    }
+
+    // The server drains the request ring before it replies, so it is empty here
+    shared_header* header = header_of(shared);
+    header->request.ring.write(request_data(shared), capacity, prompt.data(), prompt.size());
+    message request = {};
+    request.type = MSG_REQUEST;
+    request.bytes = static_cast<uint32_t>(prompt.size());
+    request.options = options;
+    if (!send_message(fd, request)) {
+        return false;
+    }
+
+    const char* in = reply_data(shared, capacity);
+    std::string chunk;
+    message msg;
+    while (recv_message(fd, msg)) {
+        if ((msg.type == MSG_STREAM || msg.type == MSG_FINAL) && msg.bytes > capacity) {
+            return false;  // No frame can be larger than the ring it was put in
+        }
+        switch (msg.type) {
+            case MSG_STREAM: {
+                chunk.resize(msg.bytes);
+                const size_t n = header->reply.ring.read(in, capacity, &chunk[0], chunk.size());
+                std::lock_guard<std::mutex> lock(partial_mutex);
+                partial_text.append(chunk, 0, n);
+                break;
+            }
+            case MSG_FINAL: {
+                chunk.resize(msg.bytes);
+                const size_t n = header->reply.ring.read(in, capacity, &chunk[0], chunk.size());
+                reply.append(chunk, 0, n);
+                break;
+            }
+            case MSG_DONE: {
+                std::lock_guard<std::mutex> lock(partial_mutex);
+                partial_text = reply;
+                return reply.size() == msg.bytes;
+            }
+            case MSG_ERROR:
+                return false;
+            default:
+                break;
+        }
+    }
+    return false;
+}
+
+std::string model_client::partial() const {
+    std::lock_guard<std::mutex> lock(partial_mutex);
+    return partial_text;
+}
+
+void model_client::cancel() {
+    if (fd >= 0) {
+        shutdown(fd, SHUT_RDWR);
+    }
+}
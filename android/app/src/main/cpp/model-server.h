@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Scalar request options a client in another process can set. Constraints that
+// point into the caller's memory (labels, logit biases) cannot cross over.
+struct remote_options {
+    int32_t priority = 0;
+    int32_t max_tokens = 0;
+    int32_t max_ttft_ms = 0;
+    int32_t max_total_ms = 0;
+    int32_t greedy = 0;
+    uint32_t seed = 0;
+};
+
+// Single-producer single-consumer byte ring living in memory shared by two
+// processes. The positions are lock-free atomics, which work across processes.
+struct shm_ring {
+    std::atomic<uint64_t> write_pos;
+    std::atomic<uint64_t> read_pos;
+
+    // Copy up to n bytes in/out; returns how many fit / were available, and 0
+    // when the positions are inconsistent (see consistent())
+    size_t write(char* data, uint32_t capacity, const char* src, size_t n);
+    size_t read(const char* data, uint32_t capacity, char* dst, size_t n);
+
+    // False when the positions claim more than capacity bytes in flight, which
+    // only a misbehaving peer can cause
+    bool consistent(uint32_t capacity) const;
+};
+
+// Serves one model to clients in other processes, e.g. a keyboard extension
+// next to the app, so the weights are resident once and one scheduler orders
+// everyone's requests. Clients connect over a Unix domain socket (a path, or
+// "@name" for the abstract namespace); only processes of the same user are
+// accepted. Each connection gets a shared-memory region (a memfd passed over
+// the socket) with two rings: prompts travel to the server through one, reply
+// text streams back through the other, and the socket only carries short
+// control messages. Each connection is served by its own thread.
+class model_server {
+public:
+    using stream_fn = std::function<void(const std::string& visible_text)>;
+    // Runs one request and returns the reply; calls stream with the reply so far.
+    // Each call must extend the text of the previous one: only the new tail is
+    // sent, so a handler must not stream a start it may later replace.
+    using handler_fn = std::function<std::string(const std::string& prompt, const remote_options& options,
+                                                 const stream_fn& stream)>;
+
+    struct stats {
+        int clients = 0;          // Connected now
+        uint64_t connections = 0;
+        uint64_t refused = 0;     // Other users, or no shared memory
+        uint64_t requests = 0;
+        uint64_t streamed_bytes = 0;
+    };
+
+    model_server(std::string socket_path, handler_fn handler, uint32_t ring_bytes);
+    ~model_server();
+
+    model_server(const model_server&) = delete;
+    model_server& operator=(const model_server&) = delete;
+
+    // Bind the socket and start accepting clients
+    bool start();
+    const std::string& path() const { return socket_path; }
+    stats snapshot() const;
+
+private:
+    struct connection;
+
+    const std::string socket_path;
+    const handler_fn handler;
+    const uint32_t ring_bytes;
+
+    int listen_fd = -1;
+    std::atomic<bool> stopping{false};
+    std::thread accept_thread;
+    mutable std::mutex mutex;  // Guards connections and counters
+    std::list<std::shared_ptr<connection>> connections;
+    stats counters;
+
+    void accept_loop();
+    void serve(const std::shared_ptr<connection>& conn);
+    void reap_locked();
+};
+
+// Client side of model_server, for use from another process
+class model_client {
+public:
+    explicit model_client(std::string socket_path);
+    ~model_client();
+
+    model_client(const model_client&) = delete;
+    model_client& operator=(const model_client&) = delete;
+
+    bool connect();
+
+    // Send a request and block until its reply is complete. Returns false if
+    // the server went away or the prompt does not fit its ring.
+    bool predict(const std::string& prompt, const remote_options& options, std::string& reply);
+
+    // Reply of the running (or last) request so far; safe to call from another thread
+    std::string partial() const;
+
+    // Shut the socket down so a predict() blocked on another thread returns
+    // false now, as does every later one
+    void cancel();
+
+private:
+    const std::string socket_path;
+    int fd = -1;
+    void* shared = nullptr;
+    size_t shared_bytes = 0;
+    uint32_t capacity = 0;
+
+    mutable std::mutex partial_mutex;
+    std::string partial_text;
+};
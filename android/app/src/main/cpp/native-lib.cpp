@@ -1,18 +1,306 @@
-#include <jni.h>
 #include <string>
 #include <vector>
 #include <cstring>
 #include <algorithm>
+#include <atomic>
+#include <list>
 #include <random>
 #include <cmath>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
 #include <android/log.h>
 #include "llama.h"
+#include "backend-modules.h"
+#include "energy-sampler.h"
+#include "fused-sampler.h"
+#include "http-server.h"
+#include "json-reader.h"
+#include "json-writer.h"
+#include "kv-pager.h"
+#include "latency-histograms.h"
+#include "memory-stats.h"
+#include "model-server.h"
+#include "perf-counters.h"
+#include "request-scheduler.h"
+#include "response-cache.h"
+#include "semantic-cache.h"
+#include "session-log.h"
+#include "thermal-governor.h"
+#include "token-pipeline.h"
+#include "vocab-constraints.h"
 
 // Log helper
 #define LOG_TAG "LlamaJNI"
 #define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
 #define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
 
+#ifndef NATIVE_LIB_FLAVOR
+#define NATIVE_LIB_FLAVOR "unknown"  // Set by CMakeLists.txt
+#endif
+
+using steady_clock = std::chrono::steady_clock;
+
+// Idle unload policy: after timeout_ms without requests the KV state is snapshotted
+// to snapshot_path and the context is freed. The model stays mapped unless
+// MemAvailable drops below min_free_ram_bytes.
+struct idle_policy {
+    int64_t timeout_ms = 0;  // 0 disables idle unloading
+    std::string snapshot_path;
+    size_t min_free_ram_bytes = 0;
+};
+
+// Counters for idle unload / wake-up, reported through get_metrics()
+struct idle_stats {
+    int n_unloads = 0;
+    int n_wakes = 0;
+    bool model_released = false;  // Whether the last unload also dropped the model
+    size_t last_saved_bytes = 0;  // RSS released by the last unload
+    double last_snapshot_ms = 0.0;
+    double last_wake_ms = 0.0;
+    double total_wake_ms = 0.0;
+};
+
+// Conversation compaction: once the chat fills trigger_ratio of the context, its
+// oldest turns are summarized in idle time until it fills at most target_ratio.
+// The keep_recent_turns newest turns are never folded into the summary.
+struct compaction_policy {
+    float trigger_ratio = 0.0f;  // 0 = off
+    float target_ratio = 0.5f;
+    int keep_recent_turns = 2;
+    int max_summary_tokens = 96;
+    int idle_delay_ms = 1000;    // Quiet time after a request before compacting
+};
+
+// Counters for compaction, reported through get_metrics()
+struct compaction_stats {
+    int n_compactions = 0;
+    int n_aborted = 0;         // Preempted by a request, or the summary was not shorter
+    int turns_folded = 0;
+    int tokens_removed = 0;    // Net, after adding the summaries back
+    int last_before = 0;       // Chat length in tokens around the last compaction
+    int last_after = 0;
+    double last_ms = 0.0;
+    double total_ms = 0.0;
+};
+
+// Oldest turns of the chat moved out of the KV cache into the pager. A range always
+// starts at position 0 when it is paged out, and it directly preceded the next
+// range (or the resident chat), so ranges can be put back by shifting them.
+struct paged_range {
+    int segment = -1;                // kv_pager segment holding the range's sequence state
+    std::vector<llama_token> tokens;
+    std::vector<int> turn_starts;    // Relative to the range
+};
+
+// Counters for KV paging, reported through get_metrics()
+struct kv_paging_stats {
+    int page_outs = 0;
+    int page_ins = 0;
+    int paged_ranges = 0;   // Currently paged out
+    int paged_tokens = 0;
+    int paged_turns = 0;
+    double last_page_out_ms = 0.0;
+    double total_page_out_ms = 0.0;
+    double last_page_in_ms = 0.0;
+};
+
+// Counters for the session log, reported through get_metrics()
+struct session_stats {
+    int saves = 0;
+    int base_saves = 0;       // Saves that wrote the whole chat
+    int deferred_bases = 0;   // Bases a request left to the idle saver
+    int restored_tokens = 0;
+    double last_save_ms = 0.0;  // Time spent serializing the save
+    double total_save_ms = 0.0;
+    double restore_ms = 0.0;
+};
+
+// Request classes: interactive requests get hard deadlines, background jobs soft ones
+enum request_priority : int32_t {
+    REQUEST_PRIORITY_INTERACTIVE = 0,
+    REQUEST_PRIORITY_BACKGROUND = 1,
+};
+
+// Per-request options passed from Dart (must match RequestOptions in llama_ffi.dart)
+struct request_options {
+    int32_t max_tokens = 20;     // Upper bound on generated tokens
+    int32_t max_ttft_ms = 0;     // 0 = no time-to-first-token limit
+    int32_t max_total_ms = 0;    // 0 = no wall-time limit
+    int32_t priority = REQUEST_PRIORITY_INTERACTIVE;
+    int32_t allow_classes = 0;             // vocab_class bits the reply may use; 0 = whole vocabulary
+    int32_t ban_classes = 0;               // vocab_class bits the reply may not use
+    const char* labels = nullptr;          // Newline-separated label set for VOCAB_CLASS_LABELS
+    const int32_t* bias_tokens = nullptr;  // Sparse logit biases: n_biases token ids...
+    const float* bias_values = nullptr;    // ...and the value added to each one's logit
+    int32_t n_biases = 0;
+    int32_t greedy = 0;  // Nonzero: always pick the most likely token
+    uint32_t seed = 0;   // Nonzero: sample from a fresh random stream with this seed
+    int32_t templated = 0;  // Nonzero: prompt is already formatted with the chat template
+};
+
+// Why generation ended
+enum stop_reason {
+    STOP_NONE = 0,
+    STOP_EOS,
+    STOP_PATTERN,
+    STOP_MAX_TOKENS,
+    STOP_CONTEXT_FULL,
+    STOP_TTFT_DEADLINE,
+    STOP_TOTAL_DEADLINE,
+    STOP_ERROR,
+    STOP_ESCALATED,
+    STOP_CACHED,
+};
+
+const char* stop_reason_name(stop_reason reason) {
+    switch (reason) {
+        case STOP_EOS:            return "eos";
+        case STOP_PATTERN:        return "stop_pattern";
+        case STOP_MAX_TOKENS:     return "max_tokens";
+        case STOP_CONTEXT_FULL:   return "context_full";
+        case STOP_TTFT_DEADLINE:  return "ttft_deadline";
+        case STOP_TOTAL_DEADLINE: return "total_deadline";
+        case STOP_ERROR:          return "error";
+        case STOP_ESCALATED:      return "escalated";
+        case STOP_CACHED:         return "cached";
+        default:                  return "none";
+    }
+}
+
+// Sequence 0 holds the chat; the rest are lent to background requests and scoring.
+// The KV cache is unified, so extra sequences cost nothing until they hold cells.
+constexpr int MAX_SEQUENCES = 10;
+
+// Capacity of the reusable batch; prompts longer than this are prefilled in chunks
+constexpr int MAX_BATCH_TOKENS = 512;
+
+// A session log base due after a request is written once the chat has been quiet this long
+constexpr int SESSION_BASE_IDLE_MS = 2000;
+
+// Soft deadlines may overrun by this factor before generation is cut
+constexpr double SOFT_DEADLINE_SLACK = 1.5;
+
+// Recent throughput on this device, used to size requests that carry a deadline
+struct throughput_estimate {
+    double prefill_tokens_per_s = 0.0;
+    double decode_tokens_per_s = 0.0;
+    double prefill_mj_per_token = 0.0;  // Only learned while an energy sampler is enabled
+    double decode_mj_per_token = 0.0;
+
+    static double blend(double old_value, double sample) {
+        return old_value > 0.0 ? 0.7 * old_value + 0.3 * sample : sample;
+    }
+};
+
+// Timings for the most recent predict() call
+struct request_metrics {
+    int n_prompt_tokens = 0;
+    int n_generated = 0;
+    double wake_ms = 0.0;     // Time spent re-materializing an idle-unloaded context
+    double prefill_ms = 0.0;
+    double decode_ms = 0.0;
+    double sample_ms = 0.0;   // Part of decode_ms spent choosing tokens (including constraints)
+    int allowed_tokens = 0;   // Vocabulary entries left by the request's class constraints, 0 if none
+    int thermal_level = 0;    // Highest governor level seen during the request
+    double pacing_ms = 0.0;   // Delay inserted by the thermal governor
+    bool energy_measured = false;
+    double prefill_mj = 0.0;  // Whole-device energy while processing the prompt
+    double decode_mj = 0.0;   // Whole-device energy while generating
+    double avg_power_w = 0.0;
+    bool perf_measured = false;  // Hardware counters, while enabled and permitted
+    perf_sample prefill_perf;
+    perf_sample decode_perf;
+    int max_tokens = 0;          // Token limit after deadline-based sizing
+    stop_reason stop = STOP_NONE;
+    bool deadline_missed = false;
+    double queue_wait_ms = 0.0;   // Time spent waiting for the scheduler before starting
+    int preemptions = 0;          // Times a background request yielded to interactive ones
+    double preempted_ms = 0.0;
+    int n_prefilled_ahead = 0;    // Prompt tokens prefilled by other requests while this one was queued
+    int n_coscheduled = 0;        // Queued prompts' tokens carried in this request's decode steps
+    double embed_ms = 0.0;        // Embedding pass for the semantic cache
+    float similarity = 0.0f;      // Closest semantic cache entry, when one was looked up
+};
+
+// Prompt of a queued background request, prefilled ahead of its turn in the spare
+// token budget of the running request's decode steps. Guarded by prefill_mutex.
+struct prefill_job {
+    std::string prompt;
+    bool templated = false;           // As request_options::templated
+    llama_seq_id seq_id = -1;         // Assigned when the first chunk is scheduled
+    std::vector<llama_token> tokens;
+    int n_done = 0;                   // Tokens already in the KV cache
+    bool failed = false;              // Owner must prefill from scratch
+    bool abandoned = false;           // Owner left the queue; the sequence is freed on the next step
+};
+
+// How long load_model_with_gpu() took, by phase
+struct startup_stats {
+    bool gpu_requested = false;
+    bool gpu_loaded = false;   // This build has the GPU module and it registered
+    double backend_ms = 0.0;   // Registering backend modules; only the first model pays for it
+    double model_ms = 0.0;     // Loading weights, including any GPU upload
+    double context_ms = 0.0;   // Creating the context, including GPU pipeline setup
+    double total_ms = 0.0;
+};
+
+// What get_memory_stats() reads from the model and context, taken whenever it
+// finds the wrapper idle and reused while a request holds it
+struct memory_poll {
+    size_t state_size = 0;
+    int kv_cells_used = 0;
+    int n_vocab = 0;
+    size_t weights_file_bytes = 0;
+    size_t weights_resident_bytes = 0;
+};
+
+// Hardware counter state mirrored for get_metrics()
+struct perf_counter_stats {
+    bool enabled = false;
+    int threads = 0;                       // Counter groups: decoding threads, plus a pinned pool
+    std::vector<perf_event_kind> events;   // Events the PMU accepted
+    std::string error;                     // Why counters could not be enabled
+};
+
+// Governor state mirrored for get_metrics()
+struct thermal_stats {
+    bool enabled = false;
+    thermal_decision decision;
+    int transitions = 0;
+    double total_pacing_ms = 0.0;
+    double cool_tokens_per_s = 0.0;
+};
+
+// When a cascade's small model hands a turn to the large one: any of the first
+// k_tokens sampled with less confidence than this escalates
+struct cascade_config {
+    int k_tokens = 8;
+    float max_entropy = 3.0f;    // Entropy of the next-token distribution, in nats
+    float min_logprob = -3.0f;   // Log-probability of the sampled token
+};
+
+// Cascade outcomes, kept by the small model. large_only_* estimate the same turns
+// on the large model alone; turns it has never been measured on are left out.
+struct cascade_stats {
+    int turns = 0;
+    int escalations = 0;
+    double small_ms = 0.0;        // Turns the small model answered
+    double escalated_ms = 0.0;    // Escalated turns, end to end
+    double wasted_ms = 0.0;       // Small-model time thrown away by escalations
+    int compared_turns = 0;
+    double actual_ms = 0.0;       // Compared turns through the cascade
+    double large_only_ms = 0.0;
+    int energy_turns = 0;         // Compared turns with energy measured on both models
+    double actual_mj = 0.0;
+    double large_only_mj = 0.0;
+};
+
 // Enhanced struct to hold model and context with proper memory management
 struct llama_context_wrapper {
     llama_model* model = nullptr;
@@ -22,14 +310,163 @@ struct llama_context_wrapper {
     llama_batch batch = {0};  // Reusable batch for efficiency
     std::vector<llama_seq_id> seq_ids;  // Buffer for sequence IDs
     std::vector<llama_token> conversation_tokens;
+    std::vector<int> turn_starts;  // Index in conversation_tokens where each chat turn begins
     int n_past = 0;  // Track position in conversation
     bool conversation_started = false;
+
+    // Load parameters kept so an idle-unloaded context (and model) can be recreated
+    std::string model_path;
+    llama_model_params mparams;
+    llama_context_params cparams;
+
+    std::mutex mutex;  // Serializes requests against the idle watchdog
+    steady_clock::time_point last_activity = steady_clock::now();
+    idle_policy idle;
+    bool has_snapshot = false;  // KV state for the conversation lives in idle.snapshot_path
+    std::thread idle_thread;
+    std::condition_variable idle_cv;
+    bool idle_thread_stop = false;
+
+    std::mutex metrics_mutex;  // Guards the stats below so they can be polled during generation
+    idle_stats idle_metrics;
+    request_metrics last_request;
+    throughput_estimate throughput;
+    request_metrics last_background_request;
+
+    // Priority scheduling: sequence 0 is the chat, background jobs borrow the others
+    request_scheduler scheduler;
+    std::vector<bool> background_seq_busy;
+
+    // Chunked prefill: tokens per decode step, including the decode token itself.
+    // Values <= 1 stop queued prompts from riding along with decode steps.
+    std::atomic<int> prefill_step_budget{32};
+    std::mutex prefill_mutex;
+    std::list<std::shared_ptr<prefill_job>> prefill_jobs;
+
+    // Memory accounting, see get_memory_stats()
+    backend_buffer_sizes buffers;          // Captured from llama.cpp logs at load / context creation
+    file_residency_probe weights_probe;    // mincore() view of the model file
+    memory_poll last_memory_poll;          // Guarded by metrics_mutex
+    startup_stats startup;                 // Set once by load_model_with_gpu()
+    int latency_series = -1;               // Row of latency_histograms() for this model and config
+
+    // Thermal governor (optional) and the pinned threadpool implementing its core placement
+    std::unique_ptr<thermal_governor> governor;
+    ggml_threadpool_t threadpool = nullptr;
+    thermal_stats thermal;
+
+    std::unique_ptr<energy_sampler> energy;  // Optional power sampling during requests
+    std::unique_ptr<perf_counters> perf;     // Optional hardware counters during requests
+    perf_counter_stats perf_status;
+
+    // The chat's sampler: the llama.cpp chain, plus a fused equivalent used when enabled
+    sampler_params sampling;
+    std::unique_ptr<fused_sampler> fast_sampler;
+    std::atomic<bool> use_fused_sampler{true};
+    // Token class bitmaps, built on first constrained request. They keep the
+    // model's vocab pointer, so they are dropped whenever the model is freed.
+    std::unique_ptr<vocab_constraints> constraints;
+
+    // Replies of deterministic requests, keyed with the model's fingerprint.
+    // Replaced under both mutex and metrics_mutex.
+    uint64_t model_hash = 0;
+    std::unique_ptr<response_cache> cache;
+    std::unique_ptr<semantic_cache> semantic;  // Paraphrases of earlier prompts, same guarding
+
+    // KV paging: once a turn no longer fits the context, the oldest turns are moved
+    // to flash, chat order preserved in `paged`. Guarded by mutex, stats by metrics_mutex;
+    // the pager is replaced under both.
+    std::unique_ptr<kv_pager> pager;
+    float paging_target_ratio = 0.5f;  // Share of the context the chat keeps after paging out
+    std::vector<paged_range> paged;
+    kv_paging_stats paging_metrics;
+
+    // Session persistence: each turn's new tokens and cells are appended to the log.
+    // session_tokens and session_pending are the chat as the log has it. Same
+    // guarding as the pager. A base (the whole chat) is never serialized on the
+    // request path: requests mark it due and session_thread writes it when idle.
+    std::unique_ptr<session_log> session;
+    std::vector<llama_token> session_tokens;
+    std::vector<llama_token> session_pending;
+    session_stats session_metrics;
+    bool session_base_due = false;
+    std::thread session_thread;
+    std::condition_variable session_cv;
+    bool session_thread_stop = false;
+
+    // Serves this model to other processes. Replaced under metrics_mutex; never
+    // destroyed under mutex, as its connection threads run requests.
+    std::unique_ptr<model_server> server;
+    std::unique_ptr<http_server> http;  // Local OpenAI-compatible endpoint; same guarding
+
+    std::mutex stream_mutex;       // Guards partial_response, written by the post-processing thread
+    std::string partial_response;  // Reply of the running (or last) interactive request so far
+
+    // Cascade: chat turns start on this model and move to `escalation` (a larger
+    // model with the same vocabulary) when it is unsure early in the reply.
+    // Turns answered by the other model (or from the response cache) wait in
+    // pending_history until the next interactive request prefills them.
+    // Guarded by mutex, except the pointer.
+    std::atomic<llama_context_wrapper*> escalation{nullptr};
+    cascade_config cascade;
+    std::vector<llama_token> pending_history;
+    cascade_stats cascade_metrics;  // Guarded by metrics_mutex
+
+    // Idle-time summarization of old turns. Guarded by mutex, stats by metrics_mutex.
+    compaction_policy compaction;
+    compaction_stats compaction_metrics;
+    int compaction_attempted_at = -1;  // n_past of the last attempt, so a failure is not retried at once
+    std::thread compaction_thread;
+    std::condition_variable compaction_cv;
+    bool compaction_thread_stop = false;
     
     ~llama_context_wrapper() {
+        http.reset();
+        server.reset();
+        stop_compactor();
+        stop_session_saver();
+        stop_idle_watchdog();
         cleanup();
     }
+
+    void stop_session_saver() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            session_thread_stop = true;
+        }
+        session_cv.notify_all();
+        if (session_thread.joinable()) {
+            session_thread.join();
+        }
+    }
+
+    void stop_compactor() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            compaction_thread_stop = true;
+        }
+        compaction_cv.notify_all();
+        if (compaction_thread.joinable()) {
+            compaction_thread.join();
+        }
+    }
+
+    void stop_idle_watchdog() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            idle_thread_stop = true;
+        }
+        idle_cv.notify_all();
+        if (idle_thread.joinable()) {
+            idle_thread.join();
+        }
+    }
     
     void cleanup() {
+        if (has_snapshot) {
+            unlink(idle.snapshot_path.c_str());
+            has_snapshot = false;
+        }
         if (batch.token) {
             llama_batch_free(batch);
             batch = {0};
@@ -42,6 +479,11 @@ struct llama_context_wrapper {
             llama_free(context);
             context = nullptr;
         }
+        if (threadpool) {
+            cpu_threadpool_free(threadpool);
+            threadpool = nullptr;
+        }
+        constraints.reset();
         if (model) {
             llama_model_free(model);
             model = nullptr;
@@ -50,26 +492,36 @@ struct llama_context_wrapper {
 };
 
 // Helper function to create and configure sampler (ultra-fast for mobile)
-llama_sampler* create_sampler() {
+llama_sampler* create_sampler(const sampler_params& params = sampler_params()) {
     auto sparams = llama_sampler_chain_default_params();
     auto* sampler = llama_sampler_chain_init(sparams);
+
+    if (params.temp <= 0.0f) {
+        llama_sampler_chain_add(sampler, llama_sampler_init_greedy());
+        return sampler;
+    }
     
-    // Balanced sampling for good quality (sampling is not the bottleneck):
+    // Balanced sampling for good quality:
     // 1. Top-K filtering
-    llama_sampler_chain_add(sampler, llama_sampler_init_top_k(40));
+    llama_sampler_chain_add(sampler, llama_sampler_init_top_k(params.top_k));
     
     // 2. Top-P nucleus sampling  
-    llama_sampler_chain_add(sampler, llama_sampler_init_top_p(0.9f, 1));
+    llama_sampler_chain_add(sampler, llama_sampler_init_top_p(params.top_p, 1));
     
     // 3. Temperature scaling
-    llama_sampler_chain_add(sampler, llama_sampler_init_temp(0.7f));
+    llama_sampler_chain_add(sampler, llama_sampler_init_temp(params.temp));
     
     // 4. Final distribution sampling
-    llama_sampler_chain_add(sampler, llama_sampler_init_dist(12345));
+    llama_sampler_chain_add(sampler, llama_sampler_init_dist(params.seed));
     
     return sampler;
 }
 
+// Fused equivalent of create_sampler(params), or nullptr if the chain must be used
+fused_sampler* create_fused_sampler(const sampler_params& params) {
+    return fused_sampler::supports(params) ? new fused_sampler(params) : nullptr;
+}
+
 // Helper function to format chat messages using proper Gemma template
 std::string format_chat_message(llama_model* model, const std::string& user_message) {
     // Try using the model's built-in chat template first
@@ -121,6 +573,48 @@ std::string format_chat_message(llama_model* model, const std::string& user_mess
     return "<start_of_turn>user\n" + user_message + "<end_of_turn>\n<start_of_turn>model\n";
 }
 
+// Format a whole conversation ({role, content} pairs) with the chat template,
+// ending with the start of the assistant's reply
+std::string format_chat_messages(llama_model* model, const std::vector<std::pair<std::string, std::string>>& turns) {
+    std::vector<llama_chat_message> messages;
+    size_t n_chars = 0;
+    for (const auto& turn : turns) {
+        messages.push_back({turn.first.c_str(), turn.second.c_str()});
+        n_chars += turn.second.size();
+    }
+
+    if (const char* chat_template = llama_model_chat_template(model, nullptr)) {
+        std::vector<char> formatted(n_chars * 2 + 256);
+        int32_t result = llama_chat_apply_template(chat_template, messages.data(), messages.size(), true,
+                                                   formatted.data(), formatted.size());
+        if (result > static_cast<int32_t>(formatted.size())) {
+            formatted.resize(result + 1);
+            result = llama_chat_apply_template(chat_template, messages.data(), messages.size(), true,
+                                               formatted.data(), formatted.size());
+        }
+        if (result > 0) {
+            return std::string(formatted.data(), result);
+        }
+    }
+
+    // Manual Gemma format, which has no system role: system text opens the first user turn
+    std::string out;
+    std::string system;
+    for (const auto& turn : turns) {
+        if (turn.first == "system") {
+            system += turn.second + "\n\n";
+            continue;
+        }
+        const char* role = turn.first == "assistant" ? "model" : "user";
+        out += std::string("<start_of_turn>") + role + "\n" + (role[0] == 'u' ? system : std::string()) + turn.second +
+               "<end_of_turn>\n";
+        if (role[0] == 'u') {
+            system.clear();
+        }
+    }
+    return out + "<start_of_turn>model\n";
+}
+
 // Helper function to convert C++ string to C char*
 char* string_to_char_ptr(const std::string& s) {
     char* pc = new char[s.size() + 1];
@@ -135,8 +629,9 @@ void clear_batch(llama_batch& batch) {
 
 // Helper function to add a token to the batch efficiently
 bool add_token_to_batch(llama_batch& batch, llama_token token, llama_pos pos, 
-                       std::vector<llama_seq_id>& seq_ids, bool get_logits = false) {
-    if (batch.n_tokens >= 512) {  // Max batch size
+                       std::vector<llama_seq_id>& seq_ids, bool get_logits = false,
+                       llama_seq_id seq_id = 0) {
+    if (batch.n_tokens >= MAX_BATCH_TOKENS) {
         return false;
     }
     
@@ -149,7 +644,7 @@ bool add_token_to_batch(llama_batch& batch, llama_token token, llama_pos pos,
     if (seq_ids.size() <= (size_t)idx) {
         seq_ids.resize(idx + 1);
     }
-    seq_ids[idx] = 0;  // Use sequence 0
+    seq_ids[idx] = seq_id;
     batch.seq_id[idx] = &seq_ids[idx];  // Point to our sequence ID
     
     batch.logits[idx] = get_logits ? 1 : 0;
@@ -162,7 +657,8 @@ bool add_token_to_batch(llama_batch& batch, llama_token token, llama_pos pos,
 int process_tokens_in_batches(llama_context* ctx, llama_batch& batch, 
                              const std::vector<llama_token>& tokens, 
                              std::vector<llama_seq_id>& seq_ids,
-                             int start_pos, bool get_logits_for_last = true) {
+                             int start_pos, bool get_logits_for_last = true,
+                             llama_seq_id seq_id = 0) {
     // Process ALL tokens in a single batch for maximum efficiency
     clear_batch(batch);
     
@@ -173,7 +669,7 @@ int process_tokens_in_batches(llama_context* ctx, llama_batch& batch,
         const bool is_last_token = (i == tokens.size() - 1);
         const bool get_logits = get_logits_for_last && is_last_token;
         
-        if (!add_token_to_batch(batch, tokens[i], start_pos + i, seq_ids, get_logits)) {
+        if (!add_token_to_batch(batch, tokens[i], start_pos + i, seq_ids, get_logits, seq_id)) {
             LOGE("Failed to add token %zu to batch", i);
             return -1;
         }
@@ -189,318 +685,3841 @@ int process_tokens_in_batches(llama_context* ctx, llama_batch& batch,
     return static_cast<int>(tokens.size());
 }
 
-extern "C" {
-    // ---- FFI Functions Exposed to Dart ----
+// Milliseconds elapsed since start
+double elapsed_ms(steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(steady_clock::now() - start).count();
+}
 
-    __attribute__((visibility("default"))) __attribute__((used))
-    void* load_model_with_gpu(const char* model_path, bool use_gpu) {
-        LOGI("Loading model from: %s (GPU: %s)", model_path, use_gpu ? "enabled" : "disabled");
-        
-        // Initialize backend once
-        llama_backend_init();
+// Mirror the paged-out history's size into the stats. Caller must hold wrapper->mutex.
+void update_paged_counts(llama_context_wrapper* wrapper) {
+    int n_tokens = 0;
+    int n_turns = 0;
+    for (const paged_range& range : wrapper->paged) {
+        n_tokens += static_cast<int>(range.tokens.size());
+        n_turns += static_cast<int>(range.turn_starts.size());
+    }
+    std::lock_guard<std::mutex> lock(wrapper->metrics_mutex);
+    wrapper->paging_metrics.paged_ranges = static_cast<int>(wrapper->paged.size());
+    wrapper->paging_metrics.paged_tokens = n_tokens;
+    wrapper->paging_metrics.paged_turns = n_turns;
+}
 
-        auto* wrapper = new llama_context_wrapper();
+// Forget the paged-out part of the chat. Caller must hold wrapper->mutex.
+void drop_paged_history(llama_context_wrapper* wrapper) {
+    if (wrapper->paged.empty()) {
+        return;
+    }
+    for (const paged_range& range : wrapper->paged) {
+        if (wrapper->pager) {
+            wrapper->pager->release(range.segment);
+        }
+    }
+    wrapper->paged.clear();
+    update_paged_counts(wrapper);
+}
 
-        // Configure model parameters
-        llama_model_params mparams = llama_model_default_params();
-        mparams.use_mmap = true;  // Use memory mapping for efficiency
-        mparams.use_mlock = false; // Don't lock memory on mobile
-        
-        // GPU acceleration settings
-        if (use_gpu) {
-            mparams.n_gpu_layers = 10; // Offload some layers to GPU (will auto-limit based on VRAM)
-            LOGI("GPU acceleration enabled: offloading layers to GPU");
+// Apply the governor's thread count and core placement to the live context.
+// Caller must hold wrapper->mutex.
+void apply_thermal_decision(llama_context_wrapper* wrapper) {
+    if (wrapper->context == nullptr) {
+        return;
+    }
+
+    ggml_threadpool_t old_pool = wrapper->threadpool;
+    wrapper->threadpool = nullptr;
+
+    if (wrapper->governor) {
+        const thermal_decision& decision = wrapper->governor->decision();
+        if (!decision.cpus.empty()) {
+            ggml_threadpool_params tpp = ggml_threadpool_params_default(decision.n_threads);
+            for (int cpu : decision.cpus) {
+                if (cpu >= 0 && cpu < GGML_MAX_N_THREADS) {
+                    tpp.cpumask[cpu] = true;
+                }
+            }
+            tpp.strict_cpu = true;
+            if (wrapper->perf) {
+                // The pool outlives any one request thread, so it gets its own counter group
+                wrapper->perf->count_threads_started_by([&] { wrapper->threadpool = cpu_threadpool_new(&tpp); });
+            } else {
+                wrapper->threadpool = cpu_threadpool_new(&tpp);
+            }
+        }
+        if (wrapper->threadpool != nullptr) {
+            llama_attach_threadpool(wrapper->context, wrapper->threadpool, wrapper->threadpool);
         } else {
-            mparams.n_gpu_layers = 0; // CPU-only mode
-            LOGI("CPU-only mode enabled");
+            llama_detach_threadpool(wrapper->context);
         }
-        
-        // Load model
-        wrapper->model = llama_model_load_from_file(model_path, mparams);
+        llama_set_n_threads(wrapper->context, decision.n_threads, decision.n_threads);
+        LOGI("Thermal governor: level %d, %d threads, %.1f C, freq ratio %.2f",
+             decision.level, decision.n_threads, decision.temp_c, decision.freq_ratio);
+    } else {
+        llama_detach_threadpool(wrapper->context);
+        llama_set_n_threads(wrapper->context, wrapper->cparams.n_threads, wrapper->cparams.n_threads_batch);
+    }
+
+    if (old_pool != nullptr) {
+        cpu_threadpool_free(old_pool);
+    }
+}
+
+// Snapshot the conversation KV state to disk and free the context.
+// Caller must hold wrapper->mutex.
+bool suspend_context(llama_context_wrapper* wrapper) {
+    if (wrapper->context == nullptr) {
+        return false;
+    }
+
+    const auto start = steady_clock::now();
+    const size_t rss_before = read_process_rss_bytes();
+
+    if (wrapper->conversation_started && !wrapper->conversation_tokens.empty()) {
+        if (!llama_state_save_file(wrapper->context, wrapper->idle.snapshot_path.c_str(),
+                                   wrapper->conversation_tokens.data(),
+                                   wrapper->conversation_tokens.size())) {
+            LOGE("Idle unload: failed to write snapshot to %s, keeping context",
+                 wrapper->idle.snapshot_path.c_str());
+            return false;
+        }
+        wrapper->has_snapshot = true;
+    }
+
+    llama_free(wrapper->context);
+    wrapper->context = nullptr;
+    wrapper->memory = nullptr;
+    if (wrapper->threadpool != nullptr) {
+        cpu_threadpool_free(wrapper->threadpool);
+        wrapper->threadpool = nullptr;
+    }
+    {
+        std::lock_guard<std::mutex> lock(wrapper->metrics_mutex);
+        wrapper->buffers.kv = 0;
+        wrapper->buffers.compute = 0;
+        wrapper->buffers.output = 0;
+    }
+
+    // Only drop the mmapped weights when the system is actually short on memory;
+    // keeping them makes the wake-up a context rebuild instead of a full load
+    bool release_model = false;
+    if (wrapper->idle.min_free_ram_bytes > 0) {
+        const size_t available = read_mem_available_bytes();
+        release_model = available > 0 && available < wrapper->idle.min_free_ram_bytes;
+    }
+    if (release_model) {
+        // The constraints point into the model's vocabulary; rebuilt on the next constrained request
+        wrapper->constraints.reset();
+        llama_model_free(wrapper->model);
+        wrapper->model = nullptr;
+        std::lock_guard<std::mutex> lock(wrapper->metrics_mutex);
+        wrapper->buffers.model = 0;
+    }
+
+    const size_t rss_after = read_process_rss_bytes();
+    const double snapshot_ms = elapsed_ms(start);
+
+    {
+        std::lock_guard<std::mutex> lock(wrapper->metrics_mutex);
+        auto& stats = wrapper->idle_metrics;
+        stats.n_unloads++;
+        stats.model_released = release_model;
+        stats.last_saved_bytes = rss_before > rss_after ? rss_before - rss_after : 0;
+        stats.last_snapshot_ms = snapshot_ms;
+    }
+
+    LOGI("Idle unload: freed context%s in %.1f ms, RSS %zu -> %zu KiB",
+         release_model ? " and model" : "", snapshot_ms, rss_before / 1024, rss_after / 1024);
+    return true;
+}
+
+// Recreate a context released by suspend_context() and restore its snapshot.
+// Caller must hold wrapper->mutex. Returns the wake-up latency in ms, or -1 on failure.
+double resume_context(llama_context_wrapper* wrapper) {
+    if (wrapper->context != nullptr) {
+        return 0.0;
+    }
+
+    const auto start = steady_clock::now();
+
+    if (wrapper->model == nullptr) {
+        begin_buffer_size_capture();
+        wrapper->model = llama_model_load_from_file(wrapper->model_path.c_str(), wrapper->mparams);
         if (wrapper->model == nullptr) {
-            LOGE("Failed to load model");
-            delete wrapper;
-            return nullptr;
+            LOGE("Wake-up: failed to reload model from %s", wrapper->model_path.c_str());
+            return -1.0;
         }
+        const backend_buffer_sizes logged = take_logged_buffer_sizes();
+        std::lock_guard<std::mutex> lock(wrapper->metrics_mutex);
+        wrapper->buffers.model = logged.model;
+    }
 
-        // Configure context parameters (properly optimized for mobile performance)
-        llama_context_params cparams = llama_context_default_params();
-        cparams.n_ctx = 1024;      // Reasonable context size
-        cparams.n_batch = 512;     // Large batch size for efficient parallel processing
-        cparams.n_ubatch = 512;
-        
-        if (use_gpu) {
-            // GPU-optimized settings
-            cparams.n_threads = 2;     // Fewer CPU threads when using GPU
-            cparams.n_threads_batch = 2;
-            LOGI("Using GPU-optimized thread configuration");
+    begin_buffer_size_capture();
+    wrapper->context = llama_init_from_model(wrapper->model, wrapper->cparams);
+    if (wrapper->context == nullptr) {
+        LOGE("Wake-up: failed to recreate context");
+        return -1.0;
+    }
+    wrapper->memory = llama_get_memory(wrapper->context);
+    {
+        const backend_buffer_sizes logged = take_logged_buffer_sizes();
+        std::lock_guard<std::mutex> lock(wrapper->metrics_mutex);
+        wrapper->buffers.kv = logged.kv;
+        wrapper->buffers.compute = logged.compute;
+        wrapper->buffers.output = logged.output;
+    }
+    if (wrapper->governor) {
+        apply_thermal_decision(wrapper);
+    }
+
+    if (wrapper->has_snapshot) {
+        std::vector<llama_token> tokens(wrapper->cparams.n_ctx);
+        size_t n_tokens = 0;
+        if (llama_state_load_file(wrapper->context, wrapper->idle.snapshot_path.c_str(),
+                                  tokens.data(), tokens.size(), &n_tokens)) {
+            tokens.resize(n_tokens);
+            wrapper->conversation_tokens = std::move(tokens);
+            wrapper->n_past = static_cast<int>(n_tokens);
         } else {
-            // CPU-optimized settings  
-            cparams.n_threads = 4;     // Use multiple CPU cores for matrix operations
-            cparams.n_threads_batch = 4; // Use multiple cores for batch processing
-            LOGI("Using CPU-optimized thread configuration");
-        }
-        
-        cparams.rope_scaling_type = LLAMA_ROPE_SCALING_TYPE_UNSPECIFIED;
-        cparams.pooling_type = LLAMA_POOLING_TYPE_UNSPECIFIED;
-        cparams.attention_type = LLAMA_ATTENTION_TYPE_UNSPECIFIED;
-        cparams.defrag_thold = -1.0f;
-        
-        // Create context
-        wrapper->context = llama_init_from_model(wrapper->model, cparams);
-        if (wrapper->context == nullptr) {
-            LOGE("Failed to create context");
-            llama_model_free(wrapper->model);
-            delete wrapper;
-            return nullptr;
+            // Snapshot unusable: fall back to a fresh conversation rather than failing the request
+            LOGE("Wake-up: failed to restore snapshot, starting a new conversation");
+            wrapper->conversation_tokens.clear();
+            wrapper->turn_starts.clear();
+            drop_paged_history(wrapper);
+            wrapper->n_past = 0;
+            wrapper->conversation_started = false;
         }
+        unlink(wrapper->idle.snapshot_path.c_str());
+        wrapper->has_snapshot = false;
+    }
 
-        // Get memory handle for efficient KV cache management
-        wrapper->memory = llama_get_memory(wrapper->context);
-        
-        // Create and configure sampler
-        wrapper->sampler = create_sampler();
-        if (wrapper->sampler == nullptr) {
-            LOGE("Failed to create sampler");
-            wrapper->cleanup();
-            delete wrapper;
-            return nullptr;
+    const double wake_ms = elapsed_ms(start);
+    {
+        std::lock_guard<std::mutex> lock(wrapper->metrics_mutex);
+        wrapper->idle_metrics.n_wakes++;
+        wrapper->idle_metrics.last_wake_ms = wake_ms;
+        wrapper->idle_metrics.total_wake_ms += wake_ms;
+    }
+
+    LOGI("Wake-up: context restored in %.1f ms (n_past = %d)", wake_ms, wrapper->n_past);
+    return wake_ms;
+}
+
+// Background thread that unloads the context once the wrapper has been idle for idle.timeout_ms
+void idle_watchdog_loop(llama_context_wrapper* wrapper) {
+    std::unique_lock<std::mutex> lock(wrapper->mutex);
+    while (!wrapper->idle_thread_stop) {
+        if (wrapper->idle.timeout_ms <= 0 || wrapper->context == nullptr) {
+            // Disabled or already unloaded: sleep until the policy changes or a request arrives
+            wrapper->idle_cv.wait(lock);
+            continue;
         }
 
-        // Initialize reusable batch (proper size for efficient parallel processing)
-        wrapper->batch = llama_batch_init(512, 0, 1);  // Match n_batch size
-        if (wrapper->batch.token == nullptr) {
-            LOGE("Failed to create batch");
-            wrapper->cleanup();
-            delete wrapper;
-            return nullptr;
+        const auto deadline = wrapper->last_activity + std::chrono::milliseconds(wrapper->idle.timeout_ms);
+        if (steady_clock::now() < deadline) {
+            wrapper->idle_cv.wait_until(lock, deadline);
+            continue;
         }
-        
-        // Initialize sequence IDs buffer (match batch size)
-        wrapper->seq_ids.resize(512, 0);  // Match batch size
 
-        LOGI("Model loaded successfully");
-        return wrapper;
+        if (!suspend_context(wrapper)) {
+            // Retry after another full idle period instead of spinning
+            wrapper->last_activity = steady_clock::now();
+        }
     }
+}
 
-    __attribute__((visibility("default"))) __attribute__((used))
-    void* load_model(const char* model_path) {
-        return load_model_with_gpu(model_path, true); // Default to GPU enabled
-    }
+// Mark the wrapper as active and make sure its context is resident.
+// Caller must hold wrapper->mutex. Returns the wake-up latency in ms, or -1 on failure.
+double touch_context(llama_context_wrapper* wrapper) {
+    wrapper->last_activity = steady_clock::now();
+    const double wake_ms = resume_context(wrapper);
+    wrapper->idle_cv.notify_all();
+    return wake_ms;
+}
 
-    __attribute__((visibility("default"))) __attribute__((used))
-    const char* predict(void* context_ptr, const char* prompt) {
-        auto* wrapper = static_cast<llama_context_wrapper*>(context_ptr);
-        if (wrapper == nullptr || wrapper->context == nullptr || wrapper->model == nullptr) {
-            return string_to_char_ptr("Model not loaded");
+// Claim a free non-chat sequence, -1 if all are in use. Caller must hold wrapper->mutex.
+llama_seq_id acquire_background_seq(llama_context_wrapper* wrapper) {
+    for (size_t i = 1; i < wrapper->background_seq_busy.size(); i++) {
+        if (!wrapper->background_seq_busy[i]) {
+            wrapper->background_seq_busy[i] = true;
+            return static_cast<llama_seq_id>(i);
         }
+    }
+    return -1;
+}
 
-        LOGI("Starting prediction for prompt: %.100s...", prompt);
+// Drop a sequence's cells and return it. Caller must hold wrapper->mutex.
+void release_background_seq(llama_context_wrapper* wrapper, llama_seq_id id) {
+    if (id < 0) {
+        return;
+    }
+    if (wrapper->memory != nullptr) {
+        llama_memory_seq_rm(wrapper->memory, id, -1, -1);
+    }
+    wrapper->background_seq_busy[id] = false;
+}
 
-        // Get vocab from model for tokenization
-        const llama_vocab* vocab = llama_model_get_vocab(wrapper->model);
-        if (vocab == nullptr) {
-            return string_to_char_ptr("Failed to get vocab");
-        }
+// KV sequence borrowed by a background request; its cells are dropped on release.
+// Must be destroyed while the wrapper mutex is held.
+struct background_sequence {
+    llama_context_wrapper* wrapper;
+    llama_seq_id id = -1;
 
-        // Format prompt using proper chat template
-        std::string formatted_prompt = format_chat_message(wrapper->model, std::string(prompt));
-        LOGI("Formatted prompt: %.200s...", formatted_prompt.c_str());
-        
-        // Tokenize the formatted prompt
-        std::vector<llama_token> prompt_tokens;
-        prompt_tokens.resize(llama_n_ctx(wrapper->context));
-        
-        int n_prompt_tokens = llama_tokenize(
-            vocab, 
-            formatted_prompt.c_str(), 
-            formatted_prompt.length(), 
-            prompt_tokens.data(), 
-            prompt_tokens.size(), 
-            true,  // add_special
-            false  // parse_special
-        );
-        
-        if (n_prompt_tokens < 0) {
-            LOGE("Failed to tokenize prompt");
-            return string_to_char_ptr("Failed to tokenize prompt");
+    // Claim a free sequence, or take over one already prefilled on our behalf
+    background_sequence(llama_context_wrapper* w, llama_seq_id adopted) : wrapper(w) {
+        if (wrapper != nullptr) {
+            id = adopted >= 0 ? adopted : acquire_background_seq(wrapper);
         }
-        prompt_tokens.resize(n_prompt_tokens);
-        LOGI("Tokenized prompt: %d tokens", n_prompt_tokens);
+    }
 
-        // Clear memory for new conversation if this is a fresh start
-        if (!wrapper->conversation_started) {
-            llama_memory_clear(wrapper->memory, true);
-            wrapper->conversation_tokens.clear();
-            wrapper->n_past = 0;
-            wrapper->conversation_started = true;
-            LOGI("Started new conversation");
+    ~background_sequence() {
+        if (wrapper != nullptr) {
+            release_background_seq(wrapper, id);
         }
-        
-        // Add prompt tokens to conversation
-        wrapper->conversation_tokens.insert(
-            wrapper->conversation_tokens.end(), 
-            prompt_tokens.begin(), 
-            prompt_tokens.end()
-        );
+    }
+};
 
-        // Process prompt tokens efficiently in batches
-        LOGI("Processing %d prompt tokens in batches", n_prompt_tokens);
-        LOGI("Starting ultra-fast processing..."); // Immediate feedback
-        int processed = process_tokens_in_batches(
-            wrapper->context, 
-            wrapper->batch, 
-            prompt_tokens, 
-            wrapper->seq_ids,  // Pass sequence IDs buffer
-            wrapper->n_past, 
-            true  // get logits for last token
-        );
-        
-        if (processed != n_prompt_tokens) {
-            LOGE("Failed to process prompt tokens: processed %d/%d", processed, n_prompt_tokens);
-            return string_to_char_ptr("Failed to process prompt");
-        }
-        
-        wrapper->n_past += n_prompt_tokens;
-        LOGI("Processed prompt efficiently, n_past = %d", wrapper->n_past);
+// Format a user message with the chat template and tokenize it. A templated
+// prompt is tokenized as it is, with the same flags.
+bool tokenize_prompt(llama_context_wrapper* wrapper, const char* prompt, std::vector<llama_token>& tokens,
+                     bool templated = false) {
+    const llama_vocab* vocab = llama_model_get_vocab(wrapper->model);
+    if (vocab == nullptr) {
+        return false;
+    }
 
-        // Generation parameters - optimized for mobile speed
-        const int n_predict = 20;  // Ultra-short for mobile speed
-        const llama_token eos_token = llama_vocab_eos(vocab);
-        const llama_token eot_token = llama_vocab_eot(vocab);
+    const std::string formatted_prompt =
+        templated ? std::string(prompt) : format_chat_message(wrapper->model, std::string(prompt));
+    LOGI("Formatted prompt: %.200s...", formatted_prompt.c_str());
+
+    tokens.resize(llama_n_ctx(wrapper->context));
+    const int n_tokens = llama_tokenize(
+        vocab,
+        formatted_prompt.c_str(),
+        formatted_prompt.length(),
+        tokens.data(),
+        tokens.size(),
+        true,  // add_special
+        false  // parse_special
+    );
+    if (n_tokens < 0) {
+        tokens.clear();
+        return false;
+    }
+    tokens.resize(n_tokens);
+    return true;
+}
+
+// Move the chat's oldest turns out of the KV cache until at most max_tokens stay
+// resident. The turns are copied to a spare sequence, serialized into the pager
+// (written to flash by its I/O thread) and removed from sequence 0; the rest of
+// the chat is shifted down to start at position 0. The newest turn is paged out
+// only if it alone is over the limit. Caller must hold wrapper->mutex.
+bool page_out_turns(llama_context_wrapper* wrapper, int max_tokens) {
+    auto& starts = wrapper->turn_starts;
+    while (!starts.empty() && starts.back() >= wrapper->n_past) {
+        starts.pop_back();  // Turn whose prompt never reached the KV cache
+    }
+    if (wrapper->n_past <= max_tokens) {
+        return true;
+    }
+    if (!wrapper->pager || starts.empty() || starts[0] != 0 ||
+        static_cast<int>(wrapper->conversation_tokens.size()) != wrapper->n_past ||
+        !llama_memory_can_shift(wrapper->memory)) {
+        return false;
+    }
+
+    // Fold whole turns, oldest first
+    const int n_turns = static_cast<int>(starts.size());
+    int keep_from = 1;
+    while (keep_from < n_turns && wrapper->n_past - starts[keep_from] > max_tokens) {
+        keep_from++;
+    }
+    const int end = keep_from < n_turns ? starts[keep_from] : wrapper->n_past;
+
+    const auto start = steady_clock::now();
+    std::vector<uint8_t> state;
+    {
+        background_sequence seq(wrapper, -1);
+        if (seq.id < 0) {
+            return false;
+        }
+        llama_memory_seq_cp(wrapper->memory, 0, seq.id, 0, end);
+        state.resize(llama_state_seq_get_size(wrapper->context, seq.id));
+        if (state.empty() ||
+            llama_state_seq_get_data(wrapper->context, state.data(), state.size(), seq.id) != state.size()) {
+            LOGE("KV paging: failed to serialize %d tokens", end);
+            return false;
+        }
+    }
+    const size_t state_bytes = state.size();
+    paged_range range;
+    range.segment = wrapper->pager->store(std::move(state));
+    if (range.segment < 0) {
+        return false;
+    }
+
+    llama_memory_seq_rm(wrapper->memory, 0, 0, end);
+    llama_memory_seq_add(wrapper->memory, 0, end, -1, -end);
+
+    auto& tokens = wrapper->conversation_tokens;
+    range.tokens.assign(tokens.begin(), tokens.begin() + end);
+    range.turn_starts.assign(starts.begin(), starts.begin() + keep_from);
+    tokens.erase(tokens.begin(), tokens.begin() + end);
+    std::vector<int> new_starts;
+    for (int t = keep_from; t < n_turns; t++) {
+        new_starts.push_back(starts[t] - end);
+    }
+    starts = std::move(new_starts);
+    wrapper->n_past -= end;
+    wrapper->paged.push_back(std::move(range));
+    wrapper->compaction_attempted_at = -1;
+
+    const double page_out_ms = elapsed_ms(start);
+    {
+        std::lock_guard<std::mutex> lock(wrapper->metrics_mutex);
+        wrapper->paging_metrics.page_outs++;
+        wrapper->paging_metrics.last_page_out_ms = page_out_ms;
+        wrapper->paging_metrics.total_page_out_ms += page_out_ms;
+    }
+    update_paged_counts(wrapper);
+    LOGI("KV paging: paged out %d turns (%d tokens, %zu bytes) in %.1f ms, n_past = %d",
+         keep_from, end, state_bytes, page_out_ms, wrapper->n_past);
+    return true;
+}
+
+// Drop the chat's last n_turns turns, paging history back in when the cut falls
+// in a paged-out range: the range is restored at its original positions and cut
+// there. Turns waiting in pending_history have no boundaries yet, so rewinding
+// is refused while there are any. Caller must hold wrapper->mutex.
+bool rewind_turns(llama_context_wrapper* wrapper, int n_turns) {
+    if (n_turns <= 0) {
+        return true;
+    }
+    if (!wrapper->pending_history.empty()) {
+        LOGE("Rewind: turns answered by another model or a cache are not in the KV cache yet");
+        return false;
+    }
+    auto& starts = wrapper->turn_starts;
+    while (!starts.empty() && starts.back() >= wrapper->n_past) {
+        starts.pop_back();
+    }
+
+    // Within the resident chat: just drop the cells
+    const int n_resident = static_cast<int>(starts.size());
+    if (n_turns <= n_resident) {
+        const int cut = starts[n_resident - n_turns];
+        llama_memory_seq_rm(wrapper->memory, 0, cut, -1);
+        wrapper->conversation_tokens.resize(cut);
+        starts.resize(n_resident - n_turns);
+        wrapper->n_past = cut;
+        wrapper->conversation_started = cut > 0 || !wrapper->paged.empty();
+        wrapper->compaction_attempted_at = -1;
+        return true;
+    }
+
+    // Ranges that end up wholly dropped are released; the one holding the cut is loaded back
+    int remaining = n_turns - n_resident;
+    size_t keep = wrapper->paged.size();
+    while (keep > 0 && remaining >= static_cast<int>(wrapper->paged[keep - 1].turn_starts.size())) {
+        remaining -= static_cast<int>(wrapper->paged[keep - 1].turn_starts.size());
+        keep--;
+    }
+    if (keep == 0) {
+        remaining = 0;  // Rewinding past the first turn empties the chat
+    }
+    std::vector<uint8_t> state;
+    if (remaining > 0) {
+        if (!wrapper->pager || !wrapper->pager->load(wrapper->paged[keep - 1].segment, state)) {
+            LOGE("Rewind: paged-out turns cannot be read back");
+            return false;
+        }
+    }
+
+    const auto start = steady_clock::now();
+    bool restored = true;
+    llama_memory_seq_rm(wrapper->memory, 0, -1, -1);
+    wrapper->conversation_tokens.clear();
+    starts.clear();
+    wrapper->n_past = 0;
+    wrapper->compaction_attempted_at = -1;
+    if (remaining > 0) {
+        const paged_range& range = wrapper->paged[keep - 1];
+        const int n_range_turns = static_cast<int>(range.turn_starts.size());
+        const int cut = range.turn_starts[n_range_turns - remaining];
+        {
+            background_sequence seq(wrapper, -1);
+            restored = seq.id >= 0 &&
+                       llama_state_seq_set_data(wrapper->context, state.data(), state.size(), seq.id) == state.size();
+            if (restored) {
+                llama_memory_seq_cp(wrapper->memory, seq.id, 0, 0, cut);
+            }
+        }
+        if (!restored) {
+            // The resident chat is gone already; the older ranges still hold the history before this one
+            LOGE("Rewind: failed to restore %zu tokens of paged-out turns", range.tokens.size());
+        } else {
+            wrapper->conversation_tokens.assign(range.tokens.begin(), range.tokens.begin() + cut);
+            starts.assign(range.turn_starts.begin(), range.turn_starts.begin() + (n_range_turns - remaining));
+            wrapper->n_past = cut;
+        }
+        const double page_in_ms = elapsed_ms(start);
+        std::lock_guard<std::mutex> lock(wrapper->metrics_mutex);
+        wrapper->paging_metrics.page_ins += restored ? 1 : 0;
+        wrapper->paging_metrics.last_page_in_ms = page_in_ms;
+        LOGI("KV paging: paged in %d tokens in %.1f ms", cut, page_in_ms);
+    }
+
+    // The range that held the cut is resident (or lost) now; later ones are dropped
+    const size_t first_dropped = remaining > 0 ? keep - 1 : keep;
+    for (size_t r = first_dropped; r < wrapper->paged.size(); r++) {
+        wrapper->pager->release(wrapper->paged[r].segment);
+    }
+    wrapper->paged.resize(first_dropped);
+    wrapper->conversation_started = wrapper->n_past > 0 || !wrapper->paged.empty();
+    update_paged_counts(wrapper);
+    return restored;
+}
+
+// Bring the session log up to date with the chat: append the tokens added since
+// the last save with their cells, or write the whole chat as a new base when it
+// changed otherwise (reset, rewind, compaction, paging) or the appends have
+// outgrown the base. Turns waiting in pending_history go into every record.
+// Outside idle time a base is only marked due for session_base_loop(), and the
+// appends continue until it is written. Only the serialization runs here; the
+// writer thread does the I/O. Caller must hold wrapper->mutex.
+void save_session_turn(llama_context_wrapper* wrapper, bool idle = false) {
+    if (!wrapper->session) {
+        return;
+    }
+    if (idle) {
+        wrapper->session_base_due = false;
+    }
+    const auto& tokens = wrapper->conversation_tokens;
+    const auto& pending = wrapper->pending_history;
+    const int n_logged = static_cast<int>(wrapper->session_tokens.size());
+    if (static_cast<int>(tokens.size()) != wrapper->n_past) {
+        return;
+    }
+    const bool pending_changed = wrapper->session_pending != pending;
+    if (wrapper->n_past == 0) {
+        // An empty chat is an empty base; it needs no context, so it can be logged while unloaded
+        if (n_logged > 0 || pending_changed) {
+            session_log::record rec;
+            rec.pending = pending;
+            wrapper->session->rewrite(std::move(rec));
+            wrapper->session_tokens.clear();
+            wrapper->session_pending = pending;
+        }
+        return;
+    }
+    if (wrapper->context == nullptr) {
+        return;
+    }
+    const bool extends = n_logged > 0 && n_logged <= wrapper->n_past &&
+                         std::equal(wrapper->session_tokens.begin(), wrapper->session_tokens.end(), tokens.begin());
+    if (extends && n_logged == wrapper->n_past && !pending_changed) {
+        return;  // Nothing new
+    }
+    bool base = !extends || wrapper->session->wants_rewrite();
+    if (base && !idle) {
+        if (!wrapper->session_base_due) {
+            wrapper->session_base_due = true;
+            std::lock_guard<std::mutex> lock(wrapper->metrics_mutex);
+            wrapper->session_metrics.deferred_bases++;
+        }
+        wrapper->session_cv.notify_all();  // Also wakes a saver that waited for the context to come back
+        if (!extends) {
+            return;  // Nothing to append to until the base is written
+        }
+        base = false;
+    }
+
+    const auto start = steady_clock::now();
+    session_log::record rec;
+    rec.pos0 = base ? 0 : n_logged;
+    rec.tokens.assign(tokens.begin() + rec.pos0, tokens.end());
+    for (int turn_start : wrapper->turn_starts) {
+        if (turn_start >= rec.pos0) {
+            rec.turn_starts.push_back(turn_start);
+        }
+    }
+    rec.pending = pending;
+    if (!rec.tokens.empty()) {
+        // A new turn's cells are copied to a spare sequence to serialize them alone
+        background_sequence seq(wrapper, -1);
+        const llama_seq_id source = base ? 0 : seq.id;
+        if (source < 0) {
+            return;
+        }
+        if (!base) {
+            llama_memory_seq_cp(wrapper->memory, 0, seq.id, rec.pos0, -1);
+        }
+        rec.state.resize(llama_state_seq_get_size(wrapper->context, source));
+        if (llama_state_seq_get_data(wrapper->context, rec.state.data(), rec.state.size(), source) != rec.state.size()) {
+            LOGE("Session log: failed to serialize %zu tokens", rec.tokens.size());
+            return;
+        }
+    }
+    if (base) {
+        wrapper->session->rewrite(std::move(rec));
+    } else {
+        wrapper->session->append(std::move(rec));
+    }
+    wrapper->session_tokens = tokens;
+    wrapper->session_pending = pending;
+
+    const double save_ms = elapsed_ms(start);
+    std::lock_guard<std::mutex> lock(wrapper->metrics_mutex);
+    auto& stats = wrapper->session_metrics;
+    stats.saves++;
+    stats.base_saves += base ? 1 : 0;
+    stats.last_save_ms = save_ms;
+    stats.total_save_ms += save_ms;
+}
+
+// Write a due session log base as a background request, so an interactive
+// request arriving meanwhile goes first. Returns false if it could not run.
+bool write_session_base(llama_context_wrapper* wrapper) {
+    const admission ticket = wrapper->scheduler.admit(REQUEST_PRIORITY_BACKGROUND, 0.0, std::string());
+    if (ticket.status != admission::ADMITTED) {
+        return false;
+    }
+    scheduled_request slot(wrapper->scheduler, ticket);
+    if (!slot.running()) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(wrapper->mutex);
+    save_session_turn(wrapper, true);
+    return true;
+}
+
+// Background thread that writes the session log base once one is due and the
+// wrapper has been quiet for SESSION_BASE_IDLE_MS
+void session_base_loop(llama_context_wrapper* wrapper) {
+    std::unique_lock<std::mutex> lock(wrapper->mutex);
+    while (!wrapper->session_thread_stop) {
+        if (!wrapper->session || !wrapper->session_base_due || wrapper->context == nullptr) {
+            wrapper->session_cv.wait(lock);
+            continue;
+        }
+
+        const auto due = wrapper->last_activity + std::chrono::milliseconds(SESSION_BASE_IDLE_MS);
+        if (steady_clock::now() < due) {
+            wrapper->session_cv.wait_until(lock, due);
+            continue;
+        }
+
+        lock.unlock();
+        const bool written = write_session_base(wrapper);
+        lock.lock();
+        if (!written) {
+            // The queue is full; try again after another quiet period
+            wrapper->session_cv.wait_for(lock, std::chrono::milliseconds(SESSION_BASE_IDLE_MS));
+        }
+    }
+}
+
+// Rebuild the chat from the records of a session log: the base goes to sequence
+// 0, each append through a spare sequence. Replay stops at an append that does
+// not continue the chat. Returns the number of tokens restored, -1 if the base
+// cannot be loaded. Caller must hold wrapper->mutex.
+int restore_session(llama_context_wrapper* wrapper, const std::vector<session_log::record>& records) {
+    llama_memory_seq_rm(wrapper->memory, 0, -1, -1);
+    wrapper->conversation_tokens.clear();
+    wrapper->turn_starts.clear();
+    drop_paged_history(wrapper);
+    wrapper->pending_history.clear();
+    wrapper->n_past = 0;
+    wrapper->conversation_started = false;
+    wrapper->session_tokens.clear();
+    wrapper->session_pending.clear();
+
+    bool complete = true;
+    for (const session_log::record& rec : records) {
+        // Records without cells only update the turns waiting to be prefilled
+        bool ok = rec.tokens.empty() && (rec.base || rec.pos0 == wrapper->n_past);
+        if (!ok && rec.base) {
+            ok = llama_state_seq_set_data(wrapper->context, rec.state.data(), rec.state.size(), 0) == rec.state.size();
+        } else if (!ok && rec.pos0 == wrapper->n_past) {
+            background_sequence seq(wrapper, -1);
+            ok = seq.id >= 0 &&
+                 llama_state_seq_set_data(wrapper->context, rec.state.data(), rec.state.size(), seq.id) == rec.state.size();
+            if (ok) {
+                llama_memory_seq_cp(wrapper->memory, seq.id, 0, -1, -1);
+            }
+        }
+        if (!ok) {
+            if (rec.base) {
+                LOGE("Session log: the saved chat does not fit this context");
+                llama_memory_seq_rm(wrapper->memory, 0, -1, -1);
+                return -1;
+            }
+            complete = false;
+            break;
+        }
+        if (rec.base) {
+            wrapper->conversation_tokens = rec.tokens;
+            wrapper->turn_starts.assign(rec.turn_starts.begin(), rec.turn_starts.end());
+        } else {
+            wrapper->conversation_tokens.insert(wrapper->conversation_tokens.end(), rec.tokens.begin(), rec.tokens.end());
+            wrapper->turn_starts.insert(wrapper->turn_starts.end(), rec.turn_starts.begin(), rec.turn_starts.end());
+        }
+        wrapper->n_past = static_cast<int>(wrapper->conversation_tokens.size());
+        wrapper->pending_history = rec.pending;
+    }
+
+    wrapper->conversation_started = wrapper->n_past > 0;
+    // A partial replay leaves records in the log the chat no longer matches; the next save starts a new base
+    if (complete) {
+        wrapper->session_tokens = wrapper->conversation_tokens;
+        wrapper->session_pending = wrapper->pending_history;
+    }
+    wrapper->compaction_attempted_at = -1;
+    return wrapper->n_past;
+}
+
+// Take a request's prefill job out of the queue once it runs. A superseded owner
+// leaves a job that already holds a sequence behind, marked for the next step to free.
+void withdraw_prefill_job(llama_context_wrapper* wrapper, const std::shared_ptr<prefill_job>& job, bool abandon) {
+    std::lock_guard<std::mutex> lock(wrapper->prefill_mutex);
+    if (abandon && job->seq_id >= 0) {
+        job->abandoned = true;
+        return;
+    }
+    wrapper->prefill_jobs.remove(job);
+}
+
+struct prefill_chunk {
+    std::shared_ptr<prefill_job> job;
+    int n_tokens;
+};
+
+// Fill the rest of a decode step's token budget with chunks of queued prompts.
+// The last prompt token is left to the owner, which needs its logits. Caller
+// must hold wrapper->mutex; pass the result to commit_prefill_chunks().
+std::vector<prefill_chunk> add_prefill_chunks(llama_context_wrapper* wrapper) {
+    std::vector<prefill_chunk> chunks;
+    int budget = std::min(wrapper->prefill_step_budget.load(), MAX_BATCH_TOKENS) - wrapper->batch.n_tokens;
+
+    std::lock_guard<std::mutex> lock(wrapper->prefill_mutex);
+    for (auto it = wrapper->prefill_jobs.begin(); it != wrapper->prefill_jobs.end();) {
+        prefill_job& job = **it;
+        if (job.abandoned) {
+            release_background_seq(wrapper, job.seq_id);
+            it = wrapper->prefill_jobs.erase(it);
+            continue;
+        }
+        if (budget <= 0 || job.failed) {
+            ++it;
+            continue;
+        }
+        if (job.seq_id < 0) {
+            job.seq_id = acquire_background_seq(wrapper);
+            if (job.seq_id < 0) {
+                break;  // No sequence for this job or any later one
+            }
+            llama_memory_seq_rm(wrapper->memory, job.seq_id, -1, -1);
+            job.failed = !tokenize_prompt(wrapper, job.prompt.c_str(), job.tokens, job.templated);
+        }
+
+        const int n = job.failed ? 0 : std::min(budget, static_cast<int>(job.tokens.size()) - 1 - job.n_done);
+        for (int k = 0; k < n; k++) {
+            const int pos = job.n_done + k;
+            add_token_to_batch(wrapper->batch, job.tokens[pos], pos, wrapper->seq_ids, false, job.seq_id);
+        }
+        if (n > 0) {
+            chunks.push_back({*it, n});
+            budget -= n;
+        }
+        ++it;
+    }
+    return chunks;
+}
+
+// Record whether the decode step carrying these chunks succeeded
+int commit_prefill_chunks(llama_context_wrapper* wrapper, const std::vector<prefill_chunk>& chunks, bool ok) {
+    int n_tokens = 0;
+    std::lock_guard<std::mutex> lock(wrapper->prefill_mutex);
+    for (const auto& chunk : chunks) {
+        if (ok) {
+            chunk.job->n_done += chunk.n_tokens;
+            n_tokens += chunk.n_tokens;
+        } else {
+            chunk.job->failed = true;
+        }
+    }
+    return n_tokens;
+}
+
+// Serialize hardware counter deltas as a named JSON object; per-token rates use n_tokens
+void write_perf_sample(json_writer& json, const char* name, const perf_sample& sample, int n_tokens) {
+    json.begin_object(name);
+    for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+        const auto kind = static_cast<perf_event_kind>(i);
+        if (sample.has(kind)) {
+            json.field(perf_event_name(kind), sample.get(kind));
+        }
+    }
+    const double cycles = static_cast<double>(sample.get(PERF_CYCLES));
+    if (sample.has(PERF_CYCLES) && sample.has(PERF_INSTRUCTIONS) && cycles > 0.0) {
+        json.field("ipc", sample.get(PERF_INSTRUCTIONS) / cycles);
+    }
+    if (sample.has(PERF_CYCLES) && sample.has(PERF_STALLED_BACKEND) && cycles > 0.0) {
+        json.field("backend_stall_ratio", sample.get(PERF_STALLED_BACKEND) / cycles);
+    }
+    if (sample.has(PERF_CYCLES) && n_tokens > 0) {
+        json.field("cycles_per_token", cycles / n_tokens);
+    }
+    if (sample.has(PERF_LLC_READ_MISSES) && n_tokens > 0) {
+        json.field("llc_read_misses_per_token", static_cast<double>(sample.get(PERF_LLC_READ_MISSES)) / n_tokens);
+    }
+    json.field("multiplexed", sample.multiplexed).end_object();
+}
+
+// Serialize one request's metrics as a named JSON object
+void write_request_metrics(json_writer& json, const char* name, const request_metrics& req) {
+    json.begin_object(name)
+        .field("n_prompt_tokens", req.n_prompt_tokens)
+        .field("n_generated", req.n_generated)
+        .field("wake_ms", req.wake_ms)
+        .field("queue_wait_ms", req.queue_wait_ms)
+        .field("prefill_ms", req.prefill_ms)
+        .field("decode_ms", req.decode_ms)
+        .field("sample_ms", req.sample_ms)
+        .field("allowed_tokens", req.allowed_tokens)
+        .field("preemptions", req.preemptions)
+        .field("preempted_ms", req.preempted_ms)
+        .field("n_prefilled_ahead", req.n_prefilled_ahead)
+        .field("n_coscheduled", req.n_coscheduled)
+        .field("embed_ms", req.embed_ms)
+        .field("similarity", static_cast<double>(req.similarity))
+        .field("thermal_level", req.thermal_level)
+        .field("pacing_ms", req.pacing_ms)
+        .field("energy_measured", req.energy_measured)
+        .field("prefill_mj", req.prefill_mj)
+        .field("decode_mj", req.decode_mj)
+        .field("mj_per_prompt_token", req.n_prompt_tokens > 0 ? req.prefill_mj / req.n_prompt_tokens : 0.0)
+        .field("mj_per_generated_token", req.n_generated > 0 ? req.decode_mj / req.n_generated : 0.0)
+        .field("avg_power_w", req.avg_power_w)
+        .field("max_tokens", req.max_tokens)
+        .field("stop_reason", stop_reason_name(req.stop))
+        .field("deadline_missed", req.deadline_missed)
+        .field("perf_measured", req.perf_measured);
+    if (req.perf_measured) {
+        write_perf_sample(json, "prefill_perf", req.prefill_perf, req.n_prompt_tokens);
+        write_perf_sample(json, "decode_perf", req.decode_perf, req.n_generated);
+    }
+    json.end_object();
+}
+
+// Estimated time in ms to prefill prompt_tokens and generate max_tokens on this device
+double estimate_tokens_cost_ms(llama_context_wrapper* wrapper, double prompt_tokens, int max_tokens) {
+    // Conservative phone-class defaults until the first requests have been measured
+    double prefill_tokens_per_s = 50.0;
+    double decode_tokens_per_s = 8.0;
+    {
+        std::lock_guard<std::mutex> metrics_lock(wrapper->metrics_mutex);
+        if (wrapper->throughput.prefill_tokens_per_s > 0.0) {
+            prefill_tokens_per_s = wrapper->throughput.prefill_tokens_per_s;
+        }
+        if (wrapper->throughput.decode_tokens_per_s > 0.0) {
+            decode_tokens_per_s = wrapper->throughput.decode_tokens_per_s;
+        }
+    }
+    return 1000.0 * (prompt_tokens / prefill_tokens_per_s + max_tokens / decode_tokens_per_s);
+}
+
+// Estimated service time of a request in ms, used for admission control. The prompt
+// has not been tokenized yet, so its length is approximated from the byte count.
+double estimate_request_cost_ms(llama_context_wrapper* wrapper, const char* prompt, const request_options& options) {
+    const double prompt_tokens = std::strlen(prompt) / 4.0 + 16.0;  // ~4 bytes per token plus chat template
+    const int max_tokens = options.max_tokens > 0 ? options.max_tokens : request_options().max_tokens;
+    double cost_ms = estimate_tokens_cost_ms(wrapper, prompt_tokens, max_tokens);
+    if (options.max_total_ms > 0 && options.max_total_ms < cost_ms) {
+        cost_ms = options.max_total_ms;
+    }
+    return cost_ms;
+}
+
+// Requests with the same key produce the same reply and may share one result
+std::string request_key(const char* prompt, const request_options& options) {
+    char header[128];
+    std::snprintf(header, sizeof(header), "%d:%d:%d:%d:%d:%d:%d:%u:%d|", options.max_tokens, options.max_ttft_ms,
+                  options.max_total_ms, options.priority, options.allow_classes, options.ban_classes,
+                  options.greedy, options.seed, options.templated);
+    std::string key(header);
+    if (options.labels != nullptr) {
+        key += options.labels;
+    }
+    for (int32_t i = 0; options.bias_tokens != nullptr && options.bias_values != nullptr && i < options.n_biases; i++) {
+        key += "|" + std::to_string(options.bias_tokens[i]) + "=" + std::to_string(options.bias_values[i]);
+    }
+    return key + "|" + prompt;
+}
+
+// Mean of the model's final hidden states over text, L2-normalized. Runs on a
+// spare sequence whose cells are dropped afterwards, and leaves the context's
+// logits overwritten. Caller must hold wrapper->mutex.
+bool embed_text(llama_context_wrapper* wrapper, const std::string& text, std::vector<float>& embedding) {
+    const llama_vocab* vocab = llama_model_get_vocab(wrapper->model);
+    std::vector<llama_token> tokens(text.size() + 8);
+    const int n_tokens = llama_tokenize(vocab, text.c_str(), text.size(), tokens.data(), tokens.size(), true, false);
+    if (n_tokens <= 0) {
+        return false;
+    }
+    tokens.resize(std::min(n_tokens, MAX_BATCH_TOKENS));
+
+    background_sequence seq(wrapper, -1);
+    if (seq.id < 0) {
+        return false;
+    }
+    clear_batch(wrapper->batch);
+    for (size_t i = 0; i < tokens.size(); i++) {
+        add_token_to_batch(wrapper->batch, tokens[i], static_cast<llama_pos>(i), wrapper->seq_ids, true, seq.id);
+    }
+
+    const int32_t n_embd = llama_model_n_embd(wrapper->model);
+    embedding.assign(n_embd, 0.0f);
+    llama_set_embeddings(wrapper->context, true);
+    bool ok = llama_decode(wrapper->context, wrapper->batch) == 0;
+    if (ok) {
+        // Models with their own pooling only expose the pooled vector
+        const float* pooled = llama_get_embeddings_seq(wrapper->context, seq.id);
+        for (size_t i = 0; ok && i < (pooled != nullptr ? 1 : tokens.size()); i++) {
+            const float* row = pooled != nullptr ? pooled : llama_get_embeddings_ith(wrapper->context, static_cast<int32_t>(i));
+            ok = row != nullptr;
+            for (int32_t d = 0; ok && d < n_embd; d++) {
+                embedding[d] += row[d];
+            }
+        }
+    }
+    llama_set_embeddings(wrapper->context, false);
+
+    const float norm = std::sqrt(dot_product(embedding.data(), embedding.data(), n_embd));
+    if (!ok || norm <= 0.0f) {
+        return false;
+    }
+    for (float& v : embedding) {
+        v /= norm;
+    }
+    return true;
+}
+
+// Finish a request with a stored reply instead of generating one: stream it at
+// once and, for the chat, leave the turn for the next request to prefill
+const char* serve_stored_reply(llama_context_wrapper* wrapper, const llama_vocab* vocab,
+                               const token_postprocessor::emit_fn& emit, bool is_background,
+                               std::vector<llama_token>& prompt_tokens, const std::vector<llama_token>& reply,
+                               request_metrics& metrics) {
+    std::string response;
+    {
+        token_postprocessor replay(vocab, static_cast<int>(reply.size()), emit);
+        for (llama_token token : reply) {
+            replay.push(token);
+        }
+        response = replay.finish();
+    }
+
+    if (!is_background) {
+        wrapper->pending_history.swap(prompt_tokens);
+        wrapper->pending_history.insert(wrapper->pending_history.end(), reply.begin(), reply.end());
+    }
+    metrics.n_generated = static_cast<int>(reply.size());
+    metrics.stop = STOP_CACHED;
+    {
+        std::lock_guard<std::mutex> metrics_lock(wrapper->metrics_mutex);
+        (is_background ? wrapper->last_background_request : wrapper->last_request) = metrics;
+    }
+    wrapper->last_activity = steady_clock::now();
+    return string_to_char_ptr(response);
+}
+
+// Entropy (in nats) of softmax(logits), returning log P(token) under the same
+// distribution. Masked logits (-inf) contribute nothing.
+double token_confidence(const float* logits, int32_t n_vocab, llama_token token, double& entropy) {
+    float max_logit = logits[0];
+    for (int32_t i = 1; i < n_vocab; i++) {
+        max_logit = std::max(max_logit, logits[i]);
+    }
+    double sum = 0.0;
+    double weighted = 0.0;  // sum of exp(l - max) * (l - max)
+    for (int32_t i = 0; i < n_vocab; i++) {
+        const double shifted = static_cast<double>(logits[i] - max_logit);
+        const double e = std::exp(shifted);
+        if (e > 0.0) {
+            sum += e;
+            weighted += e * shifted;
+        }
+    }
+    const double log_sum = std::log(sum);
+    entropy = log_sum - weighted / sum;
+    return static_cast<double>(logits[token] - max_logit) - log_sum;
+}
+
+// Time a request spent on its model, excluding the queue
+double service_ms(const request_metrics& req) {
+    return req.wake_ms + req.prefill_ms + req.decode_ms;
+}
+
+// A chat turn handed by a cascade's small model to its escalation model
+struct escalated_turn {
+    const std::vector<llama_token>* prompt_tokens = nullptr;  // Tokenized by the small model
+    llama_context_wrapper* stream_to = nullptr;  // Wrapper whose partial_response the app polls
+    bool completed = false;                      // Set once the reply was generated
+    std::vector<llama_token> reply_tokens;
+    request_metrics metrics;
+};
+
+const char* escalate_turn(llama_context_wrapper* wrapper, llama_context_wrapper* escalation, const char* prompt,
+                          const request_options& options, const std::vector<llama_token>& turn_prompt,
+                          const request_metrics& small_metrics, steady_clock::time_point request_start,
+                          const token_postprocessor::emit_fn* sink, stop_reason* stop);
+
+// Account a turn the small model answered itself, against the escalation model's
+// throughput on this device
+void record_cascade_turn(llama_context_wrapper* wrapper, llama_context_wrapper* escalation, int n_turn_prompt,
+                         const request_metrics& metrics) {
+    throughput_estimate large;
+    {
+        std::lock_guard<std::mutex> metrics_lock(escalation->metrics_mutex);
+        large = escalation->throughput;
+    }
+
+    std::lock_guard<std::mutex> metrics_lock(wrapper->metrics_mutex);
+    auto& stats = wrapper->cascade_metrics;
+    const double turn_ms = service_ms(metrics);
+    stats.turns++;
+    stats.small_ms += turn_ms;
+    if (large.prefill_tokens_per_s <= 0.0 || large.decode_tokens_per_s <= 0.0) {
+        return;
+    }
+    stats.compared_turns++;
+    stats.actual_ms += turn_ms;
+    stats.large_only_ms += 1000.0 * (n_turn_prompt / large.prefill_tokens_per_s +
+                                     metrics.n_generated / large.decode_tokens_per_s);
+    if (metrics.energy_measured && large.prefill_mj_per_token > 0.0 && large.decode_mj_per_token > 0.0) {
+        stats.energy_turns++;
+        stats.actual_mj += metrics.prefill_mj + metrics.decode_mj;
+        stats.large_only_mj += n_turn_prompt * large.prefill_mj_per_token +
+                               metrics.n_generated * large.decode_mj_per_token;
+    }
+}
+
+// Tokenize, prefill and generate a reply for one admitted request, honouring its
+// token limit and deadlines. With a handoff, the request is a turn escalated by
+// a cascade and skips tokenization. With a sink, the reply streams there instead
+// of to partial_response.
+const char* execute_prediction(llama_context_wrapper* wrapper, const char* prompt, const request_options& options,
+                               const admission& ticket, escalated_turn* handoff = nullptr,
+                               const token_postprocessor::emit_fn* sink = nullptr, stop_reason* stop = nullptr) {
+    const auto request_start = steady_clock::now();
+    const bool is_background = options.priority != REQUEST_PRIORITY_INTERACTIVE;
+    const bool hard_deadlines = !is_background;
+
+    // A background prompt can be prefilled on its own sequence while it waits, in the
+    // spare budget of whichever request is decoding (the chat owns sequence 0)
+    std::shared_ptr<prefill_job> ahead;
+    if (is_background && wrapper->prefill_step_budget.load() > 1) {
+        ahead = std::make_shared<prefill_job>();
+        ahead->prompt = prompt;
+        ahead->templated = options.templated != 0;
+        std::lock_guard<std::mutex> prefill_lock(wrapper->prefill_mutex);
+        wrapper->prefill_jobs.push_back(ahead);
+    }
+
+    scheduled_request slot(wrapper->scheduler, ticket);
+    if (!slot.running()) {
+        if (ahead) {
+            withdraw_prefill_job(wrapper, ahead, true);
+        }
+        LOGI("Request superseded after %.0f ms in the queue", slot.queue_wait_ms());
+        return string_to_char_ptr("Request superseded by a newer request");
+    }
+    std::unique_lock<std::mutex> lock(wrapper->mutex);
+
+    // Interactive requests continue the chat on sequence 0. Background jobs run on a
+    // private sequence with their own sampler, so they can be preempted between decode
+    // steps and resume later with their KV cells intact.
+    int n_prefilled = 0;
+    std::vector<llama_token> prefilled_tokens;
+    llama_seq_id prefilled_seq = -1;
+    if (ahead) {
+        withdraw_prefill_job(wrapper, ahead, false);
+        prefilled_seq = ahead->seq_id;
+        if (!ahead->failed) {
+            n_prefilled = ahead->n_done;
+            prefilled_tokens.swap(ahead->tokens);
+        }
+    }
+    background_sequence job_seq(is_background ? wrapper : nullptr, prefilled_seq);
+
+    const double wake_ms = touch_context(wrapper);
+    if (wake_ms < 0.0 || wrapper->context == nullptr || wrapper->model == nullptr) {
+        return string_to_char_ptr("Model not loaded");
+    }
+
+    LOGI("Starting %s prediction for prompt: %.100s...", is_background ? "background" : "interactive", prompt);
+    request_metrics metrics;
+    metrics.wake_ms = wake_ms;
+    metrics.queue_wait_ms = slot.queue_wait_ms();
+    latency_histograms().record(wrapper->latency_series, LATENCY_QUEUE_WAIT, metrics.queue_wait_ms);
+
+    // Background jobs, and requests asking for greedy or seeded sampling, get their
+    // own sampler; the others continue the chat's random stream
+    sampler_params sampling = wrapper->sampling;
+    if (options.greedy != 0) {
+        sampling.temp = 0.0f;
+    }
+    if (options.seed != 0) {
+        sampling.seed = options.seed;
+    }
+    const bool own_sampler = is_background || options.greedy != 0 || options.seed != 0;
+
+    std::vector<llama_token> job_tokens;
+    int job_n_past = 0;
+    std::unique_ptr<llama_sampler, decltype(&llama_sampler_free)> job_sampler(nullptr, llama_sampler_free);
+    std::unique_ptr<fused_sampler> job_fast_sampler;
+    if (own_sampler) {
+        job_sampler.reset(create_sampler(sampling));
+        job_fast_sampler.reset(create_fused_sampler(sampling));
+    }
+    if (is_background) {
+        if (job_seq.id < 0) {
+            LOGE("No free sequence for background request");
+            return string_to_char_ptr("No free sequence for background request");
+        }
+        if (n_prefilled == 0) {
+            llama_memory_seq_rm(wrapper->memory, job_seq.id, -1, -1);
+        }
+    }
+    const llama_seq_id seq_id = is_background ? job_seq.id : 0;
+    std::vector<llama_token>& seq_tokens = is_background ? job_tokens : wrapper->conversation_tokens;
+    int& seq_n_past = is_background ? job_n_past : wrapper->n_past;
+    llama_sampler* sampler = own_sampler ? job_sampler.get() : wrapper->sampler;
+    fused_sampler* fast_sampler = nullptr;
+    if (wrapper->use_fused_sampler) {
+        fast_sampler = own_sampler ? job_fast_sampler.get() : wrapper->fast_sampler.get();
+    }
+    bool energy_valid = true;  // Cleared when preemption lets another request share the sampler and counter window
+
+    // Get vocab from model for tokenization
+    const llama_vocab* vocab = llama_model_get_vocab(wrapper->model);
+    if (vocab == nullptr) {
+        return string_to_char_ptr("Failed to get vocab");
+    }
+
+    // Format with the chat template and tokenize, unless a cascade already did
+    std::vector<llama_token> prompt_tokens;
+    if (handoff != nullptr) {
+        prompt_tokens = *handoff->prompt_tokens;
+    } else if (!tokenize_prompt(wrapper, prompt, prompt_tokens, options.templated != 0)) {
+        LOGE("Failed to tokenize prompt");
+        return string_to_char_ptr("Failed to tokenize prompt");
+    }
+
+    // Cascade: this turn starts here and may move to the escalation model. The turn's
+    // own tokens are kept for the other model; turns it answered are prefilled first.
+    llama_context_wrapper* escalation = is_background || handoff != nullptr ? nullptr : wrapper->escalation.load();
+    const cascade_config cascade = wrapper->cascade;
+    std::vector<llama_token> turn_prompt;
+    if (escalation != nullptr) {
+        turn_prompt = prompt_tokens;
+    }
+    const size_t n_pending = is_background ? 0 : wrapper->pending_history.size();
+    if (n_pending > 0) {
+        prompt_tokens.insert(prompt_tokens.begin(), wrapper->pending_history.begin(), wrapper->pending_history.end());
+        LOGI("Catching up on %zu tokens of turns answered without this context", n_pending);
+    }
+    const int n_prompt_tokens = static_cast<int>(prompt_tokens.size());
+    LOGI("Tokenized prompt: %d tokens", n_prompt_tokens);
+
+    // Skip whatever was prefilled while we were queued
+    if (n_prefilled > 0 && prefilled_tokens != prompt_tokens) {
+        llama_memory_seq_rm(wrapper->memory, job_seq.id, -1, -1);
+        n_prefilled = 0;
+    }
+    if (n_prefilled > 0) {
+        job_n_past = n_prefilled;
+        metrics.n_prefilled_ahead = n_prefilled;
+        LOGI("%d prompt tokens were prefilled while queued", n_prefilled);
+    }
+
+    // Size the request from recent device throughput so a wall-time budget is
+    // spent on a complete (if shorter) answer instead of being cut mid-way
+    int n_predict = options.max_tokens > 0 ? options.max_tokens : request_options().max_tokens;
+    if (options.max_total_ms > 0 && wrapper->throughput.decode_tokens_per_s > 0.0) {
+        double budget_ms = options.max_total_ms - wake_ms;
+        if (wrapper->throughput.prefill_tokens_per_s > 0.0) {
+            budget_ms -= 1000.0 * n_prompt_tokens / wrapper->throughput.prefill_tokens_per_s;
+        }
+        if (!hard_deadlines) {
+            budget_ms *= SOFT_DEADLINE_SLACK;
+        }
+        const int achievable = static_cast<int>(budget_ms * wrapper->throughput.decode_tokens_per_s / 1000.0);
+        if (achievable < n_predict) {
+            n_predict = std::max(1, achievable);
+            LOGI("Deadline %d ms: limiting generation to %d tokens", options.max_total_ms, n_predict);
+        }
+    }
+    metrics.max_tokens = n_predict;
+
+    // Clear memory for new conversation if this is a fresh start
+    if (!is_background && !wrapper->conversation_started) {
+        llama_memory_seq_rm(wrapper->memory, 0, -1, -1);
+        wrapper->conversation_tokens.clear();
+        wrapper->turn_starts.clear();
+        drop_paged_history(wrapper);
+        wrapper->n_past = 0;
+        wrapper->conversation_started = true;
+        LOGI("Started new conversation");
+    }
+
+    // Detokenization, end-pattern matching and streaming run on the post-processing
+    // thread; the decode loop below only samples and decodes
+    token_postprocessor::emit_fn emit;
+    if (sink != nullptr) {
+        emit = *sink;
+    } else if (!is_background) {
+        llama_context_wrapper* stream = handoff != nullptr ? handoff->stream_to : wrapper;
+        emit = [stream](const std::string& text) {
+            std::lock_guard<std::mutex> stream_lock(stream->stream_mutex);
+            stream->partial_response = text;
+        };
+    }
+
+    // Only deterministic replies (greedy or freshly seeded) are cached, and only
+    // under the sampling settings and length limit they were generated with
+    const bool deterministic = escalation == nullptr && handoff == nullptr &&
+                               (sampling.temp <= 0.0f || options.seed != 0);
+    fnv1a_hash sampling_key;
+    sampling_key.add_value(sampling.temp);
+    if (sampling.temp > 0.0f) {
+        sampling_key.add_value(sampling.top_k).add_value(sampling.top_p).add_value(sampling.seed);
+    }
+    sampling_key.add_value(n_predict);
+
+    // A deterministic reply may come from the response cache. The key covers all it
+    // depends on: model, sampling, limits, constraints and every token of context.
+    uint64_t cache_key = 0;
+    const bool cacheable = wrapper->cache && deterministic;
+    if (wrapper->cache && !cacheable) {
+        wrapper->cache->note_bypass();
+    }
+    if (cacheable) {
+        fnv1a_hash key;
+        key.add_value(wrapper->model_hash)
+            .add_value(sampling_key.value())
+            .add_value(options.allow_classes)
+            .add_value(options.ban_classes)
+            .add_string(options.labels != nullptr ? options.labels : "");
+        for (int32_t b = 0; options.bias_tokens != nullptr && options.bias_values != nullptr && b < options.n_biases; b++) {
+            key.add_value(options.bias_tokens[b]).add_value(options.bias_values[b]);
+        }
+        key.add(seq_tokens.data(), seq_tokens.size() * sizeof(llama_token))
+            .add(prompt_tokens.data(), prompt_tokens.size() * sizeof(llama_token));
+        cache_key = key.value();
+
+        std::vector<llama_token> cached;
+        if (wrapper->cache->lookup(cache_key, cached)) {
+            LOGI("Response cache hit: %zu tokens", cached.size());
+            return serve_stored_reply(wrapper, vocab, emit, is_background, prompt_tokens, cached, metrics);
+        }
+    }
+
+    // The semantic cache answers close paraphrases of earlier prompts. A reply only
+    // fits another prompt when no earlier turns shape it, so only context-free
+    // requests use it: the first turn of a chat and background jobs. Entries are
+    // partitioned by sampling settings; constraints and biases are not part of
+    // the partition, so constrained requests bypass it.
+    const bool constrained = options.allow_classes != 0 || options.ban_classes != 0 ||
+                             (options.labels != nullptr && options.labels[0] != '\0') || options.n_biases > 0;
+    std::vector<float> prompt_embedding;
+    if (wrapper->semantic && deterministic && !constrained && seq_tokens.empty() && n_pending == 0) {
+        const auto embed_start = steady_clock::now();
+        if (embed_text(wrapper, normalize_prompt(prompt), prompt_embedding)) {
+            metrics.embed_ms = elapsed_ms(embed_start);
+            wrapper->semantic->add_embed_ms(metrics.embed_ms);
+            std::vector<llama_token> reply;
+            const bool hit =
+                wrapper->semantic->lookup(sampling_key.value(), prompt_embedding, reply, metrics.similarity);
+            if (hit) {
+                LOGI("Semantic cache hit (similarity %.3f): %zu tokens", metrics.similarity, reply.size());
+                return serve_stored_reply(wrapper, vocab, emit, is_background, prompt_tokens, reply, metrics);
+            }
+        } else {
+            prompt_embedding.clear();
+        }
+    }
+    
+    // KV paging: when this turn and its reply would overflow the context, move the
+    // oldest turns out to flash instead of cutting the reply short
+    if (!is_background && wrapper->pager) {
+        const int n_ctx = static_cast<int>(llama_n_ctx(wrapper->context));
+        const int n_needed = n_prompt_tokens + n_predict + 10;  // Margin of the context-full check below
+        if (wrapper->n_past + n_needed > n_ctx) {
+            const int max_resident = std::min(n_ctx - n_needed, static_cast<int>(wrapper->paging_target_ratio * n_ctx));
+            if (!page_out_turns(wrapper, std::max(0, max_resident))) {
+                LOGE("KV paging: could not make room for this turn");
+            }
+        }
+    }
+
+    // Add prompt tokens to conversation
+    if (!is_background) {
+        wrapper->turn_starts.push_back(static_cast<int>(seq_tokens.size()));
+    }
+    seq_tokens.insert(
+        seq_tokens.end(), 
+        prompt_tokens.begin(), 
+        prompt_tokens.end()
+    );
+
+    // Process prompt tokens efficiently in batches
+    if (wrapper->energy) {
+        wrapper->energy->start();
+    }
+    // A thread is attached on its first request; the workers ggml starts for
+    // each graph inherit its counters
+    const bool perf_on = wrapper->perf && wrapper->perf->attach_current_thread(true);
+    perf_sample perf_mark;
+    if (perf_on) {
+        perf_mark = wrapper->perf->read();
+    }
+    const auto prefill_start = steady_clock::now();
+    LOGI("Processing %d prompt tokens in batches", n_prompt_tokens - n_prefilled);
+    LOGI("Starting ultra-fast processing..."); // Immediate feedback
+    int processed = n_prefilled;
+    while (processed < n_prompt_tokens) {
+        // Background prompts can be preempted between chunks
+        if (processed > n_prefilled && wrapper->scheduler.should_yield(options.priority)) {
+            LOGI("Background request preempted during prefill at %d/%d tokens", processed, n_prompt_tokens);
+            lock.unlock();
+            metrics.preempted_ms += wrapper->scheduler.yield(options.priority);
+            lock.lock();
+            metrics.preemptions++;
+            energy_valid = false;
+            if (touch_context(wrapper) < 0.0 || wrapper->context == nullptr) {
+                break;
+            }
+        }
+
+        const int n_chunk = std::min(MAX_BATCH_TOKENS, n_prompt_tokens - processed);
+        const std::vector<llama_token> chunk(prompt_tokens.begin() + processed,
+                                             prompt_tokens.begin() + processed + n_chunk);
+        const bool last_chunk = processed + n_chunk == n_prompt_tokens;
+        if (process_tokens_in_batches(wrapper->context, wrapper->batch, chunk, wrapper->seq_ids,
+                                      seq_n_past, last_chunk, seq_id) != n_chunk) {
+            break;
+        }
+        seq_n_past += n_chunk;
+        processed += n_chunk;
+    }
+
+    if (processed != n_prompt_tokens) {
+        if (wrapper->energy) {
+            wrapper->energy->stop();
+        }
+        LOGE("Failed to process prompt tokens: processed %d/%d", processed, n_prompt_tokens);
+        return string_to_char_ptr("Failed to process prompt");
+    }
+
+    if (n_pending > 0) {
+        wrapper->pending_history.clear();
+    }
+    metrics.n_prompt_tokens = n_prompt_tokens;
+    metrics.prefill_ms = elapsed_ms(prefill_start);
+    if (wrapper->energy) {
+        metrics.prefill_mj = wrapper->energy->mark_mj();
+    }
+    if (n_prompt_tokens - n_prefilled >= 8 && metrics.prefill_ms > 0.0) {
+        latency_histograms().record(wrapper->latency_series, LATENCY_PREFILL_RATE,
+                                    1000.0 * (n_prompt_tokens - n_prefilled) / metrics.prefill_ms);
+    }
+    if (perf_on) {
+        const perf_sample prefill_end = wrapper->perf->read();
+        metrics.prefill_perf = prefill_end.since(perf_mark);
+        perf_mark = prefill_end;
+    }
+    LOGI("Processed prompt efficiently, n_past = %d", seq_n_past);
+
+    // Deadlines are measured from the start of the request, including any wake-up
+    const double ttft_deadline_ms = options.max_ttft_ms > 0 ? options.max_ttft_ms : 0.0;
+    double total_deadline_ms = options.max_total_ms > 0 ? options.max_total_ms : 0.0;
+    if (!hard_deadlines) {
+        total_deadline_ms *= SOFT_DEADLINE_SLACK;
+    }
+    if (ttft_deadline_ms > 0.0 && elapsed_ms(request_start) > ttft_deadline_ms) {
+        metrics.deadline_missed = true;
+        if (hard_deadlines) {
+            LOGI("TTFT deadline of %d ms missed during prefill, stopping", options.max_ttft_ms);
+            metrics.stop = STOP_TTFT_DEADLINE;
+            n_predict = 0;
+        }
+    }
+
+    const llama_token eos_token = llama_vocab_eos(vocab);
+    const llama_token eot_token = llama_vocab_eot(vocab);
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+
+    token_postprocessor post(vocab, n_predict, emit);
+    if (escalation != nullptr) {
+        // Nothing is streamed while the turn may still be escalated: the larger
+        // model's reply would not extend a start the client already has
+        post.hold(cascade.k_tokens);
+    }
+
+    // Vocabulary constraints: a cached allowed-token bitmap plus sparse biases,
+    // applied to the logits in place so both sampler paths see them
+    std::shared_ptr<const token_mask> mask;
+    if (options.allow_classes != 0 || options.ban_classes != 0) {
+        if (!wrapper->constraints) {
+            wrapper->constraints.reset(new vocab_constraints(vocab));
+        }
+        mask = wrapper->constraints->mask(options.allow_classes, options.ban_classes,
+                                          options.labels != nullptr ? options.labels : "");
+        metrics.allowed_tokens = mask->n_allowed;
+        LOGI("Vocabulary constrained to %d of %d tokens", mask->n_allowed, n_vocab);
+    }
+    std::vector<std::pair<llama_token, float>> biases;
+    if (options.bias_tokens != nullptr && options.bias_values != nullptr) {
+        for (int32_t b = 0; b < options.n_biases; b++) {
+            if (options.bias_tokens[b] >= 0 && options.bias_tokens[b] < n_vocab) {
+                biases.emplace_back(options.bias_tokens[b], options.bias_values[b]);
+            }
+        }
+    }
+    const int gen_start_pos = seq_n_past;
+    const size_t gen_start_token = seq_tokens.size();
+    
+    LOGI("Starting efficient generation loop, max tokens: %d", n_predict);
+    const auto decode_start = steady_clock::now();
+    double step_ms_ema = 0.0;
+    steady_clock::time_point last_token_at = decode_start;  // When the previous token reached the reply
+    
+    // Efficient generation loop with single reusable batch
+    for (int i = 0; i < n_predict && !post.stopped(); i++) {
+        // Sample next token straight from the logits when the fused sampler applies
+        const auto sample_start = steady_clock::now();
+        float* logits = llama_get_logits_ith(wrapper->context, -1);
+        if (mask) {
+            apply_token_mask(logits, n_vocab, mask->allowed_bits.data());
+        }
+        for (const auto& bias : biases) {
+            logits[bias.first] += bias.second;
+        }
+        const llama_token new_token = fast_sampler != nullptr
+            ? fast_sampler->sample(logits, n_vocab)
+            : llama_sampler_sample(sampler, wrapper->context, -1);
+        metrics.sample_ms += elapsed_ms(sample_start);
+
+        // Cascade: an unsure token early in the reply hands the turn to the larger model
+        if (escalation != nullptr && i < cascade.k_tokens) {
+            double entropy = 0.0;
+            const double log_prob = token_confidence(logits, n_vocab, new_token, entropy);
+            if (entropy > cascade.max_entropy || log_prob < cascade.min_logprob) {
+                LOGI("Escalating at token %d: entropy %.2f, logprob %.2f", i, entropy, log_prob);
+                post.drop_held();
+                metrics.stop = STOP_ESCALATED;
+                break;
+            }
+        }
+        
+        // Check for end of sequence tokens first
+        if (new_token == eos_token || new_token == eot_token) {
+            LOGI("Hit EOS/EOT token (%d), stopping generation", new_token);
+            metrics.stop = STOP_EOS;
+            break;
+        }
+        
+        // Accept the token (updates sampler state)
+        if (fast_sampler == nullptr) {
+            llama_sampler_accept(sampler, new_token);
+        }
+        post.push(new_token);
+        if (!is_background) {
+            const double gap_ms = elapsed_ms(i == 0 ? request_start : last_token_at);
+            last_token_at = steady_clock::now();
+            latency_histograms().record(wrapper->latency_series, i == 0 ? LATENCY_TTFT : LATENCY_INTER_TOKEN, gap_ms);
+        }
+
+        // Add new token to conversation
+        seq_tokens.push_back(new_token);
+
+        // Preemption point: the next token is already sampled, so the logits this
+        // request depends on may be overwritten while it waits
+        if (wrapper->scheduler.should_yield(options.priority)) {
+            LOGI("Background request preempted after %d tokens", i);
+            lock.unlock();
+            metrics.preempted_ms += wrapper->scheduler.yield(options.priority);
+            lock.lock();
+            metrics.preemptions++;
+            energy_valid = false;
+            if (touch_context(wrapper) < 0.0 || wrapper->context == nullptr) {
+                LOGE("Context unavailable after preemption");
+                metrics.stop = STOP_ERROR;
+                break;
+            }
+        }
+        
+        // EFFICIENT: Reuse existing batch instead of creating new ones
+        clear_batch(wrapper->batch);
+        if (!add_token_to_batch(wrapper->batch, new_token, seq_n_past, wrapper->seq_ids, true, seq_id)) {
+            LOGE("Failed to add token to batch at position %d", i);
+            metrics.stop = STOP_ERROR;
+            break;
+        }
+        
+        // Carry chunks of queued prompts in the same step, up to the token budget
+        const std::vector<prefill_chunk> chunks = add_prefill_chunks(wrapper);
+
+        const auto step_start = steady_clock::now();
+        int rc = llama_decode(wrapper->context, wrapper->batch);
+        if (rc != 0 && !chunks.empty()) {
+            // Most likely out of KV cells: drop the passengers and retry the step alone
+            commit_prefill_chunks(wrapper, chunks, false);
+            wrapper->batch.n_tokens = 1;
+            rc = llama_decode(wrapper->context, wrapper->batch);
+        } else if (!chunks.empty()) {
+            metrics.n_coscheduled += commit_prefill_chunks(wrapper, chunks, true);
+        }
+        if (rc != 0) {
+            LOGE("Failed to decode token at position %d", i);
+            metrics.stop = STOP_ERROR;
+            break;
+        }
+        
+        seq_n_past++;
+        metrics.n_generated++;
+        const double step_ms = elapsed_ms(step_start);
+        step_ms_ema = step_ms_ema > 0.0 ? 0.8 * step_ms_ema + 0.2 * step_ms : step_ms;
+
+        if (wrapper->governor) {
+            if (wrapper->governor->on_decode_step(step_ms)) {
+                apply_thermal_decision(wrapper);
+            }
+            const thermal_decision& decision = wrapper->governor->decision();
+            metrics.thermal_level = std::max(metrics.thermal_level, decision.level);
+            metrics.pacing_ms += decision.pacing_us / 1000.0;
+            {
+                std::lock_guard<std::mutex> metrics_lock(wrapper->metrics_mutex);
+                wrapper->thermal.decision = decision;
+                wrapper->thermal.transitions = wrapper->governor->transitions();
+                wrapper->thermal.total_pacing_ms = wrapper->governor->total_pacing_ms();
+                wrapper->thermal.cool_tokens_per_s = wrapper->governor->cool_tokens_per_s();
+            }
+            if (decision.pacing_us > 0) {
+                std::this_thread::sleep_for(std::chrono::microseconds(decision.pacing_us));
+            }
+        }
+        
+        // Check for context overflow
+        if (seq_n_past >= static_cast<int>(llama_n_ctx(wrapper->context)) - 10) {
+            LOGI("Approaching context limit, stopping generation");
+            metrics.stop = STOP_CONTEXT_FULL;
+            break;
+        }
+
+        // Hard deadlines stop before a step that would overrun; soft ones once they have overrun
+        if (total_deadline_ms > 0.0) {
+            const double projected_ms = elapsed_ms(request_start) + (hard_deadlines ? step_ms_ema : 0.0);
+            if (projected_ms > total_deadline_ms) {
+                LOGI("Total deadline of %d ms reached after %d tokens", options.max_total_ms, i + 1);
+                metrics.stop = STOP_TOTAL_DEADLINE;
+                metrics.deadline_missed = !hard_deadlines;
+                break;
+            }
+        }
+    }
+
+    // An end pattern may have been seen while later tokens were being decoded:
+    // drop everything from the token that completed it onward
+    std::string response = post.finish();
+    const int n_keep = post.stop_index();
+    if (metrics.stop == STOP_ESCALATED) {
+        // Drop the start of the reply; the prompt stays in the KV cache
+        llama_memory_seq_rm(wrapper->memory, seq_id, gen_start_pos, -1);
+        seq_n_past = gen_start_pos;
+        seq_tokens.resize(gen_start_token);
+    } else if (n_keep >= 0) {
+        if (seq_n_past > gen_start_pos + n_keep) {
+            llama_memory_seq_rm(wrapper->memory, seq_id, gen_start_pos + n_keep, -1);
+            seq_n_past = gen_start_pos + n_keep;
+        }
+        seq_tokens.resize(gen_start_token + n_keep);
+        metrics.n_generated = n_keep;
+        metrics.stop = STOP_PATTERN;
+    }
+
+    metrics.decode_ms = elapsed_ms(decode_start);
+    if (metrics.stop == STOP_NONE) {
+        metrics.stop = STOP_MAX_TOKENS;
+    }
+    if (ttft_deadline_ms > 0.0 && metrics.prefill_ms + metrics.wake_ms > ttft_deadline_ms) {
+        metrics.deadline_missed = true;
+    }
+    if (wrapper->energy && energy_valid) {
+        metrics.decode_mj = wrapper->energy->mark_mj() - metrics.prefill_mj;
+        metrics.avg_power_w = wrapper->energy->average_power_w();
+        metrics.energy_measured = wrapper->energy->samples() > 1;
+        wrapper->energy->stop();
+    } else if (!energy_valid) {
+        metrics.prefill_mj = 0.0;
+    }
+    if (perf_on && energy_valid) {
+        metrics.decode_perf = wrapper->perf->read().since(perf_mark);
+        metrics.perf_measured = true;
+    }
+    {
+        std::lock_guard<std::mutex> metrics_lock(wrapper->metrics_mutex);
+        (is_background ? wrapper->last_background_request : wrapper->last_request) = metrics;
+        if (perf_on) {
+            wrapper->perf_status.threads = wrapper->perf->threads();
+        }
+
+        // Only learn from samples long enough to be meaningful
+        auto& throughput = wrapper->throughput;
+        if (metrics.n_prompt_tokens >= 8 && metrics.prefill_ms > 0.0) {
+            throughput.prefill_tokens_per_s = throughput_estimate::blend(
+                throughput.prefill_tokens_per_s, 1000.0 * metrics.n_prompt_tokens / metrics.prefill_ms);
+        }
+        if (metrics.n_generated >= 4 && metrics.decode_ms > 0.0) {
+            throughput.decode_tokens_per_s = throughput_estimate::blend(
+                throughput.decode_tokens_per_s, 1000.0 * metrics.n_generated / metrics.decode_ms);
+        }
+        if (metrics.energy_measured && metrics.n_prompt_tokens >= 8) {
+            throughput.prefill_mj_per_token = throughput_estimate::blend(
+                throughput.prefill_mj_per_token, metrics.prefill_mj / metrics.n_prompt_tokens);
+        }
+        if (metrics.energy_measured && metrics.n_generated >= 4) {
+            throughput.decode_mj_per_token = throughput_estimate::blend(
+                throughput.decode_mj_per_token, metrics.decode_mj / metrics.n_generated);
+        }
+    }
+    wrapper->last_activity = steady_clock::now();
+
+    // Replies cut at a text pattern are left out: replaying their tokens would
+    // show the start of the pattern
+    if (metrics.stop == STOP_EOS || metrics.stop == STOP_MAX_TOKENS) {
+        const std::vector<llama_token> reply(seq_tokens.begin() + gen_start_token, seq_tokens.end());
+        if (cacheable) {
+            wrapper->cache->store(cache_key, reply);
+        }
+        if (!prompt_embedding.empty()) {
+            wrapper->semantic->store(sampling_key.value(), prompt_embedding, reply);
+        }
+    }
+
+    if (handoff != nullptr) {
+        handoff->reply_tokens.assign(seq_tokens.begin() + gen_start_token, seq_tokens.end());
+        handoff->metrics = metrics;
+        handoff->completed = true;
+    }
+    if (escalation != nullptr && metrics.stop == STOP_ESCALATED) {
+        lock.unlock();
+        return escalate_turn(wrapper, escalation, prompt, options, turn_prompt, metrics, request_start, sink, stop);
+    }
+    if (escalation != nullptr) {
+        // The escalation model sees this turn the next time it answers one
+        {
+            std::lock_guard<std::mutex> escalation_lock(escalation->mutex);
+            auto& history = escalation->pending_history;
+            history.insert(history.end(), turn_prompt.begin(), turn_prompt.end());
+            history.insert(history.end(), seq_tokens.begin() + gen_start_token, seq_tokens.end());
+        }
+        record_cascade_turn(wrapper, escalation, static_cast<int>(turn_prompt.size()), metrics);
+    }
+
+    if (stop != nullptr) {
+        *stop = metrics.stop;
+    }
+    LOGI("Generated response: %.200s...", response.c_str());
+    return string_to_char_ptr(response);
+}
+
+// Answer a turn the small model was unsure about on its escalation model, from the
+// prompt tokens the small model already has. Runs in the small model's request
+// slot, without its wrapper mutex.
+const char* escalate_turn(llama_context_wrapper* wrapper, llama_context_wrapper* escalation, const char* prompt,
+                          const request_options& options, const std::vector<llama_token>& turn_prompt,
+                          const request_metrics& small_metrics, steady_clock::time_point request_start,
+                          const token_postprocessor::emit_fn* sink, stop_reason* stop) {
+    if (sink == nullptr) {
+        std::lock_guard<std::mutex> stream_lock(wrapper->stream_mutex);
+        wrapper->partial_response.clear();
+    }
+
+    // Deadlines still count from the start of the turn
+    request_options large_options = options;
+    const int spent_ms = static_cast<int>(elapsed_ms(request_start));
+    if (options.max_ttft_ms > 0) {
+        large_options.max_ttft_ms = std::max(1, options.max_ttft_ms - spent_ms);
+    }
+    if (options.max_total_ms > 0) {
+        large_options.max_total_ms = std::max(1, options.max_total_ms - spent_ms);
+    }
+
+    escalated_turn turn;
+    turn.prompt_tokens = &turn_prompt;
+    turn.stream_to = wrapper;
+    const char* response = nullptr;
+    const admission ticket = escalation->scheduler.admit(
+        options.priority, estimate_request_cost_ms(escalation, prompt, large_options), std::string());
+    if (ticket.status == admission::ADMITTED) {
+        response = execute_prediction(escalation, prompt, large_options, ticket, &turn, sink, stop);
+        ticket.result->publish(response);
+    } else {
+        LOGI("Escalation rejected: queue full");
+        response = string_to_char_ptr("Request rejected: queue full");
+        std::lock_guard<std::mutex> escalation_lock(escalation->mutex);
+        escalation->pending_history.insert(escalation->pending_history.end(), turn_prompt.begin(), turn_prompt.end());
+    }
+
+    // The small model already holds the prompt and only lacks the reply
+    {
+        std::lock_guard<std::mutex> lock(wrapper->mutex);
+        wrapper->pending_history.insert(wrapper->pending_history.end(), turn.reply_tokens.begin(),
+                                        turn.reply_tokens.end());
+        wrapper->last_activity = steady_clock::now();
+    }
+
+    std::lock_guard<std::mutex> metrics_lock(wrapper->metrics_mutex);
+    auto& stats = wrapper->cascade_metrics;
+    const double wasted_ms = service_ms(small_metrics);
+    const double turn_ms = wasted_ms + turn.metrics.queue_wait_ms + service_ms(turn.metrics);
+    stats.turns++;
+    stats.escalations++;
+    stats.wasted_ms += wasted_ms;
+    stats.escalated_ms += turn_ms;
+    if (turn.completed) {
+        // On its own, the large model would have spent about its share of the turn
+        stats.compared_turns++;
+        stats.actual_ms += turn_ms;
+        stats.large_only_ms += service_ms(turn.metrics);
+        if (small_metrics.energy_measured && turn.metrics.energy_measured) {
+            const double large_mj = turn.metrics.prefill_mj + turn.metrics.decode_mj;
+            stats.energy_turns++;
+            stats.actual_mj += small_metrics.prefill_mj + small_metrics.decode_mj + large_mj;
+            stats.large_only_mj += large_mj;
+        }
+    }
+    return response;
+}
+
+// Bring the session logs of a model and its escalation model up to date after a
+// request. Whether a turn was decoded, served from a cache or answered by the
+// other model, this is where it is logged.
+void log_committed_turns(llama_context_wrapper* wrapper) {
+    for (llama_context_wrapper* w : {wrapper, wrapper->escalation.load()}) {
+        if (w != nullptr) {
+            std::lock_guard<std::mutex> lock(w->mutex);
+            save_session_turn(w);
+        }
+    }
+}
+
+// Admit a request into the bounded queue and run it, or answer it according to the
+// queue's admission policy. Shared by predict(), predict_with_options() and the
+// model server, which passes a sink for the reply stream. stop, if given, gets
+// why a decoded reply ended and is left alone for replies that were not decoded.
+const char* run_prediction(llama_context_wrapper* wrapper, const char* prompt, const request_options& options,
+                           const token_postprocessor::emit_fn* sink = nullptr, stop_reason* stop = nullptr) {
+    if (wrapper == nullptr) {
+        return string_to_char_ptr("Model not loaded");
+    }
+
+    const admission ticket = wrapper->scheduler.admit(
+        options.priority, estimate_request_cost_ms(wrapper, prompt, options), request_key(prompt, options));
+
+    if (ticket.status == admission::REJECTED) {
+        LOGI("Request rejected: queue full");
+        return string_to_char_ptr("Request rejected: queue full");
+    }
+    if (ticket.status == admission::COALESCED) {
+        LOGI("Request coalesced with an identical queued request");
+        return string_to_char_ptr(ticket.result->wait());
+    }
+
+    if (options.priority == REQUEST_PRIORITY_INTERACTIVE && sink == nullptr) {
+        std::lock_guard<std::mutex> stream_lock(wrapper->stream_mutex);
+        wrapper->partial_response.clear();
+    }
+    const char* response = execute_prediction(wrapper, prompt, options, ticket, nullptr, sink, stop);
+    ticket.result->publish(response);
+    log_committed_turns(wrapper);
+    wrapper->compaction_cv.notify_all();
+    return response;
+}
+
+// log P(token) under the softmax of one row of logits
+double token_log_prob(const float* logits, int32_t n_vocab, llama_token token) {
+    float max_logit = logits[0];
+    for (int32_t i = 1; i < n_vocab; i++) {
+        max_logit = std::max(max_logit, logits[i]);
+    }
+    double sum = 0.0;
+    for (int32_t i = 0; i < n_vocab; i++) {
+        sum += std::exp(static_cast<double>(logits[i] - max_logit));
+    }
+    return static_cast<double>(logits[token] - max_logit) - std::log(sum);
+}
+
+// Score each candidate continuation of a prompt by its summed log-probability.
+// The prompt is prefilled once on a spare sequence and copied into one sequence
+// per candidate. All candidates then go through a single batched decode, with
+// logits on every candidate token. With MAX_SEQUENCES sequences, at most
+// MAX_SEQUENCES - 2 candidates fit in one batch; larger sets are decoded in
+// several rounds. The chat on sequence 0 is left untouched.
+std::string score_candidates(llama_context_wrapper* wrapper, const char* prompt,
+                             const std::vector<std::string>& candidates) {
+    json_writer json;
+    json.begin_object();
+
+    request_options options;
+    options.max_tokens = 1;
+    const admission ticket = wrapper->scheduler.admit(
+        REQUEST_PRIORITY_INTERACTIVE, estimate_request_cost_ms(wrapper, prompt, options), std::string());
+    if (ticket.status != admission::ADMITTED) {
+        json.field("error", "Request rejected: queue full").end_object();
+        return json.str();
+    }
+    scheduled_request slot(wrapper->scheduler, ticket);
+    if (!slot.running()) {
+        json.field("error", "Request superseded by a newer request").end_object();
+        return json.str();
+    }
+    std::unique_lock<std::mutex> lock(wrapper->mutex);
+    if (touch_context(wrapper) < 0.0 || wrapper->context == nullptr || wrapper->model == nullptr) {
+        json.field("error", "Model not loaded").end_object();
+        return json.str();
+    }
+
+    const auto start = steady_clock::now();
+    const llama_vocab* vocab = llama_model_get_vocab(wrapper->model);
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+
+    std::vector<llama_token> prompt_tokens;
+    if (!tokenize_prompt(wrapper, prompt, prompt_tokens) || prompt_tokens.empty()) {
+        json.field("error", "Failed to tokenize prompt").end_object();
+        return json.str();
+    }
+    std::vector<std::vector<llama_token>> candidate_tokens(candidates.size());
+    for (size_t c = 0; c < candidates.size(); c++) {
+        auto& tokens = candidate_tokens[c];
+        tokens.resize(candidates[c].size() + 8);
+        const int n = llama_tokenize(vocab, candidates[c].c_str(), candidates[c].size(), tokens.data(),
+                                     tokens.size(), false, false);
+        tokens.resize(std::max(0, n));
+    }
+
+    // Borrow a sequence for the prompt and as many as are free for candidates
+    background_sequence prompt_seq(wrapper, -1);
+    if (prompt_seq.id < 0) {
+        json.field("error", "No free sequence for scoring").end_object();
+        return json.str();
+    }
+    std::vector<std::unique_ptr<background_sequence>> slots;
+    for (;;) {
+        std::unique_ptr<background_sequence> seq(new background_sequence(wrapper, -1));
+        if (seq->id < 0) {
+            break;
+        }
+        slots.push_back(std::move(seq));
+    }
+    const bool fork = !slots.empty();  // Otherwise score on the prompt sequence and roll back each time
+    const size_t per_round = fork ? slots.size() : 1;
+
+    // Prefill once, keeping the logits of the last prompt token for each candidate's first token
+    const int n_prompt = static_cast<int>(prompt_tokens.size());
+    llama_memory_seq_rm(wrapper->memory, prompt_seq.id, -1, -1);
+    for (int done = 0; done < n_prompt;) {
+        const int n_chunk = std::min(MAX_BATCH_TOKENS, n_prompt - done);
+        const std::vector<llama_token> chunk(prompt_tokens.begin() + done, prompt_tokens.begin() + done + n_chunk);
+        if (process_tokens_in_batches(wrapper->context, wrapper->batch, chunk, wrapper->seq_ids, done,
+                                      done + n_chunk == n_prompt, prompt_seq.id) != n_chunk) {
+            json.field("error", "Failed to process prompt").end_object();
+            return json.str();
+        }
+        done += n_chunk;
+    }
+    const double prefill_ms = elapsed_ms(start);
+
+    std::vector<double> scores(candidates.size(), 0.0);
+    std::vector<bool> valid(candidates.size(), false);
+    {
+        const float* logits = llama_get_logits_ith(wrapper->context, -1);
+        for (size_t c = 0; c < candidates.size(); c++) {
+            if (!candidate_tokens[c].empty()) {
+                scores[c] = token_log_prob(logits, n_vocab, candidate_tokens[c][0]);
+                valid[c] = true;
+            }
+        }
+    }
+
+    int n_batches = 0;
+    for (size_t first = 0; first < candidates.size();) {
+        // Fill a batch with as many candidates as there are sequences and batch room
+        clear_batch(wrapper->batch);
+        std::vector<std::pair<size_t, int>> members;  // candidate, batch index of its first token
+        size_t c = first;
+        for (; c < candidates.size() && members.size() < per_round; c++) {
+            const auto& tokens = candidate_tokens[c];
+            if (tokens.size() < 2 || !valid[c]) {
+                continue;  // Fully scored by the prompt logits already
+            }
+            if (wrapper->batch.n_tokens + static_cast<int>(tokens.size()) > MAX_BATCH_TOKENS) {
+                if (members.empty()) {
+                    valid[c] = false;  // Longer than a whole batch
+                    continue;
+                }
+                break;
+            }
+            const llama_seq_id seq = fork ? slots[members.size()]->id : prompt_seq.id;
+            if (fork) {
+                llama_memory_seq_rm(wrapper->memory, seq, -1, -1);
+                llama_memory_seq_cp(wrapper->memory, prompt_seq.id, seq, -1, -1);
+            }
+            members.push_back({c, wrapper->batch.n_tokens});
+            for (size_t j = 0; j < tokens.size(); j++) {
+                // Logits at token j predict token j + 1
+                add_token_to_batch(wrapper->batch, tokens[j], n_prompt + static_cast<int>(j), wrapper->seq_ids,
+                                   j + 1 < tokens.size(), seq);
+            }
+        }
+        first = c;
+        if (members.empty()) {
+            continue;
+        }
+
+        const int rc = llama_decode(wrapper->context, wrapper->batch);
+        n_batches++;
+        for (const auto& member : members) {
+            const auto& tokens = candidate_tokens[member.first];
+            if (rc != 0) {
+                valid[member.first] = false;
+                continue;
+            }
+            for (size_t j = 0; j + 1 < tokens.size(); j++) {
+                const float* logits = llama_get_logits_ith(wrapper->context, member.second + static_cast<int>(j));
+                scores[member.first] += token_log_prob(logits, n_vocab, tokens[j + 1]);
+            }
+        }
+        if (!fork) {
+            llama_memory_seq_rm(wrapper->memory, prompt_seq.id, n_prompt, -1);
+        }
+    }
+
+    int best = -1;
+    json.field("n_prompt_tokens", n_prompt)
+        .field("prefill_ms", prefill_ms)
+        .field("total_ms", elapsed_ms(start))
+        .field("n_batches", n_batches);
+    json.begin_array("candidates");
+    for (size_t c = 0; c < candidates.size(); c++) {
+        const int n_tokens = static_cast<int>(candidate_tokens[c].size());
+        json.begin_object()
+            .field("n_tokens", n_tokens)
+            .field("valid", static_cast<bool>(valid[c]));
+        if (valid[c]) {
+            json.field("logprob", scores[c]).field("mean_logprob", scores[c] / n_tokens);
+            if (best < 0 || scores[c] > scores[best]) {
+                best = static_cast<int>(c);
+            }
+        }
+        json.end_object();
+    }
+    json.end_array();
+    json.field("best", best).end_object();
+    wrapper->last_activity = steady_clock::now();
+    return json.str();
+}
+
+// Request that follows the folded turns when the model summarizes them
+const char* const COMPACTION_INSTRUCTION =
+    "Summarize our conversation so far in a few sentences. Keep every name, number, "
+    "fact and decision that may matter later. Reply with the summary only.";
+
+// Tokens of a user/model exchange that stands in for the turns a summary replaces
+bool tokenize_summary_turn(llama_context_wrapper* wrapper, const std::string& summary,
+                           std::vector<llama_token>& tokens) {
+    const llama_vocab* vocab = llama_model_get_vocab(wrapper->model);
+    const std::string user = "Summary of our conversation so far: " + summary;
+    const llama_chat_message messages[2] = {
+        {"user", user.c_str()},
+        {"assistant", "Understood."},
+    };
+
+    std::string formatted;
+    if (const char* chat_template = llama_model_chat_template(wrapper->model, nullptr)) {
+        std::vector<char> buf(user.size() * 2 + 256);
+        int32_t n = llama_chat_apply_template(chat_template, messages, 2, false, buf.data(), buf.size());
+        if (n > static_cast<int32_t>(buf.size())) {
+            buf.resize(n);
+            n = llama_chat_apply_template(chat_template, messages, 2, false, buf.data(), buf.size());
+        }
+        if (n > 0) {
+            formatted.assign(buf.data(), n);
+        }
+    }
+    if (formatted.empty()) {
+        formatted = "<start_of_turn>user\n" + user + "<end_of_turn>\n<start_of_turn>model\nUnderstood.<end_of_turn>\n";
+    }
+
+    // Same flags as tokenize_prompt(), so the summary reads like any other turn
+    tokens.resize(formatted.size() + 16);
+    const int n_tokens = llama_tokenize(vocab, formatted.c_str(), formatted.length(), tokens.data(),
+                                        tokens.size(), true, false);
+    if (n_tokens < 0) {
+        tokens.clear();
+        return false;
+    }
+    tokens.resize(n_tokens);
+    return true;
+}
+
+// Generate a greedy summary of the chat's first n_fold tokens on a spare sequence.
+// The sequence shares the chat's cells for those turns, so only the instruction
+// and the summary are decoded. Returns false if it fails or an interactive
+// request needs the context first. Caller must hold wrapper->mutex.
+bool summarize_turns(llama_context_wrapper* wrapper, int n_fold, std::string& summary) {
+    const llama_vocab* vocab = llama_model_get_vocab(wrapper->model);
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+
+    std::vector<llama_token> prompt_tokens;
+    if (!tokenize_prompt(wrapper, COMPACTION_INSTRUCTION, prompt_tokens) || prompt_tokens.empty()) {
+        return false;
+    }
+    const int n_prompt = static_cast<int>(prompt_tokens.size());
+    const int max_tokens = wrapper->compaction.max_summary_tokens;
+    if (n_prompt + max_tokens > static_cast<int>(llama_n_ctx(wrapper->context)) - wrapper->n_past) {
+        LOGI("Compaction: no room left in the context to summarize");
+        return false;
+    }
+
+    background_sequence seq(wrapper, -1);
+    if (seq.id < 0) {
+        return false;
+    }
+    llama_memory_seq_cp(wrapper->memory, 0, seq.id, 0, n_fold);
+    for (int done = 0; done < n_prompt;) {
+        if (wrapper->scheduler.should_yield(REQUEST_PRIORITY_BACKGROUND)) {
+            return false;
+        }
+        const int n_chunk = std::min(MAX_BATCH_TOKENS, n_prompt - done);
+        const std::vector<llama_token> chunk(prompt_tokens.begin() + done, prompt_tokens.begin() + done + n_chunk);
+        if (process_tokens_in_batches(wrapper->context, wrapper->batch, chunk, wrapper->seq_ids, n_fold + done,
+                                      done + n_chunk == n_prompt, seq.id) != n_chunk) {
+            return false;
+        }
+        done += n_chunk;
+    }
+
+    std::vector<llama_token> reply;
+    for (int i = 0; i < max_tokens; i++) {
+        if (wrapper->scheduler.should_yield(REQUEST_PRIORITY_BACKGROUND)) {
+            return false;
+        }
+        const llama_token token = argmax_logits(llama_get_logits_ith(wrapper->context, -1), n_vocab);
+        if (llama_vocab_is_eog(vocab, token)) {
+            break;
+        }
+        reply.push_back(token);
+        if (process_tokens_in_batches(wrapper->context, wrapper->batch, {token}, wrapper->seq_ids,
+                                      n_fold + n_prompt + i, true, seq.id) != 1) {
+            return false;
+        }
+    }
+
+    summary.assign(reply.size() * 8 + 16, '\0');
+    const int32_t n_chars = llama_detokenize(vocab, reply.data(), reply.size(), &summary[0], summary.size(), true, false);
+    if (n_chars <= 0) {
+        return false;
+    }
+    summary.resize(n_chars);
+    return true;
+}
+
+// Replace the chat's oldest turns with a summary of them. The summary is generated
+// on a spare sequence; then the folded cells are removed from sequence 0, the
+// remaining cells are shifted down to follow the summary, and the summary is
+// decoded in front of them. Runs as a background request, so an interactive one
+// arriving meanwhile makes it give up and try again in the next idle period.
+void compact_conversation(llama_context_wrapper* wrapper, int n_past_at_trigger, const compaction_policy& policy) {
+    const double cost_ms = estimate_tokens_cost_ms(wrapper, n_past_at_trigger, policy.max_summary_tokens);
+    const admission ticket = wrapper->scheduler.admit(REQUEST_PRIORITY_BACKGROUND, cost_ms, std::string());
+    if (ticket.status != admission::ADMITTED) {
+        return;
+    }
+    scheduled_request slot(wrapper->scheduler, ticket);
+    if (!slot.running()) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(wrapper->mutex);
+    if (wrapper->compaction_thread_stop || !wrapper->conversation_started || wrapper->n_past != n_past_at_trigger ||
+        static_cast<int>(wrapper->conversation_tokens.size()) != wrapper->n_past ||
+        touch_context(wrapper) < 0.0 || wrapper->context == nullptr) {
+        return;
+    }
+    if (!llama_memory_can_shift(wrapper->memory)) {
+        LOGE("Compaction: the KV cache of this model cannot shift positions");
+        return;
+    }
+
+    // Fold whole turns, oldest first, until the chat fits the target; always keep the newest ones
+    auto& starts = wrapper->turn_starts;
+    while (!starts.empty() && starts.back() >= wrapper->n_past) {
+        starts.pop_back();  // Turn whose prompt never reached the KV cache
+    }
+    const int n_turns = static_cast<int>(starts.size());
+    const int last_foldable = n_turns - std::max(1, policy.keep_recent_turns);
+    if (n_turns == 0 || starts[0] != 0 || last_foldable < 1) {
+        return;
+    }
+    const int n_ctx = static_cast<int>(llama_n_ctx(wrapper->context));
+    const int target = static_cast<int>(policy.target_ratio * n_ctx);
+    int fold_turns = 1;
+    while (fold_turns < last_foldable &&
+           wrapper->n_past - starts[fold_turns] + policy.max_summary_tokens > target) {
+        fold_turns++;
+    }
+    const int end = starts[fold_turns];
+
+    const auto start = steady_clock::now();
+    std::string summary;
+    std::vector<llama_token> summary_tokens;
+    if (!summarize_turns(wrapper, end, summary) || !tokenize_summary_turn(wrapper, summary, summary_tokens) ||
+        static_cast<int>(summary_tokens.size()) >= end) {
+        LOGI("Compaction of %d turns (%d tokens) abandoned", fold_turns, end);
+        std::lock_guard<std::mutex> metrics_lock(wrapper->metrics_mutex);
+        wrapper->compaction_metrics.n_aborted++;
+        return;
+    }
+
+    const int n_before = wrapper->n_past;
+    const int n_summary = static_cast<int>(summary_tokens.size());
+    const int shift = end - n_summary;
+    llama_memory_seq_rm(wrapper->memory, 0, 0, end);
+    llama_memory_seq_add(wrapper->memory, 0, end, -1, -shift);
+    bool ok = true;
+    for (int done = 0; ok && done < n_summary;) {
+        const int n_chunk = std::min(MAX_BATCH_TOKENS, n_summary - done);
+        const std::vector<llama_token> chunk(summary_tokens.begin() + done, summary_tokens.begin() + done + n_chunk);
+        ok = process_tokens_in_batches(wrapper->context, wrapper->batch, chunk, wrapper->seq_ids, done,
+                                       false, 0) == n_chunk;
+        done += n_chunk;
+    }
+    if (!ok) {
+        // The old turns are gone and the summary is incomplete: start over rather than run on a broken cache
+        LOGE("Compaction: failed to decode the summary, resetting the conversation");
+        llama_memory_seq_rm(wrapper->memory, 0, -1, -1);
+        wrapper->conversation_tokens.clear();
+        wrapper->turn_starts.clear();
+        drop_paged_history(wrapper);
+        wrapper->n_past = 0;
+        wrapper->conversation_started = false;
+        std::lock_guard<std::mutex> metrics_lock(wrapper->metrics_mutex);
+        wrapper->compaction_metrics.n_aborted++;
+        return;
+    }
+
+    auto& tokens = wrapper->conversation_tokens;
+    tokens.erase(tokens.begin(), tokens.begin() + end);
+    tokens.insert(tokens.begin(), summary_tokens.begin(), summary_tokens.end());
+    wrapper->n_past -= shift;
+    std::vector<int> new_starts = {0};
+    for (int t = fold_turns; t < n_turns; t++) {
+        new_starts.push_back(starts[t] - shift);
+    }
+    starts = std::move(new_starts);
+    wrapper->compaction_attempted_at = wrapper->n_past;
+    wrapper->last_activity = steady_clock::now();
+    save_session_turn(wrapper, true);  // Already running as an idle-time background request
+
+    const double compaction_ms = elapsed_ms(start);
+    {
+        std::lock_guard<std::mutex> metrics_lock(wrapper->metrics_mutex);
+        auto& stats = wrapper->compaction_metrics;
+        stats.n_compactions++;
+        stats.turns_folded += fold_turns;
+        stats.tokens_removed += shift;
+        stats.last_before = n_before;
+        stats.last_after = wrapper->n_past;
+        stats.last_ms = compaction_ms;
+        stats.total_ms += compaction_ms;
+    }
+    LOGI("Compaction: folded %d turns into a %d-token summary, n_past %d -> %d in %.1f ms",
+         fold_turns, n_summary, n_before, wrapper->n_past, compaction_ms);
+}
+
+// Background thread that compacts the chat once it passes compaction.trigger_ratio
+// of the context and the wrapper has been quiet for compaction.idle_delay_ms
+void compaction_loop(llama_context_wrapper* wrapper) {
+    std::unique_lock<std::mutex> lock(wrapper->mutex);
+    while (!wrapper->compaction_thread_stop) {
+        const compaction_policy& policy = wrapper->compaction;
+        const int trigger = static_cast<int>(policy.trigger_ratio * wrapper->cparams.n_ctx);
+        if (policy.trigger_ratio <= 0.0f || wrapper->context == nullptr || !wrapper->conversation_started ||
+            wrapper->n_past < trigger || wrapper->n_past == wrapper->compaction_attempted_at) {
+            // Nothing to do until a request grows the chat or the policy changes
+            wrapper->compaction_cv.wait(lock);
+            continue;
+        }
+
+        const auto due = wrapper->last_activity + std::chrono::milliseconds(policy.idle_delay_ms);
+        if (steady_clock::now() < due) {
+            wrapper->compaction_cv.wait_until(lock, due);
+            continue;
+        }
+
+        // An attempt that fails is not retried until the chat changes
+        const int n_past = wrapper->n_past;
+        const compaction_policy snapshot = policy;
+        wrapper->compaction_attempted_at = n_past;
+        lock.unlock();
+        compact_conversation(wrapper, n_past, snapshot);
+        lock.lock();
+    }
+}
+
+// ---- Local OpenAI-compatible endpoint ----
+
+// Body of an OpenAI-style error response
+std::string openai_error(const std::string& message, const char* type) {
+    json_writer json;
+    json.begin_object().begin_object("error").field("message", message).field("type", type).end_object().end_object();
+    return json.str();
+}
+
+// OpenAI finish_reason: "length" when the reply was cut short by a limit
+const char* openai_finish_reason(stop_reason stop) {
+    switch (stop) {
+        case STOP_MAX_TOKENS:
+        case STOP_CONTEXT_FULL:
+        case STOP_TTFT_DEADLINE:
+        case STOP_TOTAL_DEADLINE:
+            return "length";
+        default:
+            return "stop";
+    }
+}
+
+// Name the endpoint reports for the loaded model: its file name
+std::string openai_model_name(llama_context_wrapper* wrapper) {
+    const size_t slash = wrapper->model_path.find_last_of('/');
+    return slash == std::string::npos ? wrapper->model_path : wrapper->model_path.substr(slash + 1);
+}
+
+// Length of text without a UTF-8 sequence cut off at its end, so streamed
+// chunks are valid UTF-8 on their own
+size_t utf8_complete_length(const std::string& text) {
+    size_t i = text.size();
+    for (int back = 1; back <= 4 && i > 0; back++) {
+        const unsigned char c = static_cast<unsigned char>(text[i - 1]);
+        if ((c & 0xc0) != 0x80) {
+            const int needed = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+            return needed > back ? i - 1 : text.size();
+        }
+        i--;
+    }
+    return text.size();
+}
+
+// Text of a message's content: a string, or the text parts of an array of parts
+bool openai_message_text(const json_value* content, std::string& text) {
+    if (content == nullptr || content->kind == json_value::NUL) {
+        return true;
+    }
+    if (content->kind == json_value::STRING) {
+        text = content->string;
+        return true;
+    }
+    if (content->kind != json_value::ARRAY) {
+        return false;
+    }
+    for (const json_value& part : content->items) {
+        const json_value* type = part.get("type");
+        const json_value* part_text = part.get("text");
+        if (type == nullptr || type->string != "text" || part_text == nullptr ||
+            part_text->kind != json_value::STRING) {
+            return false;  // Images and audio are not supported
+        }
+        text += part_text->string;
+    }
+    return true;
+}
+
+// POST /v1/chat/completions. Requests are stateless, so by default the whole
+// message list is formatted with the chat template and run as a background
+// request on its own sequence; the app's chat is untouched. The non-standard
+// "priority": "interactive" instead sends the last user message as the next
+// turn of the app's chat, with hard deadlines. Replies stream as SSE chunks
+// when "stream" is set.
+void serve_chat_completion(llama_context_wrapper* wrapper, http_server::exchange& ex, const json_value& body) {
+    const json_value* messages = body.get("messages");
+    if (messages == nullptr || messages->kind != json_value::ARRAY || messages->items.empty()) {
+        ex.respond(400, "application/json", openai_error("messages must be a non-empty array", "invalid_request_error"));
+        return;
+    }
+    std::vector<std::pair<std::string, std::string>> turns;
+    for (const json_value& message : messages->items) {
+        const json_value* role = message.get("role");
+        std::string text;
+        if (role == nullptr || role->kind != json_value::STRING || !openai_message_text(message.get("content"), text)) {
+            ex.respond(400, "application/json", openai_error("each message needs a role and text content",
+                                                             "invalid_request_error"));
+            return;
+        }
+        turns.emplace_back(role->string == "developer" ? "system" : role->string, std::move(text));
+    }
+
+    request_options options;
+    options.priority = REQUEST_PRIORITY_BACKGROUND;
+    const json_value* priority = body.get("priority");
+    if (priority != nullptr && priority->kind == json_value::STRING && priority->string == "interactive") {
+        options.priority = REQUEST_PRIORITY_INTERACTIVE;
+    }
+    const json_value* max_tokens = body.get("max_completion_tokens");
+    if (max_tokens == nullptr) {
+        max_tokens = body.get("max_tokens");
+    }
+    if (max_tokens != nullptr && max_tokens->kind == json_value::NUMBER && max_tokens->number >= 1) {
+        options.max_tokens = static_cast<int32_t>(std::min(max_tokens->number, 1e6));
+    }
+    const json_value* temperature = body.get("temperature");
+    if (temperature != nullptr && temperature->kind == json_value::NUMBER && temperature->number <= 0.0) {
+        options.greedy = 1;
+    }
+    const json_value* seed = body.get("seed");
+    if (seed != nullptr && seed->kind == json_value::NUMBER) {
+        options.seed = static_cast<uint32_t>(static_cast<int64_t>(seed->number));
+    }
+    const json_value* stream = body.get("stream");
+    const bool streaming = stream != nullptr && stream->kind == json_value::BOOLEAN && stream->boolean;
+
+    std::string prompt;
+    if (options.priority == REQUEST_PRIORITY_INTERACTIVE) {
+        for (auto it = turns.rbegin(); it != turns.rend() && prompt.empty(); ++it) {
+            if (it->first == "user") {
+                prompt = it->second;
+            }
+        }
+    } else {
+        // Formatting needs the model, which may have been unloaded while idle
+        std::lock_guard<std::mutex> lock(wrapper->mutex);
+        if (touch_context(wrapper) < 0.0 || wrapper->model == nullptr) {
+            ex.respond(503, "application/json", openai_error("Model not loaded", "server_error"));
+            return;
+        }
+        prompt = format_chat_messages(wrapper->model, turns);
+        options.templated = 1;
+    }
+    if (prompt.empty()) {
+        ex.respond(400, "application/json", openai_error("no user message", "invalid_request_error"));
+        return;
+    }
+
+    static std::atomic<uint64_t> next_id{1};
+    const std::string id = "chatcmpl-" + std::to_string(next_id++);
+    const int64_t created = static_cast<int64_t>(std::time(nullptr));
+    const std::string model = openai_model_name(wrapper);
+    auto chunk = [&](const std::string* content, const char* finish_reason) {
+        json_writer json;
+        json.begin_object()
+            .field("id", id)
+            .field("object", "chat.completion.chunk")
+            .field("created", created)
+            .field("model", model)
+            .begin_array("choices")
+            .begin_object()
+            .field("index", 0)
+            .begin_object("delta");
+        if (content != nullptr) {
+            json.field("role", "assistant").field("content", *content);
+        }
+        json.end_object();
+        if (finish_reason != nullptr) {
+            json.field("finish_reason", finish_reason);
+        }
+        return json.end_object().end_array().end_object().str();
+    };
+
+    // Events start with the first text, so a rejected request can still get a status code
+    std::string streamed;
+    const token_postprocessor::emit_fn sink = [&](const std::string& visible_text) {
+        const size_t n = utf8_complete_length(visible_text);
+        if (n <= streamed.size() || visible_text.compare(0, streamed.size(), streamed) != 0 ||
+            (streamed.empty() && !ex.begin_events())) {
+            return;
+        }
+        const std::string delta = visible_text.substr(streamed.size(), n - streamed.size());
+        streamed.assign(visible_text, 0, n);
+        ex.send_event(chunk(&delta, nullptr));
+    };
+    stop_reason stop = STOP_NONE;
+    const char* response = run_prediction(wrapper, prompt.c_str(), options, streaming ? &sink : nullptr, &stop);
+    const std::string reply(response);
+    delete[] response;
+
+    if (streamed.empty() && reply.rfind("Request rejected", 0) == 0) {
+        ex.respond(429, "application/json", openai_error(reply, "rate_limit_error"));
+        return;
+    }
+    if (streaming) {
+        if (streamed.empty()) {
+            ex.begin_events();
+        }
+        if (reply.size() > streamed.size() && reply.compare(0, streamed.size(), streamed) == 0) {
+            const std::string rest = reply.substr(streamed.size());
+            ex.send_event(chunk(&rest, nullptr));
+        }
+        ex.send_event(chunk(nullptr, openai_finish_reason(stop)));
+        ex.send_event("[DONE]");
+        return;
+    }
+
+    json_writer json;
+    json.begin_object()
+        .field("id", id)
+        .field("object", "chat.completion")
+        .field("created", created)
+        .field("model", model)
+        .begin_array("choices")
+        .begin_object()
+        .field("index", 0)
+        .begin_object("message")
+        .field("role", "assistant")
+        .field("content", reply)
+        .end_object()
+        .field("finish_reason", openai_finish_reason(stop))
+        .end_object()
+        .end_array()
+        .end_object();
+    ex.respond(200, "application/json", json.str());
+}
+
+// POST /v1/embeddings: the same mean-pooled, normalized vectors the semantic
+// cache uses, computed in one background slot of the scheduler
+void serve_embeddings(llama_context_wrapper* wrapper, http_server::exchange& ex, const json_value& body) {
+    const json_value* input = body.get("input");
+    std::vector<std::string> texts;
+    if (input != nullptr && input->kind == json_value::STRING) {
+        texts.push_back(input->string);
+    } else if (input != nullptr && input->kind == json_value::ARRAY) {
+        for (const json_value& item : input->items) {
+            if (item.kind != json_value::STRING) {
+                texts.clear();
+                break;  // Token arrays are not supported
+            }
+            texts.push_back(item.string);
+        }
+    }
+    if (texts.empty()) {
+        ex.respond(400, "application/json", openai_error("input must be a string or an array of strings",
+                                                         "invalid_request_error"));
+        return;
+    }
+
+    size_t n_chars = 0;
+    for (const std::string& text : texts) {
+        n_chars += text.size();
+    }
+    const admission ticket = wrapper->scheduler.admit(
+        REQUEST_PRIORITY_BACKGROUND, estimate_tokens_cost_ms(wrapper, n_chars / 4.0 + texts.size(), 0),
+        std::string());
+    if (ticket.status != admission::ADMITTED) {
+        ex.respond(429, "application/json", openai_error("Request rejected: queue full", "rate_limit_error"));
+        return;
+    }
+    scheduled_request slot(wrapper->scheduler, ticket);
+    if (!slot.running()) {
+        ex.respond(429, "application/json", openai_error("Request superseded", "rate_limit_error"));
+        return;
+    }
+
+    std::vector<std::vector<float>> vectors(texts.size());
+    {
+        std::lock_guard<std::mutex> lock(wrapper->mutex);
+        if (touch_context(wrapper) < 0.0 || wrapper->context == nullptr) {
+            ex.respond(503, "application/json", openai_error("Model not loaded", "server_error"));
+            return;
+        }
+        for (size_t i = 0; i < texts.size(); i++) {
+            if (!embed_text(wrapper, texts[i], vectors[i])) {
+                ex.respond(500, "application/json", openai_error("Embedding failed", "server_error"));
+                return;
+            }
+        }
+        wrapper->last_activity = steady_clock::now();
+    }
+
+    json_writer json;
+    json.begin_object().field("object", "list").begin_array("data");
+    for (size_t i = 0; i < vectors.size(); i++) {
+        json.begin_object().field("object", "embedding").field("index", static_cast<int>(i)).begin_array("embedding");
+        for (float v : vectors[i]) {
+            json.number(nullptr, v, 7);
+        }
+        json.end_array().end_object();
+    }
+    json.end_array().field("model", openai_model_name(wrapper)).end_object();
+    ex.respond(200, "application/json", json.str());
+}
+
+void serve_openai_request(llama_context_wrapper* wrapper, http_server::exchange& ex) {
+    const std::string& path = ex.req.path;
+    if (path == "/v1/models") {
+        json_writer json;
+        json.begin_object()
+            .field("object", "list")
+            .begin_array("data")
+            .begin_object()
+            .field("id", openai_model_name(wrapper))
+            .field("object", "model")
+            .field("owned_by", "local")
+            .end_object()
+            .end_array()
+            .end_object();
+        ex.respond(200, "application/json", json.str());
+        return;
+    }
+    if (path == "/metrics") {
+        ex.respond(200, "text/plain; version=0.0.4", latency_histograms().prometheus_text());
+        return;
+    }
+    if (path != "/v1/chat/completions" && path != "/v1/embeddings") {
+        ex.respond(404, "application/json", openai_error("Unknown endpoint " + path, "invalid_request_error"));
+        return;
+    }
+    if (ex.req.method != "POST") {
+        ex.respond(405, "application/json", openai_error("Use POST", "invalid_request_error"));
+        return;
+    }
+    json_value body;
+    if (!json_value::parse(ex.req.body, body) || body.kind != json_value::OBJECT) {
+        ex.respond(400, "application/json", openai_error("Body is not a JSON object", "invalid_request_error"));
+        return;
+    }
+    if (path == "/v1/embeddings") {
+        serve_embeddings(wrapper, ex, body);
+    } else {
+        serve_chat_completion(wrapper, ex, body);
+    }
+}
+
+extern "C" {
+    // ---- FFI Functions Exposed to Dart ----
+
+    __attribute__((visibility("default"))) __attribute__((used))
+    void* load_model_with_gpu(const char* model_path, bool use_gpu) {
+        LOGI("Loading model from: %s (GPU: %s)", model_path, use_gpu ? "enabled" : "disabled");
+        const auto load_start = steady_clock::now();
+        
+        // Initialize backend once
+        install_llama_log_hook();
+        llama_backend_init();
+
+        // Backends are modules next to this library and must be registered before
+        // a model loads: the best CPU variant for this device and, only when the
+        // GPU is asked for, Vulkan, so CPU-only sessions never initialize it
+        startup_stats startup;
+        startup.gpu_requested = use_gpu;
+        const std::string module_dir = native_library_dir();
+        if (!load_cpu_backend(module_dir).loaded) {
+            LOGE("No CPU backend runs on this device");
+            return nullptr;
+        }
+        startup.gpu_loaded = use_gpu && load_backend_module(module_dir, "vulkan");
+        if (use_gpu && !startup.gpu_loaded) {
+            LOGI("No GPU backend in this build, falling back to the CPU");
+            use_gpu = false;
+        }
+        startup.backend_ms = elapsed_ms(load_start);
+
+        auto* wrapper = new llama_context_wrapper();
+
+        // Configure model parameters
+        llama_model_params mparams = llama_model_default_params();
+        mparams.use_mmap = true;  // Use memory mapping for efficiency
+        mparams.use_mlock = false; // Don't lock memory on mobile
+        
+        // GPU acceleration settings
+        if (use_gpu) {
+            mparams.n_gpu_layers = 10; // Offload some layers to GPU (will auto-limit based on VRAM)
+            LOGI("GPU acceleration enabled: offloading layers to GPU");
+        } else {
+            mparams.n_gpu_layers = 0; // CPU-only mode
+            // No devices: a GPU registered for an earlier model stays unused
+            static ggml_backend_dev_t no_devices[] = {nullptr};
+            mparams.devices = no_devices;
+            LOGI("CPU-only mode enabled");
+        }
+        
+        // Load model
+        auto phase_start = steady_clock::now();
+        begin_buffer_size_capture();
+        wrapper->model = llama_model_load_from_file(model_path, mparams);
+        if (wrapper->model == nullptr) {
+            LOGE("Failed to load model");
+            delete wrapper;
+            return nullptr;
+        }
+        startup.model_ms = elapsed_ms(phase_start);
+
+        wrapper->buffers.model = take_logged_buffer_sizes().model;
+
+        // Configure context parameters (properly optimized for mobile performance)
+        llama_context_params cparams = llama_context_default_params();
+        cparams.n_ctx = 1024;      // Reasonable context size
+        cparams.n_batch = 512;     // Large batch size for efficient parallel processing
+        cparams.n_ubatch = 512;
+        
+        if (use_gpu) {
+            // GPU-optimized settings
+            cparams.n_threads = 2;     // Fewer CPU threads when using GPU
+            cparams.n_threads_batch = 2;
+            LOGI("Using GPU-optimized thread configuration");
+        } else {
+            // CPU-optimized settings  
+            cparams.n_threads = 4;     // Use multiple CPU cores for matrix operations
+            cparams.n_threads_batch = 4; // Use multiple cores for batch processing
+            LOGI("Using CPU-optimized thread configuration");
+        }
+        
+        cparams.rope_scaling_type = LLAMA_ROPE_SCALING_TYPE_UNSPECIFIED;
+        cparams.pooling_type = LLAMA_POOLING_TYPE_UNSPECIFIED;
+        cparams.attention_type = LLAMA_ATTENTION_TYPE_UNSPECIFIED;
+        cparams.defrag_thold = -1.0f;
+
+        // One chat sequence plus background jobs sharing a single KV pool
+        cparams.n_seq_max = MAX_SEQUENCES;
+        cparams.kv_unified = true;
         
-        std::string response = "";
-        std::string accumulated_text = "";  // Buffer to check for end patterns
+        // Create context
+        phase_start = steady_clock::now();
+        begin_buffer_size_capture();
+        wrapper->context = llama_init_from_model(wrapper->model, cparams);
+        if (wrapper->context == nullptr) {
+            LOGE("Failed to create context");
+            llama_model_free(wrapper->model);
+            delete wrapper;
+            return nullptr;
+        }
+        startup.context_ms = elapsed_ms(phase_start);
+
+        // Get memory handle for efficient KV cache management
+        wrapper->memory = llama_get_memory(wrapper->context);
+
+        const backend_buffer_sizes logged = take_logged_buffer_sizes();
+        wrapper->buffers.kv = logged.kv;
+        wrapper->buffers.compute = logged.compute;
+        wrapper->buffers.output = logged.output;
+        wrapper->weights_probe.open(model_path);
+        wrapper->model_hash = model_fingerprint(model_path);
+
+        // Remember how we were loaded so an idle unload can be undone transparently
+        wrapper->model_path = model_path;
+        wrapper->mparams = mparams;
+        wrapper->cparams = cparams;
         
-        LOGI("Starting efficient generation loop, max tokens: %d", n_predict);
+        // Create and configure sampler
+        wrapper->sampler = create_sampler(wrapper->sampling);
+        wrapper->fast_sampler.reset(create_fused_sampler(wrapper->sampling));
+        if (wrapper->sampler == nullptr) {
+            LOGE("Failed to create sampler");
+            wrapper->cleanup();
+            delete wrapper;
+            return nullptr;
+        }
+
+        // Initialize reusable batch (proper size for efficient parallel processing)
+        wrapper->batch = llama_batch_init(MAX_BATCH_TOKENS, 0, 1);  // Match n_batch size
+        if (wrapper->batch.token == nullptr) {
+            LOGE("Failed to create batch");
+            wrapper->cleanup();
+            delete wrapper;
+            return nullptr;
+        }
         
-        // Efficient generation loop with single reusable batch
-        for (int i = 0; i < n_predict; i++) {
-            // Sample next token using the sampler chain
-            llama_token new_token = llama_sampler_sample(wrapper->sampler, wrapper->context, -1);
+        // Initialize sequence IDs buffer (match batch size)
+        wrapper->seq_ids.resize(512, 0);  // Match batch size
+        wrapper->background_seq_busy.assign(MAX_SEQUENCES, false);
+
+        startup.total_ms = elapsed_ms(load_start);
+        wrapper->startup = startup;
+        char config[32];
+        std::snprintf(config, sizeof(config), "%s-ctx%u", use_gpu ? "gpu" : "cpu", cparams.n_ctx);
+        wrapper->latency_series = latency_histograms().series(openai_model_name(wrapper), config);
+        latency_histograms().record(wrapper->latency_series, LATENCY_MODEL_LOAD, startup.total_ms);
+        LOGI("Model loaded successfully in %.0f ms (backends %.0f, weights %.0f, context %.0f)", startup.total_ms,
+             startup.backend_ms, startup.model_ms, startup.context_ms);
+        return wrapper;
+    }
+
+    __attribute__((visibility("default"))) __attribute__((used))
+    void* load_model(const char* model_path) {
+        return load_model_with_gpu(model_path, true); // Default to GPU enabled
+    }
+
+    __attribute__((visibility("default"))) __attribute__((used))
+    const char* predict(void* context_ptr, const char* prompt) {
+        return run_prediction(static_cast<llama_context_wrapper*>(context_ptr), prompt, request_options());
+    }
+
+    __attribute__((visibility("default"))) __attribute__((used))
+    const char* predict_with_options(void* context_ptr, const char* prompt, const request_options* options) {
+        return run_prediction(static_cast<llama_context_wrapper*>(context_ptr), prompt,
+                              options != nullptr ? *options : request_options());
+    }
+    
+    __attribute__((visibility("default"))) __attribute__((used))
+    void free_string(char* str) {
+        delete[] str;
+    }
+
+    __attribute__((visibility("default"))) __attribute__((used))
+    void free_model(void* context_ptr) {
+        if (context_ptr != nullptr) {
+            auto* wrapper = static_cast<llama_context_wrapper*>(context_ptr);
+            LOGI("Freeing model resources");
+            delete wrapper; // Destructor will handle cleanup
+        }
+        llama_backend_free();
+    }
+
+    __attribute__((visibility("default"))) __attribute__((used))
+    void reset_conversation(void* context_ptr) {
+        auto* wrapper = static_cast<llama_context_wrapper*>(context_ptr);
+        if (wrapper == nullptr) {
+            return;
+        }
+        if (llama_context_wrapper* escalation = wrapper->escalation.load()) {
+            reset_conversation(escalation);
+        }
+
+        std::lock_guard<std::mutex> lock(wrapper->mutex);
+        wrapper->pending_history.clear();
+        if (wrapper->context == nullptr && wrapper->has_snapshot) {
+            // Idle-unloaded: dropping the snapshot is enough, no need to wake the context
+            unlink(wrapper->idle.snapshot_path.c_str());
+            wrapper->has_snapshot = false;
+            wrapper->conversation_tokens.clear();
+            wrapper->turn_starts.clear();
+            drop_paged_history(wrapper);
+            wrapper->n_past = 0;
+            wrapper->conversation_started = false;
+            save_session_turn(wrapper);
+            LOGI("Conversation reset while unloaded");
+            return;
+        }
+
+        if (wrapper->context != nullptr && wrapper->memory != nullptr) {
+            LOGI("Resetting conversation");
             
-            // Check for end of sequence tokens first
-            if (new_token == eos_token || new_token == eot_token) {
-                LOGI("Hit EOS/EOT token (%d), stopping generation", new_token);
-                break;
+            // Clear the chat sequence; background jobs keep their cells
+            llama_memory_seq_rm(wrapper->memory, 0, -1, -1);
+            
+            // Reset sampler state
+            if (wrapper->sampler) {
+                llama_sampler_reset(wrapper->sampler);
+            }
+            if (wrapper->fast_sampler) {
+                wrapper->fast_sampler->reset();
+            }
+            
+            // Reset wrapper state
+            wrapper->conversation_tokens.clear();
+            wrapper->turn_starts.clear();
+            drop_paged_history(wrapper);
+            wrapper->n_past = 0;
+            wrapper->conversation_started = false;
+            save_session_turn(wrapper);
+            
+            LOGI("Conversation reset complete");
+        }
+    }
+
+    __attribute__((visibility("default"))) __attribute__((used))
+    void set_idle_policy(void* context_ptr, int idle_timeout_ms, const char* snapshot_path, int min_free_ram_mb) {
+        auto* wrapper = static_cast<llama_context_wrapper*>(context_ptr);
+        if (wrapper == nullptr || snapshot_path == nullptr) {
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(wrapper->mutex);
+            if (wrapper->has_snapshot && wrapper->idle.snapshot_path != snapshot_path) {
+                // Pending snapshot must stay reachable; wake up before moving the path
+                touch_context(wrapper);
+            }
+            wrapper->idle.timeout_ms = idle_timeout_ms > 0 ? idle_timeout_ms : 0;
+            wrapper->idle.snapshot_path = snapshot_path;
+            wrapper->idle.min_free_ram_bytes = min_free_ram_mb > 0 ? static_cast<size_t>(min_free_ram_mb) * 1024 * 1024 : 0;
+            wrapper->last_activity = steady_clock::now();
+            if (!wrapper->idle_thread.joinable() && wrapper->idle.timeout_ms > 0) {
+                wrapper->idle_thread = std::thread(idle_watchdog_loop, wrapper);
+            }
+        }
+        wrapper->idle_cv.notify_all();
+
+        LOGI("Idle policy: timeout %d ms, snapshot %s, min free RAM %d MiB",
+             idle_timeout_ms, snapshot_path, min_free_ram_mb);
+    }
+
+    __attribute__((visibility("default"))) __attribute__((used))
+    const char* get_metrics(void* context_ptr) {
+        auto* wrapper = static_cast<llama_context_wrapper*>(context_ptr);
+        if (wrapper == nullptr) {
+            return string_to_char_ptr("{}");
+        }
+
+        std::lock_guard<std::mutex> lock(wrapper->metrics_mutex);
+        const auto& idle = wrapper->idle_metrics;
+
+        json_writer json;
+        json.begin_object();
+        write_request_metrics(json, "last_request", wrapper->last_request);
+        write_request_metrics(json, "last_background_request", wrapper->last_background_request);
+        json.begin_object("throughput")
+            .field("prefill_tokens_per_s", wrapper->throughput.prefill_tokens_per_s)
+            .field("decode_tokens_per_s", wrapper->throughput.decode_tokens_per_s)
+            .end_object();
+        const cpu_backend_info& cpu = load_cpu_backend(native_library_dir());
+        json.begin_object("cpu_backend")
+            .field("variant", cpu.variant)
+            .field("score", cpu.score)
+            .field("candidates", cpu.candidates)
+            .field("load_ms", cpu.load_ms)
+            .begin_object("features");
+        for (const auto& feature : cpu.features) {
+            json.field(feature.first.c_str(), feature.second);
+        }
+        json.end_object().end_object();
+        const std::string module_dir = native_library_dir();
+        const auto& startup = wrapper->startup;
+        json.begin_object("startup")
+            .field("flavor", NATIVE_LIB_FLAVOR)
+            .field("gpu_requested", startup.gpu_requested)
+            .field("gpu_loaded", startup.gpu_loaded)
+            .field("backend_ms", startup.backend_ms)
+            .field("model_ms", startup.model_ms)
+            .field("context_ms", startup.context_ms)
+            .field("total_ms", startup.total_ms)
+            .field("packaged_library_bytes", static_cast<uint64_t>(packaged_library_bytes(module_dir)))
+            .field("loaded_library_bytes", static_cast<uint64_t>(loaded_library_bytes(module_dir)))
+            .end_object();
+        json.begin_object("idle")
+            .field("unloads", idle.n_unloads)
+            .field("wakes", idle.n_wakes)
+            .field("model_released", idle.model_released)
+            .field("last_saved_bytes", static_cast<uint64_t>(idle.last_saved_bytes))
+            .field("last_snapshot_ms", idle.last_snapshot_ms)
+            .field("last_wake_ms", idle.last_wake_ms)
+            .field("total_wake_ms", idle.total_wake_ms)
+            .end_object();
+
+        const request_scheduler::stats sched = wrapper->scheduler.snapshot();
+        const queue_limits limits = wrapper->scheduler.get_limits();
+        json.begin_object("scheduler")
+            .field("interactive_completed", sched.completed[REQUEST_PRIORITY_INTERACTIVE])
+            .field("background_completed", sched.completed[REQUEST_PRIORITY_BACKGROUND])
+            .field("preemptions", sched.preemptions)
+            .field("interactive_wait_ms", sched.total_wait_ms[REQUEST_PRIORITY_INTERACTIVE])
+            .field("background_wait_ms", sched.total_wait_ms[REQUEST_PRIORITY_BACKGROUND])
+            .field("prefill_step_budget", wrapper->prefill_step_budget.load())
+            .field("queue_depth", sched.depth)
+            .field("queue_max_depth", limits.max_depth)
+            .field("queue_policy", static_cast<int>(limits.policy))
+            .field("max_queue_depth_seen", sched.max_depth_seen)
+            .field("queued_cost_ms", sched.queued_cost_ms)
+            .field("rejected", sched.rejected)
+            .field("coalesced", sched.coalesced)
+            .field("replaced", sched.replaced)
+            .end_object();
+
+        json.begin_object("sampler")
+            .field("fused", wrapper->use_fused_sampler.load() && fused_sampler::supports(wrapper->sampling))
+            .field("kernel", fused_sampler::kernel_name())
+            .field("top_k", wrapper->sampling.top_k)
+            .field("top_p", static_cast<double>(wrapper->sampling.top_p))
+            .field("temp", static_cast<double>(wrapper->sampling.temp))
+            .end_object();
+
+        const auto& thermal = wrapper->thermal;
+        json.begin_object("thermal")
+            .field("enabled", thermal.enabled)
+            .field("level", thermal.decision.level)
+            .field("temp_c", static_cast<double>(thermal.decision.temp_c))
+            .field("freq_ratio", static_cast<double>(thermal.decision.freq_ratio))
+            .field("n_threads", thermal.decision.n_threads)
+            .field("pacing_us", thermal.decision.pacing_us)
+            .field("transitions", thermal.transitions)
+            .field("total_pacing_ms", thermal.total_pacing_ms)
+            .field("cool_tokens_per_s", thermal.cool_tokens_per_s);
+        json.begin_array("cpus");
+        for (int cpu : thermal.decision.cpus) {
+            json.field(nullptr, cpu);
+        }
+        json.end_array();
+        json.end_object();
+
+        const perf_counter_stats& perf = wrapper->perf_status;
+        json.begin_object("perf_counters")
+            .field("enabled", perf.enabled)
+            .field("threads", perf.threads)
+            .field("error", perf.error);
+        json.begin_array("events");
+        for (perf_event_kind kind : perf.events) {
+            json.field(nullptr, perf_event_name(kind));
+        }
+        json.end_array();
+        json.end_object();
+
+        if (wrapper->cache) {
+            const response_cache::stats cache = wrapper->cache->snapshot();
+            const uint64_t lookups = cache.hits + cache.misses;
+            json.begin_object("response_cache")
+                .field("entries", cache.entries)
+                .field("live_bytes", static_cast<uint64_t>(cache.live_bytes))
+                .field("file_bytes", static_cast<uint64_t>(cache.file_bytes))
+                .field("hits", cache.hits)
+                .field("misses", cache.misses)
+                .field("hit_rate", lookups > 0 ? static_cast<double>(cache.hits) / lookups : 0.0)
+                .field("bypassed", cache.bypassed)
+                .field("stores", cache.stores)
+                .field("evictions", cache.evictions)
+                .field("compactions", cache.compactions)
+                .end_object();
+        }
+
+        if (wrapper->semantic) {
+            const semantic_cache::stats semantic = wrapper->semantic->snapshot();
+            const uint64_t lookups = semantic.hits + semantic.misses;
+            json.begin_object("semantic_cache")
+                .field("entries", semantic.entries)
+                .field("capacity", wrapper->semantic->capacity())
+                .field("threshold", static_cast<double>(semantic.threshold))
+                .field("hits", semantic.hits)
+                .field("misses", semantic.misses)
+                .field("hit_rate", lookups > 0 ? static_cast<double>(semantic.hits) / lookups : 0.0)
+                .field("stores", semantic.stores)
+                .field("last_similarity", static_cast<double>(semantic.last_similarity))
+                .field("avg_embed_ms", lookups > 0 ? semantic.total_embed_ms / lookups : 0.0)
+                .end_object();
+        }
+
+        const auto& cascade = wrapper->cascade_metrics;
+        json.begin_object("cascade")
+            .field("enabled", wrapper->escalation.load() != nullptr)
+            .field("turns", cascade.turns)
+            .field("escalations", cascade.escalations)
+            .field("escalation_rate", cascade.turns > 0 ? static_cast<double>(cascade.escalations) / cascade.turns : 0.0)
+            .field("small_ms", cascade.small_ms)
+            .field("escalated_ms", cascade.escalated_ms)
+            .field("wasted_ms", cascade.wasted_ms)
+            .field("compared_turns", cascade.compared_turns)
+            .field("actual_ms", cascade.actual_ms)
+            .field("large_only_ms", cascade.large_only_ms)
+            .field("saved_ms", cascade.large_only_ms - cascade.actual_ms)
+            .field("energy_turns", cascade.energy_turns)
+            .field("actual_mj", cascade.actual_mj)
+            .field("large_only_mj", cascade.large_only_mj)
+            .field("saved_mj", cascade.large_only_mj - cascade.actual_mj)
+            .end_object();
+
+        const auto& compaction = wrapper->compaction_metrics;
+        const auto& paging = wrapper->paging_metrics;
+        json.begin_object("kv_paging").field("enabled", wrapper->pager != nullptr);
+        if (wrapper->pager) {
+            const kv_pager::stats pages = wrapper->pager->snapshot();
+            json.field("page_bytes", static_cast<uint64_t>(pages.page_bytes))
+                .field("pages_used", pages.pages_used)
+                .field("pages_total", pages.pages_total)
+                .field("pending_writes", pages.pending_writes)
+                .field("bytes_written", pages.bytes_written)
+                .field("bytes_read", pages.bytes_read)
+                .field("syncs", pages.syncs)
+                .field("total_write_ms", pages.total_write_ms);
+        }
+        json.field("page_outs", paging.page_outs)
+            .field("page_ins", paging.page_ins)
+            .field("paged_ranges", paging.paged_ranges)
+            .field("paged_turns", paging.paged_turns)
+            .field("paged_tokens", paging.paged_tokens)
+            .field("last_page_out_ms", paging.last_page_out_ms)
+            .field("total_page_out_ms", paging.total_page_out_ms)
+            .field("last_page_in_ms", paging.last_page_in_ms)
+            .end_object();
+
+        json.begin_object("session_log").field("enabled", wrapper->session != nullptr);
+        if (wrapper->session) {
+            const session_log::stats log = wrapper->session->snapshot();
+            json.field("appends", log.appends)
+                .field("rewrites", log.rewrites)
+                .field("syncs", log.syncs)
+                .field("pending", log.pending)
+                .field("file_bytes", log.file_bytes)
+                .field("raw_bytes", log.raw_bytes)
+                .field("stored_bytes", log.stored_bytes)
+                .field("last_write_ms", log.last_write_ms)
+                .field("total_write_ms", log.total_write_ms);
+        }
+        const auto& session = wrapper->session_metrics;
+        json.field("saves", session.saves)
+            .field("base_saves", session.base_saves)
+            .field("deferred_bases", session.deferred_bases)
+            .field("last_save_ms", session.last_save_ms)
+            .field("avg_save_ms", session.saves > 0 ? session.total_save_ms / session.saves : 0.0)
+            .field("restored_tokens", session.restored_tokens)
+            .field("restore_ms", session.restore_ms)
+            .end_object();
+
+        json.begin_object("compaction")
+            .field("compactions", compaction.n_compactions)
+            .field("aborted", compaction.n_aborted)
+            .field("turns_folded", compaction.turns_folded)
+            .field("tokens_removed", compaction.tokens_removed)
+            .field("last_before_tokens", compaction.last_before)
+            .field("last_after_tokens", compaction.last_after)
+            .field("last_ms", compaction.last_ms)
+            .field("total_ms", compaction.total_ms)
+            .end_object();
+
+        json.begin_object("model_server").field("enabled", wrapper->server != nullptr);
+        if (wrapper->server) {
+            const model_server::stats server = wrapper->server->snapshot();
+            json.field("path", wrapper->server->path())
+                .field("clients", server.clients)
+                .field("connections", server.connections)
+                .field("refused", server.refused)
+                .field("requests", server.requests)
+                .field("streamed_bytes", server.streamed_bytes);
+        }
+        json.end_object();
+
+        json.begin_object("http_server").field("enabled", wrapper->http != nullptr);
+        if (wrapper->http) {
+            const http_server::stats http = wrapper->http->snapshot();
+            json.field("port", wrapper->http->port())
+                .field("clients", http.clients)
+                .field("connections", http.connections)
+                .field("refused", http.refused)
+                .field("requests", http.requests)
+                .field("reused", http.reused)
+                .field("bad_requests", http.bad_requests)
+                .field("denied", http.denied)
+                .field("events", http.events)
+                .field("bytes_in", http.bytes_in)
+                .field("bytes_out", http.bytes_out)
+                .field("avg_parse_ms", http.requests > 0 ? http.total_parse_ms / http.requests : 0.0)
+                .field("avg_handler_ms", http.requests > 0 ? http.total_handler_ms / http.requests : 0.0);
+        }
+        json.end_object();
+        json.end_object();
+        return string_to_char_ptr(json.str());
+    }
+
+    __attribute__((visibility("default"))) __attribute__((used))
+    const char* get_memory_stats(void* context_ptr) {
+        auto* wrapper = static_cast<llama_context_wrapper*>(context_ptr);
+        if (wrapper == nullptr) {
+            return string_to_char_ptr("{}");
+        }
+
+        // Never wait behind a running request: context-derived numbers fall back to
+        // the values cached by the last poll that found the wrapper idle
+        // The model and context are only touched under the lock: the idle watchdog
+        // may free them at any time
+        bool stale = true;
+        bool resident = false;
+        size_t conversation_bytes = 0;
+        size_t snapshot_bytes = 0;  // A running request implies no snapshot on disk
+        memory_poll poll;
+        std::unique_lock<std::mutex> lock(wrapper->mutex, std::try_to_lock);
+        if (lock.owns_lock()) {
+            stale = false;
+            resident = wrapper->context != nullptr;
+            if (resident) {
+                poll.state_size = llama_state_get_size(wrapper->context);
+                poll.kv_cells_used = llama_memory_seq_pos_max(wrapper->memory, 0) + 1;
             }
-            
-            // Accept the token (updates sampler state)
-            llama_sampler_accept(wrapper->sampler, new_token);
-            
-            // Convert token to text
-            char piece[256];
-            int n_chars = llama_token_to_piece(
-                vocab, 
-                new_token, 
-                piece, 
-                sizeof(piece), 
-                0,     // lstrip
-                false  // special
-            );
-            
-            if (n_chars > 0) {
-                piece[n_chars] = '\0';
-                std::string token_text(piece);
-                
-                // Add to accumulated text for pattern checking
-                accumulated_text += token_text;
-                response += token_text;
-                
-                // Check for various end patterns (more comprehensive)
-                if (accumulated_text.find("<end_of_turn>") != std::string::npos ||
-                    accumulated_text.find("</s>") != std::string::npos ||
-                    accumulated_text.find("<|end|>") != std::string::npos ||
-                    accumulated_text.find("<start_of_turn>user") != std::string::npos) {
-                    LOGI("Hit end pattern in text: '%.30s', stopping generation", accumulated_text.c_str());
-                    
-                    // Remove the end pattern from response
-                    size_t end_pos = response.find("<end_of_turn>");
-                    if (end_pos != std::string::npos) {
-                        response = response.substr(0, end_pos);
-                    }
-                    end_pos = response.find("<start_of_turn>");
-                    if (end_pos != std::string::npos) {
-                        response = response.substr(0, end_pos);
-                    }
-                    break;
+            if (wrapper->model != nullptr) {
+                poll.n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(wrapper->model));
+            }
+            poll.weights_file_bytes = wrapper->weights_probe.file_bytes();
+            poll.weights_resident_bytes = wrapper->weights_probe.resident_bytes();
+            conversation_bytes = wrapper->conversation_tokens.capacity() * sizeof(llama_token);
+            if (wrapper->has_snapshot) {
+                snapshot_bytes = file_size_bytes(wrapper->idle.snapshot_path);
+            }
+            lock.unlock();
+        }
+        const int n_ctx = static_cast<int>(wrapper->cparams.n_ctx);
+
+        backend_buffer_sizes buffers;
+        {
+            std::lock_guard<std::mutex> metrics_lock(wrapper->metrics_mutex);
+            buffers = wrapper->buffers;
+            if (stale) {
+                poll = wrapper->last_memory_poll;
+            } else {
+                wrapper->last_memory_poll = poll;
+            }
+        }
+
+        const int kv_cells_used = std::min(poll.kv_cells_used, n_ctx);
+        const size_t kv_used_bytes = n_ctx > 0 ? buffers.kv / n_ctx * kv_cells_used : 0;
+
+        // Per-slot cost of the reusable batch: token, pos, n_seq_id, seq_id pointer + one id, logits flag
+        const size_t batch_bytes = wrapper->cparams.n_batch *
+            (sizeof(llama_token) + sizeof(llama_pos) + sizeof(int32_t) +
+             sizeof(llama_seq_id*) + sizeof(llama_seq_id) + sizeof(int8_t));
+
+        // llama_sampler_sample() builds a full candidate array per token
+        const size_t sampler_scratch_bytes = static_cast<size_t>(poll.n_vocab) * sizeof(llama_token_data);
+
+        const process_memory proc = read_process_memory();
+
+        json_writer json;
+        json.begin_object();
+        json.field("resident", resident)
+            .field("stale", stale);
+        json.begin_object("weights")
+            .field("file_bytes", static_cast<uint64_t>(poll.weights_file_bytes))
+            .field("resident_bytes", static_cast<uint64_t>(poll.weights_resident_bytes))
+            .field("buffer_bytes", static_cast<uint64_t>(buffers.model))
+            .end_object();
+        json.begin_object("kv")
+            .field("allocated_bytes", static_cast<uint64_t>(buffers.kv))
+            .field("cells_total", n_ctx)
+            .field("cells_used", kv_cells_used)
+            .field("used_bytes", static_cast<uint64_t>(kv_used_bytes))
+            .end_object();
+        json.field("compute_buffer_bytes", static_cast<uint64_t>(buffers.compute))
+            .field("output_buffer_bytes", static_cast<uint64_t>(buffers.output))
+            .field("state_bytes", static_cast<uint64_t>(poll.state_size))
+            .field("snapshot_bytes", static_cast<uint64_t>(snapshot_bytes));
+        json.begin_object("wrapper")
+            .field("conversation_bytes", static_cast<uint64_t>(conversation_bytes))
+            .field("batch_bytes", static_cast<uint64_t>(batch_bytes))
+            .field("sampler_scratch_bytes", static_cast<uint64_t>(sampler_scratch_bytes))
+            .end_object();
+        json.begin_object("process")
+            .field("rss_bytes", static_cast<uint64_t>(proc.rss))
+            .field("pss_bytes", static_cast<uint64_t>(proc.pss))
+            .field("swap_bytes", static_cast<uint64_t>(proc.swap))
+            .end_object();
+        json.end_object();
+        return string_to_char_ptr(json.str());
+    }
+
+    __attribute__((visibility("default"))) __attribute__((used))
+    void set_thermal_governor(void* context_ptr, const char* sysfs_root, float throttle_temp_c, float critical_temp_c) {
+        auto* wrapper = static_cast<llama_context_wrapper*>(context_ptr);
+        if (wrapper == nullptr) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(wrapper->mutex);
+        if (throttle_temp_c <= 0.0f) {
+            wrapper->governor.reset();
+            LOGI("Thermal governor disabled");
+        } else {
+            thermal_governor_config config;
+            if (sysfs_root != nullptr && sysfs_root[0] != '\0') {
+                config.sysfs_root = sysfs_root;
+            }
+            config.throttle_temp_c = throttle_temp_c;
+            config.critical_temp_c = critical_temp_c > throttle_temp_c ? critical_temp_c : throttle_temp_c + 10.0f;
+            config.max_threads = wrapper->cparams.n_threads;
+            wrapper->governor.reset(new thermal_governor(config));
+            LOGI("Thermal governor enabled: root %s, throttle %.1f C, critical %.1f C",
+                 config.sysfs_root.c_str(), config.throttle_temp_c, config.critical_temp_c);
+        }
+        apply_thermal_decision(wrapper);
+
+        std::lock_guard<std::mutex> metrics_lock(wrapper->metrics_mutex);
+        wrapper->thermal = thermal_stats();
+        wrapper->thermal.enabled = wrapper->governor != nullptr;
+        if (wrapper->governor) {
+            wrapper->thermal.decision = wrapper->governor->decision();
+        }
+    }
+
+    __attribute__((visibility("default"))) __attribute__((used))
+    void set_energy_sampler(void* context_ptr, const char* sysfs_root, int interval_ms) {
+        auto* wrapper = static_cast<llama_context_wrapper*>(context_ptr);
+        if (wrapper == nullptr) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(wrapper->mutex);
+        if (interval_ms <= 0) {
+            wrapper->energy.reset();
+            LOGI("Energy sampler disabled");
+            return;
+        }
+
+        const std::string root = sysfs_root != nullptr ? sysfs_root : "";
+        wrapper->energy.reset(new energy_sampler(make_power_supply_reader(root), interval_ms));
+        LOGI("Energy sampler enabled: root %s, interval %d ms", root.empty() ? "/sys" : root.c_str(), interval_ms);
+    }
+
+    // Count cycles, instructions, cache misses and backend stalls separately for
+    // the prefill and decode phases of each request (prefill_perf / decode_perf in
+    // the request metrics). Returns false, and reports why under perf_counters in
+    // get_metrics(), when the device does not permit perf events.
+    __attribute__((visibility("default"))) __attribute__((used))
+    bool set_perf_counters(void* context_ptr, bool enabled) {
+        auto* wrapper = static_cast<llama_context_wrapper*>(context_ptr);
+        if (wrapper == nullptr) {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(wrapper->mutex);
+        perf_counter_stats status;
+        if (enabled) {
+            wrapper->perf.reset(new perf_counters());
+            if (wrapper->perf->probe()) {
+                // Rebuild a pinned threadpool so its threads are counted
+                if (wrapper->threadpool != nullptr) {
+                    apply_thermal_decision(wrapper);
                 }
-                
-                // Keep only last 50 chars in accumulated_text for efficiency
-                if (accumulated_text.length() > 50) {
-                    accumulated_text = accumulated_text.substr(accumulated_text.length() - 50);
+                status.enabled = true;
+                status.threads = wrapper->perf->threads();
+                status.events = wrapper->perf->events();
+            } else {
+                status.error = wrapper->perf->error();
+                wrapper->perf.reset();
+            }
+        } else {
+            wrapper->perf.reset();
+        }
+        LOGI("Perf counters %s", status.enabled ? "enabled" : "disabled");
+        std::lock_guard<std::mutex> metrics_lock(wrapper->metrics_mutex);
+        wrapper->perf_status = status;
+        return status.enabled;
+    }
+
+    // Bound the request queue. max_depth / max_queued_cost_ms of 0 mean unbounded;
+    // policy is an admission_policy value applied to requests arriving when full.
+    // Takes effect for the next request, even while one is generating.
+    __attribute__((visibility("default"))) __attribute__((used))
+    void set_queue_policy(void* context_ptr, int max_depth, int max_queued_cost_ms, int policy) {
+        auto* wrapper = static_cast<llama_context_wrapper*>(context_ptr);
+        if (wrapper == nullptr) {
+            return;
+        }
+
+        queue_limits limits;
+        limits.max_depth = std::max(0, max_depth);
+        limits.max_cost_ms = std::max(0, max_queued_cost_ms);
+        limits.policy = policy == ADMISSION_COALESCE || policy == ADMISSION_REPLACE_LATEST
+                            ? static_cast<admission_policy>(policy)
+                            : ADMISSION_REJECT;
+        wrapper->scheduler.set_limits(limits);
+        LOGI("Queue policy: max depth %d, max cost %d ms, policy %d", limits.max_depth, max_queued_cost_ms,
+             static_cast<int>(limits.policy));
+    }
+
+    // Summed log-probability of each candidate as the reply to prompt, from one
+    // prefill and batched candidate decodes. Returns JSON; free with free_string().
+    __attribute__((visibility("default"))) __attribute__((used))
+    const char* score(void* context_ptr, const char* prompt, const char* const* candidates, int n_candidates) {
+        auto* wrapper = static_cast<llama_context_wrapper*>(context_ptr);
+        if (wrapper == nullptr || prompt == nullptr) {
+            return string_to_char_ptr("{\"error\":\"Model not loaded\"}");
+        }
+        std::vector<std::string> texts;
+        for (int i = 0; candidates != nullptr && i < n_candidates; i++) {
+            texts.emplace_back(candidates[i] != nullptr ? candidates[i] : "");
+        }
+        return string_to_char_ptr(score_candidates(wrapper, prompt, texts));
+    }
+
+    // Switch between the fused sampler and the llama.cpp chain. Both produce the
+    // same tokens for the same seed; the chain is kept for comparison.
+    __attribute__((visibility("default"))) __attribute__((used))
+    void set_fused_sampler(void* context_ptr, bool enabled) {
+        auto* wrapper = static_cast<llama_context_wrapper*>(context_ptr);
+        if (wrapper == nullptr) {
+            return;
+        }
+        wrapper->use_fused_sampler = enabled;
+        LOGI("Fused sampler %s (%s kernels)", enabled ? "enabled" : "disabled", fused_sampler::kernel_name());
+    }
+
+    // Time the llama.cpp chain against the fused sampler on synthetic logits of
+    // n_vocab entries, for the default top-k/top-p/temp configuration and for
+    // greedy. Both start from the same seed, so "mismatches" must be 0.
+    // Needs no model. Returns JSON; free with free_string().
+    __attribute__((visibility("default"))) __attribute__((used))
+    const char* benchmark_sampler(int n_vocab, int iterations) {
+        n_vocab = std::max(n_vocab, 1);
+        iterations = std::max(iterations, 1);
+
+        // A handful of logit sets so neither path benefits from seeing the same input twice in a row
+        constexpr int N_SETS = 8;
+        std::mt19937 gen(42);
+        std::normal_distribution<float> normal(0.0f, 3.0f);
+        std::vector<std::vector<float>> logit_sets(N_SETS, std::vector<float>(n_vocab));
+        for (auto& set : logit_sets) {
+            for (float& logit : set) {
+                logit = normal(gen);
+            }
+        }
+
+        // Hardware counters per path, when this device permits them
+        perf_counters perf;
+        const bool perf_on = perf.attach_current_thread(false);
+
+        json_writer json;
+        json.begin_object()
+            .field("kernel", fused_sampler::kernel_name())
+            .field("n_vocab", n_vocab)
+            .field("iterations", iterations)
+            .field("perf_error", perf_on ? std::string() : perf.error());
+
+        std::vector<llama_token_data> candidates(n_vocab);
+        const sampler_params configs[] = {sampler_params(), sampler_params{0, 1.0f, 0.0f, 0}};
+        const char* const names[] = {"top_k_top_p_temp", "greedy"};
+        for (int c = 0; c < 2; c++) {
+            std::unique_ptr<llama_sampler, decltype(&llama_sampler_free)> chain(create_sampler(configs[c]),
+                                                                                llama_sampler_free);
+            fused_sampler fused(configs[c]);
+            std::vector<llama_token> chain_tokens(iterations);
+            std::vector<llama_token> fused_tokens(iterations);
+
+            // What llama_sampler_sample() does per token: fill the candidate array, apply, accept
+            const perf_sample chain_perf_start = perf_on ? perf.read() : perf_sample();
+            const auto chain_start = steady_clock::now();
+            for (int i = 0; i < iterations; i++) {
+                const float* logits = logit_sets[i % N_SETS].data();
+                for (int id = 0; id < n_vocab; id++) {
+                    candidates[id] = {id, logits[id], 0.0f};
                 }
+                llama_token_data_array cur_p = {candidates.data(), candidates.size(), -1, false};
+                llama_sampler_apply(chain.get(), &cur_p);
+                chain_tokens[i] = cur_p.data[cur_p.selected].id;
+                llama_sampler_accept(chain.get(), chain_tokens[i]);
             }
+            const double chain_ms = elapsed_ms(chain_start);
+            const perf_sample chain_perf = perf_on ? perf.read().since(chain_perf_start) : perf_sample();
 
-            // Add new token to conversation
-            wrapper->conversation_tokens.push_back(new_token);
-            
-            // EFFICIENT: Reuse existing batch instead of creating new ones
-            clear_batch(wrapper->batch);
-            if (!add_token_to_batch(wrapper->batch, new_token, wrapper->n_past, wrapper->seq_ids, true)) {
-                LOGE("Failed to add token to batch at position %d", i);
-                break;
+            const perf_sample fused_perf_start = perf_on ? perf.read() : perf_sample();
+            const auto fused_start = steady_clock::now();
+            for (int i = 0; i < iterations; i++) {
+                fused_tokens[i] = fused.sample(logit_sets[i % N_SETS].data(), n_vocab);
             }
-            
-            // Decode single token efficiently
-            if (llama_decode(wrapper->context, wrapper->batch) != 0) {
-                LOGE("Failed to decode token at position %d", i);
-                break;
+            const double fused_ms = elapsed_ms(fused_start);
+            const perf_sample fused_perf = perf_on ? perf.read().since(fused_perf_start) : perf_sample();
+
+            int mismatches = 0;
+            for (int i = 0; i < iterations; i++) {
+                mismatches += chain_tokens[i] != fused_tokens[i];
             }
-            
-            wrapper->n_past++;
-            
-            // Check for context overflow
-            if (wrapper->n_past >= llama_n_ctx(wrapper->context) - 10) {
-                LOGI("Approaching context limit, stopping generation");
-                break;
+
+            json.begin_object(names[c])
+                .field("chain_ns_per_token", chain_ms * 1e6 / iterations)
+                .field("fused_ns_per_token", fused_ms * 1e6 / iterations)
+                .field("speedup", fused_ms > 0.0 ? chain_ms / fused_ms : 0.0)
+                .field("mismatches", mismatches);
+            if (perf_on) {
+                write_perf_sample(json, "chain_perf", chain_perf, iterations);
+                write_perf_sample(json, "fused_perf", fused_perf, iterations);
             }
-            
-            // Log progress every 5 tokens for better mobile UX feedback
-            if ((i + 1) % 5 == 0) {
-                LOGI("Generated %d/%d tokens, current: '%.20s...'", i + 1, n_predict, response.c_str());
+            json.end_object();
+        }
+        json.end_object();
+        return string_to_char_ptr(json.str());
+    }
+
+    // Text generated so far by the running interactive request (or the final text of
+    // the last one). Free with free_string().
+    __attribute__((visibility("default"))) __attribute__((used))
+    const char* get_partial_response(void* context_ptr) {
+        auto* wrapper = static_cast<llama_context_wrapper*>(context_ptr);
+        if (wrapper == nullptr) {
+            return string_to_char_ptr("");
+        }
+        std::lock_guard<std::mutex> lock(wrapper->stream_mutex);
+        return string_to_char_ptr(wrapper->partial_response);
+    }
+
+    // Keep replies of deterministic requests (greedy, or with a seed) in an
+    // append-only file at path, capped at max_mb MiB of live entries with LRU
+    // eviction. Requests sampling from the chat's random stream bypass it. An
+    // empty path or max_mb <= 0 disables the cache; the file is kept.
+    __attribute__((visibility("default"))) __attribute__((used))
+    bool set_response_cache(void* context_ptr, const char* path, int max_mb) {
+        auto* wrapper = static_cast<llama_context_wrapper*>(context_ptr);
+        if (wrapper == nullptr) {
+            return false;
+        }
+
+        // Close the old cache before opening the new one, which may be the same file
+        std::lock_guard<std::mutex> lock(wrapper->mutex);
+        {
+            std::lock_guard<std::mutex> metrics_lock(wrapper->metrics_mutex);
+            wrapper->cache.reset();
+        }
+        if (path == nullptr || path[0] == '\0' || max_mb <= 0) {
+            LOGI("Response cache disabled");
+            return true;
+        }
+
+        std::unique_ptr<response_cache> cache(new response_cache(path, static_cast<size_t>(max_mb) * 1024 * 1024));
+        if (!cache->open()) {
+            return false;
+        }
+        std::lock_guard<std::mutex> metrics_lock(wrapper->metrics_mutex);
+        wrapper->cache = std::move(cache);
+        LOGI("Response cache: %s, up to %d MiB", path, max_mb);
+        return true;
+    }
+
+    // Answer context-free requests (a chat's first turn, background jobs) whose
+    // normalized prompt embeds within cosine similarity `threshold` of an earlier
+    // one with that prompt's reply, under the same sampling settings and token
+    // limit. Requests that are not deterministic or carry constraints or biases
+    // bypass it. Keeps up to max_entries replies in memory; max_entries <= 0
+    // disables it. Calling again with the same capacity only changes the
+    // threshold and keeps the entries.
+    __attribute__((visibility("default"))) __attribute__((used))
+    bool set_semantic_cache(void* context_ptr, int max_entries, float threshold) {
+        auto* wrapper = static_cast<llama_context_wrapper*>(context_ptr);
+        if (wrapper == nullptr) {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(wrapper->mutex);
+        if (max_entries > 0 && wrapper->semantic && wrapper->semantic->capacity() == max_entries) {
+            wrapper->semantic->set_threshold(threshold);
+            LOGI("Semantic cache threshold: %.3f", threshold);
+            return true;
+        }
+
+        std::unique_ptr<semantic_cache> semantic;
+        if (max_entries > 0) {
+            if (touch_context(wrapper) < 0.0 || wrapper->model == nullptr) {
+                return false;
+            }
+            semantic.reset(new semantic_cache(llama_model_n_embd(wrapper->model), max_entries, threshold));
+        }
+        std::lock_guard<std::mutex> metrics_lock(wrapper->metrics_mutex);
+        wrapper->semantic = std::move(semantic);
+        LOGI("Semantic cache: %d entries, threshold %.3f", std::max(max_entries, 0), threshold);
+        return true;
+    }
+
+    // Answer chat turns on context_ptr and hand a turn to escalation_ptr, a larger
+    // model with the same vocabulary, when any of its first k_tokens has an entropy
+    // above max_entropy (nats) or a log-probability below min_logprob. The prompt
+    // is not tokenized twice, and each model catches up on the turns the other one
+    // answered before its next turn. A null escalation_ptr turns the cascade off;
+    // do so, with no request running, before freeing the escalation model.
+    // Returns false if the vocabularies differ. Escalation counts and savings are
+    // in get_metrics() under "cascade".
+    __attribute__((visibility("default"))) __attribute__((used))
+    bool set_cascade(void* context_ptr, void* escalation_ptr, int k_tokens, float max_entropy, float min_logprob) {
+        auto* wrapper = static_cast<llama_context_wrapper*>(context_ptr);
+        auto* escalation = static_cast<llama_context_wrapper*>(escalation_ptr);
+        if (wrapper == nullptr || escalation == wrapper) {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(wrapper->mutex);
+        if (escalation == nullptr) {
+            wrapper->escalation = nullptr;
+            LOGI("Cascade disabled");
+            return true;
+        }
+        if (escalation->escalation.load() != nullptr) {
+            LOGE("Cascade rejected: the escalation model cascades itself");
+            return false;
+        }
+
+        std::lock_guard<std::mutex> escalation_lock(escalation->mutex);
+        if (wrapper->model != nullptr && escalation->model != nullptr) {
+            const llama_vocab* small_vocab = llama_model_get_vocab(wrapper->model);
+            const llama_vocab* large_vocab = llama_model_get_vocab(escalation->model);
+            if (llama_vocab_n_tokens(small_vocab) != llama_vocab_n_tokens(large_vocab) ||
+                llama_vocab_bos(small_vocab) != llama_vocab_bos(large_vocab) ||
+                llama_vocab_eos(small_vocab) != llama_vocab_eos(large_vocab)) {
+                LOGE("Cascade rejected: the models do not share a vocabulary");
+                return false;
             }
         }
 
-        LOGI("Generated response: %.200s...", response.c_str());
-        return string_to_char_ptr(response);
+        wrapper->cascade.k_tokens = std::max(1, k_tokens);
+        wrapper->cascade.max_entropy = max_entropy;
+        wrapper->cascade.min_logprob = min_logprob;
+
+        // The escalation model starts over from the chat so far
+        escalation->conversation_started = false;
+        escalation->pending_history.clear();
+        if (wrapper->conversation_started) {
+            escalation->pending_history = wrapper->conversation_tokens;
+        }
+        escalation->pending_history.insert(escalation->pending_history.end(), wrapper->pending_history.begin(),
+                                           wrapper->pending_history.end());
+        wrapper->escalation = escalation;
+        {
+            std::lock_guard<std::mutex> metrics_lock(wrapper->metrics_mutex);
+            wrapper->cascade_metrics = cascade_stats();
+        }
+        LOGI("Cascade enabled: first %d tokens, max entropy %.2f, min logprob %.2f",
+             wrapper->cascade.k_tokens, max_entropy, min_logprob);
+        return true;
     }
-    
+
+    // Tokens per decode step, including the step's own token, that may be spent
+    // prefilling queued background prompts. Larger budgets shorten their
+    // time-to-first-token at the cost of inter-token latency for the running
+    // request; <= 1 disables co-scheduling.
     __attribute__((visibility("default"))) __attribute__((used))
-    void free_string(char* str) {
-        delete[] str;
+    void set_prefill_budget(void* context_ptr, int step_tokens) {
+        auto* wrapper = static_cast<llama_context_wrapper*>(context_ptr);
+        if (wrapper == nullptr) {
+            return;
+        }
+        wrapper->prefill_step_budget = std::max(0, std::min(step_tokens, MAX_BATCH_TOKENS));
+        LOGI("Prefill step budget: %d tokens", wrapper->prefill_step_budget.load());
     }
 
+    // Summarize the chat's oldest turns in idle time once it fills trigger_ratio of
+    // the context, folding turns until it fills at most target_ratio. The newest
+    // keep_recent_turns turns are kept verbatim and summaries are capped at
+    // max_summary_tokens. A trigger_ratio <= 0 turns compaction off.
     __attribute__((visibility("default"))) __attribute__((used))
-    void free_model(void* context_ptr) {
-        if (context_ptr != nullptr) {
-            auto* wrapper = static_cast<llama_context_wrapper*>(context_ptr);
-            LOGI("Freeing model resources");
-            delete wrapper; // Destructor will handle cleanup
+    void set_compaction_policy(void* context_ptr, float trigger_ratio, float target_ratio, int keep_recent_turns,
+                               int max_summary_tokens) {
+        auto* wrapper = static_cast<llama_context_wrapper*>(context_ptr);
+        if (wrapper == nullptr) {
+            return;
         }
-        llama_backend_free();
+
+        {
+            std::lock_guard<std::mutex> lock(wrapper->mutex);
+            auto& policy = wrapper->compaction;
+            policy.trigger_ratio = std::min(std::max(trigger_ratio, 0.0f), 1.0f);
+            policy.target_ratio = std::min(std::max(target_ratio, 0.1f), std::max(policy.trigger_ratio, 0.1f));
+            policy.keep_recent_turns = std::max(1, keep_recent_turns);
+            policy.max_summary_tokens = std::max(16, max_summary_tokens);
+            wrapper->compaction_attempted_at = -1;
+            if (!wrapper->compaction_thread.joinable() && policy.trigger_ratio > 0.0f) {
+                wrapper->compaction_thread = std::thread(compaction_loop, wrapper);
+            }
+        }
+        wrapper->compaction_cv.notify_all();
+
+        LOGI("Compaction policy: trigger %.2f, target %.2f, keep %d turns, summary <= %d tokens",
+             trigger_ratio, target_ratio, keep_recent_turns, max_summary_tokens);
     }
 
+    // Keep chats longer than the context: when a turn would not fit, the oldest
+    // turns are moved out of the KV cache into `path`, in pages of page_kb KiB,
+    // until the chat fills at most target_ratio of the context. They come back
+    // when rewind_conversation() goes past them. page_kb <= 0 (or a null path)
+    // turns paging off; turning it off or moving the file forgets the paged-out
+    // turns. Returns false if the file cannot be created.
     __attribute__((visibility("default"))) __attribute__((used))
-    void reset_conversation(void* context_ptr) {
+    bool set_kv_paging(void* context_ptr, const char* path, int page_kb, float target_ratio) {
         auto* wrapper = static_cast<llama_context_wrapper*>(context_ptr);
-        if (wrapper != nullptr && wrapper->context != nullptr && wrapper->memory != nullptr) {
-            LOGI("Resetting conversation");
-            
-            // Clear memory (both data and metadata)
-            llama_memory_clear(wrapper->memory, true);
-            
-            // Reset sampler state
-            if (wrapper->sampler) {
-                llama_sampler_reset(wrapper->sampler);
+        if (wrapper == nullptr) {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(wrapper->mutex);
+        drop_paged_history(wrapper);
+        std::unique_ptr<kv_pager> pager;
+        if (path != nullptr && page_kb > 0) {
+            pager.reset(new kv_pager(path, static_cast<size_t>(page_kb) * 1024));
+            if (!pager->open()) {
+                return false;
             }
-            
-            // Reset wrapper state
-            wrapper->conversation_tokens.clear();
-            wrapper->n_past = 0;
-            wrapper->conversation_started = false;
-            
-            LOGI("Conversation reset complete");
         }
+        wrapper->paging_target_ratio = std::min(std::max(target_ratio, 0.1f), 0.9f);
+        {
+            std::lock_guard<std::mutex> metrics_lock(wrapper->metrics_mutex);
+            wrapper->pager.swap(pager);
+        }
+        LOGI("KV paging: %s, %d KiB pages, target %.2f", path != nullptr && page_kb > 0 ? path : "off",
+             page_kb, wrapper->paging_target_ratio);
+        return true;
+    }
+
+    // Drop the chat's last n_turns turns (a turn is a prompt and its reply), e.g.
+    // to regenerate a reply or undo an exchange. Turns paged out by KV paging are
+    // read back from flash instead of being recomputed. Returns false if the chat
+    // cannot be rewound that far exactly, e.g. while the cascade's other model has
+    // answered turns this one has not prefilled yet.
+    __attribute__((visibility("default"))) __attribute__((used))
+    bool rewind_conversation(void* context_ptr, int n_turns) {
+        auto* wrapper = static_cast<llama_context_wrapper*>(context_ptr);
+        if (wrapper == nullptr) {
+            return false;
+        }
+
+        std::vector<llama_token> history;
+        bool ok = false;
+        {
+            std::lock_guard<std::mutex> lock(wrapper->mutex);
+            if (touch_context(wrapper) < 0.0 || wrapper->context == nullptr) {
+                return false;
+            }
+            ok = rewind_turns(wrapper, n_turns);
+            save_session_turn(wrapper);
+            history = wrapper->conversation_tokens;
+        }
+
+        // The escalation model starts over from the rewound chat, as in set_cascade()
+        llama_context_wrapper* escalation = wrapper->escalation.load();
+        if (ok && escalation != nullptr) {
+            reset_conversation(escalation);
+            std::lock_guard<std::mutex> lock(escalation->mutex);
+            escalation->pending_history = std::move(history);
+        }
+        LOGI("Rewound %d turns%s", n_turns, ok ? "" : " (incomplete)");
+        return ok;
+    }
+
+    // Persist the chat in an append-only log at `path`: every turn appends its new
+    // tokens and KV cells, written in the background, so a crash loses at most the
+    // turn in flight. Turns answered from a cache or by the cascade's other model
+    // are logged too. Rewriting the whole chat (after a rewind, or once the
+    // appends outgrow it) waits until the model has been idle for a moment; until
+    // then the log keeps the previous chat. If the log already holds a chat, it
+    // replaces the current one.
+    // With compress, cell data is deflated before it is written. A null path
+    // closes the log once everything queued is written. Returns the number of
+    // tokens restored, or -1 if the log cannot be opened or does not fit.
+    __attribute__((visibility("default"))) __attribute__((used))
+    int set_session_log(void* context_ptr, const char* path, bool compress) {
+        auto* wrapper = static_cast<llama_context_wrapper*>(context_ptr);
+        if (wrapper == nullptr) {
+            return -1;
+        }
+
+        std::unique_lock<std::mutex> lock(wrapper->mutex);
+        std::unique_ptr<session_log> log;
+        std::vector<session_log::record> records;
+        if (path != nullptr) {
+            log.reset(new session_log(path, compress));
+            if (!log->open(records)) {
+                return -1;
+            }
+        }
+
+        int restored = 0;
+        if (!records.empty()) {
+            if (touch_context(wrapper) < 0.0 || wrapper->context == nullptr) {
+                return -1;
+            }
+            const auto start = steady_clock::now();
+            restored = restore_session(wrapper, records);
+            if (restored < 0) {
+                return -1;
+            }
+            std::lock_guard<std::mutex> metrics_lock(wrapper->metrics_mutex);
+            wrapper->session_metrics.restored_tokens = restored;
+            wrapper->session_metrics.restore_ms = elapsed_ms(start);
+        } else {
+            wrapper->session_tokens.clear();
+        }
+        {
+            std::lock_guard<std::mutex> metrics_lock(wrapper->metrics_mutex);
+            wrapper->session.swap(log);
+        }
+        log.reset();  // Drains the previous log's queue
+        save_session_turn(wrapper, true);  // A chat that predates a new log is written as its base
+        if (wrapper->session && !wrapper->session_thread.joinable()) {
+            wrapper->session_thread = std::thread(session_base_loop, wrapper);
+        }
+        std::vector<llama_token> history = wrapper->conversation_tokens;
+        history.insert(history.end(), wrapper->pending_history.begin(), wrapper->pending_history.end());
+        lock.unlock();
+
+        // The escalation model starts over from the restored chat, as in set_cascade()
+        llama_context_wrapper* escalation = wrapper->escalation.load();
+        if (!records.empty() && escalation != nullptr) {
+            reset_conversation(escalation);
+            std::lock_guard<std::mutex> escalation_lock(escalation->mutex);
+            escalation->pending_history = history;
+        }
+        LOGI("Session log: %s, %d tokens restored", path != nullptr ? path : "closed", restored);
+        return restored;
+    }
+
+    // Serve this model to other processes of the same user on the Unix socket at
+    // socket_path ("@name" for the abstract namespace), so e.g. a keyboard
+    // extension shares the loaded weights and the request queue instead of
+    // loading its own copy. Prompts and replies travel through shared memory.
+    // Remote interactive requests continue the chat, like local ones. Replaces
+    // a running server; a null path stops it.
+    __attribute__((visibility("default"))) __attribute__((used))
+    bool start_model_server(void* context_ptr, const char* socket_path) {
+        auto* wrapper = static_cast<llama_context_wrapper*>(context_ptr);
+        if (wrapper == nullptr) {
+            return false;
+        }
+
+        // The old server goes first, as the new one may take over its socket
+        std::unique_ptr<model_server> server;
+        {
+            std::lock_guard<std::mutex> metrics_lock(wrapper->metrics_mutex);
+            wrapper->server.swap(server);
+        }
+        server.reset();  // Waits for requests it is running
+        if (socket_path != nullptr) {
+            auto handler = [wrapper](const std::string& prompt, const remote_options& remote,
+                                     const model_server::stream_fn& stream) {
+                request_options options;
+                options.priority = remote.priority;
+                options.max_tokens = remote.max_tokens > 0 ? remote.max_tokens : options.max_tokens;
+                options.max_ttft_ms = remote.max_ttft_ms;
+                options.max_total_ms = remote.max_total_ms;
+                options.greedy = remote.greedy;
+                options.seed = remote.seed;
+                const token_postprocessor::emit_fn sink = stream;
+                const char* response = run_prediction(wrapper, prompt.c_str(), options, &sink);
+                std::string reply(response);
+                delete[] response;
+                return reply;
+            };
+            server.reset(new model_server(socket_path, handler, 64 * 1024));
+            if (!server->start()) {
+                return false;
+            }
+        }
+
+        std::lock_guard<std::mutex> metrics_lock(wrapper->metrics_mutex);
+        wrapper->server = std::move(server);
+        return true;
+    }
+
+    __attribute__((visibility("default"))) __attribute__((used))
+    void stop_model_server(void* context_ptr) {
+        start_model_server(context_ptr, nullptr);
+    }
+
+    // Connect to a model served by start_model_server() in another process.
+    // Returns a client handle, or nullptr if nothing serves at socket_path.
+    __attribute__((visibility("default"))) __attribute__((used))
+    void* connect_model_server(const char* socket_path) {
+        if (socket_path == nullptr) {
+            return nullptr;
+        }
+        auto* client = new model_client(socket_path);
+        if (!client->connect()) {
+            delete client;
+            return nullptr;
+        }
+        return client;
+    }
+
+    // Run a request on the remote model and block until its reply is complete.
+    // Only the scalar options cross over; vocabulary constraints and logit biases
+    // are ignored.
+    __attribute__((visibility("default"))) __attribute__((used))
+    const char* remote_predict(void* client_ptr, const char* prompt, const request_options* options) {
+        auto* client = static_cast<model_client*>(client_ptr);
+        if (client == nullptr || prompt == nullptr) {
+            return string_to_char_ptr("Model server not connected");
+        }
+        const request_options local = options != nullptr ? *options : request_options();
+        remote_options remote;
+        remote.priority = local.priority;
+        remote.max_tokens = local.max_tokens;
+        remote.max_ttft_ms = local.max_ttft_ms;
+        remote.max_total_ms = local.max_total_ms;
+        remote.greedy = local.greedy;
+        remote.seed = local.seed;
+        std::string reply;
+        if (!client->predict(prompt, remote, reply)) {
+            return string_to_char_ptr("Model server unavailable");
+        }
+        return string_to_char_ptr(reply);
+    }
+
+    // Reply of the client's running remote request so far, for streaming
+    __attribute__((visibility("default"))) __attribute__((used))
+    const char* remote_partial_response(void* client_ptr) {
+        auto* client = static_cast<model_client*>(client_ptr);
+        return string_to_char_ptr(client != nullptr ? client->partial() : std::string());
+    }
+
+    // Make a running remote_predict on this client return now; the client
+    // accepts no further requests and only disconnect_model_server remains
+    __attribute__((visibility("default"))) __attribute__((used))
+    void cancel_remote_predict(void* client_ptr) {
+        auto* client = static_cast<model_client*>(client_ptr);
+        if (client != nullptr) {
+            client->cancel();
+        }
+    }
+
+    // Free a client; no remote_predict on it may still be running
+    __attribute__((visibility("default"))) __attribute__((used))
+    void disconnect_model_server(void* client_ptr) {
+        delete static_cast<model_client*>(client_ptr);
+    }
+
+    // Stop the local OpenAI-compatible endpoint once the requests it is running finish
+    __attribute__((visibility("default"))) __attribute__((used))
+    void stop_http_server(void* context_ptr) {
+        auto* wrapper = static_cast<llama_context_wrapper*>(context_ptr);
+        if (wrapper == nullptr) {
+            return;
+        }
+        std::unique_ptr<http_server> http;
+        {
+            std::lock_guard<std::mutex> metrics_lock(wrapper->metrics_mutex);
+            wrapper->http.swap(http);
+        }
+    }
+
+    // Serve an OpenAI-compatible API on 127.0.0.1:port (0 picks a free port) for
+    // local tools and load tests: /v1/chat/completions (with SSE streaming),
+    // /v1/embeddings, /v1/models and GET /metrics (the latency histograms as
+    // Prometheus text), on keep-alive connections. Requests run
+    // through this model's scheduler like any other. Every request must carry
+    // the endpoint's bearer token (get_http_server_token). Replaces a running
+    // endpoint, and its token; returns the bound port, or -1.
+    __attribute__((visibility("default"))) __attribute__((used))
+    int start_http_server(void* context_ptr, int port) {
+        auto* wrapper = static_cast<llama_context_wrapper*>(context_ptr);
+        if (wrapper == nullptr) {
+            return -1;
+        }
+        stop_http_server(context_ptr);  // Frees the port for the new endpoint
+
+        std::unique_ptr<http_server> http(new http_server(
+            port, [wrapper](http_server::exchange& ex) { serve_openai_request(wrapper, ex); }, 16));
+        if (!http->start()) {
+            return -1;
+        }
+        const int bound = http->port();
+        std::lock_guard<std::mutex> metrics_lock(wrapper->metrics_mutex);
+        wrapper->http = std::move(http);
+        return bound;
+    }
+
+    // Bearer token of the running HTTP endpoint, made anew each time it starts;
+    // empty when none runs. Free with free_string().
+    __attribute__((visibility("default"))) __attribute__((used))
+    const char* get_http_server_token(void* context_ptr) {
+        auto* wrapper = static_cast<llama_context_wrapper*>(context_ptr);
+        if (wrapper == nullptr) {
+            return string_to_char_ptr("");
+        }
+        std::lock_guard<std::mutex> metrics_lock(wrapper->metrics_mutex);
+        return string_to_char_ptr(wrapper->http ? wrapper->http->token() : std::string());
     }
-}
\ No newline at end of file
+
+    // Rolling TTFT, inter-token, prefill rate, queue wait and model load
+    // distributions of every model loaded in this process, labelled by model
+    // and config, as Prometheus text. Also served at /metrics by the HTTP
+    // endpoint. Free with free_string().
+    __attribute__((visibility("default"))) __attribute__((used))
+    const char* get_latency_metrics() {
+        return string_to_char_ptr(latency_histograms().prometheus_text());
+    }
+}
@@ -0,0 +1,217 @@
+#include "perf-counters.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <string>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <android/log.h>
+
+#define LOG_TAG "LlamaJNI"
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+namespace {
+
+struct event_spec {
+    const char* name;
+    uint32_t type;
+    uint64_t config;
+};
+
+constexpr uint64_t LLC_READ_MISS = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+
+// Indexed by perf_event_kind; cycles first so it leads the group when it can
+const event_spec EVENTS[PERF_EVENT_COUNT] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cache_references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+    {"cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"llc_read_misses", PERF_TYPE_HW_CACHE, LLC_READ_MISS},
+    {"stalled_cycles_backend", PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND},
+};
+
+int open_event(const event_spec& spec, int tid, int group_fd, bool inherit) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = spec.type;
+    attr.config = spec.config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.inherit = inherit ? 1 : 0;  // Threads started later count into this group
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, tid, -1, group_fd, PERF_FLAG_FD_CLOEXEC));
+}
+
+int current_tid() {
+    return static_cast<int>(syscall(SYS_gettid));
+}
+
+bool thread_alive(int tid) {
+    return access(("/proc/self/task/" + std::to_string(tid)).c_str(), F_OK) == 0;
+}
+
+} // namespace
+
+const char* perf_event_name(perf_event_kind kind) {
+    return kind >= 0 && kind < PERF_EVENT_COUNT ? EVENTS[kind].name : "unknown";
+}
+
+perf_sample perf_sample::since(const perf_sample& earlier) const {
+    perf_sample delta;
+    for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+        delta.present[i] = present[i] && earlier.present[i];
+        // A thread that exited between the samples takes its counts with it
+        delta.values[i] = values[i] > earlier.values[i] ? values[i] - earlier.values[i] : 0;
+    }
+    delta.multiplexed = multiplexed || earlier.multiplexed;
+    return delta;
+}
+
+perf_counters::~perf_counters() {
+    for (group& g : groups) {
+        close_group(g);
+    }
+}
+
+bool perf_counters::open_group(int tid, bool inherit, group& g) {
+    g.tid = tid;
+    std::fill(std::begin(g.fds), std::end(g.fds), -1);
+    for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+        const int fd = open_event(EVENTS[i], tid, g.leader, inherit);
+        if (fd < 0) {
+            // The first refusal of the leader explains why nothing can be counted
+            if (g.leader < 0 && last_error.empty()) {
+                last_error = errno == EACCES || errno == EPERM
+                                 ? "perf events not permitted (perf_event_paranoid / security.perf_harden)"
+                                 : std::string("perf_event_open: ") + std::strerror(errno);
+            }
+            continue;
+        }
+        g.fds[i] = fd;
+        g.n_open++;
+        if (g.leader < 0) {
+            g.leader = fd;
+        }
+    }
+    if (g.leader >= 0 && accepted.empty()) {
+        for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+            if (g.fds[i] >= 0) {
+                accepted.push_back(static_cast<perf_event_kind>(i));
+            }
+        }
+    }
+    return g.leader >= 0;
+}
+
+void perf_counters::close_group(group& g) {
+    for (int& fd : g.fds) {
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    g.leader = -1;
+}
+
+void perf_counters::close_tid(int tid) {
+    for (auto it = groups.begin(); it != groups.end(); ++it) {
+        if (it->tid == tid) {
+            close_group(*it);
+            groups.erase(it);
+            return;
+        }
+    }
+}
+
+bool perf_counters::probe() {
+    group g;
+    const bool ok = open_group(current_tid(), false, g);
+    close_group(g);
+    if (!ok) {
+        LOGE("Perf counters unavailable: %s", last_error.c_str());
+    }
+    return ok;
+}
+
+bool perf_counters::attach_current_thread(bool inherit) {
+    const int tid = current_tid();
+    if (std::any_of(groups.begin(), groups.end(), [tid](const group& g) { return g.tid == tid; })) {
+        return true;
+    }
+
+    // The spawner exits at once but its group counts the threads it started
+    for (auto it = groups.begin(); it != groups.end();) {
+        if (it->tid != spawner_tid && !thread_alive(it->tid)) {
+            close_group(*it);
+            it = groups.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    group g;
+    if (!open_group(tid, inherit, g)) {
+        close_group(g);
+        LOGE("Perf counters unavailable: %s", last_error.c_str());
+        return false;
+    }
+    groups.push_back(g);
+    last_error.clear();
+    LOGI("Perf counters: thread %d attached, %zu groups, %d events", tid, groups.size(), g.n_open);
+    return true;
+}
+
+bool perf_counters::count_threads_started_by(const std::function<void()>& spawn) {
+    close_tid(spawner_tid);
+    spawner_tid = 0;
+    bool counted = false;
+    std::thread spawner([&] {
+        group g;
+        const int tid = current_tid();
+        counted = open_group(tid, true, g);
+        if (counted) {
+            groups.push_back(g);
+            spawner_tid = tid;
+        } else {
+            close_group(g);
+        }
+        spawn();
+    });
+    spawner.join();
+    return counted;
+}
+
+perf_sample perf_counters::read() const {
+    perf_sample sample;
+    // nr, time_enabled, time_running, then one value per open event in open order
+    uint64_t buf[3 + PERF_EVENT_COUNT];
+    for (const group& g : groups) {
+        const ssize_t n = ::read(g.leader, buf, sizeof(buf));
+        if (n < static_cast<ssize_t>(3 * sizeof(uint64_t)) || buf[0] != static_cast<uint64_t>(g.n_open)) {
+            continue;
+        }
+        const uint64_t enabled = buf[1];
+        const uint64_t running = buf[2];
+        if (running == 0) {
+            sample.multiplexed = sample.multiplexed || enabled > 0;
+            continue;
+        }
+        const double scale = static_cast<double>(enabled) / running;
+        sample.multiplexed = sample.multiplexed || running < enabled;
+        int slot = 0;
+        for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+            if (g.fds[i] < 0) {
+                continue;
+            }
+            sample.values[i] += static_cast<uint64_t>(buf[3 + slot] * scale);
+            sample.present[i] = true;
+            slot++;
+        }
+    }
+    return sample;
+}
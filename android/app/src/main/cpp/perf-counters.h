@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Hardware events counted by perf_counters. Not every PMU has all of them;
+// missing ones are reported as absent rather than zero.
+enum perf_event_kind {
+    PERF_CYCLES = 0,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_REFERENCES,
+    PERF_CACHE_MISSES,
+    PERF_LLC_READ_MISSES,   // Last-level cache read misses, i.e. DRAM reads
+    PERF_STALLED_BACKEND,   // Cycles the backend could not retire, mostly waiting on memory
+    PERF_EVENT_COUNT
+};
+
+const char* perf_event_name(perf_event_kind kind);
+
+// Counter totals summed over the counted threads, scaled for multiplexing
+struct perf_sample {
+    uint64_t values[PERF_EVENT_COUNT] = {};
+    bool present[PERF_EVENT_COUNT] = {};
+    bool multiplexed = false;  // Some thread's group was not on the PMU the whole time
+
+    uint64_t get(perf_event_kind kind) const { return values[kind]; }
+    bool has(perf_event_kind kind) const { return present[kind]; }
+
+    // Counts between an earlier sample and this one
+    perf_sample since(const perf_sample& earlier) const;
+};
+
+// Hardware counters of the threads that decode, via perf_event_open(). ggml
+// runs a phase on worker threads: either ones the decoding thread starts for
+// each graph, or a threadpool that lives across requests. A counter group on
+// the decoding thread whose counters its new threads inherit covers the
+// first; the threadpool is created under a group of its own. The groups are
+// summed on read, and the app's other threads are never counted. User-space
+// events only, so perf_event_paranoid <= 2 is enough; on Android that needs
+// `setprop security.perf_harden 0`. When events are not permitted attaching
+// fails and error() says why, and callers carry on without counters.
+class perf_counters {
+public:
+    perf_counters() = default;
+    ~perf_counters();
+
+    perf_counters(const perf_counters&) = delete;
+    perf_counters& operator=(const perf_counters&) = delete;
+
+    // Open and close a group on the calling thread: whether this device
+    // permits the events at all, and which ones
+    bool probe();
+
+    // Count the calling thread and, with inherit, the threads it starts from
+    // now on. A thread is attached once: later calls only look it up. Groups of
+    // threads that exited are closed when a new thread is attached. False if
+    // the thread cannot be counted.
+    bool attach_current_thread(bool inherit);
+
+    // Run spawn, which starts long-lived threads such as a ggml threadpool, on
+    // a short-lived thread so that exactly the threads it starts are counted.
+    // They replace the threads of the previous call. False if they are not counted.
+    bool count_threads_started_by(const std::function<void()>& spawn);
+
+    perf_sample read() const;
+
+    // Counter groups open: attached threads, plus one for spawned threads
+    int threads() const { return static_cast<int>(groups.size()); }
+    const std::string& error() const { return last_error; }
+    // Events the PMU accepted on the first thread, for reporting
+    const std::vector<perf_event_kind>& events() const { return accepted; }
+
+private:
+    struct group {
+        int tid = 0;
+        int fds[PERF_EVENT_COUNT];  // -1 where the event could not be opened
+        int leader = -1;
+        int n_open = 0;
+    };
+
+    std::vector<group> groups;
+    int spawner_tid = 0;  // Group whose inherited counters cover the spawned threads
+    std::vector<perf_event_kind> accepted;
+    std::string last_error;
+
+    bool open_group(int tid, bool inherit, group& g);
+    void close_tid(int tid);
+    static void close_group(group& g);
+};
@@ -0,0 +1,199 @@
+#include "request-scheduler.h"
+
+// ---- shared_result ----
+
+void shared_result::publish(const std::string& value) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        text = value;
+        ready = true;
+    }
+    cv.notify_all();
+}
+
+std::string shared_result::wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&] { return ready; });
+    return text;
+}
+
+// ---- request_scheduler ----
+
+int request_scheduler::clamp_priority(int priority) {
+    if (priority < 0) {
+        return 0;
+    }
+    return priority >= N_CLASSES ? N_CLASSES - 1 : priority;
+}
+
+void request_scheduler::set_limits(const queue_limits& new_limits) {
+    std::lock_guard<std::mutex> lock(mutex);
+    limits = new_limits;
+}
+
+queue_limits request_scheduler::get_limits() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return limits;
+}
+
+bool request_scheduler::queue_full_locked(double extra_cost_ms) const {
+    if (limits.max_depth > 0 && counters.depth >= limits.max_depth) {
+        return true;
+    }
+    return limits.max_cost_ms > 0.0 && counters.depth > 0 &&
+           counters.queued_cost_ms + extra_cost_ms > limits.max_cost_ms;
+}
+
+bool request_scheduler::replace_latest_locked(int priority) {
+    // Prefer evicting our own class, then anything less important
+    for (int p = priority; p < N_CLASSES; p++) {
+        auto& queue = queues[p];
+        for (auto it = queue.rbegin(); it != queue.rend(); ++it) {
+            if (it->resumed) {
+                continue;
+            }
+            cancelled.insert(it->ticket);
+            counters.depth--;
+            counters.queued_cost_ms -= it->cost_ms;
+            waiting[p]--;
+            queue.erase(std::next(it).base());
+            counters.replaced++;
+            return true;
+        }
+    }
+    return false;
+}
+
+admission request_scheduler::admit(int priority, double cost_ms, const std::string& key) {
+    admission result;
+    result.priority = clamp_priority(priority);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (queue_full_locked(cost_ms)) {
+        bool admitted = false;
+        // Requests without a key (such as scoring) never share a result
+        if (limits.policy == ADMISSION_COALESCE && !key.empty()) {
+            for (const auto& queue : queues) {
+                for (const auto& e : queue) {
+                    if (!e.resumed && e.key == key) {
+                        result.status = admission::COALESCED;
+                        result.result = e.result;
+                        counters.coalesced++;
+                        return result;
+                    }
+                }
+            }
+        } else if (limits.policy == ADMISSION_REPLACE_LATEST) {
+            admitted = replace_latest_locked(result.priority);
+            if (admitted) {
+                cv.notify_all();  // Wake the replaced request so it can return
+            }
+        }
+        if (!admitted) {
+            result.status = admission::REJECTED;
+            counters.rejected++;
+            return result;
+        }
+    }
+
+    result.status = admission::ADMITTED;
+    result.ticket = next_ticket++;
+    result.result = std::make_shared<shared_result>();
+    queues[result.priority].push_back({result.ticket, cost_ms, key, false, result.result});
+    waiting[result.priority]++;
+    counters.depth++;
+    counters.queued_cost_ms += cost_ms;
+    if (counters.depth > counters.max_depth_seen) {
+        counters.max_depth_seen = counters.depth;
+    }
+    return result;
+}
+
+bool request_scheduler::wait_locked(std::unique_lock<std::mutex>& lock, int priority, uint64_t ticket) {
+    cv.wait(lock, [&] {
+        if (cancelled.count(ticket) > 0) {
+            return true;
+        }
+        if (busy || queues[priority].empty() || queues[priority].front().ticket != ticket) {
+            return false;
+        }
+        for (int p = 0; p < priority; p++) {
+            if (!queues[p].empty()) {
+                return false;
+            }
+        }
+        return true;
+    });
+
+    if (cancelled.erase(ticket) > 0) {
+        return false;
+    }
+
+    const entry& front = queues[priority].front();
+    if (!front.resumed) {
+        counters.depth--;
+        counters.queued_cost_ms -= front.cost_ms;
+    }
+    queues[priority].pop_front();
+    waiting[priority]--;
+    busy = true;
+    running_priority = priority;
+    return true;
+}
+
+bool request_scheduler::wait_turn(const admission& ticket, double& wait_ms) {
+    const auto start = std::chrono::steady_clock::now();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    const bool granted = wait_locked(lock, ticket.priority, ticket.ticket);
+
+    wait_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (granted) {
+        counters.total_wait_ms[ticket.priority] += wait_ms;
+    }
+    if (counters.depth == 0) {
+        counters.queued_cost_ms = 0.0;  // Drop accumulated rounding error
+    }
+    return granted;
+}
+
+void request_scheduler::release() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        busy = false;
+        counters.completed[running_priority]++;
+    }
+    cv.notify_all();
+}
+
+bool request_scheduler::should_yield(int priority) const {
+    priority = clamp_priority(priority);
+    for (int p = 0; p < priority; p++) {
+        if (waiting[p].load(std::memory_order_relaxed) > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+double request_scheduler::yield(int priority) {
+    priority = clamp_priority(priority);
+    const auto start = std::chrono::steady_clock::now();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    busy = false;
+    counters.preemptions++;
+
+    const uint64_t ticket = next_ticket++;
+    queues[priority].push_front({ticket, 0.0, std::string(), true, nullptr});
+    waiting[priority]++;
+    cv.notify_all();
+
+    wait_locked(lock, priority, ticket);  // Resumed entries are never cancelled
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+request_scheduler::stats request_scheduler::snapshot() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
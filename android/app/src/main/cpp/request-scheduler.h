@@ -0,0 +1,142 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+
+// What to do with a new request when the queue is full
+enum admission_policy : int32_t {
+    ADMISSION_REJECT = 0,          // Fail the new request immediately
+    ADMISSION_COALESCE = 1,        // Share the result of an identical queued request, else reject
+    ADMISSION_REPLACE_LATEST = 2,  // Cancel the most recently queued request and take its place
+};
+
+// Bounds on the waiting queue. A max_depth or max_cost_ms of 0 means unbounded.
+struct queue_limits {
+    int max_depth = 8;
+    double max_cost_ms = 0.0;
+    admission_policy policy = ADMISSION_REJECT;
+};
+
+// Result handed from a request to the identical requests coalesced onto it
+struct shared_result {
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool ready = false;
+    std::string text;
+
+    void publish(const std::string& value);
+    std::string wait();
+};
+
+// Outcome of request_scheduler::admit()
+struct admission {
+    enum status_t { ADMITTED, REJECTED, COALESCED };
+
+    status_t status = REJECTED;
+    int priority = 0;
+    uint64_t ticket = 0;
+    std::shared_ptr<shared_result> result;  // COALESCED: wait on it; ADMITTED: publish to it
+};
+
+// Grants the context to one request at a time. Lower priority values win:
+// a waiting interactive request is served before any background request, and a
+// running background request is expected to poll should_yield() between decode
+// steps and hand the context over with yield(). A yielded request goes back to
+// the front of its class so it resumes before newer requests of the same class.
+//
+// Admission is bounded: admit() enqueues a request with its estimated cost, or
+// applies the queue_limits policy when the queue is already full.
+class request_scheduler {
+public:
+    static constexpr int N_CLASSES = 2;
+
+    struct stats {
+        int64_t completed[N_CLASSES] = {0, 0};
+        int64_t preemptions = 0;
+        double total_wait_ms[N_CLASSES] = {0.0, 0.0};
+        int64_t rejected = 0;
+        int64_t coalesced = 0;
+        int64_t replaced = 0;
+        int depth = 0;               // Requests currently waiting (not counting preempted ones)
+        int max_depth_seen = 0;
+        double queued_cost_ms = 0.0; // Estimated work waiting in the queue
+    };
+
+    void set_limits(const queue_limits& limits);
+    queue_limits get_limits() const;
+
+    // Enqueue a request or apply the admission policy. key identifies identical
+    // requests for coalescing, an empty key opts out of it; cost_ms is the
+    // estimated service time.
+    admission admit(int priority, double cost_ms, const std::string& key);
+
+    // Block until an admitted request may run. Returns false if it was replaced
+    // while waiting; wait_ms receives the time spent queued.
+    bool wait_turn(const admission& ticket, double& wait_ms);
+    void release();
+
+    // Cheap enough to call on every decode step
+    bool should_yield(int priority) const;
+
+    // Let higher-priority requests run, then resume; returns the time spent preempted in ms
+    double yield(int priority);
+
+    stats snapshot() const;
+
+private:
+    struct entry {
+        uint64_t ticket;
+        double cost_ms;
+        std::string key;
+        bool resumed;  // Preempted request waiting to continue; never replaced or counted
+        std::shared_ptr<shared_result> result;
+    };
+
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<entry> queues[N_CLASSES];
+    std::atomic<int> waiting[N_CLASSES] = {{0}, {0}};
+    std::unordered_set<uint64_t> cancelled;
+    uint64_t next_ticket = 0;
+    bool busy = false;
+    int running_priority = 0;
+    queue_limits limits;
+    stats counters;
+
+    static int clamp_priority(int priority);
+    bool queue_full_locked(double extra_cost_ms) const;
+    bool replace_latest_locked(int priority);
+    bool wait_locked(std::unique_lock<std::mutex>& lock, int priority, uint64_t ticket);
+};
+
+// RAII helper: waits for an admitted request's turn and releases the scheduler when done
+class scheduled_request {
+public:
+    scheduled_request(request_scheduler& scheduler, const admission& ticket)
+        : scheduler(scheduler) {
+        granted = scheduler.wait_turn(ticket, wait_ms);
+    }
+    ~scheduled_request() {
+        if (granted) {
+            scheduler.release();
+        }
+    }
+
+    scheduled_request(const scheduled_request&) = delete;
+    scheduled_request& operator=(const scheduled_request&) = delete;
+
+    bool running() const { return granted; }
+    double queue_wait_ms() const { return wait_ms; }
+
+private:
+    request_scheduler& scheduler;
+    double wait_ms = 0.0;
+    bool granted = false;
+};
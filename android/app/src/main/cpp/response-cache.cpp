@@ -0,0 +1,295 @@
+#include "response-cache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <iterator>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <android/log.h>
+
+#define LOG_TAG "LlamaJNI"
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+namespace {
+
+constexpr uint32_t RECORD_MAGIC = 0x31435252;  // "RRC1"
+
+struct record_header {
+    uint32_t magic;
+    uint32_t n_tokens;
+    uint64_t key;
+    uint64_t checksum;  // Of the tokens
+};
+
+// Far beyond any reply; a larger count means a corrupt header
+constexpr uint32_t MAX_RECORD_TOKENS = 1 << 20;
+
+// Below this much dead space the file is never rewritten
+constexpr uint64_t MIN_COMPACT_BYTES = 64 * 1024;
+
+uint64_t record_bytes(uint32_t n_tokens) {
+    return sizeof(record_header) + static_cast<uint64_t>(n_tokens) * sizeof(llama_token);
+}
+
+uint64_t tokens_checksum(const std::vector<llama_token>& tokens) {
+    return fnv1a_hash().add(tokens.data(), tokens.size() * sizeof(llama_token)).value();
+}
+
+bool read_fully(int fd, void* buf, size_t size, uint64_t offset) {
+    auto* p = static_cast<char*>(buf);
+    while (size > 0) {
+        const ssize_t n = pread(fd, p, size, static_cast<off_t>(offset));
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+bool write_fully(int fd, const void* buf, size_t size, uint64_t offset) {
+    const auto* p = static_cast<const char*>(buf);
+    while (size > 0) {
+        const ssize_t n = pwrite(fd, p, size, static_cast<off_t>(offset));
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+// Read and verify the record at offset
+bool read_record(int fd, uint64_t offset, record_header& header, std::vector<llama_token>& tokens) {
+    if (!read_fully(fd, &header, sizeof(header), offset) || header.magic != RECORD_MAGIC ||
+        header.n_tokens > MAX_RECORD_TOKENS) {
+        return false;
+    }
+    tokens.resize(header.n_tokens);
+    return read_fully(fd, tokens.data(), tokens.size() * sizeof(llama_token), offset + sizeof(header)) &&
+           tokens_checksum(tokens) == header.checksum;
+}
+
+} // namespace
+
+fnv1a_hash& fnv1a_hash::add(const void* data, size_t size) {
+    const auto* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return *this;
+}
+
+uint64_t model_fingerprint(const std::string& path) {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return 0;
+    }
+
+    constexpr size_t SPAN = 64 * 1024;
+    const uint64_t size = static_cast<uint64_t>(st.st_size);
+    std::vector<char> buf(SPAN);
+    fnv1a_hash hash;
+    hash.add_value(size);
+    const uint64_t offsets[] = {0, size > SPAN ? size - SPAN : 0};
+    for (uint64_t offset : offsets) {
+        const size_t n = static_cast<size_t>(std::min<uint64_t>(SPAN, size));
+        if (!read_fully(fd, buf.data(), n, offset)) {
+            ::close(fd);
+            return 0;
+        }
+        hash.add(buf.data(), n);
+    }
+    ::close(fd);
+    return hash.value();
+}
+
+response_cache::response_cache(std::string path, size_t max_bytes)
+    : path(std::move(path)), max_bytes(max_bytes) {}
+
+response_cache::~response_cache() {
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+bool response_cache::open() {
+    std::lock_guard<std::mutex> lock(mutex);
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        LOGE("Response cache: cannot open %s", path.c_str());
+        return false;
+    }
+
+    // Later records for a key supersede earlier ones; the last written is the most recent
+    uint64_t offset = 0;
+    record_header header;
+    std::vector<llama_token> tokens;
+    while (read_record(fd, offset, header, tokens)) {
+        auto found = index.find(header.key);
+        if (found != index.end()) {
+            counters.live_bytes -= record_bytes(found->second->n_tokens);
+            lru.erase(found->second);
+        }
+        lru.push_front({header.key, offset, header.n_tokens});
+        index[header.key] = lru.begin();
+        counters.live_bytes += record_bytes(header.n_tokens);
+        offset += record_bytes(header.n_tokens);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && static_cast<uint64_t>(st.st_size) > offset) {
+        LOGI("Response cache: dropping %llu bytes of torn record",
+             static_cast<unsigned long long>(st.st_size - offset));
+        if (ftruncate(fd, static_cast<off_t>(offset)) != 0) {
+            LOGE("Response cache: cannot truncate %s", path.c_str());
+        }
+    }
+    file_end = offset;
+    counters.file_bytes = offset;
+    counters.entries = static_cast<int>(index.size());
+
+    while (counters.live_bytes > max_bytes && !lru.empty()) {
+        forget_locked(std::prev(lru.end()));
+        counters.evictions++;
+    }
+    LOGI("Response cache: %d entries, %zu bytes in %s", counters.entries, counters.live_bytes, path.c_str());
+    return true;
+}
+
+bool response_cache::lookup(uint64_t key, std::vector<llama_token>& tokens) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = index.find(key);
+    if (fd < 0 || found == index.end()) {
+        counters.misses++;
+        return false;
+    }
+
+    record_header header;
+    if (!read_record(fd, found->second->offset, header, tokens) || header.key != key) {
+        LOGE("Response cache: corrupt record at offset %llu",
+             static_cast<unsigned long long>(found->second->offset));
+        forget_locked(found->second);
+        tokens.clear();
+        counters.misses++;
+        return false;
+    }
+    lru.splice(lru.begin(), lru, found->second);
+    counters.hits++;
+    return true;
+}
+
+void response_cache::store(uint64_t key, const std::vector<llama_token>& tokens) {
+    std::lock_guard<std::mutex> lock(mutex);
+    const uint64_t size = record_bytes(static_cast<uint32_t>(tokens.size()));
+    if (fd < 0 || size > max_bytes) {
+        return;
+    }
+    auto found = index.find(key);
+    if (found != index.end()) {
+        lru.splice(lru.begin(), lru, found->second);
+        return;
+    }
+
+    const record_header header = {RECORD_MAGIC, static_cast<uint32_t>(tokens.size()), key, tokens_checksum(tokens)};
+    if (!write_fully(fd, &header, sizeof(header), file_end) ||
+        !write_fully(fd, tokens.data(), tokens.size() * sizeof(llama_token), file_end + sizeof(header))) {
+        LOGE("Response cache: write to %s failed", path.c_str());
+        if (ftruncate(fd, static_cast<off_t>(file_end)) != 0) {
+            LOGE("Response cache: cannot truncate %s", path.c_str());
+        }
+        return;
+    }
+    lru.push_front({key, file_end, header.n_tokens});
+    index[key] = lru.begin();
+    file_end += size;
+    counters.file_bytes = file_end;
+    counters.live_bytes += size;
+    counters.entries = static_cast<int>(index.size());
+    counters.stores++;
+
+    while (counters.live_bytes > max_bytes && !lru.empty()) {
+        forget_locked(std::prev(lru.end()));
+        counters.evictions++;
+    }
+    const uint64_t dead_bytes = file_end - counters.live_bytes;
+    if (dead_bytes > MIN_COMPACT_BYTES && dead_bytes > counters.live_bytes) {
+        compact_locked();
+    }
+}
+
+void response_cache::note_bypass() {
+    std::lock_guard<std::mutex> lock(mutex);
+    counters.bypassed++;
+}
+
+response_cache::stats response_cache::snapshot() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
+
+void response_cache::forget_locked(std::list<entry>::iterator it) {
+    counters.live_bytes -= record_bytes(it->n_tokens);
+    index.erase(it->key);
+    lru.erase(it);
+    counters.entries = static_cast<int>(index.size());
+}
+
+// Rewrite the file with only the live records, least recently used first, so that
+// reopening it restores the current LRU order
+void response_cache::compact_locked() {
+    const std::string tmp_path = path + ".tmp";
+    const int tmp_fd = ::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (tmp_fd < 0) {
+        LOGE("Response cache: cannot create %s", tmp_path.c_str());
+        return;
+    }
+
+    uint64_t offset = 0;
+    std::vector<uint64_t> new_offsets;
+    new_offsets.reserve(lru.size());
+    record_header header;
+    std::vector<llama_token> tokens;
+    for (auto it = lru.rbegin(); it != lru.rend(); ++it) {
+        if (!read_record(fd, it->offset, header, tokens) ||
+            !write_fully(tmp_fd, &header, sizeof(header), offset) ||
+            !write_fully(tmp_fd, tokens.data(), tokens.size() * sizeof(llama_token), offset + sizeof(header))) {
+            LOGE("Response cache: compaction of %s failed", path.c_str());
+            ::close(tmp_fd);
+            unlink(tmp_path.c_str());
+            return;
+        }
+        new_offsets.push_back(offset);
+        offset += record_bytes(header.n_tokens);
+    }
+    if (fsync(tmp_fd) != 0 || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        LOGE("Response cache: cannot replace %s", path.c_str());
+        ::close(tmp_fd);
+        unlink(tmp_path.c_str());
+        return;
+    }
+
+    ::close(fd);
+    fd = tmp_fd;
+    size_t i = 0;
+    for (auto it = lru.rbegin(); it != lru.rend(); ++it) {
+        it->offset = new_offsets[i++];
+    }
+    LOGI("Response cache: compacted %llu -> %llu bytes", static_cast<unsigned long long>(file_end),
+         static_cast<unsigned long long>(offset));
+    file_end = offset;
+    counters.file_bytes = offset;
+    counters.compactions++;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "llama.h"
+
+// 64-bit FNV-1a, fed field by field to build response cache keys
+class fnv1a_hash {
+public:
+    fnv1a_hash& add(const void* data, size_t size);
+
+    template <typename T>
+    fnv1a_hash& add_value(const T& value) {
+        return add(&value, sizeof(value));
+    }
+
+    fnv1a_hash& add_string(const std::string& s) {
+        add_value(s.size());
+        return add(s.data(), s.size());
+    }
+
+    uint64_t value() const { return hash; }
+
+private:
+    uint64_t hash = 14695981039346656037ull;
+};
+
+// Identifies a model file by its size and the first and last 64 KiB, which hold
+// the GGUF metadata and the tail of the tensor data. 0 if the file cannot be read.
+uint64_t model_fingerprint(const std::string& path);
+
+// Persistent cache of generated replies for requests whose output is fully
+// determined by their key (greedy or freshly seeded sampling). Replies are kept
+// as token ids in an append-only file: each record is a small header followed by
+// the tokens. An in-memory index maps keys to records in LRU order; once the
+// live records exceed max_bytes the least recently used ones are dropped, and
+// the file is rewritten without them when dead records outweigh live ones.
+// Recency is tracked in memory, so after a restart entries age in the order
+// they were written. Thread-safe.
+class response_cache {
+public:
+    struct stats {
+        int entries = 0;
+        size_t live_bytes = 0;
+        size_t file_bytes = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t bypassed = 0;  // Requests that could not be cached (stochastic sampling)
+        uint64_t stores = 0;
+        uint64_t evictions = 0;
+        uint64_t compactions = 0;
+    };
+
+    response_cache(std::string path, size_t max_bytes);
+    ~response_cache();
+
+    response_cache(const response_cache&) = delete;
+    response_cache& operator=(const response_cache&) = delete;
+
+    // Open (or create) the file and index its records. A torn record left by a
+    // crash is cut off. Returns false if the file cannot be opened.
+    bool open();
+
+    bool lookup(uint64_t key, std::vector<llama_token>& tokens);
+    void store(uint64_t key, const std::vector<llama_token>& tokens);
+    void note_bypass();
+
+    stats snapshot() const;
+
+private:
+    struct entry {
+        uint64_t key;
+        uint64_t offset;  // Of the record header
+        uint32_t n_tokens;
+    };
+
+    const std::string path;
+    const size_t max_bytes;
+
+    mutable std::mutex mutex;
+    int fd = -1;
+    uint64_t file_end = 0;
+    std::list<entry> lru;  // Most recently used first
+    std::unordered_map<uint64_t, std::list<entry>::iterator> index;
+    stats counters;
+
+    void forget_locked(std::list<entry>::iterator it);
+    void compact_locked();
+};
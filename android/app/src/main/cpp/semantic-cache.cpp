@@ -0,0 +1,163 @@
+#include "semantic-cache.h"
+
+#include <algorithm>
+#include <cctype>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define SEMANTIC_CACHE_NEON 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SEMANTIC_CACHE_X86 1
+#endif
+
+namespace {
+
+float dot_scalar(const float* a, const float* b, int32_t begin, int32_t n, float sum) {
+    for (int32_t i = begin; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+#if SEMANTIC_CACHE_NEON
+
+float dot_neon(const float* a, const float* b, int32_t n) {
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    int32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    return dot_scalar(a, b, i, n, vaddvq_f32(vaddq_f32(acc0, acc1)));
+}
+
+#elif SEMANTIC_CACHE_X86
+
+bool cpu_has_avx2_fma() {
+    static const bool has = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return has;
+}
+
+__attribute__((target("avx2,fma")))
+float dot_avx2(const float* a, const float* b, int32_t n) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int32_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    const __m256 acc = _mm256_add_ps(acc0, acc1);
+    const __m128 half = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    const __m128 pair = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    const __m128 one = _mm_add_ss(pair, _mm_shuffle_ps(pair, pair, 1));
+    return dot_scalar(a, b, i, n, _mm_cvtss_f32(one));
+}
+
+#endif
+
+} // namespace
+
+std::string normalize_prompt(const std::string& text) {
+    std::string out;
+    out.reserve(text.size());
+    bool pending_space = false;
+    for (unsigned char c : text) {
+        if (std::isspace(c)) {
+            pending_space = !out.empty();
+        } else if (c >= 0x80 || std::isalnum(c)) {
+            if (pending_space) {
+                out += ' ';
+                pending_space = false;
+            }
+            out += static_cast<char>(std::tolower(c));  // Bytes of UTF-8 sequences are kept as they are
+        }
+    }
+    return out;
+}
+
+float dot_product(const float* a, const float* b, int32_t n) {
+#if SEMANTIC_CACHE_NEON
+    return dot_neon(a, b, n);
+#elif SEMANTIC_CACHE_X86
+    if (cpu_has_avx2_fma()) {
+        return dot_avx2(a, b, n);
+    }
+#endif
+    return dot_scalar(a, b, 0, n, 0.0f);
+}
+
+semantic_cache::semantic_cache(int32_t n_embd, int max_entries, float threshold)
+    : n_embd(n_embd), max_entries(max_entries) {
+    counters.threshold = threshold;
+    matrix.reserve(static_cast<size_t>(max_entries) * n_embd);
+}
+
+bool semantic_cache::lookup(uint64_t partition, const std::vector<float>& embedding, std::vector<llama_token>& reply,
+                            float& similarity) {
+    std::lock_guard<std::mutex> lock(mutex);
+    int best = -1;
+    float best_similarity = -1.0f;
+    if (static_cast<int32_t>(embedding.size()) == n_embd) {
+        for (int i = 0; i < counters.entries; i++) {
+            if (partitions[i] != partition) {
+                continue;
+            }
+            const float s = dot_product(matrix.data() + static_cast<size_t>(i) * n_embd, embedding.data(), n_embd);
+            if (s > best_similarity) {
+                best_similarity = s;
+                best = i;
+            }
+        }
+    }
+    similarity = best_similarity;
+    counters.last_similarity = best_similarity;
+    if (best < 0 || best_similarity < counters.threshold) {
+        counters.misses++;
+        return false;
+    }
+    reply = replies[best];
+    last_used[best] = ++clock;
+    counters.hits++;
+    return true;
+}
+
+void semantic_cache::store(uint64_t partition, const std::vector<float>& embedding,
+                           const std::vector<llama_token>& reply) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (static_cast<int32_t>(embedding.size()) != n_embd || max_entries <= 0) {
+        return;
+    }
+    int slot = counters.entries;
+    if (counters.entries < max_entries) {
+        matrix.insert(matrix.end(), embedding.begin(), embedding.end());
+        replies.push_back(reply);
+        partitions.push_back(partition);
+        last_used.push_back(0);
+        counters.entries++;
+    } else {
+        slot = static_cast<int>(std::min_element(last_used.begin(), last_used.end()) - last_used.begin());
+        std::copy(embedding.begin(), embedding.end(), matrix.begin() + static_cast<size_t>(slot) * n_embd);
+        replies[slot] = reply;
+        partitions[slot] = partition;
+    }
+    last_used[slot] = ++clock;
+    counters.stores++;
+}
+
+void semantic_cache::set_threshold(float threshold) {
+    std::lock_guard<std::mutex> lock(mutex);
+    counters.threshold = threshold;
+}
+
+void semantic_cache::add_embed_ms(double ms) {
+    std::lock_guard<std::mutex> lock(mutex);
+    counters.total_embed_ms += ms;
+}
+
+semantic_cache::stats semantic_cache::snapshot() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
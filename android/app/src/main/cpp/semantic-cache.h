@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "llama.h"
+
+// Lowercase ASCII letters, drop punctuation and collapse whitespace, so that
+// "What's the capital of France?" and "whats the capital of france" embed alike
+std::string normalize_prompt(const std::string& text);
+
+// Dot product of two float vectors (NEON / AVX2 where available)
+float dot_product(const float* a, const float* b, int32_t n);
+
+// In-memory cache of replies keyed by prompt embeddings. Embeddings are
+// L2-normalized and kept in one contiguous matrix, so a lookup is a single SIMD
+// pass of dot products (cosine similarities) over every entry; with a few hundred
+// entries this costs far less than the embedding pass itself. Each entry belongs
+// to a partition, a hash of the settings its reply was generated with, and only
+// matches lookups in the same partition. When full, the least recently used
+// entry is overwritten. Thread-safe.
+class semantic_cache {
+public:
+    struct stats {
+        int entries = 0;
+        float threshold = 0.0f;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t stores = 0;
+        double total_embed_ms = 0.0;
+        float last_similarity = 0.0f;  // Best match found by the last lookup
+    };
+
+    semantic_cache(int32_t n_embd, int max_entries, float threshold);
+
+    int32_t dimensions() const { return n_embd; }
+    int capacity() const { return max_entries; }
+
+    // Reply of the most similar stored prompt in partition, if its similarity
+    // reaches the threshold
+    bool lookup(uint64_t partition, const std::vector<float>& embedding, std::vector<llama_token>& reply,
+                float& similarity);
+    void store(uint64_t partition, const std::vector<float>& embedding, const std::vector<llama_token>& reply);
+
+    void set_threshold(float threshold);
+    void add_embed_ms(double ms);
+    stats snapshot() const;
+
+private:
+    const int32_t n_embd;
+    const int max_entries;
+
+    mutable std::mutex mutex;
+    std::vector<float> matrix;  // entries() rows of n_embd
+    std::vector<std::vector<llama_token>> replies;
+    std::vector<uint64_t> partitions;
+    std::vector<uint64_t> last_used;
+    uint64_t clock = 0;
+    stats counters;
+};
@@ -0,0 +1,335 @@
+#include "session-log.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <android/log.h>
+#include "response-cache.h"
+
+#define LOG_TAG "LlamaJNI"
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+namespace {
+
+constexpr uint32_t RECORD_MAGIC = 0x314c5352;  // "RSL1"
+constexpr uint32_t FLAG_BASE = 1;
+constexpr uint32_t FLAG_DEFLATE = 2;
+
+struct record_header {
+    uint32_t magic;
+    uint32_t flags;
+    int32_t pos0;
+    uint32_t n_tokens;
+    uint32_t n_turns;
+    uint32_t n_pending;     // 0 in logs written before pending turns were recorded
+    uint64_t raw_bytes;     // Cell data before compression
+    uint64_t stored_bytes;  // Cell data as written
+    uint64_t checksum;      // Of everything after the header
+};
+
+// Far beyond any context; larger counts mean a corrupt header
+constexpr uint32_t MAX_RECORD_TOKENS = 1 << 20;
+constexpr uint64_t MAX_STATE_BYTES = 1ull << 34;
+
+bool write_fully(int fd, const void* buf, size_t size, uint64_t offset) {
+    const auto* p = static_cast<const char*>(buf);
+    while (size > 0) {
+        const ssize_t n = pwrite(fd, p, size, static_cast<off_t>(offset));
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+bool read_fully(int fd, void* buf, size_t size, uint64_t offset) {
+    auto* p = static_cast<char*>(buf);
+    while (size > 0) {
+        const ssize_t n = pread(fd, p, size, static_cast<off_t>(offset));
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+// Read and verify the record at offset, advancing offset past it
+bool read_record(int fd, uint64_t& offset, session_log::record& rec) {
+    record_header header;
+    if (!read_fully(fd, &header, sizeof(header), offset) || header.magic != RECORD_MAGIC ||
+        header.n_tokens > MAX_RECORD_TOKENS || header.n_turns > header.n_tokens ||
+        header.n_pending > MAX_RECORD_TOKENS || header.raw_bytes > MAX_STATE_BYTES ||
+        header.stored_bytes > MAX_STATE_BYTES) {
+        return false;
+    }
+
+    rec.base = (header.flags & FLAG_BASE) != 0;
+    rec.pos0 = header.pos0;
+    rec.tokens.resize(header.n_tokens);
+    rec.turn_starts.resize(header.n_turns);
+    rec.pending.resize(header.n_pending);
+    std::vector<uint8_t> stored(header.stored_bytes);
+    const size_t token_bytes = rec.tokens.size() * sizeof(llama_token);
+    const size_t turn_bytes = rec.turn_starts.size() * sizeof(int32_t);
+    const size_t pending_bytes = rec.pending.size() * sizeof(llama_token);
+    const uint64_t at = offset + sizeof(header);
+    if (!read_fully(fd, rec.tokens.data(), token_bytes, at) ||
+        !read_fully(fd, rec.turn_starts.data(), turn_bytes, at + token_bytes) ||
+        !read_fully(fd, rec.pending.data(), pending_bytes, at + token_bytes + turn_bytes) ||
+        !read_fully(fd, stored.data(), stored.size(), at + token_bytes + turn_bytes + pending_bytes)) {
+        return false;
+    }
+    const uint64_t checksum = fnv1a_hash()
+        .add(rec.tokens.data(), token_bytes)
+        .add(rec.turn_starts.data(), turn_bytes)
+        .add(rec.pending.data(), pending_bytes)
+        .add(stored.data(), stored.size())
+        .value();
+    if (checksum != header.checksum) {
+        return false;
+    }
+
+    if ((header.flags & FLAG_DEFLATE) != 0) {
+        rec.state.resize(header.raw_bytes);
+        uLongf n = static_cast<uLongf>(header.raw_bytes);
+        if (uncompress(rec.state.data(), &n, stored.data(), static_cast<uLong>(stored.size())) != Z_OK ||
+            n != header.raw_bytes) {
+            return false;
+        }
+    } else {
+        rec.state = std::move(stored);
+    }
+    offset = at + token_bytes + turn_bytes + pending_bytes + header.stored_bytes;
+    return true;
+}
+
+} // namespace
+
+session_log::session_log(std::string path, bool compress)
+    : path(std::move(path)), compress(compress) {}
+
+session_log::~session_log() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cv.notify_all();
+    if (writer.joinable()) {
+        writer.join();
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+bool session_log::open(std::vector<record>& restored) {
+    std::lock_guard<std::mutex> lock(mutex);
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        LOGE("Session log: cannot open %s", path.c_str());
+        return false;
+    }
+
+    // Records before the last base are superseded by it
+    restored.clear();
+    uint64_t offset = 0;
+    record rec;
+    while (read_record(fd, offset, rec)) {
+        if (rec.base) {
+            restored.clear();
+            base_bytes = rec.state.size();
+            appended_bytes = 0;
+        } else {
+            appended_bytes += rec.state.size();
+        }
+        restored.push_back(std::move(rec));
+        rec = record();
+    }
+    if (!restored.empty() && !restored.front().base) {
+        restored.clear();  // Appends without their base cannot be replayed
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && static_cast<uint64_t>(st.st_size) > offset) {
+        LOGI("Session log: dropping %llu bytes of torn record", static_cast<unsigned long long>(st.st_size - offset));
+        if (ftruncate(fd, static_cast<off_t>(offset)) != 0) {
+            LOGE("Session log: cannot truncate %s", path.c_str());
+        }
+    }
+    file_end = offset;
+    counters.file_bytes = offset;
+    writer = std::thread(&session_log::writer_loop, this);
+    LOGI("Session log: %zu records to replay from %s", restored.size(), path.c_str());
+    return true;
+}
+
+void session_log::append(record r) {
+    std::lock_guard<std::mutex> lock(mutex);
+    appended_bytes += r.state.size();
+    r.base = false;
+    queue.push_back({false, std::move(r)});
+    counters.pending = static_cast<int>(queue.size());
+    cv.notify_all();
+}
+
+void session_log::rewrite(record base) {
+    std::lock_guard<std::mutex> lock(mutex);
+    base_bytes = base.state.size();
+    appended_bytes = 0;
+    needs_base = false;
+    base.base = true;
+    queue.push_back({true, std::move(base)});
+    counters.pending = static_cast<int>(queue.size());
+    cv.notify_all();
+}
+
+bool session_log::wants_rewrite() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return needs_base || appended_bytes > base_bytes;
+}
+
+void session_log::flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle_cv.wait(lock, [this] { return queue.empty() && !writing; });
+}
+
+session_log::stats session_log::snapshot() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
+
+bool session_log::write_record(int target_fd, uint64_t& offset, const record& rec, uint64_t& stored_bytes) {
+    std::vector<uint8_t> packed;
+    const std::vector<uint8_t>* stored = &rec.state;
+    uint32_t flags = rec.base ? FLAG_BASE : 0;
+    if (compress && !rec.state.empty()) {
+        uLongf n = compressBound(static_cast<uLong>(rec.state.size()));
+        packed.resize(n);
+        if (compress2(packed.data(), &n, rec.state.data(), static_cast<uLong>(rec.state.size()), 1) == Z_OK &&
+            n < rec.state.size()) {
+            packed.resize(n);
+            stored = &packed;
+            flags |= FLAG_DEFLATE;
+        }
+    }
+
+    record_header header = {};
+    header.magic = RECORD_MAGIC;
+    header.flags = flags;
+    header.pos0 = rec.pos0;
+    header.n_tokens = static_cast<uint32_t>(rec.tokens.size());
+    header.n_turns = static_cast<uint32_t>(rec.turn_starts.size());
+    header.n_pending = static_cast<uint32_t>(rec.pending.size());
+    header.raw_bytes = rec.state.size();
+    header.stored_bytes = stored->size();
+
+    const size_t token_bytes = rec.tokens.size() * sizeof(llama_token);
+    const size_t turn_bytes = rec.turn_starts.size() * sizeof(int32_t);
+    const size_t pending_bytes = rec.pending.size() * sizeof(llama_token);
+    header.checksum = fnv1a_hash()
+        .add(rec.tokens.data(), token_bytes)
+        .add(rec.turn_starts.data(), turn_bytes)
+        .add(rec.pending.data(), pending_bytes)
+        .add(stored->data(), stored->size())
+        .value();
+
+    const uint64_t at = offset + sizeof(header);
+    if (!write_fully(target_fd, &header, sizeof(header), offset) ||
+        !write_fully(target_fd, rec.tokens.data(), token_bytes, at) ||
+        !write_fully(target_fd, rec.turn_starts.data(), turn_bytes, at + token_bytes) ||
+        !write_fully(target_fd, rec.pending.data(), pending_bytes, at + token_bytes + turn_bytes) ||
+        !write_fully(target_fd, stored->data(), stored->size(), at + token_bytes + turn_bytes + pending_bytes)) {
+        return false;
+    }
+    offset = at + token_bytes + turn_bytes + pending_bytes + stored->size();
+    stored_bytes = stored->size();
+    return true;
+}
+
+// Write everything queued, then sync once for the whole batch. A rewrite starts a
+// new file; records queued behind it are appended to that file.
+void session_log::writer_loop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        cv.wait(lock, [this] { return stop || !queue.empty(); });
+        if (queue.empty()) {
+            break;  // Stopping with nothing left to write
+        }
+
+        std::deque<job> batch;
+        batch.swap(queue);
+        writing = true;
+        counters.pending = 0;
+        lock.unlock();
+
+        const auto start = std::chrono::steady_clock::now();
+        uint64_t raw = 0;
+        uint64_t stored = 0;
+        uint64_t appends = 0;
+        uint64_t rewrites = 0;
+        bool failed = false;
+        for (const job& j : batch) {
+            uint64_t record_stored = 0;
+            if (j.rewrite) {
+                const std::string tmp_path = path + ".tmp";
+                const int tmp_fd = ::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+                uint64_t offset = 0;
+                if (tmp_fd < 0 || !write_record(tmp_fd, offset, j.rec, record_stored) || fdatasync(tmp_fd) != 0 ||
+                    rename(tmp_path.c_str(), path.c_str()) != 0) {
+                    LOGE("Session log: rewrite of %s failed", path.c_str());
+                    if (tmp_fd >= 0) {
+                        ::close(tmp_fd);
+                        unlink(tmp_path.c_str());
+                    }
+                    failed = true;
+                    continue;
+                }
+                ::close(fd);
+                fd = tmp_fd;
+                file_end = offset;
+                rewrites++;
+            } else {
+                if (!write_record(fd, file_end, j.rec, record_stored)) {
+                    LOGE("Session log: append to %s failed", path.c_str());
+                    if (ftruncate(fd, static_cast<off_t>(file_end)) != 0) {
+                        LOGE("Session log: cannot truncate %s", path.c_str());
+                    }
+                    failed = true;
+                    continue;
+                }
+                appends++;
+            }
+            raw += j.rec.state.size();
+            stored += record_stored;
+        }
+        const bool synced = fdatasync(fd) == 0;
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        lock.lock();
+        counters.appends += appends;
+        counters.rewrites += rewrites;
+        counters.syncs += synced ? 1 : 0;
+        counters.raw_bytes += raw;
+        counters.stored_bytes += stored;
+        counters.file_bytes = file_end;
+        counters.last_write_ms = ms;
+        counters.total_write_ms += ms;
+        if (failed) {
+            needs_base = true;  // Later appends build on a record that is missing
+        }
+        writing = false;
+        idle_cv.notify_all();
+    }
+    writing = false;
+    idle_cv.notify_all();
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "llama.h"
+
+// Append-only log of a chat's KV state. A base record holds the whole chat; each
+// later turn appends only its new tokens and their cells. Every record also
+// carries the turns committed to the chat but not decoded yet, which have no
+// cells to save. Records are written and synced by a writer thread, so saving a
+// turn costs the caller no more than serializing its cells. Once the appended
+// records outweigh the base, the owner writes a fresh base, which replaces the
+// file (via a temporary file and rename). On open the log is replayed from its
+// last base; a record torn by a crash is cut off, so at most the turn being
+// written is lost. Thread-safe.
+class session_log {
+public:
+    struct record {
+        bool base = false;
+        int32_t pos0 = 0;                  // Position of the record's first token
+        std::vector<llama_token> tokens;
+        std::vector<int32_t> turn_starts;  // Chat turns starting in this record, as positions
+        std::vector<uint8_t> state;        // llama_state_seq_get_data() of the record's cells
+        std::vector<llama_token> pending;  // Tokens that follow the cells but are not decoded yet
+    };
+
+    struct stats {
+        uint64_t appends = 0;
+        uint64_t rewrites = 0;
+        uint64_t syncs = 0;
+        uint64_t raw_bytes = 0;      // State bytes handed to the log
+        uint64_t stored_bytes = 0;   // After compression
+        uint64_t file_bytes = 0;
+        int pending = 0;
+        double last_write_ms = 0.0;
+        double total_write_ms = 0.0;
+    };
+
+    // With compress, cell data is deflated on the writer thread
+    session_log(std::string path, bool compress);
+    ~session_log();
+
+    session_log(const session_log&) = delete;
+    session_log& operator=(const session_log&) = delete;
+
+    // Open (or create) the log, return the records from its last base on, and
+    // start the writer. Returns false if the file cannot be opened.
+    bool open(std::vector<record>& restored);
+
+    void append(record r);
+    void rewrite(record base);
+
+    // True once the records appended since the last base hold more data than it,
+    // or a failed write left the log unable to take further appends
+    bool wants_rewrite() const;
+
+    // Block until everything queued is on flash
+    void flush();
+
+    stats snapshot() const;
+
+private:
+    struct job {
+        bool rewrite;
+        record rec;
+    };
+
+    const std::string path;
+    const bool compress;
+
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    std::condition_variable idle_cv;
+    std::thread writer;
+    std::deque<job> queue;
+    bool stop = false;
+    bool writing = false;
+    int fd = -1;
+    uint64_t file_end = 0;
+    uint64_t base_bytes = 0;      // Raw state bytes of the last base
+    uint64_t appended_bytes = 0;  // Raw state bytes appended since
+    bool needs_base = false;      // A write failed; the log needs a fresh base
+    stats counters;
+
+    void writer_loop();
+    bool write_record(int target_fd, uint64_t& offset, const record& rec, uint64_t& stored);
+};
@@ -0,0 +1,95 @@
+#include "energy-sampler.h"
+
+#include <atomic>
+#include <thread>
+
+#include "test-util.h"
+
+namespace {
+
+void test_power_supply_reader() {
+    temp_dir sys;
+    // 500 mA at 4 V; some vendors report discharge current as negative
+    sys.write("class/power_supply/battery/current_now", "-500000\n");
+    sys.write("class/power_supply/battery/voltage_now", "4000000\n");
+    double watts = 0.0;
+    CHECK(make_power_supply_reader(sys.path())(watts));
+    CHECK_NEAR(watts, 2.0, 1e-9);
+
+    sys.write("class/power_supply/usb/current_now", "100000\n");
+    CHECK(!make_power_supply_reader(sys.path(), "usb")(watts));  // No voltage_now
+    CHECK(!make_power_supply_reader(sys.path(), "missing")(watts));
+}
+
+void test_integration_with_injected_reader() {
+    std::atomic<double> power{2.0};
+    std::atomic<int> reads{0};
+    energy_sampler sampler(
+        [&](double& watts) {
+            watts = power.load();
+            reads++;
+            return true;
+        },
+        5);
+
+    sampler.start();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    const double first_mj = sampler.mark_mj();
+    // 2 W for ~100 ms; the sleep may overshoot but never undershoots
+    CHECK(first_mj >= 190.0 && first_mj < 400.0);
+
+    power = 4.0;
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    const double total_mj = sampler.mark_mj();
+    CHECK(total_mj - first_mj >= 380.0);
+    sampler.stop();
+
+    CHECK(sampler.samples() > 4);
+    CHECK(reads.load() >= sampler.samples());
+    const double avg = sampler.average_power_w();
+    CHECK(avg > 2.0 && avg < 4.0);
+
+    // Stopped: no more samples, marks return the final total
+    const int samples = sampler.samples();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    CHECK_EQ(sampler.samples(), samples);
+    CHECK_NEAR(sampler.mark_mj(), total_mj, 50.0);
+}
+
+void test_failing_reader() {
+    energy_sampler sampler([](double&) { return false; }, 5);
+    sampler.start();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    CHECK_EQ(sampler.mark_mj(), 0.0);
+    sampler.stop();
+    CHECK_EQ(sampler.samples(), 0);
+    CHECK_EQ(sampler.average_power_w(), 0.0);
+}
+
+// samples() is polled from get_metrics() while the worker thread samples
+void test_concurrent_polling() {
+    energy_sampler sampler(
+        [](double& watts) {
+            watts = 1.0;
+            return true;
+        },
+        1);
+    sampler.start();
+    int last = 0;
+    for (int i = 0; i < 200; i++) {
+        const int now = sampler.samples();
+        CHECK(now >= last);
+        last = now;
+    }
+    sampler.stop();
+}
+
+} // namespace
+
+int main() {
+    test_power_supply_reader();
+    test_integration_with_injected_reader();
+    test_failing_reader();
+    test_concurrent_polling();
+    return 0;
+}
@@ -0,0 +1,189 @@
+#include "fused-sampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "test-util.h"
+
+namespace {
+
+// Random logits with the spread of a real vocabulary: a few strong candidates
+// over a long flat tail. Distinct values, so tie-breaking plays no part.
+std::vector<float> make_logits(int32_t n, uint32_t seed) {
+    std::mt19937 gen(seed);
+    std::normal_distribution<float> tail(0.0f, 2.0f);
+    std::vector<float> logits(n);
+    for (int32_t i = 0; i < n; i++) {
+        logits[i] = tail(gen) + static_cast<float>(i) * 1e-6f;
+    }
+    for (int j = 0; j < 8; j++) {
+        logits[gen() % n] += 12.0f;
+    }
+    return logits;
+}
+
+// The top-k -> top-p -> temp -> dist chain written the way llama.cpp runs it:
+// every logit becomes a candidate, the array is sorted, and softmax runs over
+// the survivors before the nucleus cut and again after tempering
+class reference_chain {
+public:
+    explicit reference_chain(const sampler_params& params) : params(params), rng(params.seed) {}
+
+    llama_token sample(const float* logits, int32_t n) {
+        std::vector<llama_token_data> cur(n);
+        for (int32_t i = 0; i < n; i++) {
+            cur[i] = {i, logits[i], 0.0f};
+        }
+        std::sort(cur.begin(), cur.end(),
+                  [](const llama_token_data& a, const llama_token_data& b) { return a.logit > b.logit; });
+        cur.resize(std::min<size_t>(cur.size(), params.top_k));
+
+        if (params.top_p < 1.0f) {
+            softmax(cur);
+            float cum_sum = 0.0f;
+            for (size_t i = 0; i < cur.size(); i++) {
+                cum_sum += cur[i].p;
+                if (cum_sum >= params.top_p) {
+                    cur.resize(i + 1);
+                    break;
+                }
+            }
+        }
+        for (auto& c : cur) {
+            c.logit /= params.temp;
+        }
+        softmax(cur);
+
+        std::vector<float> weights;
+        for (const auto& c : cur) {
+            weights.push_back(c.p);
+        }
+        std::discrete_distribution<int> dist(weights.begin(), weights.end());
+        return cur[dist(rng)].id;
+    }
+
+    void reset() { rng.seed(params.seed); }
+
+private:
+    sampler_params params;
+    std::mt19937 rng;
+
+    static void softmax(std::vector<llama_token_data>& cur) {
+        const float max_logit = cur.front().logit;
+        float sum = 0.0f;
+        for (auto& c : cur) {
+            c.p = expf(c.logit - max_logit);
+            sum += c.p;
+        }
+        for (auto& c : cur) {
+            c.p /= sum;
+        }
+    }
+};
+
+void test_argmax() {
+    // Odd sizes exercise the scalar tails after the vector loops
+    for (int32_t n : {1, 3, 7, 8, 9, 33, 1001, 262144}) {
+        const std::vector<float> logits = make_logits(n, static_cast<uint32_t>(n));
+        const int32_t expected = static_cast<int32_t>(std::max_element(logits.begin(), logits.end()) - logits.begin());
+        CHECK_EQ(argmax_logits(logits.data(), n), expected);
+    }
+    CHECK_EQ(argmax_logits(nullptr, 0), -1);
+
+    // Ties go to the lowest index, as in the greedy sampler, whichever lane holds them
+    std::vector<float> flat(100, 1.0f);
+    flat[37] = 5.0f;
+    flat[90] = 5.0f;
+    flat[61] = 5.0f;
+    CHECK_EQ(argmax_logits(flat.data(), 100), 37);
+}
+
+void test_top_k() {
+    const int32_t n = 5003;
+    const std::vector<float> logits = make_logits(n, 7);
+    std::vector<llama_token> order(n);
+    for (int32_t i = 0; i < n; i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](llama_token a, llama_token b) { return logits[a] > logits[b]; });
+
+    std::vector<llama_token_data> top;
+    for (int32_t k : {1, 5, 40, 100}) {
+        top_k_logits(logits.data(), n, k, top);
+        CHECK_EQ(top.size(), static_cast<size_t>(k));
+        for (int32_t i = 0; i < k; i++) {
+            CHECK_EQ(top[i].id, order[i]);
+            CHECK(top[i].logit == logits[order[i]]);
+        }
+    }
+
+    // k larger than the vocabulary keeps everything
+    top_k_logits(logits.data(), 10, 40, top);
+    CHECK_EQ(top.size(), static_cast<size_t>(10));
+}
+
+void test_token_mask() {
+    const int32_t n = 100;  // Three full words and a partial one
+    std::vector<float> logits(n, 1.0f);
+    std::vector<uint32_t> allowed((n + 31) / 32, UINT32_MAX);
+    allowed[1] = 0x0000ffffu;  // Bans tokens 48..63
+    allowed[3] = 1u << 1;      // Only 97 survives in the tail
+    apply_token_mask(logits.data(), n, allowed.data());
+
+    for (int32_t i = 0; i < n; i++) {
+        const bool banned = (i >= 48 && i < 64) || (i >= 96 && i != 97);
+        CHECK(banned ? std::isinf(logits[i]) && logits[i] < 0 : logits[i] == 1.0f);
+    }
+}
+
+// Same seed, same tokens: the fused sampler against the full-sort chain
+void test_matches_chain() {
+    const int32_t n = 8192;
+    const sampler_params configs[] = {
+        {40, 0.9f, 0.7f, 12345},
+        {40, 1.0f, 1.0f, 42},
+        {5, 0.5f, 1.5f, 7},
+        {100, 0.95f, 0.3f, 99},
+    };
+    for (const sampler_params& params : configs) {
+        CHECK(fused_sampler::supports(params));
+        fused_sampler fused(params);
+        reference_chain chain(params);
+        for (uint32_t step = 0; step < 50; step++) {
+            const std::vector<float> logits = make_logits(n, step);
+            CHECK_EQ(fused.sample(logits.data(), n), chain.sample(logits.data(), n));
+        }
+
+        // reset() restarts the stream like llama_sampler_reset()
+        fused.reset();
+        chain.reset();
+        const std::vector<float> logits = make_logits(n, 1);
+        CHECK_EQ(fused.sample(logits.data(), n), chain.sample(logits.data(), n));
+    }
+
+    sampler_params greedy;
+    greedy.temp = 0.0f;
+    greedy.top_k = 0;
+    CHECK(fused_sampler::supports(greedy));
+    const std::vector<float> logits = make_logits(n, 3);
+    fused_sampler fused(greedy);
+    CHECK_EQ(fused.sample(logits.data(), n), argmax_logits(logits.data(), n));
+
+    sampler_params unbounded;
+    unbounded.top_k = 0;
+    CHECK(!fused_sampler::supports(unbounded));
+}
+
+} // namespace
+
+int main() {
+    std::printf("kernels: %s\n", fused_sampler::kernel_name());
+    test_argmax();
+    test_top_k();
+    test_token_mask();
+    test_matches_chain();
+    return 0;
+}
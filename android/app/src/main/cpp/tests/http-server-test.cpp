@@ -0,0 +1,104 @@
+#include "http-server.h"
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+#include "test-util.h"
+
+namespace {
+
+size_t content_length(const std::string& response) {
+    const size_t at = response.find("Content-Length: ");
+    return at == std::string::npos ? 0 : std::strtoul(response.c_str() + at + 16, nullptr, 10);
+}
+
+// Send one raw request on a new connection and return the status code
+int send_request(int port, const std::string& request) {
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(fd >= 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(static_cast<uint16_t>(port));
+    CHECK(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+    CHECK(send(fd, request.data(), request.size(), 0) == static_cast<ssize_t>(request.size()));
+
+    // Every response here has a Content-Length; the server may keep the socket open
+    std::string response;
+    char chunk[4096];
+    size_t head_end;
+    while ((head_end = response.find("\r\n\r\n")) == std::string::npos ||
+           response.size() < head_end + 4 + content_length(response)) {
+        const ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        CHECK(n > 0);
+        response.append(chunk, static_cast<size_t>(n));
+    }
+    close(fd);
+    CHECK(response.compare(0, 9, "HTTP/1.1 ") == 0);
+    return std::atoi(response.c_str() + 9);
+}
+
+std::string post(const std::string& headers, const std::string& body = "{}") {
+    return "POST /v1/chat/completions HTTP/1.1\r\n" + headers + "Content-Length: " + std::to_string(body.size()) +
+           "\r\nConnection: close\r\n\r\n" + body;
+}
+
+void test_access() {
+    std::atomic<int> handled{0};
+    http_server server(0, [&](http_server::exchange& ex) {
+        handled++;
+        ex.respond(200, "application/json", ex.req.body);
+    }, 4);
+    CHECK(server.start());
+    const int port = server.port();
+    const std::string token = server.token();
+    CHECK_EQ(token.size(), size_t(32));
+    const std::string auth = "Authorization: Bearer " + token + "\r\n";
+    const std::string json = "Content-Type: application/json; charset=utf-8\r\n";
+
+    CHECK_EQ(send_request(port, post("Host: 127.0.0.1:8080\r\n" + auth + json)), 200);
+    CHECK_EQ(send_request(port, post("Host: localhost\r\nauthorization: bearer " + token + "\r\n" + json)), 200);
+    CHECK_EQ(send_request(port, "GET /metrics HTTP/1.1\r\nHost: [::1]:80\r\n" + auth + "Connection: close\r\n\r\n"),
+             200);
+    CHECK_EQ(handled.load(), 3);
+
+    // Missing or wrong token
+    CHECK_EQ(send_request(port, post("Host: localhost\r\n" + json)), 401);
+    CHECK_EQ(send_request(port, post("Host: localhost\r\nAuthorization: Bearer x" + token + "\r\n" + json)), 401);
+    CHECK_EQ(send_request(port, post("Host: localhost\r\nAuthorization: Basic " + token + "\r\n" + json)), 401);
+
+    // Web pages: any Origin, or a name rebound to 127.0.0.1
+    CHECK_EQ(send_request(port, post("Host: localhost\r\nOrigin: http://localhost\r\n" + auth + json)), 403);
+    CHECK_EQ(send_request(port, post("Host: evil.example:8080\r\n" + auth + json)), 403);
+    CHECK_EQ(send_request(port, post("Host: localhost.evil.example\r\n" + auth + json)), 403);
+
+    // Bodies a cross-origin form could send without a preflight
+    CHECK_EQ(send_request(port, post("Host: localhost\r\n" + auth + "Content-Type: text/plain\r\n")), 415);
+    CHECK_EQ(send_request(port, post("Host: localhost\r\n" + auth)), 415);
+
+    // The server counts a refusal just after sending it
+    for (int i = 0; i < 100 && server.snapshot().denied < 8; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    CHECK_EQ(handled.load(), 3);
+    CHECK_EQ(server.snapshot().denied, uint64_t(8));
+    CHECK_EQ(server.snapshot().bad_requests, uint64_t(0));
+
+    // Each server has its own token
+    http_server other(0, [](http_server::exchange& ex) { ex.respond(200, "text/plain", ""); }, 1);
+    CHECK(other.token() != token);
+}
+
+} // namespace
+
+int main() {
+    test_access();
+    return 0;
+}
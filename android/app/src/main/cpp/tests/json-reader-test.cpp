@@ -0,0 +1,88 @@
+#include "json-reader.h"
+
+#include <string>
+
+#include "test-util.h"
+
+namespace {
+
+bool parses(const std::string& text) {
+    json_value value;
+    return json_value::parse(text, value);
+}
+
+void test_request_body() {
+    json_value body;
+    CHECK(json_value::parse(R"( {"model": "m", "messages": [{"role": "user", "content": "hi"}],
+                                 "max_tokens": 16, "temperature": 0.5e0, "stream": true, "stop": null} )",
+                            body));
+    CHECK(body.kind == json_value::OBJECT);
+    CHECK_EQ(body.members.size(), size_t(6));
+    CHECK(body.members[0].first == "model");  // Document order
+
+    const json_value* messages = body.get("messages");
+    CHECK(messages != nullptr && messages->kind == json_value::ARRAY);
+    CHECK_EQ(messages->items.size(), size_t(1));
+    CHECK(messages->items[0].get("content")->string == "hi");
+    CHECK_NEAR(body.get("max_tokens")->number, 16.0, 0.0);
+    CHECK_NEAR(body.get("temperature")->number, 0.5, 0.0);
+    CHECK(body.get("stream")->kind == json_value::BOOLEAN && body.get("stream")->boolean);
+    CHECK(body.get("stop")->kind == json_value::NUL);
+    CHECK(body.get("missing") == nullptr);
+    CHECK(messages->get("role") == nullptr);  // Not an object
+
+    json_value empty;
+    CHECK(json_value::parse("{}", empty) && empty.kind == json_value::OBJECT && empty.members.empty());
+    CHECK(json_value::parse("[ ]", empty) && empty.kind == json_value::ARRAY && empty.items.empty());
+    CHECK(json_value::parse("-12.5", empty) && empty.number == -12.5);
+}
+
+void test_strings() {
+    json_value value;
+    CHECK(json_value::parse(R"("a\"b\\c\/d\n\t")", value));
+    CHECK(value.string == "a\"b\\c/d\n\t");
+
+    // \u escapes become UTF-8, surrogate pairs a single 4-byte sequence
+    CHECK(json_value::parse(R"("\u0041\u00e9\u20AC")", value));
+    CHECK(value.string == "A\xc3\xa9\xe2\x82\xac");
+    CHECK(json_value::parse(R"("\ud83d\ude00")", value));
+    CHECK(value.string == "\xf0\x9f\x98\x80");
+
+    // Raw UTF-8 passes through untouched
+    CHECK(json_value::parse("\"\xe6\x97\xa5\"", value));
+    CHECK(value.string == "\xe6\x97\xa5");
+}
+
+void test_malformed() {
+    CHECK(!parses(""));
+    CHECK(!parses("   "));
+    CHECK(!parses("{"));
+    CHECK(!parses("{\"a\" 1}"));
+    CHECK(!parses("{\"a\": 1,}"));
+    CHECK(!parses("{a: 1}"));
+    CHECK(!parses("[1, 2"));
+    CHECK(!parses("[1 2]"));
+    CHECK(!parses("\"unterminated"));
+    CHECK(!parses("\"bad \\x escape\""));
+    CHECK(!parses("\"\\u12\""));
+    CHECK(!parses("\"raw\nnewline\""));
+    CHECK(!parses("tru"));
+    CHECK(!parses("nul"));
+    CHECK(!parses("1e"));
+    CHECK(!parses("--1"));
+    CHECK(!parses("{} x"));  // Trailing garbage
+    CHECK(!parses("\"a\" \"b\""));
+
+    // Nesting is bounded instead of recursing without limit
+    CHECK(parses(std::string(60, '[') + std::string(60, ']')));
+    CHECK(!parses(std::string(100000, '[') + std::string(100000, ']')));
+}
+
+} // namespace
+
+int main() {
+    test_request_body();
+    test_strings();
+    test_malformed();
+    return 0;
+}
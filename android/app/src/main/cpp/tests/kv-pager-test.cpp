@@ -0,0 +1,165 @@
+#include "kv-pager.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+#include "test-util.h"
+
+namespace {
+
+constexpr size_t PAGE = 64;
+
+// While held, the I/O thread waits before writing, so stores stay queued
+std::mutex gate_mutex;
+std::condition_variable gate_cv;
+bool writes_held = false;
+
+void hold_writes(bool held) {
+    {
+        std::lock_guard<std::mutex> lock(gate_mutex);
+        writes_held = held;
+    }
+    gate_cv.notify_all();
+}
+
+std::vector<uint8_t> segment_data(size_t size, uint8_t seed) {
+    std::vector<uint8_t> data(size);
+    for (size_t i = 0; i < size; i++) {
+        data[i] = static_cast<uint8_t>(seed + i);
+    }
+    return data;
+}
+
+void test_round_trip() {
+    temp_dir dir;
+    const std::string path = dir.path() + "/kv";
+    kv_pager pager(path, PAGE);
+    CHECK(pager.open());
+
+    // Two full pages and a partial one
+    hold_writes(true);
+    const std::vector<uint8_t> data = segment_data(2 * PAGE + 22, 7);
+    const int id = pager.store(data);
+    CHECK(id >= 0);
+
+    // Before the write lands the segment is served from memory
+    std::vector<uint8_t> loaded;
+    CHECK(pager.load(id, loaded));
+    CHECK(loaded == data);
+    kv_pager::stats stats = pager.snapshot();
+    CHECK_EQ(stats.reads, uint64_t(0));
+    CHECK_EQ(stats.writes, uint64_t(0));
+    CHECK_EQ(stats.segments, 1);
+    CHECK_EQ(stats.pages_used, 3);
+    CHECK_EQ(stats.pages_total, 3);
+
+    hold_writes(false);
+    pager.flush();
+    stats = pager.snapshot();
+    CHECK_EQ(stats.writes, uint64_t(1));
+    CHECK_EQ(stats.bytes_written, uint64_t(data.size()));
+    CHECK(stats.syncs >= 1);
+    CHECK_EQ(stats.pending_writes, 0);
+    struct stat st;
+    CHECK(stat(path.c_str(), &st) == 0);
+    CHECK_EQ(static_cast<size_t>(st.st_size), data.size());
+
+    // After flush() it comes back from the file
+    loaded.clear();
+    CHECK(pager.load(id, loaded));
+    CHECK(loaded == data);
+    stats = pager.snapshot();
+    CHECK_EQ(stats.reads, uint64_t(1));
+    CHECK_EQ(stats.bytes_read, uint64_t(data.size()));
+
+    CHECK(!pager.load(id + 1, loaded));
+}
+
+void test_page_reuse() {
+    temp_dir dir;
+    kv_pager pager(dir.path() + "/kv", PAGE);
+    CHECK(pager.open());
+
+    const int a = pager.store(segment_data(2 * PAGE, 1));
+    const int b = pager.store(segment_data(PAGE / 2, 2));
+    pager.flush();
+    CHECK_EQ(pager.snapshot().pages_total, 3);
+
+    pager.release(a);
+    pager.release(a);  // Releasing twice frees nothing more
+    kv_pager::stats stats = pager.snapshot();
+    CHECK_EQ(stats.segments, 1);
+    CHECK_EQ(stats.pages_used, 1);
+    CHECK_EQ(stats.pages_total, 3);
+    std::vector<uint8_t> loaded;
+    CHECK(!pager.load(a, loaded));
+
+    // A new segment of the same size fits in the freed pages without growing the file
+    const std::vector<uint8_t> c_data = segment_data(2 * PAGE, 3);
+    const int c = pager.store(c_data);
+    pager.flush();
+    stats = pager.snapshot();
+    CHECK_EQ(stats.segments, 2);
+    CHECK_EQ(stats.pages_used, 3);
+    CHECK_EQ(stats.pages_total, 3);
+    CHECK(pager.load(c, loaded));
+    CHECK(loaded == c_data);
+    CHECK(pager.load(b, loaded));
+    CHECK(loaded == segment_data(PAGE / 2, 2));
+
+    // A larger one takes the freed pages it can and appends the rest
+    pager.release(c);
+    const std::vector<uint8_t> d_data = segment_data(3 * PAGE, 4);
+    const int d = pager.store(d_data);
+    pager.flush();
+    stats = pager.snapshot();
+    CHECK_EQ(stats.pages_used, 4);
+    CHECK_EQ(stats.pages_total, 4);
+    CHECK(pager.load(d, loaded));
+    CHECK(loaded == d_data);
+}
+
+void test_reuse_behind_queued_write() {
+    temp_dir dir;
+    kv_pager pager(dir.path() + "/kv", PAGE);
+    CHECK(pager.open());
+
+    // Pages freed while their write is still queued go to the next segment;
+    // its write is queued behind the stale one, so its data lands last
+    hold_writes(true);
+    const int stale = pager.store(segment_data(2 * PAGE, 10));
+    pager.release(stale);
+    const std::vector<uint8_t> data = segment_data(2 * PAGE, 20);
+    const int id = pager.store(data);
+    kv_pager::stats stats = pager.snapshot();
+    CHECK_EQ(stats.pages_used, 2);
+    CHECK_EQ(stats.pages_total, 2);
+
+    hold_writes(false);
+    pager.flush();
+    std::vector<uint8_t> loaded;
+    CHECK(!pager.load(stale, loaded));
+    CHECK(pager.load(id, loaded));
+    CHECK(loaded == data);
+    stats = pager.snapshot();
+    CHECK_EQ(stats.reads, uint64_t(1));
+    CHECK_EQ(stats.writes, uint64_t(2));
+}
+
+} // namespace
+
+void kv_pager_before_write() {
+    std::unique_lock<std::mutex> lock(gate_mutex);
+    gate_cv.wait(lock, [] { return !writes_held; });
+}
+
+int main() {
+    test_round_trip();
+    test_page_reuse();
+    test_reuse_behind_queued_write();
+    return 0;
+}
@@ -0,0 +1,112 @@
+#include "latency-histograms.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "test-util.h"
+
+namespace {
+
+// Value of the exposition line starting with prefix, or -1 if there is none
+double sample_value(const std::string& text, const std::string& prefix) {
+    const size_t at = text.find("\n" + prefix + " ");
+    if (at == std::string::npos) {
+        return -1.0;
+    }
+    return std::strtod(text.c_str() + at + prefix.size() + 2, nullptr);
+}
+
+void check_bucket(uint64_t value) {
+    const int b = log_histogram::bucket_of(value);
+    CHECK(b >= 0 && b < log_histogram::BUCKETS);
+    CHECK(log_histogram::bucket_low(b) <= value);
+    CHECK(value < log_histogram::bucket_high(b));
+}
+
+void test_bucket_math() {
+    // Exact below 32, then 16 sub-buckets per power of two
+    for (uint64_t v = 0; v < 32; v++) {
+        CHECK_EQ(log_histogram::bucket_of(v), static_cast<int>(v));
+    }
+    CHECK_EQ(log_histogram::bucket_of(32), 32);
+    CHECK_EQ(log_histogram::bucket_of(33), 32);
+    CHECK_EQ(log_histogram::bucket_of(34), 33);
+    CHECK_EQ(log_histogram::bucket_of(1000), log_histogram::bucket_of(1023));
+    CHECK(log_histogram::bucket_of(1023) != log_histogram::bucket_of(1024));
+
+    for (uint64_t v = 0; v < 100000; v++) {
+        check_bucket(v);
+    }
+    for (int bit = 17; bit <= 36; bit++) {
+        const uint64_t power = uint64_t(1) << bit;
+        check_bucket(power - 1);
+        check_bucket(power);
+        check_bucket(power + power / 3);
+    }
+
+    // Buckets tile the range without gaps, each within 1/16 of its low edge
+    for (int b = 0; b + 1 < log_histogram::BUCKETS; b++) {
+        CHECK_EQ(log_histogram::bucket_high(b), log_histogram::bucket_low(b + 1));
+        CHECK_EQ(log_histogram::bucket_of(log_histogram::bucket_low(b)), b);
+        const uint64_t width = log_histogram::bucket_high(b) - log_histogram::bucket_low(b);
+        CHECK(b < 32 || width * log_histogram::SUB_BUCKETS <= log_histogram::bucket_low(b));
+    }
+
+    // Larger values land in the last bucket
+    const int last = log_histogram::BUCKETS - 1;
+    CHECK_EQ(log_histogram::bucket_of(uint64_t(1) << 37), last);
+    CHECK_EQ(log_histogram::bucket_of(UINT64_MAX), last);
+}
+
+void test_series() {
+    static latency_registry registry;  // Static storage zeroes the atomics
+    CHECK_EQ(registry.series("a", "cpu"), 0);
+    CHECK_EQ(registry.series("a", "gpu"), 1);
+    CHECK_EQ(registry.series("a", "cpu"), 0);
+    for (int i = 2; i < latency_registry::MAX_SERIES; i++) {
+        CHECK_EQ(registry.series("m" + std::to_string(i), ""), i);
+    }
+    CHECK_EQ(registry.series("one too many", ""), -1);
+    registry.record(-1, LATENCY_TTFT, 5.0);  // Ignored
+    CHECK(registry.prometheus_text().find("llm_time_to_first_token_seconds_count{model=\"a\",config=\"cpu\"} 0\n") !=
+          std::string::npos);
+}
+
+void test_prometheus_text() {
+    static latency_registry registry;
+    const int s = registry.series("q\"uote", "cpu\\4t");
+    for (int ms = 1; ms <= 1000; ms++) {
+        registry.record(s, LATENCY_TTFT, ms);
+    }
+    registry.record(s, LATENCY_PREFILL_RATE, 250.0);
+    const std::string text = registry.prometheus_text();
+
+    const std::string ttft = "llm_time_to_first_token_seconds";
+    const std::string labels = "{model=\"q\\\"uote\",config=\"cpu\\\\4t\"";
+    CHECK(text.find("# TYPE " + ttft + " summary\n") != std::string::npos);
+    CHECK_NEAR(sample_value(text, ttft + "_count" + labels + "}"), 1000.0, 0.0);
+    CHECK_NEAR(sample_value(text, ttft + "_sum" + labels + "}"), 500.5, 1e-6);
+
+    // Samples of 1..1000 ms put quantile q near q seconds; reported values are
+    // bucket midpoints, so within a bucket width of it
+    for (double q : {0.5, 0.9, 0.99, 0.999}) {
+        char key[64];
+        std::snprintf(key, sizeof(key), ",quantile=\"%g\"}", q);
+        CHECK_NEAR(sample_value(text, ttft + labels + key), q, q / 16.0);
+    }
+
+    // Rates are exported as recorded; metrics without samples have no quantiles
+    CHECK_NEAR(sample_value(text, "llm_prefill_tokens_per_second" + labels + ",quantile=\"0.5\"}"), 250.0, 250.0 / 16);
+    CHECK(text.find("llm_queue_wait_seconds" + labels + ",quantile=\"0.5\"} NaN\n") != std::string::npos);
+    CHECK_NEAR(sample_value(text, "llm_latency_samples_dropped_total"), 0.0, 0.0);
+}
+
+} // namespace
+
+int main() {
+    test_bucket_math();
+    test_series();
+    test_prometheus_text();
+    return 0;
+}
@@ -0,0 +1,139 @@
+#include "model-server.h"
+
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "test-util.h"
+
+namespace {
+
+constexpr uint32_t CAPACITY = 16;
+
+void reset(shm_ring& ring, uint64_t write_pos, uint64_t read_pos) {
+    ring.write_pos.store(write_pos);
+    ring.read_pos.store(read_pos);
+}
+
+void test_wraparound() {
+    shm_ring ring;
+    reset(ring, 0, 0);
+    std::vector<char> data(CAPACITY);
+    char out[CAPACITY] = {};
+
+    CHECK_EQ(ring.write(data.data(), CAPACITY, "0123456789", 10), size_t(10));
+    CHECK_EQ(ring.read(data.data(), CAPACITY, out, 6), size_t(6));
+    CHECK(std::memcmp(out, "012345", 6) == 0);
+
+    // 6 bytes free at the front, 6 at the back: a 12-byte write wraps
+    CHECK_EQ(ring.write(data.data(), CAPACITY, "abcdefghijklmnop", 16), size_t(12));
+    CHECK_EQ(ring.write(data.data(), CAPACITY, "x", 1), size_t(0));
+    CHECK(ring.consistent(CAPACITY));
+    CHECK_EQ(ring.read(data.data(), CAPACITY, out, sizeof(out)), size_t(16));
+    CHECK(std::memcmp(out, "6789abcdefghijkl", 16) == 0);
+    CHECK_EQ(ring.read(data.data(), CAPACITY, out, sizeof(out)), size_t(0));
+}
+
+void test_corrupt_positions() {
+    // Guard bytes on both sides catch a copy leaving the ring
+    std::vector<char> region(3 * CAPACITY, 'g');
+    char* const data = region.data() + CAPACITY;
+    char out[4 * CAPACITY];
+    const std::string big(4 * CAPACITY, 'z');
+    shm_ring ring;
+
+    // Reader ahead of the writer: w - r wraps to a huge count
+    reset(ring, 5, 9);
+    CHECK(!ring.consistent(CAPACITY));
+    CHECK_EQ(ring.read(data, CAPACITY, out, sizeof(out)), size_t(0));
+    CHECK_EQ(ring.write(data, CAPACITY, big.data(), big.size()), size_t(0));
+
+    // Writer more than a ring ahead of the reader
+    reset(ring, 100, 100 - CAPACITY - 1);
+    CHECK(!ring.consistent(CAPACITY));
+    CHECK_EQ(ring.read(data, CAPACITY, out, sizeof(out)), size_t(0));
+    CHECK_EQ(ring.write(data, CAPACITY, big.data(), big.size()), size_t(0));
+    CHECK_EQ(ring.read_pos.load(), uint64_t(100 - CAPACITY - 1));
+
+    // Exactly full is still valid, and reads no more than capacity
+    reset(ring, 100, 100 - CAPACITY);
+    CHECK(ring.consistent(CAPACITY));
+    CHECK_EQ(ring.read(data, CAPACITY, out, sizeof(out)), size_t(CAPACITY));
+
+    // Positions near the top of the range wrap like any others
+    reset(ring, UINT64_MAX - 2, UINT64_MAX - 2);
+    CHECK_EQ(ring.write(data, CAPACITY, big.data(), big.size()), size_t(CAPACITY));
+    CHECK_EQ(ring.read(data, CAPACITY, out, sizeof(out)), size_t(CAPACITY));
+
+    CHECK(!ring.consistent(0));
+    CHECK_EQ(ring.write(data, 0, big.data(), 1), size_t(0));
+
+    for (uint32_t i = 0; i < CAPACITY; i++) {
+        CHECK_EQ(region[i], 'g');
+        CHECK_EQ(region[2 * CAPACITY + i], 'g');
+    }
+}
+
+void test_round_trip() {
+    const std::string path = "@model-server-test-" + std::to_string(getpid());
+    const model_server::handler_fn echo = [](const std::string& prompt, const remote_options&,
+                                             const model_server::stream_fn& stream) {
+        stream("echo: ");
+        return "echo: " + prompt;
+    };
+    model_server server(path, echo, 4096);
+    CHECK(server.start());
+
+    model_client client(path);
+    CHECK(client.connect());
+    std::string reply;
+    CHECK(client.predict("hello", remote_options{}, reply));
+    CHECK(reply == "echo: hello");
+
+    // Longer than a ring: refused on the client before anything is sent
+    CHECK(!client.predict(std::string(5000, 'p'), remote_options{}, reply));
+    CHECK(client.predict("again", remote_options{}, reply));
+    CHECK(reply == "echo: again");
+    CHECK_EQ(server.snapshot().requests, uint64_t(2));
+}
+
+void test_cancel() {
+    const std::string path = "@model-server-cancel-" + std::to_string(getpid());
+    const model_server::handler_fn slow = [](const std::string& prompt, const remote_options&,
+                                             const model_server::stream_fn&) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        return prompt;
+    };
+    model_server server(path, slow, 4096);
+    CHECK(server.start());
+
+    model_client client(path);
+    CHECK(client.connect());
+    bool ok = true;
+    std::thread caller([&] {
+        std::string reply;
+        ok = client.predict("slow", remote_options{}, reply);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    const auto cancelled_at = std::chrono::steady_clock::now();
+    client.cancel();
+    caller.join();
+    CHECK(!ok);
+    CHECK(std::chrono::steady_clock::now() - cancelled_at < std::chrono::milliseconds(200));
+
+    std::string reply;
+    CHECK(!client.predict("again", remote_options{}, reply));
+}
+
+} // namespace
+
+int main() {
+    test_wraparound();
+    test_corrupt_positions();
+    test_round_trip();
+    test_cancel();
+    return 0;
+}
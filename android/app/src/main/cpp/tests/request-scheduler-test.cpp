@@ -0,0 +1,73 @@
+#include "request-scheduler.h"
+
+#include "test-util.h"
+
+namespace {
+
+request_scheduler& one_deep(request_scheduler& scheduler, admission_policy policy) {
+    queue_limits limits;
+    limits.max_depth = 1;
+    limits.policy = policy;
+    scheduler.set_limits(limits);
+    return scheduler;
+}
+
+void test_coalesce_identical_keys() {
+    request_scheduler scheduler;
+    one_deep(scheduler, ADMISSION_COALESCE);
+
+    const admission first = scheduler.admit(0, 10.0, "prompt");
+    CHECK(first.status == admission::ADMITTED);
+    const admission twin = scheduler.admit(0, 10.0, "prompt");
+    CHECK(twin.status == admission::COALESCED);
+    CHECK(twin.result == first.result);
+    const admission other = scheduler.admit(0, 10.0, "another prompt");
+    CHECK(other.status == admission::REJECTED);
+
+    const request_scheduler::stats stats = scheduler.snapshot();
+    CHECK_EQ(stats.coalesced, 1);
+    CHECK_EQ(stats.rejected, 1);
+    CHECK_EQ(stats.depth, 1);
+}
+
+// Keyless requests (scoring) are rejected when the queue is full, never coalesced
+void test_empty_key_never_coalesces() {
+    request_scheduler scheduler;
+    one_deep(scheduler, ADMISSION_COALESCE);
+
+    CHECK(scheduler.admit(0, 10.0, "").status == admission::ADMITTED);
+    CHECK(scheduler.admit(0, 10.0, "").status == admission::REJECTED);
+
+    const request_scheduler::stats stats = scheduler.snapshot();
+    CHECK_EQ(stats.coalesced, 0);
+    CHECK_EQ(stats.rejected, 1);
+}
+
+void test_replace_latest() {
+    request_scheduler scheduler;
+    one_deep(scheduler, ADMISSION_REPLACE_LATEST);
+
+    const admission old = scheduler.admit(1, 10.0, "");
+    const admission newer = scheduler.admit(1, 10.0, "");
+    CHECK(newer.status == admission::ADMITTED);
+
+    // The replaced request is told so instead of running
+    double wait_ms = 0.0;
+    CHECK(!scheduler.wait_turn(old, wait_ms));
+    CHECK(scheduler.wait_turn(newer, wait_ms));
+    scheduler.release();
+
+    const request_scheduler::stats stats = scheduler.snapshot();
+    CHECK_EQ(stats.replaced, 1);
+    CHECK_EQ(stats.completed[1], 1);
+    CHECK_EQ(stats.depth, 0);
+}
+
+} // namespace
+
+int main() {
+    test_coalesce_identical_keys();
+    test_empty_key_never_coalesces();
+    test_replace_latest();
+    return 0;
+}
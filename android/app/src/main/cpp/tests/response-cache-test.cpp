@@ -0,0 +1,156 @@
+#include "response-cache.h"
+
+#include <sys/stat.h>
+
+#include "test-util.h"
+
+namespace {
+
+// Header of 24 bytes plus four per token
+constexpr size_t RECORD_10 = 24 + 10 * sizeof(llama_token);
+
+std::vector<llama_token> reply(llama_token first, int n) {
+    std::vector<llama_token> tokens(n);
+    for (int i = 0; i < n; i++) {
+        tokens[i] = first + i;
+    }
+    return tokens;
+}
+
+size_t file_size(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? static_cast<size_t>(st.st_size) : 0;
+}
+
+void test_lru_eviction() {
+    temp_dir dir;
+    response_cache cache(dir.path() + "/replies.bin", 3 * RECORD_10);
+    CHECK(cache.open());
+
+    cache.store(1, reply(100, 10));
+    cache.store(2, reply(200, 10));
+    cache.store(3, reply(300, 10));
+    std::vector<llama_token> tokens;
+    CHECK(cache.lookup(1, tokens));  // 2 is now the least recently used
+    CHECK(tokens == reply(100, 10));
+
+    cache.store(4, reply(400, 10));
+    CHECK(!cache.lookup(2, tokens));
+    for (uint64_t key : {1, 3, 4}) {
+        CHECK(cache.lookup(key, tokens));
+        CHECK(tokens == reply(static_cast<llama_token>(key * 100), 10));
+    }
+
+    const response_cache::stats stats = cache.snapshot();
+    CHECK_EQ(stats.entries, 3);
+    CHECK_EQ(stats.evictions, static_cast<uint64_t>(1));
+    CHECK_EQ(stats.stores, static_cast<uint64_t>(4));
+    CHECK_EQ(stats.live_bytes, 3 * RECORD_10);
+    CHECK_EQ(stats.hits, static_cast<uint64_t>(4));
+    CHECK_EQ(stats.misses, static_cast<uint64_t>(1));
+
+    // Replies larger than the whole cache are not stored
+    cache.store(5, reply(0, 50));
+    CHECK(!cache.lookup(5, tokens));
+}
+
+// After a restart entries age in write order; a torn tail is cut off
+void test_reopen_and_torn_record() {
+    temp_dir dir;
+    const std::string path = dir.path() + "/replies.bin";
+    {
+        response_cache cache(path, 3 * RECORD_10);
+        CHECK(cache.open());
+        for (uint64_t key = 1; key <= 4; key++) {
+            cache.store(key, reply(static_cast<llama_token>(key * 100), 10));
+        }
+    }
+    FILE* f = std::fopen(path.c_str(), "ab");
+    CHECK(f != nullptr);
+    std::fputs("RRC1 half a header", f);
+    std::fclose(f);
+
+    response_cache cache(path, 3 * RECORD_10);
+    CHECK(cache.open());
+    CHECK_EQ(file_size(path), 4 * RECORD_10);
+    std::vector<llama_token> tokens;
+    CHECK(!cache.lookup(1, tokens));
+    for (uint64_t key : {2, 3, 4}) {
+        CHECK(cache.lookup(key, tokens));
+        CHECK(tokens == reply(static_cast<llama_token>(key * 100), 10));
+    }
+    CHECK_EQ(cache.snapshot().entries, 3);
+}
+
+void test_corrupt_record_is_dropped() {
+    temp_dir dir;
+    const std::string path = dir.path() + "/replies.bin";
+    response_cache cache(path, 1 << 20);
+    CHECK(cache.open());
+    cache.store(7, reply(700, 10));
+
+    FILE* f = std::fopen(path.c_str(), "r+b");
+    CHECK(f != nullptr);
+    std::fseek(f, 24, SEEK_SET);  // First token
+    std::fputc(0x5a, f);
+    std::fclose(f);
+
+    std::vector<llama_token> tokens;
+    CHECK(!cache.lookup(7, tokens));
+    CHECK(tokens.empty());
+    CHECK_EQ(cache.snapshot().entries, 0);
+}
+
+// Dead records beyond 64 KiB that outweigh the live ones trigger a rewrite
+void test_compaction() {
+    temp_dir dir;
+    const std::string path = dir.path() + "/replies.bin";
+    const size_t record = 24 + 1000 * sizeof(llama_token);
+    {
+        response_cache cache(path, 2 * record);
+        CHECK(cache.open());
+        for (uint64_t key = 1; key <= 40; key++) {
+            cache.store(key, reply(static_cast<llama_token>(key * 1000), 1000));
+        }
+        const response_cache::stats stats = cache.snapshot();
+        CHECK(stats.compactions >= 1);
+        CHECK_EQ(stats.entries, 2);
+        CHECK(stats.file_bytes < 64 * 1024 + 2 * record);
+        CHECK_EQ(file_size(path), stats.file_bytes);
+
+        std::vector<llama_token> tokens;
+        CHECK(cache.lookup(39, tokens));
+        CHECK(tokens == reply(39000, 1000));
+    }
+
+    // The compacted file reopens with the same live entries
+    response_cache cache(path, 2 * record);
+    CHECK(cache.open());
+    std::vector<llama_token> tokens;
+    CHECK(cache.lookup(40, tokens));
+    CHECK(tokens == reply(40000, 1000));
+    CHECK(cache.lookup(39, tokens));
+    CHECK(!cache.lookup(38, tokens));
+}
+
+void test_model_fingerprint() {
+    temp_dir dir;
+    dir.write("a.gguf", std::string(200 * 1024, 'a'));
+    dir.write("b.gguf", std::string(200 * 1024, 'a') + "b");
+    const uint64_t a = model_fingerprint(dir.path() + "/a.gguf");
+    CHECK(a != 0);
+    CHECK_EQ(model_fingerprint(dir.path() + "/a.gguf"), a);
+    CHECK(model_fingerprint(dir.path() + "/b.gguf") != a);
+    CHECK_EQ(model_fingerprint(dir.path() + "/missing.gguf"), static_cast<uint64_t>(0));
+}
+
+} // namespace
+
+int main() {
+    test_lru_eviction();
+    test_reopen_and_torn_record();
+    test_corrupt_record_is_dropped();
+    test_compaction();
+    test_model_fingerprint();
+    return 0;
+}
@@ -0,0 +1,106 @@
+#include "semantic-cache.h"
+
+#include <cmath>
+#include <vector>
+
+#include "test-util.h"
+
+namespace {
+
+constexpr int32_t N_EMBD = 19;  // Not a multiple of the vector width, so the tails run
+
+// Unit vector along axis, tilted slightly towards axis + 1
+std::vector<float> unit(int axis, float tilt = 0.0f) {
+    std::vector<float> v(N_EMBD, 0.0f);
+    v[axis % N_EMBD] = 1.0f;
+    v[(axis + 1) % N_EMBD] = tilt;
+    const float norm = std::sqrt(1.0f + tilt * tilt);
+    for (float& x : v) {
+        x /= norm;
+    }
+    return v;
+}
+
+void test_normalize_and_dot() {
+    CHECK(normalize_prompt("  What's the Capital\tof France?? ") == "whats the capital of france");
+    CHECK(normalize_prompt("caf\xc3\xa9 au lait") == "caf\xc3\xa9 au lait");
+    CHECK(normalize_prompt("?!").empty());
+
+    std::vector<float> a(37), b(37);
+    double expected = 0.0;
+    for (int i = 0; i < 37; i++) {
+        a[i] = 0.1f * i;
+        b[i] = 1.0f - 0.05f * i;
+        expected += static_cast<double>(a[i]) * b[i];
+    }
+    CHECK_NEAR(dot_product(a.data(), b.data(), 37), expected, 1e-3);
+    CHECK_NEAR(dot_product(a.data(), b.data(), 0), 0.0, 0.0);
+}
+
+void test_threshold() {
+    semantic_cache cache(N_EMBD, 4, 0.95f);
+    cache.store(1, unit(0), {10, 11});
+
+    std::vector<llama_token> reply;
+    float similarity = 0.0f;
+    CHECK(cache.lookup(1, unit(0, 0.1f), reply, similarity));  // cos ~ 0.995
+    CHECK(reply == std::vector<llama_token>({10, 11}));
+    CHECK(!cache.lookup(1, unit(0, 0.5f), reply, similarity));  // cos ~ 0.894
+    CHECK_NEAR(similarity, 1.0 / std::sqrt(1.25), 1e-4);
+
+    cache.set_threshold(0.85f);
+    CHECK(cache.lookup(1, unit(0, 0.5f), reply, similarity));
+
+    // Embeddings of the wrong size never match or get stored
+    CHECK(!cache.lookup(1, std::vector<float>(N_EMBD + 1, 0.1f), reply, similarity));
+    cache.store(1, std::vector<float>(3, 1.0f), {1});
+    CHECK_EQ(cache.snapshot().entries, 1);
+}
+
+// Replies generated under other sampling settings are invisible
+void test_partitions() {
+    semantic_cache cache(N_EMBD, 4, 0.9f);
+    cache.store(7, unit(2), {70});
+    cache.store(8, unit(2), {80});
+
+    std::vector<llama_token> reply;
+    float similarity = 0.0f;
+    CHECK(cache.lookup(7, unit(2), reply, similarity));
+    CHECK(reply == std::vector<llama_token>({70}));
+    CHECK(cache.lookup(8, unit(2), reply, similarity));
+    CHECK(reply == std::vector<llama_token>({80}));
+    CHECK(!cache.lookup(9, unit(2), reply, similarity));
+}
+
+void test_lru_eviction() {
+    semantic_cache cache(N_EMBD, 3, 0.99f);
+    for (int i = 0; i < 3; i++) {
+        cache.store(0, unit(i), {static_cast<llama_token>(i)});
+    }
+    std::vector<llama_token> reply;
+    float similarity = 0.0f;
+    CHECK(cache.lookup(0, unit(0), reply, similarity));  // Entry 1 is now the least recently used
+
+    cache.store(0, unit(5), {5});
+    CHECK_EQ(cache.snapshot().entries, 3);
+    CHECK(!cache.lookup(0, unit(1), reply, similarity));
+    for (int axis : {0, 2, 5}) {
+        CHECK(cache.lookup(0, unit(axis), reply, similarity));
+        CHECK(reply == std::vector<llama_token>({static_cast<llama_token>(axis)}));
+    }
+
+    const semantic_cache::stats stats = cache.snapshot();
+    CHECK_EQ(stats.stores, static_cast<uint64_t>(4));
+    CHECK_EQ(stats.hits, static_cast<uint64_t>(4));
+    CHECK_EQ(stats.misses, static_cast<uint64_t>(1));
+}
+
+} // namespace
+
+int main() {
+    test_normalize_and_dot();
+    test_threshold();
+    test_partitions();
+    test_lru_eviction();
+    return 0;
+}
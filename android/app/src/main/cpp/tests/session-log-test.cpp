@@ -0,0 +1,159 @@
+#include "session-log.h"
+
+#include <sys/stat.h>
+
+#include "test-util.h"
+
+namespace {
+
+session_log::record make_record(int32_t pos0, std::vector<llama_token> tokens, size_t state_bytes, uint8_t fill) {
+    session_log::record rec;
+    rec.pos0 = pos0;
+    rec.tokens = std::move(tokens);
+    rec.turn_starts = {pos0};
+    rec.state.assign(state_bytes, fill);
+    return rec;
+}
+
+std::vector<session_log::record> reopen(const std::string& path, bool compress = false) {
+    session_log log(path, compress);
+    std::vector<session_log::record> records;
+    CHECK(log.open(records));
+    return records;
+}
+
+// A base and two turns come back in order, with their cells and pending turns
+void test_replay() {
+    for (bool compress : {false, true}) {
+        temp_dir dir;
+        const std::string path = dir.path() + "/chat.log";
+        {
+            session_log log(path, compress);
+            std::vector<session_log::record> records;
+            CHECK(log.open(records));
+            CHECK(records.empty());
+
+            log.rewrite(make_record(0, {1, 2, 3, 4}, 4000, 0xa1));
+            log.append(make_record(4, {5, 6}, 2000, 0xb2));
+            session_log::record cached = make_record(6, {}, 0, 0);
+            cached.turn_starts.clear();
+            cached.pending = {7, 8, 9};  // A turn answered from the cache, not decoded yet
+            log.append(std::move(cached));
+            log.flush();
+
+            const session_log::stats stats = log.snapshot();
+            CHECK_EQ(stats.rewrites, static_cast<uint64_t>(1));
+            CHECK_EQ(stats.appends, static_cast<uint64_t>(2));
+            CHECK_EQ(stats.raw_bytes, static_cast<uint64_t>(6000));
+            if (compress) {
+                CHECK(stats.stored_bytes < stats.raw_bytes);
+            }
+        }
+
+        const std::vector<session_log::record> records = reopen(path, compress);
+        CHECK_EQ(records.size(), static_cast<size_t>(3));
+        CHECK(records[0].base);
+        CHECK(records[0].tokens == std::vector<llama_token>({1, 2, 3, 4}));
+        CHECK(records[0].state == std::vector<uint8_t>(4000, 0xa1));
+        CHECK(!records[1].base);
+        CHECK_EQ(records[1].pos0, 4);
+        CHECK(records[1].turn_starts == std::vector<int32_t>({4}));
+        CHECK(records[1].state == std::vector<uint8_t>(2000, 0xb2));
+        CHECK(records[2].tokens.empty());
+        CHECK(records[2].state.empty());
+        CHECK(records[2].pending == std::vector<llama_token>({7, 8, 9}));
+    }
+}
+
+// A new base supersedes everything before it, and appends outgrowing it ask for another
+void test_rewrite() {
+    temp_dir dir;
+    const std::string path = dir.path() + "/chat.log";
+    {
+        session_log log(path, false);
+        std::vector<session_log::record> records;
+        CHECK(log.open(records));
+        log.rewrite(make_record(0, {1, 2}, 100, 1));
+        log.append(make_record(2, {3}, 60, 2));
+        CHECK(!log.wants_rewrite());
+        log.append(make_record(3, {4}, 60, 3));
+        CHECK(log.wants_rewrite());
+
+        log.rewrite(make_record(0, {1, 2, 3, 4}, 220, 4));
+        CHECK(!log.wants_rewrite());
+        log.flush();
+    }
+    const std::vector<session_log::record> records = reopen(path);
+    CHECK_EQ(records.size(), static_cast<size_t>(1));
+    CHECK(records[0].tokens == std::vector<llama_token>({1, 2, 3, 4}));
+
+    // An empty base (a reset chat) may still carry pending turns
+    {
+        session_log log(path, false);
+        std::vector<session_log::record> restored;
+        CHECK(log.open(restored));
+        session_log::record empty;
+        empty.pending = {42};
+        log.rewrite(std::move(empty));
+        log.flush();
+    }
+    const std::vector<session_log::record> reset = reopen(path);
+    CHECK_EQ(reset.size(), static_cast<size_t>(1));
+    CHECK(reset[0].base && reset[0].tokens.empty());
+    CHECK(reset[0].pending == std::vector<llama_token>({42}));
+}
+
+// A record torn by a crash is cut off; the records before it survive
+void test_torn_record() {
+    temp_dir dir;
+    const std::string path = dir.path() + "/chat.log";
+    {
+        session_log log(path, false);
+        std::vector<session_log::record> records;
+        CHECK(log.open(records));
+        log.rewrite(make_record(0, {1, 2}, 100, 1));
+        log.append(make_record(2, {3}, 100, 2));
+        log.flush();
+    }
+    struct stat st;
+    CHECK(stat(path.c_str(), &st) == 0);
+    const off_t intact = st.st_size;
+    CHECK(truncate(path.c_str(), intact - 10) == 0);
+
+    session_log log(path, false);
+    std::vector<session_log::record> records;
+    CHECK(log.open(records));
+    CHECK_EQ(records.size(), static_cast<size_t>(1));
+    CHECK(records[0].base);
+    CHECK(log.snapshot().file_bytes < static_cast<uint64_t>(intact));
+    CHECK(stat(path.c_str(), &st) == 0);
+    CHECK_EQ(static_cast<uint64_t>(st.st_size), log.snapshot().file_bytes);
+
+    // Appends continue after the cut
+    log.append(make_record(2, {3}, 100, 5));
+    log.flush();
+    CHECK_EQ(reopen(path).size(), static_cast<size_t>(2));
+}
+
+void test_appends_without_base() {
+    temp_dir dir;
+    const std::string path = dir.path() + "/chat.log";
+    {
+        session_log log(path, false);
+        std::vector<session_log::record> records;
+        CHECK(log.open(records));
+        log.append(make_record(2, {3}, 10, 1));
+        log.flush();
+    }
+    CHECK(reopen(path).empty());
+}
+
+} // namespace
+
+int main() {
+    test_replay();
+    test_rewrite();
+    test_torn_record();
+    test_appends_without_base();
+    return 0;
+}
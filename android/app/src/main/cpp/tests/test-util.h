@@ -0,0 +1,76 @@
+#pragma once
+
+// Minimal assertions for the host unit tests. Each test is a small executable
+// registered with CTest; the first failed CHECK prints where and exits non-zero.
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <ftw.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CHECK(cond)                                                                       \
+    do {                                                                                  \
+        if (!(cond)) {                                                                    \
+            std::fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+            std::exit(1);                                                                 \
+        }                                                                                 \
+    } while (0)
+
+#define CHECK_EQ(a, b)                                                                                  \
+    do {                                                                                                \
+        const auto check_a = (a);                                                                       \
+        const auto check_b = (b);                                                                       \
+        if (!(check_a == check_b)) {                                                                    \
+            std::fprintf(stderr, "%s:%d: CHECK_EQ failed: %s == %s (%s vs %s)\n", __FILE__, __LINE__, #a, \
+                         #b, std::to_string(check_a).c_str(), std::to_string(check_b).c_str());         \
+            std::exit(1);                                                                               \
+        }                                                                                               \
+    } while (0)
+
+#define CHECK_NEAR(a, b, eps)                                                                              \
+    do {                                                                                                   \
+        const double check_a = (a);                                                                        \
+        const double check_b = (b);                                                                        \
+        if (std::fabs(check_a - check_b) > (eps)) {                                                        \
+            std::fprintf(stderr, "%s:%d: CHECK_NEAR failed: %s ~ %s (%g vs %g)\n", __FILE__, __LINE__, #a, \
+                         #b, check_a, check_b);                                                            \
+            std::exit(1);                                                                                  \
+        }                                                                                                  \
+    } while (0)
+
+// Scratch directory removed with everything in it when the test ends
+class temp_dir {
+public:
+    temp_dir() {
+        char templ[] = "/tmp/native-test-XXXXXX";
+        const char* made = mkdtemp(templ);
+        CHECK(made != nullptr);
+        root = made;
+    }
+
+    ~temp_dir() {
+        nftw(root.c_str(), [](const char* p, const struct stat*, int, FTW*) { return remove(p); }, 16,
+             FTW_DEPTH | FTW_PHYS);
+    }
+
+    const std::string& path() const { return root; }
+
+    // Write content to path (relative to the directory), creating parent directories
+    void write(const std::string& relative, const std::string& content) const {
+        std::string dir;
+        for (size_t slash = relative.find('/'); slash != std::string::npos; slash = relative.find('/', slash + 1)) {
+            dir = root + "/" + relative.substr(0, slash);
+            mkdir(dir.c_str(), 0700);
+        }
+        FILE* f = std::fopen((root + "/" + relative).c_str(), "w");
+        CHECK(f != nullptr);
+        std::fputs(content.c_str(), f);
+        std::fclose(f);
+    }
+
+private:
+    std::string root;
+};
@@ -0,0 +1,122 @@
+#include "thermal-governor.h"
+
+#include <vector>
+
+#include "test-util.h"
+
+namespace {
+
+// Four little cores at 1.8 GHz and four big ones at 2.8 GHz, one CPU thermal
+// zone and a hot battery zone the governor must ignore
+void make_fake_sysfs(const temp_dir& sys) {
+    for (int id = 0; id < 8; id++) {
+        const std::string cpu = "devices/system/cpu/cpu" + std::to_string(id) + "/cpufreq/";
+        const char* khz = id < 4 ? "1800000\n" : "2800000\n";
+        sys.write(cpu + "cpuinfo_max_freq", khz);
+        sys.write(cpu + "scaling_cur_freq", khz);
+    }
+    sys.write("class/thermal/thermal_zone0/type", "cpu-big\n");
+    sys.write("class/thermal/thermal_zone0/temp", "40000\n");
+    sys.write("class/thermal/thermal_zone1/type", "battery\n");
+    sys.write("class/thermal/thermal_zone1/temp", "90000\n");
+}
+
+void set_temp(const temp_dir& sys, const char* value) {
+    sys.write("class/thermal/thermal_zone0/temp", value);
+}
+
+void set_big_freq(const temp_dir& sys, const char* khz) {
+    for (int id = 4; id < 8; id++) {
+        sys.write("devices/system/cpu/cpu" + std::to_string(id) + "/cpufreq/scaling_cur_freq", khz);
+    }
+}
+
+thermal_governor_config fake_config(const temp_dir& sys) {
+    thermal_governor_config config;
+    config.sysfs_root = sys.path();
+    config.sample_interval_ms = 0;  // Re-read the fake tree on every step
+    return config;
+}
+
+void test_levels_and_placement() {
+    temp_dir sys;
+    make_fake_sysfs(sys);
+    thermal_governor governor(fake_config(sys));
+
+    // Cool: all threads on the big cluster; the hot battery zone does not count
+    governor.on_decode_step(100.0);
+    CHECK_EQ(governor.decision().level, 0);
+    CHECK_EQ(governor.decision().n_threads, 4);
+    CHECK(governor.decision().cpus == std::vector<int>({4, 5, 6, 7}));
+    CHECK_NEAR(governor.decision().temp_c, 40.0, 1e-3);
+    CHECK_EQ(governor.decision().pacing_us, 0);
+
+    // Warm: one thread fewer, paced to 85% of the cool rate (10 tokens/s)
+    set_temp(sys, "47000\n");
+    CHECK(governor.on_decode_step(100.0));
+    CHECK_EQ(governor.decision().level, 1);
+    CHECK_EQ(governor.decision().n_threads, 3);
+    CHECK_NEAR(governor.decision().pacing_us, (1000.0 / 8.5 - 100.0) * 1000.0, 2.0);
+
+    // Hot: half the threads, moved off the big cluster
+    set_temp(sys, "60000\n");
+    CHECK(governor.on_decode_step(100.0));
+    CHECK_EQ(governor.decision().level, 2);
+    CHECK_EQ(governor.decision().n_threads, 2);
+    CHECK(governor.decision().cpus == std::vector<int>({0, 1}));
+
+    // Hysteresis: 53 C is under the critical 55 C but not by 3 C
+    set_temp(sys, "53000\n");
+    governor.on_decode_step(100.0);
+    CHECK_EQ(governor.decision().level, 2);
+    set_temp(sys, "51000\n");
+    governor.on_decode_step(100.0);
+    CHECK_EQ(governor.decision().level, 1);
+    set_temp(sys, "30000\n");
+    governor.on_decode_step(100.0);
+    CHECK_EQ(governor.decision().level, 0);
+    CHECK_EQ(governor.transitions(), 4);
+}
+
+void test_frequency_throttling() {
+    temp_dir sys;
+    make_fake_sysfs(sys);
+    thermal_governor governor(fake_config(sys));
+
+    // The SoC clamping the big cores counts as warm even at a low temperature
+    set_big_freq(sys, "1400000\n");
+    governor.on_decode_step(50.0);
+    CHECK_NEAR(governor.decision().freq_ratio, 0.5, 1e-3);
+    CHECK_EQ(governor.decision().level, 1);
+
+    set_big_freq(sys, "2800000\n");
+    governor.on_decode_step(50.0);
+    CHECK_EQ(governor.decision().level, 0);
+}
+
+void test_whole_degrees_and_missing_tree() {
+    temp_dir sys;
+    make_fake_sysfs(sys);
+    set_temp(sys, "47\n");
+    thermal_governor governor(fake_config(sys));
+    governor.on_decode_step(50.0);
+    CHECK_NEAR(governor.decision().temp_c, 47.0, 1e-3);
+    CHECK_EQ(governor.decision().level, 1);
+
+    // No sysfs at all: stays cool with the configured thread count and no pinning
+    temp_dir empty;
+    thermal_governor blind(fake_config(empty));
+    blind.on_decode_step(50.0);
+    CHECK_EQ(blind.decision().level, 0);
+    CHECK_EQ(blind.decision().n_threads, 4);
+    CHECK(blind.decision().cpus.empty());
+}
+
+} // namespace
+
+int main() {
+    test_levels_and_placement();
+    test_frequency_throttling();
+    test_whole_degrees_and_missing_tree();
+    return 0;
+}
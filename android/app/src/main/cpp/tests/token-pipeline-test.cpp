@@ -0,0 +1,207 @@
+#include "token-pipeline.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "test-util.h"
+
+namespace {
+
+// Token ids index this table; the last pieces spell an end pattern over two tokens
+const char* const PIECES[] = {"Hello", " world", "!", "<end", "_of_turn>", "x"};
+const llama_token END_HEAD = 3;
+const llama_token END_TAIL = 4;
+const llama_token X = 5;
+
+// Set to have the worker pause before its next pop, standing in for preemption
+std::atomic<bool> pause_next_pop{false};
+std::atomic<bool> pop_paused{false};
+
+void test_streams_until_end_pattern() {
+    std::vector<std::string> emitted;
+    token_postprocessor post(nullptr, 16, [&](const std::string& text) { emitted.push_back(text); });
+    for (llama_token token : {0, 1, END_HEAD, END_TAIL, 2}) {
+        post.push(token);
+    }
+    const std::string response = post.finish();
+
+    CHECK(response == "Hello world");
+    CHECK_EQ(post.stop_index(), 3);
+    CHECK(post.stopped());
+    // The partial "<end" is held back instead of being streamed
+    for (const std::string& text : emitted) {
+        CHECK(text.find('<') == std::string::npos);
+    }
+    CHECK(emitted.back() == "Hello world");
+}
+
+void test_finish_releases_held_back_tail() {
+    std::string last;
+    token_postprocessor post(nullptr, 16, [&](const std::string& text) { last = text; });
+    post.push(0);
+    post.push(END_HEAD);
+    CHECK(post.finish() == "Hello<end");
+    CHECK(last == "Hello<end");
+    CHECK_EQ(post.stop_index(), -1);
+
+    token_postprocessor idle(nullptr, 16, nullptr);
+    CHECK(idle.finish().empty());
+}
+
+void test_hold_releases_after_window() {
+    std::vector<std::string> emitted;
+    token_postprocessor post(nullptr, 16, [&](const std::string& text) { emitted.push_back(text); });
+    post.hold(2);
+    post.push(0);
+    CHECK(emitted.empty());  // Never reached the worker
+    post.push(1);
+    post.push(2);
+    CHECK(post.finish() == "Hello world!");
+    CHECK(emitted.back() == "Hello world!");
+
+    // A reply shorter than the window is kept when it ends
+    std::string last;
+    token_postprocessor short_reply(nullptr, 16, [&](const std::string& text) { last = text; });
+    short_reply.hold(4);
+    short_reply.push(0);
+    CHECK(short_reply.finish() == "Hello");
+    CHECK(last == "Hello");
+}
+
+// A cascade turn escalated within the window: the small model's start is
+// dropped unseen, so a sink that only extends what it streamed (like the SSE
+// one) still streams the larger model's answer in full
+void test_escalated_turn_streams_only_the_answer() {
+    std::string streamed;
+    const token_postprocessor::emit_fn sink = [&](const std::string& text) {
+        if (text.size() > streamed.size() && text.compare(0, streamed.size(), streamed) == 0) {
+            streamed = text;
+        }
+    };
+
+    token_postprocessor small(nullptr, 16, sink);
+    small.hold(3);
+    small.push(0);
+    small.push(1);
+    small.drop_held();
+    CHECK(small.finish().empty());
+    CHECK(streamed.empty());
+
+    token_postprocessor large(nullptr, 16, sink);
+    for (llama_token token : {X, X, 2}) {
+        large.push(token);
+    }
+    CHECK(large.finish() == "xx!");
+    CHECK(streamed == "xx!");
+}
+
+// A slow consumer fills the 64-slot ring; push() must block rather than drop or spin
+void test_full_ring_blocks_producer() {
+    const int n_tokens = 300;
+    int n_emitted = 0;
+    token_postprocessor post(nullptr, n_tokens, [&](const std::string&) {
+        if (++n_emitted % 50 == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+    });
+    for (int i = 0; i < n_tokens; i++) {
+        post.push(X);
+    }
+    const std::string response = post.finish();
+    CHECK_EQ(response.size(), static_cast<size_t>(n_tokens));
+    CHECK_EQ(n_emitted, n_tokens + 1);  // One per token plus the final release in finish()
+}
+
+// Pushes spaced out so the worker goes to sleep between tokens each time
+void test_wakes_for_every_token() {
+    std::mutex seen_mutex;
+    size_t seen = 0;
+    token_postprocessor post(nullptr, 8, [&](const std::string& text) {
+        std::lock_guard<std::mutex> lock(seen_mutex);
+        seen = text.size();
+    });
+    for (int i = 1; i <= 8; i++) {
+        post.push(X);
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        for (;;) {
+            {
+                std::lock_guard<std::mutex> lock(seen_mutex);
+                if (seen == static_cast<size_t>(i)) {
+                    break;
+                }
+            }
+            CHECK(std::chrono::steady_clock::now() < deadline);
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    }
+    CHECK_EQ(post.finish().size(), static_cast<size_t>(8));
+}
+
+// Regression: a worker preempted just before a pop while the ring filled used
+// to miss the producer blocking on the full ring, and both threads slept
+// forever. A slow emit, as with an SSE socket, keeps the ring full afterwards.
+void test_full_ring_with_preempted_worker() {
+    std::atomic<bool> done{false};
+    std::thread watchdog([&] {
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (!done.load()) {
+            if (std::chrono::steady_clock::now() > deadline) {
+                std::fprintf(stderr, "token pipeline deadlocked on a full ring\n");
+                std::_Exit(1);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    });
+
+    pause_next_pop = true;
+    const int n_tokens = 1000;
+    token_postprocessor post(nullptr, n_tokens, [](const std::string&) {
+        std::this_thread::sleep_for(std::chrono::microseconds(20));
+    });
+    // Fill the ring only once the worker has looked at it empty
+    while (!pop_paused.load()) {
+        std::this_thread::yield();
+    }
+    for (int i = 0; i < n_tokens; i++) {
+        post.push(X);
+    }
+    CHECK_EQ(post.finish().size(), static_cast<size_t>(n_tokens));
+
+    done = true;
+    watchdog.join();
+}
+
+} // namespace
+
+void token_pipeline_before_pop() {
+    if (pause_next_pop.exchange(false)) {
+        pop_paused = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+}
+
+// The only llama.cpp call the pipeline makes
+int32_t llama_token_to_piece(const llama_vocab*, llama_token token, char* buf, int32_t length, int32_t, bool) {
+    const int32_t n = static_cast<int32_t>(std::strlen(PIECES[token]));
+    if (n > length) {
+        return -n;
+    }
+    std::memcpy(buf, PIECES[token], n);
+    return n;
+}
+
+int main() {
+    test_streams_until_end_pattern();
+    test_finish_releases_held_back_tail();
+    test_hold_releases_after_window();
+    test_escalated_turn_streams_only_the_answer();
+    test_full_ring_blocks_producer();
+    test_wakes_for_every_token();
+    test_full_ring_with_preempted_worker();
+    return 0;
+}
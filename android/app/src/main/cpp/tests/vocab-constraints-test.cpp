@@ -0,0 +1,145 @@
+#include "vocab-constraints.h"
+
+#include <cstring>
+#include <initializer_list>
+#include <string>
+
+#include "test-util.h"
+
+namespace {
+
+// Fake vocabulary: the empty pieces are control tokens, and only the first
+// is end-of-generation
+const char* const PIECES[] = {"", "Hello", " 42", "**", "\xc3\xa9", "yes", " yes", "no", " no", "<", "3.5", ""};
+constexpr int32_t N_VOCAB = sizeof(PIECES) / sizeof(PIECES[0]);
+constexpr llama_token EOG = 0;
+
+bool allowed(const token_mask& mask, llama_token id) {
+    return (mask.allowed_bits[id / 32] >> (id % 32)) & 1u;
+}
+
+// Checks that exactly the given tokens are allowed
+void check_allows(const token_mask& mask, std::initializer_list<llama_token> expected) {
+    CHECK_EQ(mask.n_allowed, static_cast<int32_t>(expected.size()));
+    for (llama_token id : expected) {
+        CHECK(allowed(mask, id));
+    }
+}
+
+void test_eog_always_allowed() {
+    vocab_constraints constraints(nullptr);
+    check_allows(*constraints.mask(VOCAB_CLASS_DIGITS, 0, ""), {EOG, 2, 10});
+    check_allows(*constraints.mask(0, VOCAB_CLASS_ASCII, ""), {EOG, 4, 11});
+    check_allows(*constraints.mask(VOCAB_CLASS_LABELS, 0, ""), {EOG});
+}
+
+void test_allow_and_ban() {
+    vocab_constraints constraints(nullptr);
+    CHECK_EQ(constraints.mask(0, 0, "")->n_allowed, N_VOCAB);
+
+    // A token is allowed by any allowed class it has, and refused by any banned one
+    check_allows(*constraints.mask(VOCAB_CLASS_DIGITS | VOCAB_CLASS_MARKUP, 0, ""), {EOG, 2, 3, 9, 10});
+    check_allows(*constraints.mask(VOCAB_CLASS_ASCII, VOCAB_CLASS_MARKUP, ""), {EOG, 1, 2, 5, 6, 7, 8, 10});
+    check_allows(*constraints.mask(VOCAB_CLASS_ASCII, VOCAB_CLASS_DIGITS | VOCAB_CLASS_MARKUP, ""),
+                 {EOG, 1, 5, 6, 7, 8});
+    check_allows(*constraints.mask(VOCAB_CLASS_DIGITS, VOCAB_CLASS_DIGITS, ""), {EOG});
+}
+
+void test_labels() {
+    vocab_constraints constraints(nullptr);
+
+    // Each label is tokenized both as written and after a space; blank lines are skipped
+    check_allows(*constraints.mask(VOCAB_CLASS_LABELS, 0, "yes\nno"), {EOG, 5, 6, 7, 8});
+    check_allows(*constraints.mask(VOCAB_CLASS_LABELS, 0, "\nyes\n\n"), {EOG, 5, 6});
+    check_allows(*constraints.mask(VOCAB_CLASS_ASCII, VOCAB_CLASS_LABELS, "yes\nno"), {EOG, 1, 2, 3, 9, 10});
+    check_allows(*constraints.mask(VOCAB_CLASS_LABELS | VOCAB_CLASS_DIGITS, 0, "Hello"), {EOG, 1, 2, 10});
+
+    // Longer than the first tokenization buffer
+    std::string long_label;
+    for (int i = 0; i < 300; i++) {
+        long_label += "no";
+    }
+    check_allows(*constraints.mask(VOCAB_CLASS_LABELS, 0, long_label), {EOG, 7, 8});
+
+    // Labels only key the cache when a label class is used
+    CHECK(constraints.mask(VOCAB_CLASS_ASCII, 0, "yes") == constraints.mask(VOCAB_CLASS_ASCII, 0, "no"));
+    CHECK(constraints.mask(VOCAB_CLASS_LABELS, 0, "yes") != constraints.mask(VOCAB_CLASS_LABELS, 0, "no"));
+}
+
+void test_cache_eviction() {
+    vocab_constraints constraints(nullptr);
+    const auto first = constraints.mask(VOCAB_CLASS_DIGITS, 0, "");
+    CHECK(constraints.mask(VOCAB_CLASS_DIGITS, 0, "") == first);
+    CHECK_EQ(constraints.cached_masks(), size_t(1));
+
+    for (int32_t ban = 1; ban < 16; ban++) {
+        constraints.mask(VOCAB_CLASS_DIGITS, ban << 8, "");
+    }
+    CHECK_EQ(constraints.cached_masks(), size_t(16));
+
+    // The cache is full: the next new mask starts it over
+    constraints.mask(VOCAB_CLASS_MARKUP, 0, "");
+    CHECK_EQ(constraints.cached_masks(), size_t(1));
+
+    // The evicted mask stays usable, and an equal one is built again
+    check_allows(*first, {EOG, 2, 10});
+    const auto rebuilt = constraints.mask(VOCAB_CLASS_DIGITS, 0, "");
+    CHECK(rebuilt != first);
+    CHECK(rebuilt->allowed_bits == first->allowed_bits);
+    CHECK_EQ(constraints.cached_masks(), size_t(2));
+}
+
+} // namespace
+
+// The llama.cpp calls the constraints make, over the fake vocabulary
+int32_t llama_vocab_n_tokens(const llama_vocab*) {
+    return N_VOCAB;
+}
+
+bool llama_vocab_is_eog(const llama_vocab*, llama_token token) {
+    return token == EOG;
+}
+
+int32_t llama_token_to_piece(const llama_vocab*, llama_token token, char* buf, int32_t length, int32_t, bool) {
+    const int32_t n = static_cast<int32_t>(std::strlen(PIECES[token]));
+    if (n > length) {
+        return -n;
+    }
+    std::memcpy(buf, PIECES[token], n);
+    return n;
+}
+
+// Greedy longest match over the pieces; returns minus the count when it does not fit
+int32_t llama_tokenize(const llama_vocab*, const char* text, int32_t text_len, llama_token* tokens,
+                       int32_t n_tokens_max, bool, bool) {
+    int32_t n = 0;
+    for (int32_t at = 0; at < text_len;) {
+        llama_token best = -1;
+        int32_t best_len = 0;
+        for (llama_token id = 0; id < N_VOCAB; id++) {
+            const int32_t len = static_cast<int32_t>(std::strlen(PIECES[id]));
+            if (len > best_len && len <= text_len - at && std::memcmp(text + at, PIECES[id], len) == 0) {
+                best = id;
+                best_len = len;
+            }
+        }
+        if (best < 0) {
+            at++;  // No piece covers this byte
+            continue;
+        }
+        if (n < n_tokens_max) {
+            tokens[n] = best;
+        }
+        n++;
+        at += best_len;
+    }
+    return n <= n_tokens_max ? n : -n;
+}
+
+int main() {
+    test_eog_always_allowed();
+    test_allow_and_ban();
+    test_labels();
+    test_cache_eviction();
+    return 0;
+}
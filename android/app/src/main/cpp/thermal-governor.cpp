@@ -0,0 +1,226 @@
+#include "thermal-governor.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <unistd.h>
+
+namespace {
+
+bool read_long(const std::string& path, long& out) {
+    FILE* f = std::fopen(path.c_str(), "r");
+    if (f == nullptr) {
+        return false;
+    }
+    const bool ok = std::fscanf(f, "%ld", &out) == 1;
+    std::fclose(f);
+    return ok;
+}
+
+std::string read_line(const std::string& path) {
+    FILE* f = std::fopen(path.c_str(), "r");
+    if (f == nullptr) {
+        return "";
+    }
+    char buf[128] = {0};
+    if (std::fgets(buf, sizeof(buf), f) == nullptr) {
+        buf[0] = '\0';
+    }
+    std::fclose(f);
+    std::string line(buf);
+    while (!line.empty() && std::isspace(static_cast<unsigned char>(line.back()))) {
+        line.pop_back();
+    }
+    return line;
+}
+
+bool path_exists(const std::string& path) {
+    return access(path.c_str(), F_OK) == 0;
+}
+
+// Thermal zone types that track the SoC / CPU clusters on common Android kernels
+bool is_cpu_zone(std::string type) {
+    std::transform(type.begin(), type.end(), type.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    static const char* const markers[] = {"cpu", "soc", "tsens", "cluster", "big", "little"};
+    for (const char* marker : markers) {
+        if (type.find(marker) != std::string::npos) {
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace
+
+thermal_governor::thermal_governor(const thermal_governor_config& config) : cfg(config) {
+    if (cfg.sysfs_root.empty()) {
+        cfg.sysfs_root = "/sys";
+    }
+    cfg.min_threads = std::max(1, cfg.min_threads);
+    cfg.max_threads = std::max(cfg.min_threads, cfg.max_threads);
+    discover();
+    apply_level(0);
+}
+
+void thermal_governor::discover() {
+    const std::string cpu_dir = cfg.sysfs_root + "/devices/system/cpu/cpu";
+    for (int id = 0; path_exists(cpu_dir + std::to_string(id)); id++) {
+        long max_khz = 0;
+        read_long(cpu_dir + std::to_string(id) + "/cpufreq/cpuinfo_max_freq", max_khz);
+        cpus_by_speed.push_back({id, max_khz});
+    }
+    std::stable_sort(cpus_by_speed.begin(), cpus_by_speed.end(),
+                     [](const cpu_info& a, const cpu_info& b) { return a.max_khz > b.max_khz; });
+
+    const std::string zone_dir = cfg.sysfs_root + "/class/thermal/thermal_zone";
+    std::vector<std::string> all_zones;
+    for (int id = 0; path_exists(zone_dir + std::to_string(id)); id++) {
+        const std::string zone = zone_dir + std::to_string(id);
+        all_zones.push_back(zone + "/temp");
+        if (is_cpu_zone(read_line(zone + "/type"))) {
+            zone_paths.push_back(zone + "/temp");
+        }
+    }
+    if (zone_paths.empty()) {
+        zone_paths = all_zones;
+    }
+}
+
+float thermal_governor::read_max_temp_c() const {
+    float max_temp = 0.0f;
+    for (const auto& path : zone_paths) {
+        long value = 0;
+        if (!read_long(path, value)) {
+            continue;
+        }
+        // Most kernels report millidegrees, a few report whole degrees
+        const float temp = value > 1000 ? value / 1000.0f : static_cast<float>(value);
+        max_temp = std::max(max_temp, temp);
+    }
+    return max_temp;
+}
+
+float thermal_governor::read_fast_cluster_freq_ratio() const {
+    if (cpus_by_speed.empty() || cpus_by_speed.front().max_khz <= 0) {
+        return 1.0f;
+    }
+
+    const long top_khz = cpus_by_speed.front().max_khz;
+    double sum = 0.0;
+    int n = 0;
+    for (const auto& cpu : cpus_by_speed) {
+        if (cpu.max_khz != top_khz) {
+            break;
+        }
+        long cur_khz = 0;
+        const std::string path = cfg.sysfs_root + "/devices/system/cpu/cpu" + std::to_string(cpu.id) +
+                                 "/cpufreq/scaling_cur_freq";
+        if (read_long(path, cur_khz)) {
+            sum += static_cast<double>(cur_khz) / top_khz;
+            n++;
+        }
+    }
+    return n > 0 ? static_cast<float>(sum / n) : 1.0f;
+}
+
+int thermal_governor::choose_level(float temp_c, float freq_ratio) const {
+    int target = 0;
+    if (temp_c >= cfg.critical_temp_c) {
+        target = 2;
+    } else if (temp_c >= cfg.throttle_temp_c || freq_ratio < cfg.min_freq_ratio) {
+        target = 1;
+    }
+
+    if (target >= current.level) {
+        return target;
+    }
+
+    // Only step down once we are clearly below the threshold that put us here
+    const float threshold = current.level == 2 ? cfg.critical_temp_c : cfg.throttle_temp_c;
+    if (temp_c < threshold - cfg.hysteresis_c && freq_ratio >= cfg.min_freq_ratio) {
+        return current.level - 1;
+    }
+    return current.level;
+}
+
+void thermal_governor::apply_level(int level) {
+    const int n_cpus = static_cast<int>(cpus_by_speed.size());
+    int n_threads = cfg.max_threads;
+    if (level == 1) {
+        n_threads = cfg.max_threads - 1;
+    } else if (level == 2) {
+        n_threads = cfg.max_threads / 2;
+    }
+    n_threads = std::max(cfg.min_threads, n_threads);
+    if (n_cpus > 0) {
+        n_threads = std::min(n_threads, n_cpus);
+    }
+
+    std::vector<int> cpus;
+    if (n_cpus > 0) {
+        // When hot, leave the fastest (and hottest) cluster alone if the others can take the threads
+        size_t first = 0;
+        if (level == 2) {
+            const long top_khz = cpus_by_speed.front().max_khz;
+            while (first < cpus_by_speed.size() && cpus_by_speed[first].max_khz == top_khz) {
+                first++;
+            }
+            if (cpus_by_speed.size() - first < static_cast<size_t>(n_threads)) {
+                first = 0;
+            }
+        }
+        for (size_t i = first; i < cpus_by_speed.size() && cpus.size() < static_cast<size_t>(n_threads); i++) {
+            cpus.push_back(cpus_by_speed[i].id);
+        }
+        std::sort(cpus.begin(), cpus.end());
+    }
+
+    current.level = level;
+    current.n_threads = n_threads;
+    current.cpus = cpus;
+}
+
+bool thermal_governor::on_decode_step(double step_ms) {
+    if (step_ms > 0.0) {
+        step_ms_ema = step_ms_ema > 0.0 ? 0.8 * step_ms_ema + 0.2 * step_ms : step_ms;
+        if (current.level == 0) {
+            cool_rate = 1000.0 / step_ms_ema;
+        }
+    }
+
+    bool placement_changed = false;
+    const auto now = std::chrono::steady_clock::now();
+    if (!sampled || now - last_sample >= std::chrono::milliseconds(cfg.sample_interval_ms)) {
+        sampled = true;
+        last_sample = now;
+
+        current.temp_c = read_max_temp_c();
+        current.freq_ratio = read_fast_cluster_freq_ratio();
+
+        const int level = choose_level(current.temp_c, current.freq_ratio);
+        if (level != current.level) {
+            const int old_threads = current.n_threads;
+            const std::vector<int> old_cpus = current.cpus;
+            apply_level(level);
+            n_transitions++;
+            placement_changed = current.n_threads != old_threads || current.cpus != old_cpus;
+        }
+    }
+
+    // Pace to a fraction of the cool rate instead of running flat out until the SoC clamps us
+    current.pacing_us = 0;
+    if (current.level > 0 && cool_rate > 0.0 && step_ms_ema > 0.0) {
+        double target_rate = cool_rate * cfg.sustain_factor;
+        if (current.level == 2) {
+            target_rate *= cfg.sustain_factor;
+        }
+        const double target_step_ms = 1000.0 / target_rate;
+        if (target_step_ms > step_ms_ema) {
+            current.pacing_us = static_cast<int>((target_step_ms - step_ms_ema) * 1000.0);
+        }
+    }
+    pacing_ms_total += current.pacing_us / 1000.0;
+
+    return placement_changed;
+}
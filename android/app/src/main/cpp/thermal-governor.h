@@ -0,0 +1,70 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+// Configuration for the thermal governor. sysfs_root is normally "/sys" but can
+// point at a fake tree laid out like class/thermal and devices/system/cpu.
+struct thermal_governor_config {
+    std::string sysfs_root = "/sys";
+    float throttle_temp_c = 45.0f;   // Start trading peak speed for sustained speed
+    float critical_temp_c = 55.0f;   // Move to fewer, slower cores
+    float hysteresis_c = 3.0f;       // Temperature must drop this far below a threshold to step down
+    float min_freq_ratio = 0.7f;     // Fast cores running below this fraction of max count as throttled
+    float sustain_factor = 0.85f;    // Warm target rate as a fraction of the rate measured while cool
+    int max_threads = 4;
+    int min_threads = 1;
+    int sample_interval_ms = 1000;   // sysfs is read at most this often
+};
+
+// What the decode loop should do right now
+struct thermal_decision {
+    int level = 0;                   // 0 = cool, 1 = warm, 2 = hot
+    int n_threads = 0;
+    std::vector<int> cpus;           // Cores the compute threads should be pinned to
+    int pacing_us = 0;               // Delay to insert between decode steps
+    float temp_c = 0.0f;
+    float freq_ratio = 1.0f;         // Current / max frequency of the fastest cluster
+};
+
+// Reads thermal zones and CPU frequencies from sysfs and adapts thread count,
+// core placement and inter-token pacing so decode speed stays sustainable over
+// long sessions instead of bursting and then collapsing under throttling.
+class thermal_governor {
+public:
+    explicit thermal_governor(const thermal_governor_config& config);
+
+    // Feed the duration of the last decode step; re-samples sysfs when due.
+    // Returns true when thread count or core placement changed.
+    bool on_decode_step(double step_ms);
+
+    const thermal_decision& decision() const { return current; }
+    const thermal_governor_config& config() const { return cfg; }
+    int transitions() const { return n_transitions; }
+    double total_pacing_ms() const { return pacing_ms_total; }
+    double cool_tokens_per_s() const { return cool_rate; }
+
+private:
+    struct cpu_info {
+        int id;
+        long max_khz;
+    };
+
+    thermal_governor_config cfg;
+    std::vector<cpu_info> cpus_by_speed;   // Fastest first
+    std::vector<std::string> zone_paths;
+    thermal_decision current;
+    std::chrono::steady_clock::time_point last_sample;
+    bool sampled = false;
+    double step_ms_ema = 0.0;
+    double cool_rate = 0.0;                // tokens/s EMA while at level 0
+    int n_transitions = 0;
+    double pacing_ms_total = 0.0;
+
+    void discover();
+    float read_max_temp_c() const;
+    float read_fast_cluster_freq_ratio() const;
+    int choose_level(float temp_c, float freq_ratio) const;
+    void apply_level(int level);
+};
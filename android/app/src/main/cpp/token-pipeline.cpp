@@ -0,0 +1,188 @@
+#include "token-pipeline.h"
+
+#include <algorithm>
+#include <android/log.h>
+
+#define LOG_TAG "LlamaJNI"
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+
+#ifdef TOKEN_PIPELINE_TEST_HOOKS
+// Defined by the unit test; runs on the worker before each pop to force interleavings
+void token_pipeline_before_pop();
+#endif
+
+namespace {
+
+// Text that ends generation when the model emits it instead of an EOS/EOT token
+const char* const END_PATTERNS[] = {"<end_of_turn>", "</s>", "<|end|>", "<start_of_turn>user"};
+
+// Length of the longest suffix of text that is a proper prefix of an end pattern;
+// those characters are held back from streaming until the next piece decides them
+size_t partial_pattern_length(const std::string& text) {
+    size_t longest = 0;
+    for (const char* pattern : END_PATTERNS) {
+        const std::string p(pattern);
+        for (size_t n = std::min(p.size() - 1, text.size()); n > longest; n--) {
+            if (text.compare(text.size() - n, n, p, 0, n) == 0) {
+                longest = n;
+                break;
+            }
+        }
+    }
+    return longest;
+}
+
+} // namespace
+
+token_postprocessor::token_postprocessor(const llama_vocab* vocab, int n_predict, emit_fn emit)
+    : vocab(vocab), n_predict(n_predict), emit(std::move(emit)) {
+    worker = std::thread(&token_postprocessor::run, this);
+}
+
+token_postprocessor::~token_postprocessor() {
+    finish();
+}
+
+void token_postprocessor::push(llama_token token) {
+    if (n_hold > 0) {
+        held.push_back(token);
+        if (static_cast<int>(held.size()) >= n_hold) {
+            release_held();
+        }
+        return;
+    }
+    enqueue(token);
+}
+
+void token_postprocessor::hold(int n_tokens) {
+    n_hold = n_tokens;
+    held.reserve(std::max(n_tokens, 0));
+}
+
+void token_postprocessor::drop_held() {
+    held.clear();
+    n_hold = 0;
+}
+
+void token_postprocessor::release_held() {
+    n_hold = 0;
+    for (llama_token token : held) {
+        enqueue(token);
+    }
+    held.clear();
+}
+
+void token_postprocessor::enqueue(llama_token token) {
+    if (!ring.try_push(token)) {
+        // Announced under the lock the worker takes after each pop, so the
+        // slot it frees next cannot go unnoticed
+        std::unique_lock<std::mutex> lock(wake_mutex);
+        producer_waiting = true;
+        space_cv.wait(lock, [&] { return !ring.full(); });
+        producer_waiting = false;
+        ring.try_push(token);
+    }
+    {
+        // The worker checks for tokens under this lock before sleeping
+        std::lock_guard<std::mutex> lock(wake_mutex);
+    }
+    wake_cv.notify_one();
+}
+
+std::string token_postprocessor::finish() {
+    if (worker.joinable()) {
+        release_held();  // A reply that ended within the held tokens keeps them
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex);
+            closing.store(true, std::memory_order_release);
+        }
+        wake_cv.notify_one();
+        worker.join();
+    }
+    return response;
+}
+
+void token_postprocessor::run() {
+    for (;;) {
+#ifdef TOKEN_PIPELINE_TEST_HOOKS
+        token_pipeline_before_pop();
+#endif
+        llama_token token;
+        if (ring.try_pop(token)) {
+            bool notify;
+            {
+                std::lock_guard<std::mutex> lock(wake_mutex);
+                notify = producer_waiting;
+            }
+            if (notify) {
+                space_cv.notify_one();
+            }
+            if (!stopped()) {
+                process(token);
+            }
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(wake_mutex);
+        if (closing.load(std::memory_order_acquire) && ring.empty()) {
+            break;
+        }
+        wake_cv.wait(lock, [&] { return !ring.empty() || closing.load(std::memory_order_acquire); });
+    }
+
+    if (emit && !stopped()) {
+        emit(response);  // Nothing more can complete a pattern; release the held-back tail
+    }
+}
+
+void token_postprocessor::process(llama_token token) {
+    const int index = n_processed++;
+
+    char piece[256];
+    const int n_chars = llama_token_to_piece(
+        vocab,
+        token,
+        piece,
+        sizeof(piece),
+        0,     // lstrip
+        false  // special
+    );
+
+    if (n_chars > 0) {
+        const std::string token_text(piece, n_chars);
+        accumulated_text += token_text;
+        response += token_text;
+
+        for (const char* pattern : END_PATTERNS) {
+            if (accumulated_text.find(pattern) == std::string::npos) {
+                continue;
+            }
+            LOGI("Hit end pattern in text: '%.30s', stopping generation", accumulated_text.c_str());
+
+            // Cut the response at the earliest end pattern
+            size_t end_pos = std::string::npos;
+            for (const char* p : END_PATTERNS) {
+                end_pos = std::min(end_pos, response.find(p));
+            }
+            response.resize(std::min(end_pos, response.size()));
+            stop_at.store(index, std::memory_order_release);
+            if (emit) {
+                emit(response);
+            }
+            return;
+        }
+
+        // Keep only the last 50 chars for pattern checking
+        if (accumulated_text.length() > 50) {
+            accumulated_text.erase(0, accumulated_text.length() - 50);
+        }
+
+        if (emit) {
+            emit(response.substr(0, response.size() - partial_pattern_length(response)));
+        }
+    }
+
+    // Log progress every 5 tokens for better mobile UX feedback
+    if ((index + 1) % 5 == 0) {
+        LOGI("Generated %d/%d tokens, current: '%.20s...'", index + 1, n_predict, response.c_str());
+    }
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "llama.h"
+
+// Lock-free ring for exactly one producer thread and one consumer thread.
+// N must be a power of two.
+template <typename T, size_t N>
+class spsc_ring {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "spsc_ring capacity must be a power of two");
+
+public:
+    bool try_push(const T& value) {
+        const size_t write = write_pos.load(std::memory_order_relaxed);
+        if (write - read_pos.load(std::memory_order_acquire) == N) {
+            return false;
+        }
+        slots[write & (N - 1)] = value;
+        write_pos.store(write + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T& value) {
+        const size_t read = read_pos.load(std::memory_order_relaxed);
+        if (read == write_pos.load(std::memory_order_acquire)) {
+            return false;
+        }
+        value = slots[read & (N - 1)];
+        read_pos.store(read + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return read_pos.load(std::memory_order_acquire) == write_pos.load(std::memory_order_acquire);
+    }
+
+    bool full() const {
+        return write_pos.load(std::memory_order_acquire) - read_pos.load(std::memory_order_acquire) == N;
+    }
+
+private:
+    T slots[N];
+    alignas(64) std::atomic<size_t> write_pos{0};  // Separate cache lines: no false sharing
+    alignas(64) std::atomic<size_t> read_pos{0};
+};
+
+// Turns sampled token ids into text on its own thread, so the decode loop only
+// samples and decodes. Detokenization, stop-pattern matching, streaming and
+// progress logging all happen here. The decode loop pushes each sampled token
+// and polls stopped(). Once a stop pattern has been seen, it stops decoding and
+// rolls back every token from stop_index() onward, which it decoded in the
+// meantime.
+class token_postprocessor {
+public:
+    // Receives the response text that is safe to show so far, i.e. without a
+    // trailing partial stop pattern. Called on the post-processing thread.
+    using emit_fn = std::function<void(const std::string& visible_text)>;
+
+    token_postprocessor(const llama_vocab* vocab, int n_predict, emit_fn emit);
+    ~token_postprocessor();
+
+    token_postprocessor(const token_postprocessor&) = delete;
+    token_postprocessor& operator=(const token_postprocessor&) = delete;
+
+    // Hand over the next sampled token. Only blocks if the ring is full, until
+    // the worker frees a slot.
+    void push(llama_token token);
+
+    // Keep the next n_tokens pushed back from the post-processing thread, so
+    // none of them reaches emit, until the last of them is pushed or finish()
+    // is called. For a reply whose start may still be replaced by another
+    // model's; drop_held() discards them instead.
+    void hold(int n_tokens);
+    void drop_held();
+
+    bool stopped() const { return stop_at.load(std::memory_order_acquire) >= 0; }
+
+    // Process everything pushed so far, stop the thread and return the response
+    std::string finish();
+
+    // Index (in push order) of the token that completed a stop pattern, -1 if none
+    int stop_index() const { return stop_at.load(std::memory_order_acquire); }
+
+private:
+    static constexpr size_t RING_SIZE = 64;
+
+    const llama_vocab* vocab;
+    const int n_predict;
+    emit_fn emit;
+
+    spsc_ring<llama_token, RING_SIZE> ring;
+    // Sleeping on either side is decided under wake_mutex, and the other side
+    // takes it before notifying, so a wake-up cannot fall between the check and the wait
+    std::mutex wake_mutex;
+    std::condition_variable wake_cv;   // Worker: a token or closing arrived
+    std::condition_variable space_cv;  // Producer: the full ring has a free slot
+    bool producer_waiting = false;     // Guarded by wake_mutex
+    std::atomic<bool> closing{false};
+    std::atomic<int> stop_at{-1};
+    std::thread worker;
+
+    // Owned by the producer
+    std::vector<llama_token> held;
+    int n_hold = 0;
+
+    // Owned by the worker until finish() joins it
+    std::string response;
+    std::string accumulated_text;  // Tail of the response checked for end patterns
+    int n_processed = 0;
+
+    void enqueue(llama_token token);
+    void release_held();
+    void run();
+    void process(llama_token token);
+};
@@ -0,0 +1,123 @@
+#include "vocab-constraints.h"
+
+#include <cstring>
+
+namespace {
+
+uint8_t classify_text(const char* text, int n) {
+    if (n <= 0) {
+        return 0;  // Control tokens have no text and belong to no class
+    }
+
+    bool ascii = true;
+    bool digits = true;
+    bool markup = false;
+    for (int i = 0; i < n; i++) {
+        const unsigned char c = static_cast<unsigned char>(text[i]);
+        const bool space = c == ' ' || c == '\n' || c == '\t' || c == '\r';
+        ascii = ascii && (space || (c >= 0x20 && c < 0x7f));
+        digits = digits && (space || (c >= '0' && c <= '9') || std::strchr(".,+-", c) != nullptr);
+        markup = markup || (c != 0 && std::strchr("*_`#<>[]|~\\", c) != nullptr);
+    }
+
+    uint8_t classes = 0;
+    if (ascii) {
+        classes |= VOCAB_CLASS_ASCII;
+    }
+    if (digits) {
+        classes |= VOCAB_CLASS_DIGITS;
+    }
+    if (markup) {
+        classes |= VOCAB_CLASS_MARKUP;
+    }
+    return classes;
+}
+
+} // namespace
+
+vocab_constraints::vocab_constraints(const llama_vocab* vocab)
+    : vocab(vocab), n_vocab(llama_vocab_n_tokens(vocab)) {}
+
+void vocab_constraints::classify_vocab() {
+    text_classes.resize(n_vocab);
+    char piece[256];
+    for (llama_token id = 0; id < n_vocab; id++) {
+        const int n = llama_token_to_piece(vocab, id, piece, sizeof(piece), 0, false);
+        text_classes[id] = classify_text(piece, n);
+    }
+}
+
+const std::vector<bool>& vocab_constraints::label_tokens(const std::string& labels) {
+    auto it = label_sets.find(labels);
+    if (it != label_sets.end()) {
+        return it->second;
+    }
+    if (label_sets.size() >= MAX_CACHED) {
+        label_sets.clear();
+    }
+
+    std::vector<bool> in_set(n_vocab, false);
+    std::vector<llama_token> tokens(256);
+    size_t start = 0;
+    while (start <= labels.size()) {
+        size_t end = labels.find('\n', start);
+        if (end == std::string::npos) {
+            end = labels.size();
+        }
+        const std::string label = labels.substr(start, end - start);
+        start = end + 1;
+        if (label.empty()) {
+            continue;
+        }
+
+        // A label may start the reply or follow a space
+        for (const std::string& text : {label, " " + label}) {
+            int n = llama_tokenize(vocab, text.c_str(), text.size(), tokens.data(), tokens.size(), false, false);
+            if (n < 0) {
+                tokens.resize(-n);
+                n = llama_tokenize(vocab, text.c_str(), text.size(), tokens.data(), tokens.size(), false, false);
+            }
+            for (int i = 0; i < n; i++) {
+                if (tokens[i] >= 0 && tokens[i] < n_vocab) {
+                    in_set[tokens[i]] = true;
+                }
+            }
+        }
+    }
+    return label_sets.emplace(labels, std::move(in_set)).first->second;
+}
+
+std::shared_ptr<const token_mask> vocab_constraints::mask(int32_t allow, int32_t ban, const std::string& labels) {
+    const bool uses_labels = ((allow | ban) & VOCAB_CLASS_LABELS) != 0;
+    const std::string key = std::to_string(allow) + ":" + std::to_string(ban) + ":" + (uses_labels ? labels : "");
+    auto it = masks.find(key);
+    if (it != masks.end()) {
+        return it->second;
+    }
+    if (masks.size() >= MAX_CACHED) {
+        masks.clear();
+    }
+
+    if (text_classes.empty()) {
+        classify_vocab();
+    }
+    static const std::vector<bool> no_labels;
+    const std::vector<bool>& in_labels = uses_labels ? label_tokens(labels) : no_labels;
+
+    auto result = std::make_shared<token_mask>();
+    result->allowed_bits.assign((n_vocab + 31) / 32, 0);
+    for (llama_token id = 0; id < n_vocab; id++) {
+        int32_t classes = text_classes[id];
+        if (uses_labels && in_labels[id]) {
+            classes |= VOCAB_CLASS_LABELS;
+        }
+        const bool allowed = llama_vocab_is_eog(vocab, id) ||
+                             ((allow == 0 || (classes & allow) != 0) && (classes & ban) == 0);
+        if (allowed) {
+            result->allowed_bits[id / 32] |= 1u << (id % 32);
+            result->n_allowed++;
+        }
+    }
+    masks.emplace(key, result);
+    return result;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "llama.h"
+
+// Token classes a request can allow or ban, derived from each token's text
+enum vocab_class : int32_t {
+    VOCAB_CLASS_ASCII = 1 << 0,   // Printable ASCII and whitespace only (no emoji, no byte tokens)
+    VOCAB_CLASS_DIGITS = 1 << 1,  // Digits, whitespace and . , + -
+    VOCAB_CLASS_MARKUP = 1 << 2,  // Contains a markdown/HTML character: * _ ` # < > [ ] | ~ backslash
+    VOCAB_CLASS_LABELS = 1 << 3,  // Appears in the tokenization of the request's label set
+};
+
+// One bit per vocabulary entry, set when the token may be sampled
+struct token_mask {
+    std::vector<uint32_t> allowed_bits;
+    int32_t n_allowed = 0;
+};
+
+// Builds allowed-token bitmaps from vocab_class combinations. Each class is
+// classified once per model and every combination once per distinct
+// (allow, ban, labels) triple, so applying a constraint on a request costs a
+// single masked pass over the logits. End-of-generation tokens are always
+// allowed, so a constrained request can still finish.
+class vocab_constraints {
+public:
+    explicit vocab_constraints(const llama_vocab* vocab);
+
+    // allow = 0 admits the whole vocabulary before bans are applied. labels is a
+    // newline-separated label set, used by VOCAB_CLASS_LABELS.
+    // The mask stays valid after later calls evict it from the cache.
+    std::shared_ptr<const token_mask> mask(int32_t allow, int32_t ban, const std::string& labels);
+
+    size_t cached_masks() const { return masks.size(); }
+
+private:
+    static constexpr size_t MAX_CACHED = 16;
+
+    const llama_vocab* vocab;
+    int32_t n_vocab;
+    std::vector<uint8_t> text_classes;               // ASCII/DIGITS/MARKUP bits per token, built on first use
+    std::map<std::string, std::vector<bool>> label_sets;
+    std::map<std::string, std::shared_ptr<const token_mask>> masks;
+
+    void classify_vocab();
+    const std::vector<bool>& label_tokens(const std::string& labels);
+};
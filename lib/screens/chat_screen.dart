@@ -1,4 +1,7 @@
+import 'dart:async';
+
 import 'package:flutter/material.dart';
+import 'package:path_provider/path_provider.dart';
 import '../models/chat_message.dart';
 import '../models/model_config.dart';
 import '../services/llama_service.dart';
@@ -60,6 +63,16 @@ class _ChatScreenState extends State<ChatScreen> {
     final success =
         await _llamaService.loadModel(_modelManager.modelFile!.path, useGpu: GpuSettings.useGpu);
 
+    if (success) {
+      // Release the KV cache and compute buffers when the chat sits idle
+      final cacheDir = await getApplicationCacheDirectory();
+      _llamaService.setIdlePolicy(
+        const Duration(minutes: 5),
+        '${cacheDir.path}/session.idle',
+        minFreeRamMb: 512,
+      );
+    }
+
     setState(() {
       if (success) {
         _messages.last = ChatMessage(
@@ -96,8 +109,20 @@ class _ChatScreenState extends State<ChatScreen> {
 
     final stopwatch = Stopwatch()..start();
 
+    // Stream the reply into the placeholder while the native side generates it
+    final streamTimer =
+        Timer.periodic(const Duration(milliseconds: 100), (_) {
+      final partial = _llamaService.getPartialResponse();
+      if (mounted && _isGenerating && partial != _messages.last.text) {
+        setState(() {
+          _messages.last = ChatMessage(text: partial, isUser: false);
+        });
+      }
+    });
+
     try {
       final response = await _llamaService.generateResponse(prompt);
+      streamTimer.cancel();
       stopwatch.stop();
       
       if (mounted) {
@@ -111,6 +136,7 @@ class _ChatScreenState extends State<ChatScreen> {
         });
       }
     } catch (e) {
+      streamTimer.cancel();
       stopwatch.stop();
       if (mounted) {
         setState(() {
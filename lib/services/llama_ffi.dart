@@ -5,33 +5,250 @@ import 'package:ffi/ffi.dart';
 // --- FFI Type Definitions ---
 final class LlamaOpaque extends Opaque {}
 
+/// Connection to a model served by another process, see `model_client`.
+final class ModelClientOpaque extends Opaque {}
+
+/// Request classes: interactive requests get hard deadlines, background jobs
+/// soft ones. Indices match `request_priority` in native-lib.cpp.
+enum RequestPriority { interactive, background }
+
+/// Token classes a reply can be restricted to or banned from, mirrors
+/// `vocab_class` in vocab-constraints.h.
+abstract final class VocabClass {
+  static const int ascii = 1 << 0;
+  static const int digits = 1 << 1;
+  static const int markup = 1 << 2;
+  static const int labels = 1 << 3;
+}
+
+/// What the native queue does with a request that arrives while it is full,
+/// mirrors `admission_policy` in request-scheduler.h.
+enum QueuePolicy { reject, coalesce, replaceLatest }
+
+/// Per-request options, mirrors `request_options` in native-lib.cpp.
+final class RequestOptions extends Struct {
+  @Int32()
+  external int maxTokens;
+
+  @Int32()
+  external int maxTtftMs;
+
+  @Int32()
+  external int maxTotalMs;
+
+  @Int32()
+  external int priority;
+
+  @Int32()
+  external int allowClasses;
+
+  @Int32()
+  external int banClasses;
+
+  external Pointer<Utf8> labels;
+
+  external Pointer<Int32> biasTokens;
+
+  external Pointer<Float> biasValues;
+
+  @Int32()
+  external int nBiases;
+
+  @Int32()
+  external int greedy;
+
+  @Uint32()
+  external int seed;
+
+  @Int32()
+  external int templated;
+}
+
 typedef LoadModelNative = Pointer<LlamaOpaque> Function(
     Pointer<Utf8> modelPath);
 typedef LoadModelWithGpuNative = Pointer<LlamaOpaque> Function(
     Pointer<Utf8> modelPath, Bool useGpu);
 typedef PredictNative = Pointer<Utf8> Function(
     Pointer<LlamaOpaque> context, Pointer<Utf8> prompt);
+typedef PredictWithOptionsNative = Pointer<Utf8> Function(
+    Pointer<LlamaOpaque> context,
+    Pointer<Utf8> prompt,
+    Pointer<RequestOptions> options);
 typedef FreeStringNative = Void Function(Pointer<Utf8> str);
 typedef FreeModelNative = Void Function(Pointer<LlamaOpaque> context);
 typedef ResetConversationNative = Void Function(Pointer<LlamaOpaque> context);
+typedef SetIdlePolicyNative = Void Function(Pointer<LlamaOpaque> context,
+    Int32 idleTimeoutMs, Pointer<Utf8> snapshotPath, Int32 minFreeRamMb);
+typedef SetThermalGovernorNative = Void Function(Pointer<LlamaOpaque> context,
+    Pointer<Utf8> sysfsRoot, Float throttleTempC, Float criticalTempC);
+typedef SetEnergySamplerNative = Void Function(
+    Pointer<LlamaOpaque> context, Pointer<Utf8> sysfsRoot, Int32 intervalMs);
+typedef SetQueuePolicyNative = Void Function(Pointer<LlamaOpaque> context,
+    Int32 maxDepth, Int32 maxQueuedCostMs, Int32 policy);
+typedef SetPrefillBudgetNative = Void Function(
+    Pointer<LlamaOpaque> context, Int32 stepTokens);
+typedef SetFusedSamplerNative = Void Function(
+    Pointer<LlamaOpaque> context, Bool enabled);
+typedef BenchmarkSamplerNative = Pointer<Utf8> Function(
+    Int32 nVocab, Int32 iterations);
+typedef SetResponseCacheNative = Bool Function(
+    Pointer<LlamaOpaque> context, Pointer<Utf8> path, Int32 maxMb);
+typedef SetSemanticCacheNative = Bool Function(
+    Pointer<LlamaOpaque> context, Int32 maxEntries, Float threshold);
+typedef SetCascadeNative = Bool Function(
+    Pointer<LlamaOpaque> context,
+    Pointer<LlamaOpaque> escalation,
+    Int32 kTokens,
+    Float maxEntropy,
+    Float minLogprob);
+typedef SetCompactionPolicyNative = Void Function(
+    Pointer<LlamaOpaque> context,
+    Float triggerRatio,
+    Float targetRatio,
+    Int32 keepRecentTurns,
+    Int32 maxSummaryTokens);
+typedef SetKvPagingNative = Bool Function(Pointer<LlamaOpaque> context,
+    Pointer<Utf8> path, Int32 pageKb, Float targetRatio);
+typedef RewindConversationNative = Bool Function(
+    Pointer<LlamaOpaque> context, Int32 nTurns);
+typedef SetSessionLogNative = Int32 Function(
+    Pointer<LlamaOpaque> context, Pointer<Utf8> path, Bool compress);
+typedef StartModelServerNative = Bool Function(
+    Pointer<LlamaOpaque> context, Pointer<Utf8> socketPath);
+typedef StopModelServerNative = Void Function(Pointer<LlamaOpaque> context);
+typedef ConnectModelServerNative = Pointer<ModelClientOpaque> Function(
+    Pointer<Utf8> socketPath);
+typedef RemotePredictNative = Pointer<Utf8> Function(
+    Pointer<ModelClientOpaque> client,
+    Pointer<Utf8> prompt,
+    Pointer<RequestOptions> options);
+typedef RemotePartialResponseNative = Pointer<Utf8> Function(
+    Pointer<ModelClientOpaque> client);
+typedef CancelRemotePredictNative = Void Function(
+    Pointer<ModelClientOpaque> client);
+typedef DisconnectModelServerNative = Void Function(
+    Pointer<ModelClientOpaque> client);
+typedef StartHttpServerNative = Int32 Function(
+    Pointer<LlamaOpaque> context, Int32 port);
+typedef StopHttpServerNative = Void Function(Pointer<LlamaOpaque> context);
+typedef GetHttpServerTokenNative = Pointer<Utf8> Function(
+    Pointer<LlamaOpaque> context);
+typedef SetPerfCountersNative = Bool Function(
+    Pointer<LlamaOpaque> context, Bool enabled);
+typedef GetLatencyMetricsNative = Pointer<Utf8> Function();
+typedef GetMetricsNative = Pointer<Utf8> Function(Pointer<LlamaOpaque> context);
 
 typedef LoadModelDart = Pointer<LlamaOpaque> Function(Pointer<Utf8> modelPath);
 typedef LoadModelWithGpuDart = Pointer<LlamaOpaque> Function(
     Pointer<Utf8> modelPath, bool useGpu);
 typedef PredictDart = Pointer<Utf8> Function(
     Pointer<LlamaOpaque> context, Pointer<Utf8> prompt);
+typedef PredictWithOptionsDart = Pointer<Utf8> Function(
+    Pointer<LlamaOpaque> context,
+    Pointer<Utf8> prompt,
+    Pointer<RequestOptions> options);
 typedef FreeStringDart = void Function(Pointer<Utf8> str);
 typedef FreeModelDart = void Function(Pointer<LlamaOpaque> context);
 typedef ResetConversationDart = void Function(Pointer<LlamaOpaque> context);
+typedef SetIdlePolicyDart = void Function(Pointer<LlamaOpaque> context,
+    int idleTimeoutMs, Pointer<Utf8> snapshotPath, int minFreeRamMb);
+typedef SetThermalGovernorDart = void Function(Pointer<LlamaOpaque> context,
+    Pointer<Utf8> sysfsRoot, double throttleTempC, double criticalTempC);
+typedef SetEnergySamplerDart = void Function(
+    Pointer<LlamaOpaque> context, Pointer<Utf8> sysfsRoot, int intervalMs);
+typedef SetQueuePolicyDart = void Function(Pointer<LlamaOpaque> context,
+    int maxDepth, int maxQueuedCostMs, int policy);
+typedef SetPrefillBudgetDart = void Function(
+    Pointer<LlamaOpaque> context, int stepTokens);
+typedef SetFusedSamplerDart = void Function(
+    Pointer<LlamaOpaque> context, bool enabled);
+typedef BenchmarkSamplerDart = Pointer<Utf8> Function(
+    int nVocab, int iterations);
+typedef SetResponseCacheDart = bool Function(
+    Pointer<LlamaOpaque> context, Pointer<Utf8> path, int maxMb);
+typedef SetSemanticCacheDart = bool Function(
+    Pointer<LlamaOpaque> context, int maxEntries, double threshold);
+typedef SetCascadeDart = bool Function(
+    Pointer<LlamaOpaque> context,
+    Pointer<LlamaOpaque> escalation,
+    int kTokens,
+    double maxEntropy,
+    double minLogprob);
+typedef SetCompactionPolicyDart = void Function(
+    Pointer<LlamaOpaque> context,
+    double triggerRatio,
+    double targetRatio,
+    int keepRecentTurns,
+    int maxSummaryTokens);
+typedef SetKvPagingDart = bool Function(Pointer<LlamaOpaque> context,
+    Pointer<Utf8> path, int pageKb, double targetRatio);
+typedef RewindConversationDart = bool Function(
+    Pointer<LlamaOpaque> context, int nTurns);
+typedef SetSessionLogDart = int Function(
+    Pointer<LlamaOpaque> context, Pointer<Utf8> path, bool compress);
+typedef StartModelServerDart = bool Function(
+    Pointer<LlamaOpaque> context, Pointer<Utf8> socketPath);
+typedef StopModelServerDart = void Function(Pointer<LlamaOpaque> context);
+typedef ConnectModelServerDart = Pointer<ModelClientOpaque> Function(
+    Pointer<Utf8> socketPath);
+typedef RemotePredictDart = Pointer<Utf8> Function(
+    Pointer<ModelClientOpaque> client,
+    Pointer<Utf8> prompt,
+    Pointer<RequestOptions> options);
+typedef RemotePartialResponseDart = Pointer<Utf8> Function(
+    Pointer<ModelClientOpaque> client);
+typedef CancelRemotePredictDart = void Function(
+    Pointer<ModelClientOpaque> client);
+typedef DisconnectModelServerDart = void Function(
+    Pointer<ModelClientOpaque> client);
+typedef StartHttpServerDart = int Function(
+    Pointer<LlamaOpaque> context, int port);
+typedef StopHttpServerDart = void Function(Pointer<LlamaOpaque> context);
+typedef GetHttpServerTokenDart = Pointer<Utf8> Function(
+    Pointer<LlamaOpaque> context);
+typedef SetPerfCountersDart = bool Function(
+    Pointer<LlamaOpaque> context, bool enabled);
+typedef GetLatencyMetricsDart = Pointer<Utf8> Function();
+typedef GetMetricsDart = Pointer<Utf8> Function(Pointer<LlamaOpaque> context);
 
 class LlamaFFI {
   late final DynamicLibrary _lib;
   late final LoadModelDart loadModel;
   late final LoadModelWithGpuDart loadModelWithGpu;
   late final PredictDart predict;
+  late final PredictWithOptionsDart predictWithOptions;
   late final FreeStringDart freeString;
   late final FreeModelDart freeModel;
   late final ResetConversationDart resetConversation;
+  late final SetIdlePolicyDart setIdlePolicy;
+  late final SetThermalGovernorDart setThermalGovernor;
+  late final SetEnergySamplerDart setEnergySampler;
+  late final SetQueuePolicyDart setQueuePolicy;
+  late final SetPrefillBudgetDart setPrefillBudget;
+  late final SetFusedSamplerDart setFusedSampler;
+  late final BenchmarkSamplerDart benchmarkSampler;
+  late final SetResponseCacheDart setResponseCache;
+  late final SetSemanticCacheDart setSemanticCache;
+  late final SetCascadeDart setCascade;
+  late final SetCompactionPolicyDart setCompactionPolicy;
+  late final SetKvPagingDart setKvPaging;
+  late final RewindConversationDart rewindConversation;
+  late final SetSessionLogDart setSessionLog;
+  late final StartModelServerDart startModelServer;
+  late final StopModelServerDart stopModelServer;
+  late final ConnectModelServerDart connectModelServer;
+  late final RemotePredictDart remotePredict;
+  late final RemotePartialResponseDart remotePartialResponse;
+  late final CancelRemotePredictDart cancelRemotePredict;
+  late final DisconnectModelServerDart disconnectModelServer;
+  late final StartHttpServerDart startHttpServer;
+  late final StopHttpServerDart stopHttpServer;
+  late final GetHttpServerTokenDart getHttpServerToken;
+  late final SetPerfCountersDart setPerfCounters;
+  late final GetLatencyMetricsDart getLatencyMetrics;
+  late final GetMetricsDart getMetrics;
+  late final GetMetricsDart getMemoryStats;
+  late final GetMetricsDart getPartialResponse;
 
   LlamaFFI() {
     _lib = Platform.isAndroid
@@ -50,6 +267,11 @@ class LlamaFFI {
         .lookup<NativeFunction<PredictNative>>('predict')
         .asFunction<PredictDart>();
 
+    predictWithOptions = _lib
+        .lookup<NativeFunction<PredictWithOptionsNative>>(
+            'predict_with_options')
+        .asFunction<PredictWithOptionsDart>();
+
     freeString = _lib
         .lookup<NativeFunction<FreeStringNative>>('free_string')
         .asFunction<FreeStringDart>();
@@ -61,5 +283,129 @@ class LlamaFFI {
     resetConversation = _lib
         .lookup<NativeFunction<ResetConversationNative>>('reset_conversation')
         .asFunction<ResetConversationDart>();
+
+    setIdlePolicy = _lib
+        .lookup<NativeFunction<SetIdlePolicyNative>>('set_idle_policy')
+        .asFunction<SetIdlePolicyDart>();
+
+    setThermalGovernor = _lib
+        .lookup<NativeFunction<SetThermalGovernorNative>>(
+            'set_thermal_governor')
+        .asFunction<SetThermalGovernorDart>();
+
+    setEnergySampler = _lib
+        .lookup<NativeFunction<SetEnergySamplerNative>>('set_energy_sampler')
+        .asFunction<SetEnergySamplerDart>();
+
+    setQueuePolicy = _lib
+        .lookup<NativeFunction<SetQueuePolicyNative>>('set_queue_policy')
+        .asFunction<SetQueuePolicyDart>();
+
+    setPrefillBudget = _lib
+        .lookup<NativeFunction<SetPrefillBudgetNative>>('set_prefill_budget')
+        .asFunction<SetPrefillBudgetDart>();
+
+    setFusedSampler = _lib
+        .lookup<NativeFunction<SetFusedSamplerNative>>('set_fused_sampler')
+        .asFunction<SetFusedSamplerDart>();
+
+    benchmarkSampler = _lib
+        .lookup<NativeFunction<BenchmarkSamplerNative>>('benchmark_sampler')
+        .asFunction<BenchmarkSamplerDart>();
+
+    setResponseCache = _lib
+        .lookup<NativeFunction<SetResponseCacheNative>>('set_response_cache')
+        .asFunction<SetResponseCacheDart>();
+
+    setSemanticCache = _lib
+        .lookup<NativeFunction<SetSemanticCacheNative>>('set_semantic_cache')
+        .asFunction<SetSemanticCacheDart>();
+
+    setCascade = _lib
+        .lookup<NativeFunction<SetCascadeNative>>('set_cascade')
+        .asFunction<SetCascadeDart>();
+
+    setCompactionPolicy = _lib
+        .lookup<NativeFunction<SetCompactionPolicyNative>>(
+            'set_compaction_policy')
+        .asFunction<SetCompactionPolicyDart>();
+
+    setKvPaging = _lib
+        .lookup<NativeFunction<SetKvPagingNative>>('set_kv_paging')
+        .asFunction<SetKvPagingDart>();
+
+    rewindConversation = _lib
+        .lookup<NativeFunction<RewindConversationNative>>(
+            'rewind_conversation')
+        .asFunction<RewindConversationDart>();
+
+    setSessionLog = _lib
+        .lookup<NativeFunction<SetSessionLogNative>>('set_session_log')
+        .asFunction<SetSessionLogDart>();
+
+    startModelServer = _lib
+        .lookup<NativeFunction<StartModelServerNative>>('start_model_server')
+        .asFunction<StartModelServerDart>();
+
+    stopModelServer = _lib
+        .lookup<NativeFunction<StopModelServerNative>>('stop_model_server')
+        .asFunction<StopModelServerDart>();
+
+    connectModelServer = _lib
+        .lookup<NativeFunction<ConnectModelServerNative>>(
+            'connect_model_server')
+        .asFunction<ConnectModelServerDart>();
+
+    remotePredict = _lib
+        .lookup<NativeFunction<RemotePredictNative>>('remote_predict')
+        .asFunction<RemotePredictDart>();
+
+    remotePartialResponse = _lib
+        .lookup<NativeFunction<RemotePartialResponseNative>>(
+            'remote_partial_response')
+        .asFunction<RemotePartialResponseDart>();
+
+    cancelRemotePredict = _lib
+        .lookup<NativeFunction<CancelRemotePredictNative>>(
+            'cancel_remote_predict')
+        .asFunction<CancelRemotePredictDart>();
+
+    disconnectModelServer = _lib
+        .lookup<NativeFunction<DisconnectModelServerNative>>(
+            'disconnect_model_server')
+        .asFunction<DisconnectModelServerDart>();
+
+    startHttpServer = _lib
+        .lookup<NativeFunction<StartHttpServerNative>>('start_http_server')
+        .asFunction<StartHttpServerDart>();
+
+    stopHttpServer = _lib
+        .lookup<NativeFunction<StopHttpServerNative>>('stop_http_server')
+        .asFunction<StopHttpServerDart>();
+
+    getHttpServerToken = _lib
+        .lookup<NativeFunction<GetHttpServerTokenNative>>(
+            'get_http_server_token')
+        .asFunction<GetHttpServerTokenDart>();
+
+    setPerfCounters = _lib
+        .lookup<NativeFunction<SetPerfCountersNative>>('set_perf_counters')
+        .asFunction<SetPerfCountersDart>();
+
+    getLatencyMetrics = _lib
+        .lookup<NativeFunction<GetLatencyMetricsNative>>('get_latency_metrics')
+        .asFunction<GetLatencyMetricsDart>();
+
+    getMetrics = _lib
+        .lookup<NativeFunction<GetMetricsNative>>('get_metrics')
+        .asFunction<GetMetricsDart>();
+
+    getMemoryStats = _lib
+        .lookup<NativeFunction<GetMetricsNative>>('get_memory_stats')
+        .asFunction<GetMetricsDart>();
+
+    getPartialResponse = _lib
+        .lookup<NativeFunction<GetMetricsNative>>('get_partial_response')
+        .asFunction<GetMetricsDart>();
   }
 }
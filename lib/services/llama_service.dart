@@ -1,3 +1,4 @@
+import 'dart:convert';
 import 'dart:ffi';
 import 'dart:io';
 import 'package:ffi/ffi.dart';
@@ -7,6 +8,7 @@ import '../services/llama_ffi.dart';
 class LlamaService {
   final LlamaFFI _ffi = LlamaFFI();
   Pointer<LlamaOpaque>? _context;
+  Pointer<LlamaOpaque>? _escalation;
   bool _isInitialized = false;
 
   bool get isInitialized => _isInitialized;
@@ -46,7 +48,365 @@ class LlamaService {
     }
   }
 
-  Future<String> generateResponse(String prompt) async {
+  /// Drop the last [turns] exchanges of the conversation, e.g. to regenerate
+  /// the last reply. Turns paged out by [setKvPaging] are read back from flash.
+  bool rewindConversation({int turns = 1}) {
+    if (!_isInitialized || _context == null) {
+      return false;
+    }
+    return _ffi.rewindConversation(_context!, turns);
+  }
+
+  /// Unload the context after [idleTimeout] without requests. The KV state is
+  /// snapshotted to [snapshotPath] and restored on the next request; the model
+  /// itself is only released when free RAM drops below [minFreeRamMb].
+  void setIdlePolicy(Duration idleTimeout, String snapshotPath,
+      {int minFreeRamMb = 0}) {
+    if (_isInitialized && _context != null) {
+      final pathC = snapshotPath.toNativeUtf8();
+      _ffi.setIdlePolicy(
+          _context!, idleTimeout.inMilliseconds, pathC, minFreeRamMb);
+      calloc.free(pathC);
+    }
+  }
+
+  /// Enable the thermal governor, which adapts thread count, core placement
+  /// and inter-token pacing from sysfs thermal zones and CPU frequencies.
+  /// A [throttleTempC] of 0 disables it. [sysfsRoot] defaults to /sys.
+  void setThermalGovernor(
+      {double throttleTempC = 45.0,
+      double criticalTempC = 55.0,
+      String sysfsRoot = '/sys'}) {
+    if (_isInitialized && _context != null) {
+      final rootC = sysfsRoot.toNativeUtf8();
+      _ffi.setThermalGovernor(_context!, rootC, throttleTempC, criticalTempC);
+      calloc.free(rootC);
+    }
+  }
+
+  /// Sample battery current/voltage every [interval] during requests and
+  /// report mJ per prompt token and per generated token in the metrics.
+  /// A zero interval disables sampling.
+  void setEnergySampler(
+      {Duration interval = const Duration(milliseconds: 50),
+      String sysfsRoot = '/sys'}) {
+    if (_isInitialized && _context != null) {
+      final rootC = sysfsRoot.toNativeUtf8();
+      _ffi.setEnergySampler(_context!, rootC, interval.inMilliseconds);
+      calloc.free(rootC);
+    }
+  }
+
+  /// Count CPU cycles, instructions, cache misses and backend stalls for the
+  /// prefill and decode phases of each request (`prefill_perf` and
+  /// `decode_perf` in the request metrics). Returns false when the device
+  /// does not permit perf events; the reason is under `perf_counters` in
+  /// getMetrics().
+  bool setPerfCounters(bool enabled) {
+    if (!_isInitialized || _context == null) {
+      return false;
+    }
+    return _ffi.setPerfCounters(_context!, enabled);
+  }
+
+  /// Bound the native request queue. Requests arriving while [maxDepth]
+  /// requests (or [maxQueuedCost] of estimated work) are waiting are handled
+  /// by [policy]. A zero depth or cost means unbounded.
+  void setQueuePolicy(
+      {int maxDepth = 8,
+      Duration maxQueuedCost = Duration.zero,
+      QueuePolicy policy = QueuePolicy.reject}) {
+    if (_isInitialized && _context != null) {
+      _ffi.setQueuePolicy(
+          _context!, maxDepth, maxQueuedCost.inMilliseconds, policy.index);
+    }
+  }
+
+  /// Tokens per decode step (including the step's own token) that may be
+  /// spent prefilling queued background prompts. Higher values shorten their
+  /// time to first token but slow the running stream; 0 disables this.
+  void setPrefillBudget(int stepTokens) {
+    if (_isInitialized && _context != null) {
+      _ffi.setPrefillBudget(_context!, stepTokens);
+    }
+  }
+
+  /// Use the fused SIMD sampler (default) or the llama.cpp sampler chain.
+  /// Both pick the same tokens for the same seed.
+  void setFusedSampler(bool enabled) {
+    if (_isInitialized && _context != null) {
+      _ffi.setFusedSampler(_context!, enabled);
+    }
+  }
+
+  /// Persist replies of deterministic requests ([generateResponse] with
+  /// `greedy` or a `seed`) in [path], using at most [maxMb] MiB. Repeats are
+  /// answered instantly from the cache. A [maxMb] of 0 turns it off.
+  bool setResponseCache(String path, {int maxMb = 16}) {
+    if (!_isInitialized || _context == null) {
+      return false;
+    }
+    final pathC = path.toNativeUtf8();
+    final ok = _ffi.setResponseCache(_context!, pathC, maxMb);
+    calloc.free(pathC);
+    return ok;
+  }
+
+  /// Answer near-identical questions ("capital of France?" after "what's the
+  /// capital of france") from memory when their embeddings reach a cosine
+  /// similarity of [threshold]. Only applies to a conversation's first turn and
+  /// to background requests that are greedy or seeded and have no class
+  /// constraints or logit biases; a reply is only reused under the same
+  /// sampling settings and token limit. Calling it again with the same [maxEntries]
+  /// only changes the threshold; 0 turns it off. Hit rate is under
+  /// `semantic_cache` in getMetrics().
+  bool setSemanticCache({int maxEntries = 256, double threshold = 0.92}) {
+    if (!_isInitialized || _context == null) {
+      return false;
+    }
+    return _ffi.setSemanticCache(_context!, maxEntries, threshold);
+  }
+
+  /// Save the conversation to [path] as it goes: each turn appends only its
+  /// new tokens and KV cells, written in the background, so a crash loses at
+  /// most the turn in flight. After a rewind, the full rewrite of the saved
+  /// conversation waits until the model is idle. A conversation already saved
+  /// there is restored and replaces the current one. [compress] deflates the
+  /// saved cells.
+  /// Returns the number of tokens restored, or -1 on failure.
+  int openSession(String path, {bool compress = false}) {
+    if (!_isInitialized || _context == null) {
+      return -1;
+    }
+    final pathC = path.toNativeUtf8();
+    final restored = _ffi.setSessionLog(_context!, pathC, compress);
+    calloc.free(pathC);
+    return restored;
+  }
+
+  /// Stop saving the conversation, once everything pending is written.
+  void closeSession() {
+    if (_isInitialized && _context != null) {
+      _ffi.setSessionLog(_context!, nullptr, false);
+    }
+  }
+
+  /// Serve the loaded model to other processes of this app's user (e.g. a
+  /// keyboard extension) on the Unix socket at [socketPath]; a name starting
+  /// with `@` is in the abstract namespace. They connect with
+  /// [RemoteLlamaClient] and share the weights and request queue; prompts and
+  /// replies travel through shared memory. Interactive remote requests
+  /// continue this conversation. Counts are under `model_server` in
+  /// getMetrics().
+  bool startModelServer(String socketPath) {
+    if (!_isInitialized || _context == null) {
+      return false;
+    }
+    final pathC = socketPath.toNativeUtf8();
+    final ok = _ffi.startModelServer(_context!, pathC);
+    calloc.free(pathC);
+    return ok;
+  }
+
+  /// Stop serving other processes, once their running requests finish.
+  void stopModelServer() {
+    if (_isInitialized && _context != null) {
+      _ffi.stopModelServer(_context!);
+    }
+  }
+
+  /// Serve an OpenAI-compatible API on 127.0.0.1:[port] (0 picks a free
+  /// port) for local tools and load tests: `/v1/chat/completions` with SSE
+  /// streaming, `/v1/embeddings` and `/v1/models`. Chat completions are
+  /// stateless background requests unless the body sets the extension
+  /// `"priority": "interactive"`, which continues this conversation. Every
+  /// request must send `Authorization: Bearer <token>` with the token from
+  /// [httpServerToken], and POST bodies must be `application/json`; requests
+  /// from web pages are refused. Returns the bound port, or -1. Counts are
+  /// under `http_server` in getMetrics().
+  int startHttpServer({int port = 8080}) {
+    if (!_isInitialized || _context == null) {
+      return -1;
+    }
+    return _ffi.startHttpServer(_context!, port);
+  }
+
+  /// Bearer token of the running HTTP endpoint, new each time it starts; empty
+  /// when none runs.
+  String httpServerToken() {
+    if (!_isInitialized || _context == null) {
+      return '';
+    }
+    final resultPtr = _ffi.getHttpServerToken(_context!);
+    final token = resultPtr.toDartString();
+    _ffi.freeString(resultPtr);
+    return token;
+  }
+
+  /// Stop the HTTP endpoint, once its running requests finish.
+  void stopHttpServer() {
+    if (_isInitialized && _context != null) {
+      _ffi.stopHttpServer(_context!);
+    }
+  }
+
+  /// Keep conversations longer than the context: turns that no longer fit
+  /// are moved to [path] in [pageKb] KiB pages until the chat fills at most
+  /// [targetRatio] of the context, and are paged back in by
+  /// [rewindConversation]. A [pageKb] of 0 turns it off. Counts and I/O
+  /// totals are under `kv_paging` in getMetrics().
+  bool setKvPaging(String path, {int pageKb = 64, double targetRatio = 0.5}) {
+    if (!_isInitialized || _context == null) {
+      return false;
+    }
+    final pathC = path.toNativeUtf8();
+    final ok = _ffi.setKvPaging(_context!, pathC, pageKb, targetRatio);
+    calloc.free(pathC);
+    return ok;
+  }
+
+  /// Summarize the oldest turns of a long chat while the app is idle, once it
+  /// fills [triggerRatio] of the context, until it fills at most
+  /// [targetRatio]. The last [keepRecentTurns] turns are kept verbatim and a
+  /// summary is at most [maxSummaryTokens] tokens. A [triggerRatio] of 0 turns
+  /// it off. Counts and timings are under `compaction` in getMetrics().
+  void setCompaction(
+      {double triggerRatio = 0.75,
+      double targetRatio = 0.5,
+      int keepRecentTurns = 2,
+      int maxSummaryTokens = 96}) {
+    if (_isInitialized && _context != null) {
+      _ffi.setCompactionPolicy(_context!, triggerRatio, targetRatio,
+          keepRecentTurns, maxSummaryTokens);
+    }
+  }
+
+  /// Cascade mode: keep answering on the loaded model, but hand a turn to the
+  /// larger model at [modelPath] (same tokenizer) when any of the first
+  /// [kTokens] tokens has an entropy above [maxEntropy] nats or a
+  /// log-probability below [minLogprob]. Escalation rate and the time and
+  /// energy saved versus the large model alone are under `cascade` in
+  /// getMetrics().
+  Future<bool> enableCascade(String modelPath,
+      {bool useGpu = true,
+      int kTokens = 8,
+      double maxEntropy = 3.0,
+      double minLogprob = -3.0}) async {
+    if (!_isInitialized || _context == null) {
+      return false;
+    }
+    disableCascade();
+
+    final pathC = modelPath.toNativeUtf8();
+    final escalation = _ffi.loadModelWithGpu(pathC, useGpu);
+    calloc.free(pathC);
+    if (escalation.address == 0) {
+      print('Failed to load escalation model');
+      return false;
+    }
+    if (!_ffi.setCascade(
+        _context!, escalation, kTokens, maxEntropy, minLogprob)) {
+      print('Escalation model rejected: vocabularies differ');
+      _ffi.freeModel(escalation);
+      return false;
+    }
+    _escalation = escalation;
+    return true;
+  }
+
+  /// Answer every turn on the loaded model again and free the larger one.
+  /// Call it while no reply is being generated.
+  void disableCascade() {
+    if (_escalation == null) {
+      return;
+    }
+    if (_context != null) {
+      _ffi.setCascade(_context!, nullptr, 0, 0.0, 0.0);
+    }
+    _ffi.freeModel(_escalation!);
+    _escalation = null;
+  }
+
+  /// ns per token of the llama.cpp chain vs the fused sampler on synthetic
+  /// logits; Gemma 3 has a 262144-token vocabulary. Needs no loaded model.
+  Map<String, dynamic> benchmarkSampler(
+      {int nVocab = 262144, int iterations = 200}) {
+    final resultPtr = _ffi.benchmarkSampler(nVocab, iterations);
+    final json = resultPtr.toDartString();
+    _ffi.freeString(resultPtr);
+    return jsonDecode(json) as Map<String, dynamic>;
+  }
+
+  /// Native metrics: last request timings, idle unload/wake-up counters and
+  /// thermal governor decisions, energy per token, cascade escalations and
+  /// response / semantic cache hit rates.
+  Map<String, dynamic> getMetrics() => _readJson(_ffi.getMetrics);
+
+  /// Rolling TTFT, inter-token latency, prefill rate, queue wait and model
+  /// load distributions for every model loaded in this process, as Prometheus
+  /// text (also served at /metrics by [startHttpServer]). Needs no loaded model.
+  String getLatencyMetrics() {
+    final resultPtr = _ffi.getLatencyMetrics();
+    final text = resultPtr.toDartString();
+    _ffi.freeString(resultPtr);
+    return text;
+  }
+
+  /// Native memory breakdown (weights, KV cache, compute buffers, saved state,
+  /// process RSS/PSS). Never blocks on a running request, so it can be polled
+  /// once a second for a memory HUD.
+  Map<String, dynamic> getMemoryStats() => _readJson(_ffi.getMemoryStats);
+
+  /// Text of the reply currently being generated, safe to poll from the UI
+  /// isolate while [generateResponse] runs.
+  String getPartialResponse() {
+    if (!_isInitialized || _context == null) {
+      return '';
+    }
+    final resultPtr = _ffi.getPartialResponse(_context!);
+    final text = resultPtr.toDartString();
+    _ffi.freeString(resultPtr);
+    return text;
+  }
+
+  Map<String, dynamic> _readJson(
+      Pointer<Utf8> Function(Pointer<LlamaOpaque>) call) {
+    if (!_isInitialized || _context == null) {
+      return {};
+    }
+    final resultPtr = call(_context!);
+    final json = resultPtr.toDartString();
+    _ffi.freeString(resultPtr);
+    return jsonDecode(json) as Map<String, dynamic>;
+  }
+
+  /// Generate a reply. [maxTtft] and [maxTotal] bound time to first token and
+  /// total wall time; they are hard limits for interactive requests and soft
+  /// targets for background ones. The stop reason is in getMetrics().
+  ///
+  /// Background requests run on their own KV sequence and are preempted at the
+  /// next decode step whenever an interactive request arrives, then resume.
+  ///
+  /// [allowClasses] and [banClasses] are [VocabClass] bits restricting which
+  /// tokens may be sampled, e.g. `allowClasses: VocabClass.labels` with
+  /// [labels] to answer with one of a few words, or
+  /// `banClasses: VocabClass.markup`. [logitBias] adds to the logits of
+  /// individual token ids.
+  ///
+  /// [greedy] always picks the most likely token, and a non-zero [seed]
+  /// samples from a fresh random stream. Either makes the reply repeatable, so
+  /// it can be served from the response cache (see [setResponseCache]).
+  Future<String> generateResponse(String prompt,
+      {int maxTokens = 20,
+      Duration? maxTtft,
+      Duration? maxTotal,
+      RequestPriority priority = RequestPriority.interactive,
+      int allowClasses = 0,
+      int banClasses = 0,
+      List<String> labels = const [],
+      Map<int, double> logitBias = const {},
+      bool greedy = false,
+      int seed = 0}) async {
     if (!_isInitialized || _context == null) {
       return 'Error: Model not loaded';
     }
@@ -56,6 +416,17 @@ class LlamaService {
       final result = await compute(_runInferenceCompute, {
         'contextAddress': _context!.address,
         'prompt': prompt,
+        'maxTokens': maxTokens,
+        'maxTtftMs': maxTtft?.inMilliseconds ?? 0,
+        'maxTotalMs': maxTotal?.inMilliseconds ?? 0,
+        'priority': priority.index,
+        'allowClasses': allowClasses,
+        'banClasses': banClasses,
+        'labels': labels.join('\n'),
+        'biasTokens': logitBias.keys.toList(),
+        'biasValues': logitBias.values.toList(),
+        'greedy': greedy,
+        'seed': seed,
       });
 
       return result.isEmpty ? 'No response generated' : result;
@@ -64,7 +435,25 @@ class LlamaService {
     }
   }
 
+  /// Score each of [candidates] as the reply to [prompt] by its summed token
+  /// log-probability, e.g. to pick an intent label without free generation.
+  /// The prompt is prefilled once and all candidates are decoded together.
+  /// Returns the native JSON: `candidates[i].logprob`, `best`, timings.
+  Future<Map<String, dynamic>> score(
+      String prompt, List<String> candidates) async {
+    if (!_isInitialized || _context == null) {
+      return {'error': 'Model not loaded'};
+    }
+    final result = await compute(_runScoreCompute, {
+      'contextAddress': _context!.address,
+      'prompt': prompt,
+      'candidates': candidates,
+    });
+    return jsonDecode(result) as Map<String, dynamic>;
+  }
+
   void dispose() {
+    disableCascade();
     if (_isInitialized && _context != null) {
       _ffi.freeModel(_context!);
       _context = null;
@@ -86,9 +475,11 @@ String _runInferenceCompute(Map<String, dynamic> args) {
 
     // Use simple function signatures without defining types
     final predict = lib.lookupFunction<
-        Pointer<Utf8> Function(Pointer<Void> context, Pointer<Utf8> prompt),
-        Pointer<Utf8> Function(Pointer<Void> context, Pointer<Utf8> prompt)
-    >('predict');
+        Pointer<Utf8> Function(Pointer<Void> context, Pointer<Utf8> prompt,
+            Pointer<RequestOptions> options),
+        Pointer<Utf8> Function(Pointer<Void> context, Pointer<Utf8> prompt,
+            Pointer<RequestOptions> options)
+    >('predict_with_options');
 
     final freeString = lib.lookupFunction<
         Void Function(Pointer<Utf8> str),
@@ -101,11 +492,40 @@ String _runInferenceCompute(Map<String, dynamic> args) {
     // Convert prompt to native string
     final promptC = prompt.toNativeUtf8();
     
+    final List<int> biasTokens = args['biasTokens'];
+    final List<double> biasValues = args['biasValues'];
+    final labelsC = (args['labels'] as String).toNativeUtf8();
+    final biasTokensC = calloc<Int32>(biasTokens.length);
+    final biasValuesC = calloc<Float>(biasValues.length);
+    for (var i = 0; i < biasTokens.length; i++) {
+      biasTokensC[i] = biasTokens[i];
+      biasValuesC[i] = biasValues[i];
+    }
+
+    final options = calloc<RequestOptions>();
+    options.ref
+      ..maxTokens = args['maxTokens']
+      ..maxTtftMs = args['maxTtftMs']
+      ..maxTotalMs = args['maxTotalMs']
+      ..priority = args['priority']
+      ..allowClasses = args['allowClasses']
+      ..banClasses = args['banClasses']
+      ..labels = labelsC
+      ..biasTokens = biasTokensC
+      ..biasValues = biasValuesC
+      ..nBiases = biasTokens.length
+      ..greedy = args['greedy'] ? 1 : 0
+      ..seed = args['seed'];
+
     // Call the native predict function
-    final resultPtr = predict(contextPtr, promptC);
+    final resultPtr = predict(contextPtr, promptC, options);
     
-    // Free the prompt string
+    // Free the prompt string and options
     calloc.free(promptC);
+    calloc.free(labelsC);
+    calloc.free(biasTokensC);
+    calloc.free(biasValuesC);
+    calloc.free(options);
     
     // Convert result to Dart string
     final result = resultPtr.toDartString();
@@ -118,3 +538,41 @@ String _runInferenceCompute(Map<String, dynamic> args) {
     return 'Error in isolate: $e';
   }
 }
+
+// Top-level function for compute isolate - scores candidates in background
+String _runScoreCompute(Map<String, dynamic> args) {
+  final int contextAddress = args['contextAddress'];
+  final String prompt = args['prompt'];
+  final List<String> candidates = args['candidates'];
+
+  final DynamicLibrary lib = Platform.isAndroid
+      ? DynamicLibrary.open("libnative-lib.so")
+      : DynamicLibrary.process();
+
+  final score = lib.lookupFunction<
+      Pointer<Utf8> Function(Pointer<Void> context, Pointer<Utf8> prompt,
+          Pointer<Pointer<Utf8>> candidates, Int32 nCandidates),
+      Pointer<Utf8> Function(Pointer<Void> context, Pointer<Utf8> prompt,
+          Pointer<Pointer<Utf8>> candidates, int nCandidates)>('score');
+  final freeString = lib.lookupFunction<Void Function(Pointer<Utf8> str),
+      void Function(Pointer<Utf8> str)>('free_string');
+
+  final promptC = prompt.toNativeUtf8();
+  final candidatesC = calloc<Pointer<Utf8>>(candidates.length);
+  for (var i = 0; i < candidates.length; i++) {
+    candidatesC[i] = candidates[i].toNativeUtf8();
+  }
+
+  final resultPtr = score(Pointer<Void>.fromAddress(contextAddress), promptC,
+      candidatesC, candidates.length);
+
+  for (var i = 0; i < candidates.length; i++) {
+    calloc.free(candidatesC[i]);
+  }
+  calloc.free(candidatesC);
+  calloc.free(promptC);
+
+  final result = resultPtr.toDartString();
+  freeString(resultPtr);
+  return result;
+}
@@ -0,0 +1,120 @@
+import 'dart:ffi';
+import 'dart:io';
+import 'package:ffi/ffi.dart';
+import 'package:flutter/foundation.dart';
+import '../services/llama_ffi.dart';
+
+/// Client of a model served by another process with
+/// [LlamaService.startModelServer], so this process needs no weights of its
+/// own.
+class RemoteLlamaClient {
+  final LlamaFFI _ffi = LlamaFFI();
+  Pointer<ModelClientOpaque>? _client;
+  // Running generateResponse calls; the client is freed only after they return
+  final Set<Future<String>> _inFlight = {};
+
+  bool get isConnected => _client != null;
+
+  /// Connect to the server at [socketPath]. Returns false if nothing serves
+  /// there.
+  Future<bool> connect(String socketPath) async {
+    await disconnect();
+    final pathC = socketPath.toNativeUtf8();
+    final client = _ffi.connectModelServer(pathC);
+    calloc.free(pathC);
+    if (client == nullptr) {
+      return false;
+    }
+    _client = client;
+    return true;
+  }
+
+  /// Generate a reply on the server. Only the scalar options of
+  /// [LlamaService.generateResponse] cross over.
+  Future<String> generateResponse(String prompt,
+      {int maxTokens = 20,
+      Duration? maxTtft,
+      Duration? maxTotal,
+      RequestPriority priority = RequestPriority.interactive,
+      bool greedy = false,
+      int seed = 0}) async {
+    if (_client == null) {
+      return 'Error: Model server not connected';
+    }
+    final call = compute(_runRemoteCompute, {
+      'clientAddress': _client!.address,
+      'prompt': prompt,
+      'maxTokens': maxTokens,
+      'maxTtftMs': maxTtft?.inMilliseconds ?? 0,
+      'maxTotalMs': maxTotal?.inMilliseconds ?? 0,
+      'priority': priority.index,
+      'greedy': greedy,
+      'seed': seed,
+    });
+    _inFlight.add(call);
+    try {
+      return await call;
+    } catch (e) {
+      return 'Error generating response: $e';
+    } finally {
+      _inFlight.remove(call);
+    }
+  }
+
+  /// Text of the reply currently being generated, safe to poll while
+  /// [generateResponse] runs.
+  String getPartialResponse() {
+    if (_client == null) {
+      return '';
+    }
+    final resultPtr = _ffi.remotePartialResponse(_client!);
+    final text = resultPtr.toDartString();
+    _ffi.freeString(resultPtr);
+    return text;
+  }
+
+  /// Close the connection. A [generateResponse] still running is cancelled
+  /// and returns an error; the native client is freed once it has returned.
+  Future<void> disconnect() async {
+    final client = _client;
+    if (client == null) {
+      return;
+    }
+    _client = null;
+    _ffi.cancelRemotePredict(client);
+    await Future.wait(_inFlight.map((call) => call.catchError((_) => '')));
+    _ffi.disconnectModelServer(client);
+  }
+}
+
+// Top-level function for isolate execution with compute
+String _runRemoteCompute(Map<String, dynamic> args) {
+  final DynamicLibrary lib = Platform.isAndroid
+      ? DynamicLibrary.open("libnative-lib.so")
+      : DynamicLibrary.process();
+  final remotePredict = lib
+      .lookup<NativeFunction<RemotePredictNative>>('remote_predict')
+      .asFunction<RemotePredictDart>();
+  final freeString = lib.lookupFunction<Void Function(Pointer<Utf8> str),
+      void Function(Pointer<Utf8> str)>('free_string');
+
+  final promptC = (args['prompt'] as String).toNativeUtf8();
+  final options = calloc<RequestOptions>();
+  options.ref
+    ..maxTokens = args['maxTokens']
+    ..maxTtftMs = args['maxTtftMs']
+    ..maxTotalMs = args['maxTotalMs']
+    ..priority = args['priority']
+    ..greedy = args['greedy'] ? 1 : 0
+    ..seed = args['seed'];
+
+  final resultPtr = remotePredict(
+      Pointer<ModelClientOpaque>.fromAddress(args['clientAddress']),
+      promptC,
+      options);
+  final result = resultPtr.toDartString();
+  freeString(resultPtr);
+  calloc.free(promptC);
+  calloc.free(options);
+  return result;
+}